@@ -12,6 +12,7 @@
 #include "maggrid.h"
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 #define IS_INDEXABLE(arg) (sizeof(arg[0]))
 #define IS_ARRAY(arg) (IS_INDEXABLE(arg) && (((void *) &arg) == ((void *) arg)))
@@ -29,6 +30,18 @@
 //magic word used to test if byte swapping is required
 #define MAGICWORD 0xced
 
+//the native variant of the format, written by writeField, is flagged in the
+//otherwise unused header words: reserved3 holds NATIVEFORMATTAG, reserved4 the
+//offset of the data in bytes and reserved5 a layout descriptor: the low byte
+//is the layout (NATIVELAYOUT, (b1, b2, b3) floats with q3 varying fastest),
+//the next byte the byte order of the writer (1 little, 2 big endian).
+//The padding after the header holds NATIVEMETRICSTAG followed by the field
+//metrics, so a mapped native file does not have to be walked to get them.
+#define NATIVEFORMATTAG 0x6e617476
+#define NATIVEMETRICSTAG 0x6d747263
+#define NATIVEDATAOFFSET 128
+#define NATIVELAYOUT 0
+
 //pointers to structures defined below
 typedef struct fieldmapheader *FieldMapHeaderPtr;
 typedef struct magneticfield *MagneticFieldPtr;
@@ -36,6 +49,8 @@ typedef struct fieldmetrics *FieldMetricsPtr;
 typedef struct fieldvalue *FieldValuePtr;
 typedef struct cell3d *Cell3DPtr;
 typedef struct cell2d *Cell2DPtr;
+typedef struct fieldprobe *FieldProbePtr;
+typedef struct fielduniformity *FieldUniformityPtr;
 
 //some strings for prints
 extern const char *csLabels[];
@@ -45,6 +60,11 @@ extern const char *fieldUnitLabels[];
 
 //used for unit testing
 extern MagneticFieldPtr testFieldPtr;
+extern MagneticFieldPtr testSolenoidPtr; //the solenoid combined with testFieldPtr
+
+//cosine and sine of the sector rotations, indexed by sector [1..6]
+extern const double cosSect[];
+extern const double sinSect[];
 
 //the header of the binary files
 typedef struct fieldmapheader {
@@ -65,9 +85,9 @@ typedef struct fieldmapheader {
     unsigned int nq3; // numColors equally spaced in q3 direction including ends
     int cdHigh; //high word of unix creation date of map
     int cdLow; //low word of unix creation date of map
-    unsigned int reserved3; //reserved
-    unsigned int reserved4; //reserved
-    unsigned int reserved5; //reserved
+    unsigned int reserved3; //reserved, NATIVEFORMATTAG for the native format
+    unsigned int reserved4; //reserved, data offset for the native format
+    unsigned int reserved5; //reserved, layout descriptor for the native format
 } FieldMapHeader;
 
 //holds a single field value
@@ -108,12 +128,8 @@ typedef struct cell3d {
     double rhoNorm; //cached value to speed up evaluation
     double zNorm; //cached value to speed up evaluation
 
-    // space used by the cell.
-    double f[3];
-    double g[3];
-    double a[8];
-
-    FieldValuePtr b[2][2][2]; //field at 4 corners of cell
+    FieldValuePtr b[2][2][2]; //field at 8 corners of cell
+    FieldValue corners[8]; //decoded corners when the storage is compact
 } Cell3D;
 
 //2d cell is used by solenoid
@@ -135,12 +151,31 @@ typedef struct cell2d {
     double zNorm; //cached value to speed up evaluation
 
     FieldValuePtr b[2][2]; //field at 4 corners of cell
+    FieldValue corners[4]; //decoded corners when the storage is compact
 
 } Cell2D;
 
+//a probe is the per-thread, mutable part of a field lookup. The map itself
+//is only read, so any number of probes (one per thread) can share it.
+typedef struct fieldprobe {
+    MagneticFieldPtr fieldPtr; //the (shared, read only) field map
+
+    Cell3DPtr cell3DPtr;  //the cached cell for a torus, NULL for a solenoid
+    Cell2DPtr cell2DPtr;  //the cached cell for a solenoid, NULL for a torus
+} FieldProbe;
+
 typedef enum {TORUS, SOLENOID} FieldType;
 typedef enum {INTERPOLATION, NEAREST_NEIGHBOR} Algorithm;
 
+//how the field values are stored: as read (3 floats per point), or compact
+//(3 IEEE half floats, or 3 16-bit integers times a per map scale factor)
+typedef enum {FLOAT32, FLOAT16, SCALED_INT16} StoragePrecision;
+
+//a function specialized for one map type (symmetric torus, full torus or solenoid)
+//and algorithm. Arguments are the result (unscaled), x, y, rho and z relative to
+//the field origin (the point has already been checked to be within the map), and the probe.
+typedef void (*FieldEvaluator)(FieldValuePtr, double, double, double, double, FieldProbePtr);
+
 //holds the entire field map
 typedef struct magneticfield {
     FieldMapHeaderPtr headerPtr; //pointer to the header data
@@ -149,6 +184,8 @@ typedef struct magneticfield {
     char *name; //a descriptive name
     bool symmetric; //is this a symmetric grid (solenoid always is)
     FieldType  type;
+    Algorithm algorithm; //interpolation or nearest neighbor, set with setFieldAlgorithm
+    FieldEvaluator evaluator; //resolved from the type, symmetry and algorithm
     char *creationDate;  //date the map was created
     unsigned int numValues;  //total number of field values
 
@@ -159,8 +196,9 @@ typedef struct magneticfield {
 
     FieldMetricsPtr metricsPtr; //some field metrics
 
-    Cell3DPtr cell3DPtr;  //the cell, or probe for torus
-    Cell2DPtr cell2DPtr;  //the cell, or probe for solenoid
+    FieldProbePtr probePtr; //the default probe, used by getFieldValue (not thread safe)
+    Cell3DPtr cell3DPtr;  //the cell of the default probe for torus
+    Cell2DPtr cell2DPtr;  //the cell of the default probe for solenoid
 
     double scale; //scale factor of the field
 
@@ -173,6 +211,20 @@ typedef struct magneticfield {
 
     //use 1D array which will require manual indexing
     FieldValue *fieldValues;
+
+    //if the values are memory mapped from the file rather than read
+    void *mapping; //start of the mapping, NULL if the values were read
+    size_t mappingLength; //length of the mapping in bytes
+
+    //optional compact values, see setFieldPrecision. Used in place of
+    //fieldValues by lookups if not NULL.
+    StoragePrecision precision;
+    uint16_t *compactValues; //3 per grid point, NULL for FLOAT32
+    float compactScale; //multiplies the integers for SCALED_INT16
+
+    //optional bounds on the variation of the field over regions, see
+    //buildFieldUniformity. NULL unless built.
+    FieldUniformityPtr uniformityPtr;
 } MagneticField;
 
 // external function prototypes
@@ -181,13 +233,34 @@ extern void invertCompositeIndex(MagneticFieldPtr fieldPtr, int index, int *phiI
 extern char *compositeIndexUnitTest();
 extern char *containsUnitTest();
 extern char *nearestNeighborUnitTest();
+//getFieldAtIndex returns NULL (with an error) for fields with compact storage,
+//which have no float values; copyFieldAtIndex works for any precision
 extern FieldValuePtr getFieldAtIndex(MagneticFieldPtr, int );
+extern void copyFieldAtIndex(MagneticFieldPtr, int, FieldValuePtr);
 extern void getFieldValue(FieldValuePtr, double, double, double, MagneticFieldPtr);
 extern void getCompositeFieldValue(FieldValuePtr, double, double, double, MagneticFieldPtr, MagneticFieldPtr);
+extern void getFieldValueProbe(FieldValuePtr, double, double, double, FieldProbePtr);
+extern void getCompositeFieldValueProbe(FieldValuePtr, double, double, double, FieldProbePtr, FieldProbePtr);
+extern void getCompositeFieldValueProbes(FieldValuePtr, double, double, double, FieldProbePtr *, int);
+extern void getFieldValues(const double *, const double *, const double *,
+                           float *, float *, float *, int, FieldProbePtr);
+extern void getCompositeFieldValues(const double *, const double *, const double *,
+                                    float *, float *, float *, int, FieldProbePtr, FieldProbePtr);
+extern char *probeUnitTest();
+extern char *solenoidRotationUnitTest();
+extern char *compositeUnitTest();
+extern char *batchUnitTest();
 extern void setAlgorithm(Algorithm);
 extern Algorithm getAlgorithm();
+extern void setFieldAlgorithm(MagneticFieldPtr, Algorithm);
+extern void registerField(MagneticFieldPtr);
+extern void unregisterField(MagneticFieldPtr);
+extern Algorithm getFieldAlgorithm(MagneticFieldPtr);
+extern void invalidateProbe(FieldProbePtr);
 bool containsCartesian(MagneticFieldPtr, double, double, double);
 bool containsCylindrical(MagneticFieldPtr, double, double);
+extern bool containedInCell3D(Cell3DPtr, double, double, double);
+extern bool containedInCell2D(Cell2DPtr, double, double);
 extern void resetCell3D(Cell3DPtr, double, double, double);
 extern void resetCell2D(Cell2DPtr, double, double);
 extern void getCoordinateIndices(MagneticFieldPtr, double, double, double,
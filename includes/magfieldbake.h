@@ -0,0 +1,20 @@
+//
+//  magfieldbake.h
+//  cMag
+//  the sum of two fields resampled ("baked") onto a single grid
+//
+
+#ifndef CMAG_MAGFIELDBAKE_H
+#define CMAG_MAGFIELDBAKE_H
+
+#include "magfield.h"
+
+// external function prototypes
+extern MagneticFieldPtr bakeCompositeField(MagneticFieldPtr, MagneticFieldPtr, const char *, long);
+extern void getBakedFieldValue(FieldValuePtr, double, double, double,
+                               MagneticFieldPtr, MagneticFieldPtr, MagneticFieldPtr);
+extern void getBakedFieldValueProbe(FieldValuePtr, double, double, double,
+                                    FieldProbePtr, FieldProbePtr, FieldProbePtr);
+extern char *bakeUnitTest();
+
+#endif //CMAG_MAGFIELDBAKE_H
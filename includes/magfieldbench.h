@@ -0,0 +1,32 @@
+//
+//  magfieldbench.h
+//  cMag
+//  simple timing benchmarks for the field lookups
+//
+
+#ifndef CMAG_MAGFIELDBENCH_H
+#define CMAG_MAGFIELDBENCH_H
+
+#include "magfield.h"
+
+//external function prototypes
+extern double benchmarkTime(void);
+extern void batchBenchmark(MagneticFieldPtr, MagneticFieldPtr, FILE *);
+extern void fieldSetBenchmark(MagneticFieldPtr, MagneticFieldPtr, FILE *);
+extern void simdBenchmark(MagneticFieldPtr, FILE *);
+extern void compactBenchmark(MagneticFieldPtr, FILE *);
+extern void gradientBenchmark(MagneticFieldPtr, FILE *);
+extern void sectorFoldBenchmark(MagneticFieldPtr, FILE *);
+extern void swimBenchmark(MagneticFieldPtr, MagneticFieldPtr, FILE *);
+extern void swimScalingBenchmark(MagneticFieldPtr, MagneticFieldPtr, FILE *);
+extern void swimLanesBenchmark(MagneticFieldPtr, MagneticFieldPtr, FILE *);
+extern void jacobianBenchmark(MagneticFieldPtr, MagneticFieldPtr, FILE *);
+extern void surfaceBenchmark(MagneticFieldPtr, MagneticFieldPtr, FILE *);
+extern void helixBenchmark(MagneticFieldPtr, MagneticFieldPtr, FILE *);
+extern void predictBenchmark(MagneticFieldPtr, MagneticFieldPtr, FILE *);
+extern void tableBenchmark(MagneticFieldPtr, MagneticFieldPtr, FILE *);
+extern void integralBenchmark(MagneticFieldPtr, MagneticFieldPtr, FILE *);
+extern void fieldLineBenchmark(MagneticFieldPtr, MagneticFieldPtr, FILE *);
+extern void runBenchmarks(MagneticFieldPtr, MagneticFieldPtr, FILE *);
+
+#endif //CMAG_MAGFIELDBENCH_H
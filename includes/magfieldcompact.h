@@ -0,0 +1,28 @@
+//
+//  magfieldcompact.h
+//  cMag
+//  compact (16 bit) storage of the field values
+//
+
+#ifndef CMAG_MAGFIELDCOMPACT_H
+#define CMAG_MAGFIELDCOMPACT_H
+
+#include "magfield.h"
+
+//some strings for prints
+extern const char *precisionLabels[];
+
+// external function prototypes
+extern void setDefaultPrecision(StoragePrecision);
+extern StoragePrecision getDefaultPrecision(void);
+extern bool setFieldPrecision(MagneticFieldPtr, StoragePrecision);
+extern StoragePrecision getFieldPrecision(MagneticFieldPtr);
+extern bool addCompactValues(MagneticFieldPtr, StoragePrecision);
+extern void removeCompactValues(MagneticFieldPtr);
+extern void decodeCompactValue(MagneticFieldPtr, int, FieldValuePtr);
+extern uint16_t floatToHalf(float);
+extern float halfToFloat(uint16_t);
+extern void compactAccuracyReport(MagneticFieldPtr, FILE *);
+extern char *compactUnitTest();
+
+#endif //CMAG_MAGFIELDCOMPACT_H
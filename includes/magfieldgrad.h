@@ -0,0 +1,29 @@
+//
+//  magfieldgrad.h
+//  cMag
+//  the field and its gradient from the interpolation cell
+//
+
+#ifndef CMAG_MAGFIELDGRAD_H
+#define CMAG_MAGFIELDGRAD_H
+
+#include "magfield.h"
+
+typedef struct fieldgradient *FieldGradientPtr;
+
+//the field and its 3x3 gradient (the Jacobian of B), in Cartesian components
+typedef struct fieldgradient {
+    double b[3];     //the field (Bx, By, Bz) in kG
+    double dB[3][3]; //dB[i][j] = dB_i/dx_j in kG/cm, i and j over (x, y, z)
+} FieldGradient;
+
+// external function prototypes
+extern void getFieldGradient(FieldGradientPtr, double, double, double, MagneticFieldPtr);
+extern void getFieldGradientProbe(FieldGradientPtr, double, double, double, FieldProbePtr);
+extern void getCompositeFieldGradient(FieldGradientPtr, double, double, double,
+                                      MagneticFieldPtr, MagneticFieldPtr);
+extern void getCompositeFieldGradientProbe(FieldGradientPtr, double, double, double,
+                                           FieldProbePtr, FieldProbePtr);
+extern char *gradientUnitTest();
+
+#endif //CMAG_MAGFIELDGRAD_H
@@ -0,0 +1,52 @@
+//
+//  magfieldintegral.h
+//  cMag
+//  integrals of the field along straight lines, for momentum kick estimates,
+//  by quadrature aligned to the grid cells, and tables of them over (theta, phi)
+//
+
+#ifndef CMAG_MAGFIELDINTEGRAL_H
+#define CMAG_MAGFIELDINTEGRAL_H
+
+#include "magfieldtable.h"
+
+//Gauss-Legendre points per panel. Two are exact for interpolated maps along
+//lines at constant phi, where the field is quadratic in the path length within a cell.
+#define INTEGRALGAUSSPOINTS 2
+
+typedef struct fieldintegral *FieldIntegralPtr;
+typedef struct integraltable *IntegralTablePtr;
+
+//the integral of the field along a line
+typedef struct fieldintegral {
+    double bdl[3];      //the integral of (Bx, By, Bz) dl, kG cm
+    double transverse;  //the magnitude of the integral of t x B dl, kG cm. Times
+                        //SWIMCONSTANT it is the transverse momentum kick, GeV/c.
+    int numEvaluations; //lookups, in each map separately
+} FieldIntegral;
+
+//field integrals along lines from (0, 0, vertex z), at fixed scales and shifts
+typedef struct integraltable {
+    TableAxis theta;  //degrees
+    TableAxis phi;    //degrees, -30 to 30 if symmetric
+    double vertexZ;   //cm
+    double length;    //of the lines, cm
+    bool symmetric;   //true if the table covers one sector, rotated to the others
+
+    //what the integrals were computed for
+    double torusScale, solenoidScale;
+    double torusShift[3], solenoidShift[3]; //cm
+
+    float *bdl; //3 per node, theta slowest
+} IntegralTable;
+
+// external function prototypes
+extern void fieldIntegral(FieldProbePtr, FieldProbePtr, const SwimPoint *, double, double, FieldIntegralPtr);
+extern IntegralTablePtr createIntegralTable(MagneticFieldPtr, MagneticFieldPtr, const TableAxis *,
+                                            const TableAxis *, double, double, int);
+extern void freeIntegralTable(IntegralTablePtr);
+extern bool integralTableIsCurrent(IntegralTablePtr, MagneticFieldPtr, MagneticFieldPtr);
+extern bool lookupFieldIntegral(IntegralTablePtr, double, double, FieldIntegralPtr);
+extern char *integralUnitTest();
+
+#endif //CMAG_MAGFIELDINTEGRAL_H
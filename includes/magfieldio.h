@@ -12,9 +12,22 @@
 // external function prototypes
 extern MagneticFieldPtr initializeTorus(const char *);
 extern MagneticFieldPtr initializeSolenoid(const char *);
+extern MagneticFieldPtr initializeField(const char *);
+extern MagneticFieldPtr createFieldFromData(FieldMapHeaderPtr, FieldValuePtr, const char *);
+extern bool writeField(MagneticFieldPtr, const char *);
+extern bool writeFileAtomically(const char *, const char *, const void *, size_t, const void *, size_t);
+extern unsigned int getByteOrder(void);
 extern void createCell3D(MagneticFieldPtr);
 extern void createCell2D(MagneticFieldPtr);
 extern void freeCell3D(Cell3DPtr);
 extern void freeCell2D(Cell2DPtr);
+extern FieldProbePtr createProbe(MagneticFieldPtr);
+extern void freeProbe(FieldProbePtr);
+extern void setMemoryMapping(bool);
+extern bool getMemoryMapping(void);
+extern void setCacheDirectory(const char *);
+extern const char *getCacheDirectory(void);
+extern char *memoryMappingUnitTest();
+extern char *cacheDirectoryUnitTest();
 
 #endif //CMAG_MAGFIELDIO_H
@@ -0,0 +1,21 @@
+//
+//  magfieldpool.h
+//  cMag
+//  a small work-stealing thread pool for running many independent jobs
+//
+
+#ifndef CMAG_MAGFIELDPOOL_H
+#define CMAG_MAGFIELDPOOL_H
+
+#include "magfield.h"
+
+//a job: do item index of the work, on behalf of worker [0..numThreads-1]
+typedef void (*WorkFunction)(void *, int, int);
+
+// external function prototypes
+extern int getNumCores(void);
+extern int getPoolSize(int, int);
+extern int parallelFor(int, int, WorkFunction, void *);
+extern char *poolUnitTest();
+
+#endif //CMAG_MAGFIELDPOOL_H
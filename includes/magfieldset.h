@@ -0,0 +1,79 @@
+//
+//  magfieldset.h
+//  cMag
+//  any number of field maps, each with its own scale and shift, superimposed
+//  and evaluated together in one pass
+//
+
+#ifndef CMAG_MAGFIELDSET_H
+#define CMAG_MAGFIELDSET_H
+
+#include "magfield.h"
+
+//the most maps in a set, one bit each in the coverage masks
+#define FIELDSETMAXFIELDS 16
+
+//rho bins of the coverage index in each slab, from the axis to the outermost map
+#define FIELDSETRHOBINS 64
+
+//the most z slabs, from the z extents of the maps, widened and narrowed
+#define FIELDSETMAXSLABS (4 * FIELDSETMAXFIELDS - 1)
+
+typedef struct fieldsetmember *FieldSetMemberPtr;
+typedef struct fieldsetslab *FieldSetSlabPtr;
+typedef struct fieldset *FieldSetPtr;
+typedef struct fieldsetprobe *FieldSetProbePtr;
+
+//one map in a set. The set's scale and shift are used rather than the map's,
+//so the same map can be placed more than once.
+typedef struct fieldsetmember {
+    MagneticFieldPtr fieldPtr; //the (shared, read only) field map
+    double scale;              //scale factor of the field
+    double shiftX;             //shifts of the map, cm
+    double shiftY;
+    double shiftZ;
+} FieldSetMember;
+
+//a range of z over which the same maps can contribute, with a coverage
+//index over rho: bit m of a mask is for map m of the set
+typedef struct fieldsetslab {
+    double zMin; //cm, inclusive
+    double zMax; //cm, exclusive
+    int numMembers;
+    int members[FIELDSETMAXFIELDS]; //indices of the maps, in the order they were added
+    unsigned int reach[FIELDSETRHOBINS];  //the maps that may contain points in the bin
+    unsigned int inside[FIELDSETRHOBINS]; //the maps that contain every point in the bin
+} FieldSetSlab;
+
+//a set of maps. Once it is complete it is only read, so any number of
+//probes (one per thread) can share it.
+typedef struct fieldset {
+    int numMembers;
+    FieldSetMember members[FIELDSETMAXFIELDS];
+
+    //the regions, rebuilt whenever a member is added or moved
+    int numSlabs;
+    FieldSetSlab slabs[FIELDSETMAXSLABS]; //in increasing z
+    double rhoMax;  //no map reaches this distance from the z axis, cm
+    double rhoNorm; //rho bins per cm
+} FieldSet;
+
+//the per thread, mutable part of a field set lookup
+typedef struct fieldsetprobe {
+    FieldSetPtr setPtr;
+    FieldProbePtr probes[FIELDSETMAXFIELDS]; //one per member
+    int slab; //the slab of the last lookup, tried first
+} FieldSetProbe;
+
+// external function prototypes
+extern FieldSetPtr createFieldSet(void);
+extern void freeFieldSet(FieldSetPtr);
+extern int addFieldToSet(FieldSetPtr, MagneticFieldPtr);
+extern bool setFieldSetScale(FieldSetPtr, int, double);
+extern bool setFieldSetShift(FieldSetPtr, int, double, double, double);
+extern FieldSetProbePtr createFieldSetProbe(FieldSetPtr);
+extern void freeFieldSetProbe(FieldSetProbePtr);
+extern void getFieldSetValue(FieldValuePtr, double, double, double, FieldSetProbePtr);
+extern char *fieldSetUnitTest();
+
+#endif //CMAG_MAGFIELDSET_H
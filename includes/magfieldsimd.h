@@ -0,0 +1,26 @@
+//
+//  magfieldsimd.h
+//  cMag
+//  vectorized (SIMD) interpolation kernels for batched lookups
+//
+
+#ifndef CMAG_MAGFIELDSIMD_H
+#define CMAG_MAGFIELDSIMD_H
+
+#include "magfield.h"
+
+//the instruction sets for which there are kernels, from worst to best
+typedef enum {SIMD_SCALAR, SIMD_SSE2, SIMD_AVX2, SIMD_AVX512} SimdLevel;
+
+//some strings for prints
+extern const char *simdLevelLabels[];
+
+// external function prototypes
+extern SimdLevel getBestSimdLevel(void);
+extern SimdLevel getSimdLevel(void);
+extern void setSimdLevel(SimdLevel);
+extern void simdFieldValues(const double *, const double *, const double *,
+                            float *, float *, float *, int, MagneticFieldPtr, bool);
+extern char *simdUnitTest();
+
+#endif //CMAG_MAGFIELDSIMD_H
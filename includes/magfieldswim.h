@@ -0,0 +1,143 @@
+//
+//  magfieldswim.h
+//  cMag
+//  Runge-Kutta swimming of charged particles through the torus and solenoid
+//
+
+#ifndef CMAG_MAGFIELDSWIM_H
+#define CMAG_MAGFIELDSWIM_H
+
+#include "magfield.h"
+
+//speed of light times the unit conversions, GeV/c per (kG cm)
+#define SWIMCONSTANT 2.99792458e-4
+
+//defaults for the adaptive swimmer
+#define SWIMTOLERANCE 1.0e-6  //absolute error per step, cm (position) and direction cosines
+#define SWIMMINSTEP 1.0e-4    //smallest step, cm
+#define SWIMMAXSTEP 50.0      //largest step, cm
+#define SWIMMAXSTEPS 100000   //bail out after this many steps
+#define SWIMSURFACETOLERANCE 1.0e-5 //distance from a stopping surface that counts as on it, cm
+
+//tracks stepped together by swimTracksSimd, one per SIMD lane
+#define SWIMLANES 16
+
+typedef struct swimpoint *SwimPointPtr;
+typedef struct swimresult *SwimResultPtr;
+typedef struct swimmer *SwimmerPtr;
+typedef struct swimtrack *SwimTrackPtr;
+typedef struct swimjacobian *SwimJacobianPtr;
+typedef struct swimsurface *SwimSurfacePtr;
+
+//a point on a trajectory
+typedef struct swimpoint {
+    double x, y, z;    //position in cm
+    double tx, ty, tz; //direction cosines
+    double s;          //path length from the start in cm
+} SwimPoint;
+
+typedef enum {SWIM_OK, SWIM_MAX_STEPS, SWIM_STEP_TOO_SMALL, SWIM_NO_FIELD} SwimStatus;
+
+//some strings for prints
+extern const char *swimStatusLabels[];
+
+//the outcome of a swim
+typedef struct swimresult {
+    SwimStatus status;
+    SwimPoint final;         //the last point, even if the trajectory buffer filled up
+    int numPoints;           //points written to the trajectory buffer, including the start
+    bool truncated;          //true if the trajectory buffer was too small
+    int numSteps;            //accepted steps
+    int numRejected;         //rejected or discarded trial steps (adaptive swimming only)
+    int numFieldEvaluations; //composite field lookups
+    bool hitSurface;         //swimToSurface: the swim ended on the surface
+    int numHelixSteps;       //accepted steps that were helix steps (helix mode only)
+} SwimResult;
+
+//holds what a swim needs besides the track. Each swimmer has its own probes, so
+//consecutive lookups reuse the cached cells, and swimmers in different
+//threads can share the field maps.
+typedef struct swimmer {
+    FieldProbePtr torusProbe;    //probe for the torus, NULL if none
+    FieldProbePtr solenoidProbe; //probe for the solenoid, NULL if none
+
+    double tolerance; //adaptive: absolute error per step
+    double minStep;   //adaptive: smallest step in cm
+    double maxStep;   //adaptive: largest step in cm
+    int maxSteps;     //give up after this many steps
+    double surfaceTolerance; //swimToSurface: how close to the surface the swim must end, cm
+    bool helix;       //adaptive, EXPERIMENTAL and off by default: exact helix steps where the
+                      //field is uniform enough, needs buildFieldUniformity on the maps. Clearly
+                      //faster only in nearly uniform fields; on the CLAS12 maps the gain is within
+                      //the run to run spread (see helixBenchmark)
+    bool predictSteps; //adaptive: start with the step from predictStepSize and stop steps short
+                       //of the edges of the maps, needs buildFieldUniformity on the maps
+
+    int numFieldEvaluations; //running count for the current swim
+    double field[3];         //the field at the last lookup, kG
+} Swimmer;
+
+//one track of a multi-track swim, or field line of traceFieldLines
+typedef struct swimtrack {
+    int charge;              //in units of e, for field lines the direction (1 along B, -1 against)
+    double momentum;         //GeV/c
+    SwimPoint start;         //the start point
+    double sMax;             //the path length to swim in cm
+    SwimPointPtr trajectory; //a buffer for the trajectory, can be NULL
+    int capacity;            //the number of points the buffer holds
+    SwimResult result;       //upon return, the outcome of the swim
+} SwimTrack;
+
+//the derivatives of the end of a swim with respect to its start, with q/p in e/(GeV/c)
+typedef struct swimjacobian {
+    //d(x, y, z, tx, ty, tz) at the end by d(x, y, z, tx, ty, tz, q/p) at the start,
+    //for a fixed path length, with the direction cosines treated as independent
+    double global[6][7];
+
+    //the transport matrix: d(x, y, dx/dz, dy/dz, q/p) on the plane z = z(end)
+    //by d(x, y, dx/dz, dy/dz, q/p) on the plane z = z(start)
+    double transport[5][5];
+} SwimJacobian;
+
+typedef enum {SWIM_ZPLANE, SWIM_CYLINDER, SWIM_SECTORPLANE} SwimSurfaceType;
+
+//a surface to stop on. The planes are n . r = distance, the cylinder is rho = distance.
+typedef struct swimsurface {
+    SwimSurfaceType type;
+    int sector;        //sector planes: the sector [1..6], 0 for the sector of the start point
+    double tilt;       //sector planes: the tilt from the z axis towards the sector's midplane, degrees
+    double distance;   //the z of the plane, the radius of the cylinder, or the distance of the sector plane, cm
+    double nx, ny, nz; //the unit normal of a plane
+} SwimSurface;
+
+// external function prototypes
+extern SwimmerPtr createSwimmer(MagneticFieldPtr, MagneticFieldPtr);
+extern void freeSwimmer(SwimmerPtr);
+extern void initSwimPoint(SwimPointPtr, double, double, double, double, double);
+extern void swimField(SwimmerPtr, double, double, double, double *);
+extern void swimRK4(SwimmerPtr, int, double, const SwimPoint *, double, double,
+                    SwimPointPtr, int, SwimResultPtr);
+extern void swimAdaptive(SwimmerPtr, int, double, const SwimPoint *, double,
+                         SwimPointPtr, int, SwimResultPtr);
+extern double predictStepSize(SwimmerPtr, int, double, const SwimPoint *);
+extern void swimJacobian(SwimmerPtr, int, double, const SwimPoint *, double,
+                         SwimPointPtr, int, SwimResultPtr, SwimJacobianPtr);
+extern void initZPlaneSurface(SwimSurfacePtr, double);
+extern void initCylinderSurface(SwimSurfacePtr, double);
+extern void initSectorPlaneSurface(SwimSurfacePtr, int, double, double);
+extern double surfaceDistance(const SwimSurface *, double, double, double);
+extern void swimToSurface(SwimmerPtr, int, double, const SwimPoint *, const SwimSurface *, double,
+                          SwimPointPtr, int, SwimResultPtr);
+extern int swimTracks(MagneticFieldPtr, MagneticFieldPtr, SwimTrackPtr, int, int, const Swimmer *);
+extern int swimTracksSimd(MagneticFieldPtr, MagneticFieldPtr, SwimTrackPtr, int, int, const Swimmer *);
+extern void traceFieldLine(SwimmerPtr, int, double, double, double, double, SwimPointPtr, int, SwimResultPtr);
+extern int traceFieldLines(MagneticFieldPtr, MagneticFieldPtr, SwimTrackPtr, int, int, const Swimmer *);
+extern MagneticFieldPtr createUniformField(double);
+extern char *swimUnitTest();
+extern char *jacobianUnitTest();
+extern char *surfaceUnitTest();
+extern char *helixUnitTest();
+extern char *predictUnitTest();
+extern char *fieldLineUnitTest();
+
+#endif //CMAG_MAGFIELDSWIM_H
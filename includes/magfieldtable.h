@@ -0,0 +1,100 @@
+//
+//  magfieldtable.h
+//  cMag
+//  precomputed crossings of tracks from the target with reference surfaces,
+//  so that pattern recognition can find them without any field evaluations
+//
+
+#ifndef CMAG_MAGFIELDTABLE_H
+#define CMAG_MAGFIELDTABLE_H
+
+#include "magfieldswim.h"
+
+//the most reference surfaces in a table
+#define TABLEMAXSURFACES 8
+
+//identifies a table file, and its version
+#define TABLEMAGICWORD 0x43544142
+#define TABLEVERSION 2
+
+//room for the names of the map files in the header
+#define TABLENAMELENGTH 128
+
+typedef struct tableaxis *TableAxisPtr;
+typedef struct tablespec *TableSpecPtr;
+typedef struct tableentry *TableEntryPtr;
+typedef struct tableheader *TableHeaderPtr;
+typedef struct trajectorytable *TrajectoryTablePtr;
+
+//evenly spaced nodes from min to max, inclusive
+typedef struct tableaxis {
+    double min;
+    double max;
+    int numPoints; //at least 2
+} TableAxis;
+
+//what a table covers. Tracks start at (0, 0, vertex z), both charges.
+typedef struct tablespec {
+    TableAxis momentum; //GeV/c, the nodes are evenly spaced in 1/p
+    TableAxis theta;    //degrees
+    TableAxis phi;      //degrees, sector symmetric fields only need one sector and use just the spacing
+    TableAxis vertexZ;  //cm
+    double sMax;        //the longest swim to a surface, cm
+    int numSurfaces;
+    SwimSurface surfaces[TABLEMAXSURFACES]; //sector planes in sector 0 are in the track's sector
+} TableSpec;
+
+//the crossing of one track with one surface
+typedef struct tableentry {
+    float x, y, z;    //cm
+    float tx, ty, tz; //direction cosines
+    float s;          //path length in cm, negative if the track misses the surface
+} TableEntry;
+
+//the start of a table file. Tables are written in the byte order of the
+//machine and memory mapped when read.
+typedef struct tableheader {
+    unsigned int magicWord;   //TABLEMAGICWORD
+    unsigned int version;     //TABLEVERSION
+    unsigned int byteOrder;   //1 little endian, 2 big endian
+    unsigned int symmetric;   //1 if the table covers one sector, rotated to the others
+    TableSpec spec;
+    char torusName[TABLENAMELENGTH];    //file name of the torus map, empty if none
+    char solenoidName[TABLENAMELENGTH]; //file name of the solenoid map, empty if none
+    double torusScale;
+    double solenoidScale;
+    double torusShift[3];     //cm
+    double solenoidShift[3];  //cm
+    long long torusFile[2];    //size in bytes and modification time of the torus map file
+    long long solenoidFile[2]; //size in bytes and modification time of the solenoid map file
+    unsigned long long numEntries;
+    unsigned long long dataOffset; //of the entries, bytes from the start of the file
+} TableHeader;
+
+//a table in memory
+typedef struct trajectorytable {
+    TableHeader header;
+    TableEntryPtr entries; //charge slowest, then p, theta, phi, vertex z, surface fastest
+
+    //if the entries are memory mapped from a file rather than computed
+    void *mapping;
+    size_t mappingLength;
+} TrajectoryTable;
+
+// external function prototypes
+extern void initTableSpec(TableSpecPtr);
+extern bool addTableSurface(TableSpecPtr, const SwimSurface *);
+extern TrajectoryTablePtr createTrajectoryTable(MagneticFieldPtr, MagneticFieldPtr, const TableSpec *, int);
+extern bool writeTrajectoryTable(TrajectoryTablePtr, const char *);
+extern TrajectoryTablePtr readTrajectoryTable(const char *);
+extern void freeTrajectoryTable(TrajectoryTablePtr);
+extern bool tableMatchesFields(TrajectoryTablePtr, MagneticFieldPtr, MagneticFieldPtr);
+extern double tableAxisValue(const TableAxis *, int);
+extern bool tableAxisCell(const TableAxis *, double, int *, double *);
+extern void sectorPhiAxis(const TableAxis *, TableAxisPtr);
+extern int toTableSector(bool, const TableAxis *, double *);
+extern void fromTableSector(int, double *, double *);
+extern bool lookupTrajectory(TrajectoryTablePtr, int, double, double, double, double, int, SwimPointPtr, double *);
+extern char *tableUnitTest();
+
+#endif //CMAG_MAGFIELDTABLE_H
@@ -0,0 +1,64 @@
+//
+//  magfielduniform.h
+//  cMag
+//  bounds on how much the field varies over a region, from a pyramid of
+//  per block minima, maxima and derivatives of the grid values
+//
+
+#ifndef CMAG_MAGFIELDUNIFORM_H
+#define CMAG_MAGFIELDUNIFORM_H
+
+#include "magfield.h"
+
+//grid cells along each edge of the smallest blocks
+#define UNIFORMBASEBLOCK 4
+
+//the most levels of the pyramid
+#define UNIFORMMAXLEVELS 24
+
+typedef struct blockbound *BlockBoundPtr;
+typedef struct derivativebound *DerivativeBoundPtr;
+typedef struct uniformitybuild *UniformityBuildPtr;
+
+//the range of the grid values in a block of cells. Since the interpolation
+//weights are positive and sum to one, the interpolated field anywhere in the
+//block is within the same range. The derivatives are finite differences of
+//neighboring grid values along the grid lines, with phi differences taken
+//along the arc.
+typedef struct blockbound {
+    float lo[3];        //smallest value of each component
+    float hi[3];        //largest value of each component
+    float maxMagnitude; //largest magnitude
+    float maxGradient;  //largest |dB/ds|, kG/cm
+    float maxCurvature; //largest |d2B/ds2|, kG/cm^2
+} BlockBound;
+
+//the field and its derivatives over a ball, see fieldDerivativeBound
+typedef struct derivativebound {
+    double magnitude; //largest |B|, kG
+    double gradient;  //largest |dB/ds|, kG/cm
+    double curvature; //largest |d2B/ds2|, kG/cm^2
+    double spacing;   //longest cell edge, cm
+    double edgeField; //if the ball reaches an edge of the map, where the field
+                      //jumps to zero, the largest field in the ball, else 0, kG
+} DerivativeBound;
+
+//the bounds for blocks of 1, 2, 4, ... times UNIFORMBASEBLOCK cells on a
+//side, up to a single block for the whole map
+typedef struct fielduniformity {
+    int numLevels;
+    int numBlocks[UNIFORMMAXLEVELS][3]; //blocks along (phi, rho, z) at each level
+    BlockBoundPtr blocks[UNIFORMMAXLEVELS]; //phi slowest, z fastest, as the grid
+} FieldUniformity;
+
+// external function prototypes
+extern bool buildFieldUniformity(MagneticFieldPtr);
+extern UniformityBuildPtr startFieldUniformityBuild(MagneticFieldPtr);
+extern bool finishFieldUniformityBuild(UniformityBuildPtr);
+extern void freeFieldUniformity(FieldUniformityPtr);
+extern double fieldVariationBound(MagneticFieldPtr, double, double, double, double);
+extern double compositeVariationBound(MagneticFieldPtr, MagneticFieldPtr, double, double, double, double);
+extern bool fieldDerivativeBound(MagneticFieldPtr, double, double, double, double, DerivativeBoundPtr);
+extern char *uniformityUnitTest();
+
+#endif //CMAG_MAGFIELDUNIFORM_H
@@ -14,9 +14,14 @@
 //used for comparing real numbers
 extern const double TINY;
 
+//starting value for hashBytes (the FNV-1a offset basis)
+#define FNVOFFSET 14695981039346656037ULL
+
 
 //external prototypes
 extern void stringCopy(char **, const char *);
+extern unsigned long long hashBytes(unsigned long long, const void *, size_t);
+extern unsigned long long hashFile(unsigned long long, const char *);
 extern const char *fieldUnits(MagneticFieldPtr);
 extern const char *lengthUnits(MagneticFieldPtr);
 extern double fieldMagnitude(FieldValue *);
@@ -45,5 +50,7 @@ extern int sign(double);
 extern void sortArray(double *, int);
 extern double relativePhi(double);
 extern int getSector(double);
+extern void sectorFold(double, double, double *, int *);
+extern char *sectorFoldUnitTest();
 
 #endif /* magfieldutil_h */
@@ -0,0 +1,167 @@
+//
+//  cmagtable.c
+//  cMag
+//  Command line tool that builds a trajectory lookup table for a torus and
+//  solenoid configuration and writes it to a file, for pattern recognition
+//  to memory map with readTrajectoryTable.
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <time.h>
+#include "magfield.h"
+#include "magfieldio.h"
+#include "magfieldtable.h"
+
+//local prototypes
+static void usage(const char *);
+static bool parseAxis(const char *, TableAxisPtr);
+static bool parseSurface(const char *, SwimSurfacePtr);
+
+/**
+ * Print how to use the tool.
+ * @param program the name of the program.
+ */
+static void usage(const char *program) {
+    fprintf(stderr, "\nusage: %s [options] -o table surface [surface ...]", program);
+    fprintf(stderr, "\n\t-t path\t\ttorus map");
+    fprintf(stderr, "\n\t-s path\t\tsolenoid map");
+    fprintf(stderr, "\n\t-o path\t\tthe table file to write");
+    fprintf(stderr, "\n\t-p min,max,n\tmomentum in GeV/c (nodes even in 1/p)");
+    fprintf(stderr, "\n\t-a min,max,n\ttheta in degrees");
+    fprintf(stderr, "\n\t-f min,max,n\tphi in degrees (only the spacing is used for symmetric fields)");
+    fprintf(stderr, "\n\t-v min,max,n\tvertex z in cm");
+    fprintf(stderr, "\n\t-l length\tlongest swim in cm");
+    fprintf(stderr, "\n\t-j threads\tthreads, 0 for one per core");
+    fprintf(stderr, "\n\tsurfaces are z:<z cm>, rho:<radius cm> or sector:<sector 0-6>:<tilt deg>:<distance cm>\n");
+}
+
+/**
+ * Parse an axis from min,max,n.
+ * @param arg the argument.
+ * @param axis upon return the axis.
+ * @return false if the argument is not an axis.
+ */
+static bool parseAxis(const char *arg, TableAxisPtr axis) {
+    return sscanf(arg, "%lf,%lf,%d", &(axis->min), &(axis->max), &(axis->numPoints)) == 3;
+}
+
+/**
+ * Parse a surface from z:<z>, rho:<radius> or sector:<sector>:<tilt>:<distance>.
+ * @param arg the argument.
+ * @param surface upon return the surface.
+ * @return false if the argument is not a surface.
+ */
+static bool parseSurface(const char *arg, SwimSurfacePtr surface) {
+    double a, b;
+    int sector;
+
+    if (sscanf(arg, "z:%lf", &a) == 1) {
+        initZPlaneSurface(surface, a);
+        return true;
+    }
+    if (sscanf(arg, "rho:%lf", &a) == 1) {
+        initCylinderSurface(surface, a);
+        return true;
+    }
+    if ((sscanf(arg, "sector:%d:%lf:%lf", &sector, &a, &b) == 3) && (sector >= 0) && (sector <= 6)) {
+        initSectorPlaneSurface(surface, sector, a, b);
+        return true;
+    }
+    return false;
+}
+
+/**
+ * The main method of the table tool.
+ * @param argc the number of arguments.
+ * @param argv the arguments, see usage.
+ * @return 0 on successful completion, 1 if any error occurred.
+ */
+int main(int argc, char *argv[]) {
+    TableSpec spec;
+    initTableSpec(&spec);
+
+    const char *torusPath = NULL;
+    const char *solenoidPath = NULL;
+    const char *outputPath = NULL;
+    int numThreads = 0;
+    bool ok = true;
+    int option;
+
+    while ((option = getopt(argc, argv, "t:s:o:p:a:f:v:l:j:")) != -1) {
+        switch (option) {
+            case 't':
+                torusPath = optarg;
+                break;
+            case 's':
+                solenoidPath = optarg;
+                break;
+            case 'o':
+                outputPath = optarg;
+                break;
+            case 'p':
+                ok = ok && parseAxis(optarg, &(spec.momentum));
+                break;
+            case 'a':
+                ok = ok && parseAxis(optarg, &(spec.theta));
+                break;
+            case 'f':
+                ok = ok && parseAxis(optarg, &(spec.phi));
+                break;
+            case 'v':
+                ok = ok && parseAxis(optarg, &(spec.vertexZ));
+                break;
+            case 'l':
+                spec.sMax = atof(optarg);
+                break;
+            case 'j':
+                numThreads = atoi(optarg);
+                break;
+            default:
+                ok = false;
+                break;
+        }
+    }
+
+    SwimSurface surface;
+    for (int i = optind; ok && (i < argc); i++) {
+        ok = parseSurface(argv[i], &surface) && addTableSurface(&spec, &surface);
+    }
+
+    if (!ok || (outputPath == NULL) || ((torusPath == NULL) && (solenoidPath == NULL))) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    MagneticFieldPtr torus = NULL;
+    MagneticFieldPtr solenoid = NULL;
+    if (torusPath != NULL) {
+        torus = initializeTorus(torusPath);
+        if (torus == NULL) {
+            fprintf(stderr, "\ncMag ERROR failed to read torus map from [%s]\n", torusPath);
+            return 1;
+        }
+    }
+    if (solenoidPath != NULL) {
+        solenoid = initializeSolenoid(solenoidPath);
+        if (solenoid == NULL) {
+            fprintf(stderr, "\ncMag ERROR failed to read solenoid map from [%s]\n", solenoidPath);
+            return 1;
+        }
+    }
+
+    clock_t start = clock();
+    TrajectoryTablePtr table = createTrajectoryTable(torus, solenoid, &spec, numThreads);
+    if ((table == NULL) || !writeTrajectoryTable(table, outputPath)) {
+        return 1;
+    }
+
+    fprintf(stdout, "\nWrote %llu crossings (%s) to [%s] in %-7.2f s of CPU\n", table->header.numEntries,
+            table->header.symmetric ? "one sector" : "all sectors", outputPath,
+            ((double) (clock() - start)) / CLOCKS_PER_SEC);
+    freeTrajectoryTable(table);
+    return 0;
+}
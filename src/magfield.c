@@ -7,52 +7,113 @@
 
 #include "magfield.h"
 #include "magfieldutil.h"
+#include "magfieldio.h"
+#include "magfieldsimd.h"
+#include "magfieldcompact.h"
 #include "munittest.h"
 #include "testdata.h"
 
 #include <stdlib.h>
 #include <math.h>
+#include <pthread.h>
 
 //used for unit testing only
 MagneticFieldPtr testFieldPtr;
+MagneticFieldPtr testSolenoidPtr;
 
-//the field algorithm (global; applies to all fields)
+//the algorithm given to fields when they are loaded, and to the loaded fields
+//when it is changed
+static Algorithm _algorithm = INTERPOLATION;
 
-Algorithm _algorithm = INTERPOLATION;
+//the loaded fields, so setAlgorithm can reach them. The list grows as
+//needed and is locked, since fields can be loaded and freed on any thread.
+static MagneticFieldPtr *_loadedFields = NULL;
+static int _numLoadedFields = 0;
+static int _loadedFieldsCapacity = 0;
+static pthread_mutex_t _loadedFieldsLock = PTHREAD_MUTEX_INITIALIZER;
 
 //for sector rotations
-static double cosSect[] = { NAN, 1, 0.5, -0.5, -1, -0.5, 0.5 };
-static double sinSect[] = { NAN, 0, ROOT3OVER2, ROOT3OVER2, 0, -ROOT3OVER2, -ROOT3OVER2 };
+const double cosSect[] = { NAN, 1, 0.5, -0.5, -1, -0.5, 0.5 };
+const double sinSect[] = { NAN, 0, ROOT3OVER2, ROOT3OVER2, 0, -ROOT3OVER2, -ROOT3OVER2 };
 
 //local prototypes
-static bool containedInCell3D(Cell3DPtr, double, double, double);
-static bool containedInCell2D(Cell2DPtr, double, double);
+static void evaluateField(FieldValuePtr, double, double, double, double, FieldProbePtr);
 
-static void getFieldValueTorus(FieldValuePtr, double, double, double, MagneticFieldPtr);
-static void getFieldValueSolenoid(FieldValuePtr, double, double, double, MagneticFieldPtr);
+static void torusInterpolate(FieldValuePtr, double, double, double, Cell3DPtr);
+static void torusNearestNeighbor(FieldValuePtr, double, double, double, Cell3DPtr);
+static void symmetricTorusUnfold(FieldValuePtr, int, double);
+static void solenoidRotate(FieldValuePtr, double, double, double);
 
-static void torusCalculate(FieldValuePtr,
-                           double,
-                           double,
-                           double,
-                           MagneticFieldPtr);
+//the field evaluators, one per map type and algorithm
+static void symmetricTorusInterpolation(FieldValuePtr, double, double, double, double, FieldProbePtr);
+static void symmetricTorusNearestNeighbor(FieldValuePtr, double, double, double, double, FieldProbePtr);
+static void fullTorusInterpolation(FieldValuePtr, double, double, double, double, FieldProbePtr);
+static void fullTorusNearestNeighbor(FieldValuePtr, double, double, double, double, FieldProbePtr);
+static void solenoidInterpolation(FieldValuePtr, double, double, double, double, FieldProbePtr);
+static void solenoidNearestNeighbor(FieldValuePtr, double, double, double, double, FieldProbePtr);
 
 
 /**
- * Set the global option for the algorithm used to extract field values.
- * @param algorithm it can either be
+ * Set the global option for the algorithm used to extract field values. It is
+ * applied to all loaded fields and given to fields loaded later. Use
+ * setFieldAlgorithm to change a single field.
+ * Do not call this while other threads are using the fields.
+ * @param algorithm either INTERPOLATION or NEAREST_NEIGHBOR.
  */
 void setAlgorithm(Algorithm algorithm) {
+    pthread_mutex_lock(&_loadedFieldsLock);
     if (algorithm != _algorithm) {
         _algorithm = algorithm;
-        fprintf(stdout, "The algorithm for finding field values has been changed to: %s\n",
-                (_algorithm == INTERPOLATION) ? "INTERPOLATION" : "NEAREST_NEIGHBOR");
+        debugPrint("The algorithm for finding field values has been changed to: %s\n",
+                   (_algorithm == INTERPOLATION) ? "INTERPOLATION" : "NEAREST_NEIGHBOR");
     }
+
+    for (int i = 0; i < _numLoadedFields; i++) {
+        setFieldAlgorithm(_loadedFields[i], algorithm);
+    }
+    pthread_mutex_unlock(&_loadedFieldsLock);
 }
 
 /**
- * Get the current algorithm for obtaining field values
- * @return the current algorithm (interpolation or nearest neighbor)
+ * Register a loaded field, so that setAlgorithm applies to it.
+ * @param fieldPtr a pointer to the field map.
+ */
+void registerField(MagneticFieldPtr fieldPtr) {
+    pthread_mutex_lock(&_loadedFieldsLock);
+    if (_numLoadedFields >= _loadedFieldsCapacity) {
+        int capacity = (_loadedFieldsCapacity == 0) ? 8 : 2 * _loadedFieldsCapacity;
+        MagneticFieldPtr *loadedFields = (MagneticFieldPtr *) realloc(_loadedFields,
+                                                                      capacity * sizeof(MagneticFieldPtr));
+        if (loadedFields == NULL) {
+            pthread_mutex_unlock(&_loadedFieldsLock);
+            fprintf(stderr, "\ncMag ERROR out of memory when registering a field, setAlgorithm will not reach it.\n");
+            return;
+        }
+        _loadedFields = loadedFields;
+        _loadedFieldsCapacity = capacity;
+    }
+    _loadedFields[_numLoadedFields++] = fieldPtr;
+    pthread_mutex_unlock(&_loadedFieldsLock);
+}
+
+/**
+ * Forget a field that is being freed.
+ * @param fieldPtr a pointer to the field map.
+ */
+void unregisterField(MagneticFieldPtr fieldPtr) {
+    pthread_mutex_lock(&_loadedFieldsLock);
+    for (int i = 0; i < _numLoadedFields; i++) {
+        if (_loadedFields[i] == fieldPtr) {
+            _loadedFields[i] = _loadedFields[--_numLoadedFields];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&_loadedFieldsLock);
+}
+
+/**
+ * Get the default algorithm for obtaining field values
+ * @return the default algorithm (interpolation or nearest neighbor)
  */
 Algorithm getAlgorithm() {
     return _algorithm;
@@ -186,6 +247,21 @@ void resetCell3D(Cell3DPtr cell3DPtr, double phi, double rho, double z) {
     cell3DPtr->zMax = zGrid->values[nZ + 1];
     cell3DPtr->zNorm = 1. / zGrid->delta;
 
+    //compact storage, decode the corners into the cell
+    if (fieldPtr->compactValues != NULL) {
+        FieldValuePtr corners = cell3DPtr->corners;
+        for (int i = 0; i < 2; i++) {
+            for (int j = 0; j < 2; j++) {
+                int index = getCompositeIndex(fieldPtr, nPhi + i, nRho + j, nZ);
+                decodeCompactValue(fieldPtr, index, corners);
+                decodeCompactValue(fieldPtr, index + 1, corners + 1);
+                cell3DPtr->b[i][j][0] = corners++;
+                cell3DPtr->b[i][j][1] = corners++;
+            }
+        }
+        return;
+    }
+
     int i000 = getCompositeIndex(fieldPtr, nPhi, nRho, nZ);
     int i001 = i000 + 1; // nPhi nRho nZ+1
 
@@ -252,6 +328,19 @@ void resetCell2D(Cell2DPtr cell2DPtr, double rho, double z) {
     cell2DPtr->zMax = zGrid->values[nZ + 1];
     cell2DPtr->zNorm = 1. / zGrid->delta;
 
+    //compact storage, decode the corners into the cell
+    if (fieldPtr->compactValues != NULL) {
+        FieldValuePtr corners = cell2DPtr->corners;
+        for (int j = 0; j < 2; j++) {
+            int index = getCompositeIndex(fieldPtr, 0, nRho + j, nZ);
+            decodeCompactValue(fieldPtr, index, corners);
+            decodeCompactValue(fieldPtr, index + 1, corners + 1);
+            cell2DPtr->b[j][0] = corners++;
+            cell2DPtr->b[j][1] = corners++;
+        }
+        return;
+    }
+
     int i00 = getCompositeIndex(fieldPtr, 0, nRho, nZ);
     int i01 = i00 + 1;
 
@@ -268,7 +357,8 @@ void resetCell2D(Cell2DPtr cell2DPtr, double rho, double z) {
 
 /**
  * Obtain the value of the field by tri-linear interpolation or nearest neighbor,
- * depending on settings.
+ * depending on settings. This uses the default probe of the field, so it
+ * is not thread safe. Multithreaded code should use getFieldValueProbe.
  * @param fieldValuePtr should be a valid pointer to a FieldValue. Upon
  * return it will hold the value of the field in kG, in Cartesian components
  * Bx, By, BZ, regardless of the field coordinate system of the map.
@@ -282,30 +372,63 @@ void getFieldValue(FieldValuePtr fieldValuePtr,
                    double y,
                    double z,
                    MagneticFieldPtr fieldPtr) {
+    getFieldValueProbe(fieldValuePtr, x, y, z, fieldPtr->probePtr);
+}
+
+/**
+ * Obtain the value of the field by tri-linear interpolation or nearest neighbor,
+ * depending on settings. Only the probe is modified, so different threads
+ * can safely share a field map as long as each uses its own probe.
+ * @param fieldValuePtr should be a valid pointer to a FieldValue. Upon
+ * return it will hold the value of the field in kG, in Cartesian components
+ * Bx, By, BZ, regardless of the field coordinate system of the map.
+ * @param x the x coordinate in cm.
+ * @param y the y coordinate in cm.
+ * @param z the z coordinate in cm.
+ * @param probePtr a pointer to a probe created (by createProbe) for the field map.
+ */
+void getFieldValueProbe(FieldValuePtr fieldValuePtr,
+                        double x,
+                        double y,
+                        double z,
+                        FieldProbePtr probePtr) {
+
+    MagneticFieldPtr fieldPtr = probePtr->fieldPtr;
 
     //here is where we apply any shifts
     x -= fieldPtr->shiftX;
     y -= fieldPtr->shiftY;
     z -= fieldPtr->shiftZ;
 
-    //see if we are contained
-    double rho = hypot(x, y);
+    evaluateField(fieldValuePtr, x, y, hypot(x, y), z, probePtr);
+}
+
+/**
+ * Obtain the value of one field at a point already in the field's own
+ * coordinates (shifts applied), with rho already computed, so that fields
+ * with the same shifts can share the transformation.
+ * @param fieldValuePtr upon return it will hold the (scaled) value of the
+ * field in kG, in Cartesian components Bx, By, BZ.
+ * @param x the x coordinate in cm, relative to the field's origin.
+ * @param y the y coordinate in cm, relative to the field's origin.
+ * @param rho the rho coordinate in cm, hypot(x, y).
+ * @param z the z coordinate in cm, relative to the field's origin.
+ * @param probePtr a pointer to a probe for the field map.
+ */
+static void evaluateField(FieldValuePtr fieldValuePtr, double x, double y, double rho, double z,
+                          FieldProbePtr probePtr) {
 
+    MagneticFieldPtr fieldPtr = probePtr->fieldPtr;
+
+    //see if we are contained
     if (!containsCylindrical(fieldPtr, rho, z)) {
         fieldValuePtr->b1 = 0;
         fieldValuePtr->b2 = 0;
         fieldValuePtr->b3 = 0;
     } else {
 
-        //will even need phi for solenoid to rotate
-        double phi = toDegrees(atan2(y, x));
-
-        if (fieldPtr->type == TORUS) {
-            getFieldValueTorus(fieldValuePtr, phi, rho, z, fieldPtr);
-        }
-        else  { //solenoid
-            getFieldValueSolenoid(fieldValuePtr, phi, rho, z, fieldPtr);
-        }
+        //the evaluator was chosen when the map or algorithm was set
+        fieldPtr->evaluator(fieldValuePtr, x, y, rho, z, probePtr);
 
         //scale the field
         fieldValuePtr->b1 *= fieldPtr->scale;
@@ -315,198 +438,316 @@ void getFieldValue(FieldValuePtr fieldValuePtr,
 }
 
 /**
- * Convenience function to avoid duplicating code for symmetric and full torus maps.
- * @param fieldValuePtr should be a valid pointer to a Torus field. Upon
- * return it will hold the value of the field in kG, in Cartesian components
- * Bx, By, BZ.
+ * Tri-linear interpolation in a torus cell.
+ * @param fieldValuePtr upon return it will hold the value of the field in kG,
+ * in the (Cartesian) components of the map.
  * @param phi the phi coordinate in degrees.
  * @param rho the rho coordinate in cm.
  * @param z the z coordinate in cm.
- * @param fieldPtr a pointer to a torus field map.
+ * @param cell the cell of the probe being used for a torus field map.
  */
-static void torusCalculate(FieldValuePtr fieldValuePtr,
-                           double phi,
-                           double rho,
-                           double z,
-                           MagneticFieldPtr fieldPtr) {
-
-    Cell3DPtr cell = fieldPtr->cell3DPtr;
+static void torusInterpolate(FieldValuePtr fieldValuePtr,
+                             double phi,
+                             double rho,
+                             double z,
+                             Cell3DPtr cell) {
 
     if (!containedInCell3D(cell, phi, rho, z)) {
         resetCell3D(cell, phi, rho, z);
     }
 
-    if (_algorithm == INTERPOLATION) {
-        cell->f[0] = (phi - cell->phiMin) * cell->phiNorm;
-        cell->f[1] = (rho - cell->rhoMin) * cell->rhoNorm;
-        cell->f[2] = (z - cell->zMin) * cell->zNorm;
+    //the scratch space lives on the stack so that the cell
+    //is only written to when it is reset
+    double f[3], g[3], a[8];
+
+    f[0] = (phi - cell->phiMin) * cell->phiNorm;
+    f[1] = (rho - cell->rhoMin) * cell->rhoNorm;
+    f[2] = (z - cell->zMin) * cell->zNorm;
+
+    g[0] = 1 - f[0];
+    g[1] = 1 - f[1];
+    g[2] = 1 - f[2];
+
+    a[0] = g[0] * g[1] * g[2];
+    a[1] = g[0] * g[1] * f[2];
+    a[2] = g[0] * f[1] * g[2];
+    a[3] = g[0] * f[1] * f[2];
+    a[4] = f[0] * g[1] * g[2];
+    a[5] = f[0] * g[1] * f[2];
+    a[6] = f[0] * f[1] * g[2];
+    a[7] = f[0] * f[1] * f[2];
+
+
+    fieldValuePtr->b1 = cell->b[0][0][0]->b1 * a[0] + cell->b[0][0][1]->b1 * a[1] + cell->b[0][1][0]->b1 * a[2] + cell->b[0][1][1]->b1 * a[3]
+                        + cell->b[1][0][0]->b1 * a[4] + cell->b[1][0][1]->b1 * a[5] + cell->b[1][1][0]->b1 * a[6] + cell->b[1][1][1]->b1 * a[7];
+    fieldValuePtr->b2 = cell->b[0][0][0]->b2 * a[0] + cell->b[0][0][1]->b2 * a[1] + cell->b[0][1][0]->b2 * a[2] + cell->b[0][1][1]->b2 * a[3]
+                        + cell->b[1][0][0]->b2 * a[4] + cell->b[1][0][1]->b2 * a[5] + cell->b[1][1][0]->b2 * a[6] + cell->b[1][1][1]->b2 * a[7];
+    fieldValuePtr->b3 = cell->b[0][0][0]->b3 * a[0] + cell->b[0][0][1]->b3 * a[1] + cell->b[0][1][0]->b3 * a[2] + cell->b[0][1][1]->b3 * a[3]
+                        + cell->b[1][0][0]->b3 * a[4] + cell->b[1][0][1]->b3 * a[5] + cell->b[1][1][0]->b3 * a[6] + cell->b[1][1][1]->b3 * a[7];
+}
 
-      /*  cell->f[0] = cell->f[0] - floor(cell->f[0]);
-        cell->f[1] = cell->f[1] - floor(cell->f[1]);
-        cell->f[2] = cell->f[2] - floor(cell->f[2]);*/
+/**
+ * Nearest neighbor lookup in a torus cell.
+ * @param fieldValuePtr upon return it will hold the value of the field in kG,
+ * in the (Cartesian) components of the map.
+ * @param phi the phi coordinate in degrees.
+ * @param rho the rho coordinate in cm.
+ * @param z the z coordinate in cm.
+ * @param cell the cell of the probe being used for a torus field map.
+ */
+static void torusNearestNeighbor(FieldValuePtr fieldValuePtr,
+                                 double phi,
+                                 double rho,
+                                 double z,
+                                 Cell3DPtr cell) {
 
-        cell->g[0] = 1 - cell->f[0];
-        cell->g[1] = 1 - cell->f[1];
-        cell->g[2] = 1 - cell->f[2];
+    if (!containedInCell3D(cell, phi, rho, z)) {
+        resetCell3D(cell, phi, rho, z);
+    }
 
-        cell->a[0] = cell->g[0] * cell->g[1] * cell->g[2];
-        cell->a[1] = cell->g[0] * cell->g[1] * cell->f[2];
-        cell->a[2] = cell->g[0] * cell->f[1] * cell->g[2];
-        cell->a[3] = cell->g[0] * cell->f[1] * cell->f[2];
-        cell->a[4] = cell->f[0] * cell->g[1] * cell->g[2];
-        cell->a[5] = cell->f[0] * cell->g[1] * cell->f[2];
-        cell->a[6] = cell->f[0] * cell->f[1] * cell->g[2];
-        cell->a[7] = cell->f[0] * cell->f[1] * cell->f[2];
+    double fractPhi = (phi - cell->phiMin) * cell->phiNorm;
+    double fractRho = (rho - cell->rhoMin) * cell->rhoNorm;
+    double fractZ = (z - cell->zMin) * cell->zNorm;
 
+    int N1 = (fractPhi > 0.5) ? 1 : 0;
+    int N2 = (fractRho > 0.5) ? 1 : 0;
+    int N3 = (fractZ > 0.5) ? 1 : 0;
 
-        fieldValuePtr->b1 = cell->b[0][0][0]->b1 * cell->a[0] + cell->b[0][0][1]->b1 * cell->a[1] + cell->b[0][1][0]->b1 * cell->a[2] + cell->b[0][1][1]->b1 * cell->a[3]
-                            + cell->b[1][0][0]->b1 * cell->a[4] + cell->b[1][0][1]->b1 * cell->a[5] + cell->b[1][1][0]->b1 * cell->a[6] + cell->b[1][1][1]->b1 * cell->a[7];
-        fieldValuePtr->b2 = cell->b[0][0][0]->b2 * cell->a[0] + cell->b[0][0][1]->b2 * cell->a[1] + cell->b[0][1][0]->b2 * cell->a[2] + cell->b[0][1][1]->b2 * cell->a[3]
-                            + cell->b[1][0][0]->b2 * cell->a[4] + cell->b[1][0][1]->b2 * cell->a[5] + cell->b[1][1][0]->b2 * cell->a[6] + cell->b[1][1][1]->b2 * cell->a[7];
-        fieldValuePtr->b3 = cell->b[0][0][0]->b3 * cell->a[0] + cell->b[0][0][1]->b3 * cell->a[1] + cell->b[0][1][0]->b3 * cell->a[2] + cell->b[0][1][1]->b3 * cell->a[3]
-                            + cell->b[1][0][0]->b3 * cell->a[4] + cell->b[1][0][1]->b3 * cell->a[5] + cell->b[1][1][0]->b3 * cell->a[6] + cell->b[1][1][1]->b3 * cell->a[7];
+    fieldValuePtr->b1 = cell->b[N1][N2][N3]->b1; // Bx
+    fieldValuePtr->b2 = cell->b[N1][N2][N3]->b2; // By
+    fieldValuePtr->b3 = cell->b[N1][N2][N3]->b3; // Bz
+}
 
+/**
+ * The symmetric torus map only covers [0, 30] degrees. After the lookup at
+ * |relative phi| we may have to flip (for negative relative phi) and then
+ * rotate into the actual sector.
+ * @param fieldValuePtr on input, the field from the map. Upon return,
+ * the field in the actual Cartesian components Bx, By, Bz.
+ * @param sector the sector [1..6].
+ * @param relPhi the phi coordinate relative to the middle of the sector, in degrees.
+ */
+static void symmetricTorusUnfold(FieldValuePtr fieldValuePtr, int sector, double relPhi) {
 
+    //do we need to flip?
+    if (relPhi < 0.0) {
+        //flip x and z components
+        fieldValuePtr->b1 = -fieldValuePtr->b1;
+        fieldValuePtr->b3 = -fieldValuePtr->b3;
     }
-    else { //nearest neighbor
-        double fractPhi = (phi - cell->phiMin) * cell->phiNorm;
-        double fractRho = (rho - cell->rhoMin) * cell->rhoNorm;
-        double fractZ = (z - cell->zMin) * cell->zNorm;
-
-        int N1 = (fractPhi > 0.5) ? 1 : 0;
-        int N2 = (fractRho > 0.5) ? 1 : 0;
-        int N3 = (fractZ > 0.5) ? 1 : 0;
 
-        fieldValuePtr->b1 = cell->b[N1][N2][N3]->b1; // Bx
-        fieldValuePtr->b2 = cell->b[N1][N2][N3]->b2; // By
-        fieldValuePtr->b3 = cell->b[N1][N2][N3]->b3; // Bz
+    //do we need to rotate?
+    if (sector > 1) {
+        double cos = cosSect[sector];
+        double sin = sinSect[sector];
+        double bx = fieldValuePtr->b1;
+        double by = fieldValuePtr->b2;
+        fieldValuePtr->b1 = (float) (bx * cos - by * sin);
+        fieldValuePtr->b2 = (float) (bx * sin + by * cos);
     }
+}
 
+/**
+ * Get the field for a TORUS map with 12-fold symmetry by tri-linear interpolation.
+ * This is one of the field evaluators selected by setFieldAlgorithm.
+ * @param fieldValuePtr upon return it will hold the (unscaled) value of the
+ * field in kG, in Cartesian components Bx, By, BZ.
+ * @param x the x coordinate in cm, relative to the field's origin.
+ * @param y the y coordinate in cm, relative to the field's origin.
+ * @param rho the rho coordinate in cm (already checked to be within the map).
+ * @param z the z coordinate in cm, relative to the field's origin.
+ * @param probePtr a pointer to a probe for the torus field map.
+ */
+static void symmetricTorusInterpolation(FieldValuePtr fieldValuePtr,
+                                        double x, double y, double rho, double z,
+                                        FieldProbePtr probePtr) {
+    // relativePhi (-30, 30] phi relative to middle of sector
+    double relPhi;
+    int sector;
+    sectorFold(x, y, &relPhi, &sector);
+    torusInterpolate(fieldValuePtr, fabs(relPhi), rho, z, probePtr->cell3DPtr);
+    symmetricTorusUnfold(fieldValuePtr, sector, relPhi);
 }
 
 /**
- * Get the TORUS field value by tri-linear interpolation or nearest neighbor,
- * depending on settings.
- * @param fieldValuePtr should be a valid pointer to a Torus field. Upon
- * return it will hold the value of the field in kG, in Cartesian components
- * Bx, By, BZ.
- * @param phi the phi coordinate in degrees.
- * @param rho the rho coordinate in cm.
- * @param z the z coordinate in cm.
- * @param fieldPtr a pointer to a torus field map.
+ * Get the field for a TORUS map with 12-fold symmetry by nearest neighbor.
+ * Parameters are as for symmetricTorusInterpolation.
  */
-void getFieldValueTorus(FieldValuePtr fieldValuePtr,
-                   double phi,
-                   double rho,
-                   double z,
-                   MagneticFieldPtr fieldPtr) {
+static void symmetricTorusNearestNeighbor(FieldValuePtr fieldValuePtr,
+                                          double x, double y, double rho, double z,
+                                          FieldProbePtr probePtr) {
+    double relPhi;
+    int sector;
+    sectorFold(x, y, &relPhi, &sector);
+    torusNearestNeighbor(fieldValuePtr, fabs(relPhi), rho, z, probePtr->cell3DPtr);
+    symmetricTorusUnfold(fieldValuePtr, sector, relPhi);
+}
 
-    if (fieldPtr->symmetric) { //torus with 12-fold symmetry
-        // relativePhi (-30, 30) phi relative to middle of sector
-        double relPhi = relativePhi(phi);
-         bool flip = (relPhi < 0.0);
-        torusCalculate(fieldValuePtr, fabs(relPhi), rho, z, fieldPtr);
-
-        //do we need to flip?
-        if (flip) {
-            //flip x and z components
-            fieldValuePtr->b1 = -fieldValuePtr->b1;
-            fieldValuePtr->b3 = -fieldValuePtr->b3;
-        }
+/**
+ * Get the field for a full (360 degree) TORUS map by tri-linear interpolation.
+ * Parameters are as for symmetricTorusInterpolation.
+ */
+static void fullTorusInterpolation(FieldValuePtr fieldValuePtr,
+                                   double x, double y, double rho, double z,
+                                   FieldProbePtr probePtr) {
+    double phi = toDegrees(atan2(y, x));
+    if (phi < 0) {
+        phi += 360;
+    }
+    torusInterpolate(fieldValuePtr, phi, rho, z, probePtr->cell3DPtr);
+}
 
-        //do we need to rotate?
-        int sector = getSector(phi);
+/**
+ * Get the field for a full (360 degree) TORUS map by nearest neighbor.
+ * Parameters are as for symmetricTorusInterpolation.
+ */
+static void fullTorusNearestNeighbor(FieldValuePtr fieldValuePtr,
+                                     double x, double y, double rho, double z,
+                                     FieldProbePtr probePtr) {
+    double phi = toDegrees(atan2(y, x));
+    if (phi < 0) {
+        phi += 360;
+    }
+    torusNearestNeighbor(fieldValuePtr, phi, rho, z, probePtr->cell3DPtr);
+}
 
-        if (sector > 1) {
-            double cos = cosSect[sector];
-            double sin = sinSect[sector];
-            double bx = fieldValuePtr->b1;
-            double by = fieldValuePtr->b2;
-            fieldValuePtr->b1 = (float) (bx * cos - by * sin);
-            fieldValuePtr->b2 = (float) (bx * sin + by * cos);
-        }
+/**
+ * The solenoid map is in the phi = 0 plane, with Bphi = 0. Rotate
+ * Brho (in b2) into the Cartesian components. The cosine and sine of phi
+ * are just x/rho and y/rho. On the axis, where phi is undefined, the
+ * rotation is taken to be by phi = 0 (which atan2(0, 0) used to give).
+ * @param fieldValuePtr on input, the field from the map. Upon return,
+ * the field in Cartesian components Bx, By, Bz.
+ * @param x the x coordinate in cm, relative to the field's origin.
+ * @param y the y coordinate in cm, relative to the field's origin.
+ * @param rho the rho coordinate in cm, hypot(x, y).
+ */
+static void solenoidRotate(FieldValuePtr fieldValuePtr, double x, double y, double rho) {
+    double bRho = fieldValuePtr->b2;
 
+    if (rho > 0) {
+        fieldValuePtr->b1 = bRho * (x / rho);
+        fieldValuePtr->b2 = bRho * (y / rho);
     }
-    else { // full map
-        if (phi < 0) {
-            phi += 360;
-        }
-        torusCalculate(fieldValuePtr, phi, rho, z, fieldPtr);
+    else {
+        fieldValuePtr->b1 = bRho;
+        fieldValuePtr->b2 = 0;
     }
-
-
 }
 
 /**
- * Get the SOLENOID field value by tri-linear interpolation or nearest neighbor,
- * depending on settings.
- * @param fieldValuePtr should be a valid pointer to a Solenoid field. Upon
- * return it will hold the value of the field in kG, in Cartesian components
- * Bx, By, BZ.
- * @param phi the phi coordinate in degrees. This is needed for a final rotation
- * of the field after it was calculated in the phi = 0 plane.
- * @param rho the rho coordinate in cm.
- * @param z the z coordinate in cm.
- * @param fieldPtr a pointer to a torus field map.
+ * Get the field for a SOLENOID map by tri-linear interpolation (which, since
+ * there is no phi dependence, is actually bi-linear).
+ * Parameters are as for symmetricTorusInterpolation.
  */
-void getFieldValueSolenoid(FieldValuePtr fieldValuePtr,
-                           double phi,
-                           double rho,
-                           double z,
-                           MagneticFieldPtr fieldPtr) {
+static void solenoidInterpolation(FieldValuePtr fieldValuePtr,
+                                  double x, double y, double rho, double z,
+                                  FieldProbePtr probePtr) {
 
-    Cell2DPtr cell = fieldPtr->cell2DPtr;
+    Cell2DPtr cell = probePtr->cell2DPtr;
 
     if (!containedInCell2D(cell, rho, z)) {
         resetCell2D(cell, rho, z);
     }
 
-    if (_algorithm == INTERPOLATION) {
-        double fractRho = (rho - cell->rhoMin) * cell->rhoNorm;
-        double fractZ = (z - cell->zMin) * cell->zNorm;
+    double fractRho = (rho - cell->rhoMin) * cell->rhoNorm;
+    double fractZ = (z - cell->zMin) * cell->zNorm;
 
-      //  fractRho = fractRho - floor(fractRho);
-      //  fractZ = fractZ - floor(fractZ);
+    double g1 = 1 - fractRho;
+    double g2 = 1 - fractZ;
 
-        double g1 = 1 - fractRho;
-        double g2 = 1 - fractZ;
+    double g1g2 = g1 * g2;
+    double f1g2 = fractRho * g2;
+    double g1f2 = g1 * fractZ;
+    double f1f2 = fractRho * fractZ;
 
-        double g1g2 = g1 * g2;
-        double f1g2 = fractRho * g2;
-        double g1f2 = g1 * fractZ;
-        double f1f2 = fractRho * fractZ;
+    if (cell->b[1][0] == NULL) {
+        fprintf(stderr, "Recovering from NULL b vector in solenoidInterpolation.");
+        cell->b[1][0] = cell->b[0][0];
+        cell->b[1][1] = cell->b[0][1];
+    }
 
-        if (cell->b[1][0] == NULL) {
-            fprintf(stderr, "Recovering from NULL b vector in getFieldValueSolenoid.");
-            cell->b[1][0] = cell->b[0][0];
-            cell->b[1][1] = cell->b[0][1];
-        }
+    fieldValuePtr->b1 = 0; // Bphi is 0
+    fieldValuePtr->b2 = cell->b[0][0]->b2 * g1g2 + cell->b[0][1]->b2 * g1f2 + cell->b[1][0]->b2 * f1g2 +
+                        cell->b[1][1]->b2 * f1f2;
+    fieldValuePtr->b3 = cell->b[0][0]->b3 * g1g2 + cell->b[0][1]->b3 * g1f2 + cell->b[1][0]->b3 * f1g2 +
+                        cell->b[1][1]->b3 * f1f2;
 
-        fieldValuePtr->b1 = 0; // Bphi is 0
-        fieldValuePtr->b2 = cell->b[0][0]->b2 * g1g2 + cell->b[0][1]->b2 * g1f2 + cell->b[1][0]->b2 * f1g2 +
-                            cell->b[1][1]->b2 * f1f2;
-        fieldValuePtr->b3 = cell->b[0][0]->b3 * g1g2 + cell->b[0][1]->b3 * g1f2 + cell->b[1][0]->b3 * f1g2 +
-                            cell->b[1][1]->b3 * f1f2;
+    solenoidRotate(fieldValuePtr, x, y, rho);
+}
 
+/**
+ * Get the field for a SOLENOID map by nearest neighbor.
+ * Parameters are as for symmetricTorusInterpolation.
+ */
+static void solenoidNearestNeighbor(FieldValuePtr fieldValuePtr,
+                                    double x, double y, double rho, double z,
+                                    FieldProbePtr probePtr) {
+
+    Cell2DPtr cell = probePtr->cell2DPtr;
+
+    if (!containedInCell2D(cell, rho, z)) {
+        resetCell2D(cell, rho, z);
     }
-    else { //nearest neighbor
-        double fractRho = (rho - cell->rhoMin) * cell->rhoNorm;
-        double fractZ = (z - cell->zMin) * cell->zNorm;
 
-        int N2 = (fractRho < 0.5) ? 0 : 1;
-        int N3 = (fractZ < 0.5) ? 0 : 1;
+    double fractRho = (rho - cell->rhoMin) * cell->rhoNorm;
+    double fractZ = (z - cell->zMin) * cell->zNorm;
+
+    int N2 = (fractRho < 0.5) ? 0 : 1;
+    int N3 = (fractZ < 0.5) ? 0 : 1;
+
+    fieldValuePtr->b1 = 0; // Bphi is 0
+    fieldValuePtr->b2 = cell->b[N2][N3]->b2; // Brho
+    fieldValuePtr->b3 = cell->b[N2][N3]->b3; // Bz
+
+    solenoidRotate(fieldValuePtr, x, y, rho);
+}
+
+/**
+ * Set the algorithm (interpolation or nearest neighbor) used by one field.
+ * This also resolves the field's evaluator, the function specialized for the
+ * map type and algorithm, so that lookups do not have to test the settings.
+ * Do not call this while other threads are using the field.
+ * @param fieldPtr a pointer to the field map.
+ * @param algorithm the algorithm to use for this field.
+ */
+void setFieldAlgorithm(MagneticFieldPtr fieldPtr, Algorithm algorithm) {
+    bool interpolate = (algorithm == INTERPOLATION);
+    fieldPtr->algorithm = algorithm;
 
-        fieldValuePtr->b1 = 0; // Bphi is 0
-        fieldValuePtr->b2 = cell->b[N2][N3]->b2; // Brho
-        fieldValuePtr->b3 = cell->b[N2][N3]->b3; // Bz
+    if (fieldPtr->type == SOLENOID) {
+        fieldPtr->evaluator = interpolate ? solenoidInterpolation : solenoidNearestNeighbor;
+    }
+    else if (fieldPtr->symmetric) {
+        fieldPtr->evaluator = interpolate ? symmetricTorusInterpolation : symmetricTorusNearestNeighbor;
+    }
+    else {
+        fieldPtr->evaluator = interpolate ? fullTorusInterpolation : fullTorusNearestNeighbor;
     }
+}
 
-    //rotate with knowledge that for solenoid Bphi = 0 in map
-    double phiRad = toRadians(phi);
-    double bRho = fieldValuePtr->b2;
+/**
+ * Get the algorithm used by a field.
+ * @param fieldPtr a pointer to the field map.
+ * @return the algorithm (interpolation or nearest neighbor) used by the field.
+ */
+Algorithm getFieldAlgorithm(MagneticFieldPtr fieldPtr) {
+    return fieldPtr->algorithm;
+}
 
-    fieldValuePtr->b1 = bRho * cos(phiRad);
-    fieldValuePtr->b2 = bRho * sin(phiRad);
+/**
+ * Make the cell of a probe "contain nothing", so that the next lookup resets it.
+ * @param probePtr the probe.
+ */
+void invalidateProbe(FieldProbePtr probePtr) {
+    if (probePtr->cell3DPtr != NULL) {
+        probePtr->cell3DPtr->phiMin = INFINITY;
+        probePtr->cell3DPtr->phiMax = -INFINITY;
+    }
+    if (probePtr->cell2DPtr != NULL) {
+        probePtr->cell2DPtr->rhoMin = INFINITY;
+        probePtr->cell2DPtr->rhoMax = -INFINITY;
+    }
 }
 
 /**
@@ -532,23 +773,219 @@ void getCompositeFieldValue(FieldValuePtr fieldValuePtr,
                             MagneticFieldPtr field1,
                             MagneticFieldPtr field2) {
 
+    getCompositeFieldValueProbe(fieldValuePtr, x, y, z,
+                                (field1 == NULL) ? NULL : field1->probePtr,
+                                (field2 == NULL) ? NULL : field2->probePtr);
+}
+
+/**
+ * Obtain the combined value of two fields using caller owned probes, so that
+ * it is safe to call from many threads as long as each has its own probes.
+ * @param fieldValuePtr should be a valid pointer to a FieldValue. Upon
+ * return it will hold the value of the combined field, in kG, in Cartesian
+ * components Bx, By, BZ.
+ * @param x the x coordinate in cm.
+ * @param y the y coordinate in cm.
+ * @param z the z coordinate in cm.
+ * @param probe1 a probe for the first field (can be NULL).
+ * @param probe2 a probe for the second field (can be NULL).
+ */
+void getCompositeFieldValueProbe(FieldValuePtr fieldValuePtr,
+                                 double x,
+                                 double y,
+                                 double z,
+                                 FieldProbePtr probe1,
+                                 FieldProbePtr probe2) {
+
+    FieldProbePtr probes[2] = {probe1, probe2};
+    getCompositeFieldValueProbes(fieldValuePtr, x, y, z, probes, 2);
+}
+
+/**
+ * Obtain the combined value of any number of fields using caller owned
+ * probes. The point is transformed into a field's coordinates (shifted,
+ * and rho computed) only when the field's shifts differ from those of the
+ * previous field, so fields with equal shifts, the usual case, share it.
+ * The result is the same as adding the values from getFieldValueProbe.
+ * @param fieldValuePtr should be a valid pointer to a FieldValue. Upon
+ * return it will hold the value of the combined field, in kG, in Cartesian
+ * components Bx, By, BZ.
+ * @param x the x coordinate in cm.
+ * @param y the y coordinate in cm.
+ * @param z the z coordinate in cm.
+ * @param probes a probe for each field. NULL entries are skipped.
+ * @param numProbes the number of probes.
+ */
+void getCompositeFieldValueProbes(FieldValuePtr fieldValuePtr,
+                                  double x,
+                                  double y,
+                                  double z,
+                                  FieldProbePtr *probes,
+                                  int numProbes) {
+
     fieldValuePtr->b1 = 0;
     fieldValuePtr->b2 = 0;
     fieldValuePtr->b3 = 0;
 
     FieldValue temp;
+    MagneticFieldPtr previous = NULL;
+    double xx = 0, yy = 0, zz = 0, rho = 0;
 
-    if (field1 != NULL) {
-        getFieldValue(fieldValuePtr, x, y, z, field1);
-    }
-    if (field2 != NULL) {
-        getFieldValue(&temp, x, y, z, field2);
+    for (int i = 0; i < numProbes; i++) {
+        if (probes[i] == NULL) {
+            continue;
+        }
+
+        MagneticFieldPtr fieldPtr = probes[i]->fieldPtr;
+        if ((previous == NULL) || (fieldPtr->shiftX != previous->shiftX) ||
+            (fieldPtr->shiftY != previous->shiftY) || (fieldPtr->shiftZ != previous->shiftZ)) {
+            xx = x - fieldPtr->shiftX;
+            yy = y - fieldPtr->shiftY;
+            zz = z - fieldPtr->shiftZ;
+            rho = hypot(xx, yy);
+        }
+        previous = fieldPtr;
+
+        evaluateField(&temp, xx, yy, rho, zz, probes[i]);
         fieldValuePtr->b1 += temp.b1;
         fieldValuePtr->b2 += temp.b2;
         fieldValuePtr->b3 += temp.b3;
     }
 }
 
+/**
+ * Evaluate one field at an array of points. Interpolation is handed to the
+ * vectorized kernels. Otherwise the loop invariant work
+ * (shifts, scale, bounds, field type) is done once, outside the loop.
+ * @param x the x coordinates in cm.
+ * @param y the y coordinates in cm.
+ * @param z the z coordinates in cm.
+ * @param bx upon return the x components of the field in kG.
+ * @param by upon return the y components of the field in kG.
+ * @param bz upon return the z components of the field in kG.
+ * @param n the number of points.
+ * @param probePtr a probe for the field.
+ * @param accumulate if true, the field is added to what is already in bx, by, bz.
+ */
+static void batchFieldValues(const double *x, const double *y, const double *z,
+                             float *bx, float *by, float *bz, int n,
+                             FieldProbePtr probePtr, bool accumulate) {
+
+    MagneticFieldPtr fieldPtr = probePtr->fieldPtr;
+
+    if (fieldPtr->algorithm == INTERPOLATION) {
+        simdFieldValues(x, y, z, bx, by, bz, n, fieldPtr, accumulate);
+        return;
+    }
+
+    double shiftX = fieldPtr->shiftX;
+    double shiftY = fieldPtr->shiftY;
+    double shiftZ = fieldPtr->shiftZ;
+    double scale = fieldPtr->scale;
+
+    double rhoMin = fieldPtr->rhoGridPtr->minVal;
+    double rhoMax = fieldPtr->rhoGridPtr->maxVal;
+    double zMin = fieldPtr->zGridPtr->minVal;
+    double zMax = fieldPtr->zGridPtr->maxVal;
+
+    FieldEvaluator evaluator = fieldPtr->evaluator;
+
+    FieldValue fv;
+
+    for (int i = 0; i < n; i++) {
+        double xx = x[i] - shiftX;
+        double yy = y[i] - shiftY;
+        double zz = z[i] - shiftZ;
+
+        if ((zz < zMin) || (zz >= zMax)) {
+            fv.b1 = 0;
+            fv.b2 = 0;
+            fv.b3 = 0;
+        }
+        else {
+            double rho = hypot(xx, yy);
+            if ((rho < rhoMin) || (rho >= rhoMax)) {
+                fv.b1 = 0;
+                fv.b2 = 0;
+                fv.b3 = 0;
+            }
+            else {
+                evaluator(&fv, xx, yy, rho, zz, probePtr);
+                fv.b1 *= scale;
+                fv.b2 *= scale;
+                fv.b3 *= scale;
+            }
+        }
+
+        if (accumulate) {
+            bx[i] += fv.b1;
+            by[i] += fv.b2;
+            bz[i] += fv.b3;
+        }
+        else {
+            bx[i] = fv.b1;
+            by[i] = fv.b2;
+            bz[i] = fv.b3;
+        }
+    }
+}
+
+/**
+ * Obtain the value of a field at many points at once. This is equivalent to
+ * calling getFieldValueProbe for each point, but the per point overhead is
+ * amortized. The inputs and outputs are "structure of arrays."
+ * @param x the x coordinates in cm.
+ * @param y the y coordinates in cm.
+ * @param z the z coordinates in cm.
+ * @param bx upon return the x components of the field in kG.
+ * @param by upon return the y components of the field in kG.
+ * @param bz upon return the z components of the field in kG.
+ * @param n the number of points.
+ * @param probePtr a probe for the field.
+ */
+void getFieldValues(const double *x, const double *y, const double *z,
+                    float *bx, float *by, float *bz, int n,
+                    FieldProbePtr probePtr) {
+    batchFieldValues(x, y, z, bx, by, bz, n, probePtr, false);
+}
+
+/**
+ * Obtain the combined value of two fields at many points at once. This is
+ * equivalent to calling getCompositeFieldValueProbe for each point.
+ * @param x the x coordinates in cm.
+ * @param y the y coordinates in cm.
+ * @param z the z coordinates in cm.
+ * @param bx upon return the x components of the field in kG.
+ * @param by upon return the y components of the field in kG.
+ * @param bz upon return the z components of the field in kG.
+ * @param n the number of points.
+ * @param probe1 a probe for the first field (can be NULL).
+ * @param probe2 a probe for the second field (can be NULL).
+ */
+void getCompositeFieldValues(const double *x, const double *y, const double *z,
+                             float *bx, float *by, float *bz, int n,
+                             FieldProbePtr probe1, FieldProbePtr probe2) {
+
+    bool accumulate = false;
+
+    if (probe1 != NULL) {
+        batchFieldValues(x, y, z, bx, by, bz, n, probe1, accumulate);
+        accumulate = true;
+    }
+    if (probe2 != NULL) {
+        batchFieldValues(x, y, z, bx, by, bz, n, probe2, accumulate);
+        accumulate = true;
+    }
+
+    if (!accumulate) {
+        for (int i = 0; i < n; i++) {
+            bx[i] = 0;
+            by[i] = 0;
+            bz[i] = 0;
+        }
+    }
+}
+
 
 /**
  * Get the composite index into the 1D data array holding
@@ -622,7 +1059,18 @@ char *nearestNeighborUnitTest() {
 
     double resolution = 1;   //gauss
 
+    Algorithm algorithm = getFieldAlgorithm(testFieldPtr);
+    Algorithm defaultAlgorithm = getAlgorithm();
+
+    //the list of loaded fields grows as needed
+    for (int i = 0; i < 40; i++) {
+        registerField(testFieldPtr);
+    }
     setAlgorithm(NEAREST_NEIGHBOR);
+    for (int i = 0; i < 40; i++) {
+        unregisterField(testFieldPtr);
+    }
+    mu_assert("setAlgorithm did not change a loaded field.", getFieldAlgorithm(testFieldPtr) == NEAREST_NEIGHBOR);
     FieldValuePtr fieldValuePtr = (FieldValuePtr) malloc (sizeof(FieldValue));
 
     if (testFieldPtr->type == TORUS) {
@@ -643,7 +1091,8 @@ char *nearestNeighborUnitTest() {
             int k = 66;
         }
 
-        setAlgorithm(INTERPOLATION);
+        setAlgorithm(defaultAlgorithm);
+        setFieldAlgorithm(testFieldPtr, algorithm);
         fprintf(stdout, "\nPASSED Torus nearest neighbor UnitTest\n");
         return NULL;
     }
@@ -686,7 +1135,8 @@ char *nearestNeighborUnitTest() {
 
         }
 
-        setAlgorithm(INTERPOLATION);
+        setAlgorithm(defaultAlgorithm);
+        setFieldAlgorithm(testFieldPtr, algorithm);
         fprintf(stdout, "\nPASSED Solenoid nearest neighbor UnitTest\n");
         return NULL;
     }
@@ -778,17 +1228,243 @@ char *compositeIndexUnitTest() {
 }
 
 /**
- * Get the field at a given composite index.
+ * A unit test for the probes. Two probes are used in an interleaved fashion
+ * on unrelated points, and each result must match the default probe exactly.
+ * This checks that no lookup state is shared between probes.
+ * @return an error message if the test fails, or NULL if it passes.
+ */
+char *probeUnitTest() {
+
+    int count = 100000;
+    double x, y;
+    FieldValue fv0, fv1, fv2;
+
+    FieldProbePtr probe1 = createProbe(testFieldPtr);
+    FieldProbePtr probe2 = createProbe(testFieldPtr);
+
+    for (int i = 0; i < count; i++) {
+
+        double phi = randomDouble(0, 360);
+        double rho = randomDouble(testFieldPtr->rhoGridPtr->minVal, testFieldPtr->rhoGridPtr->maxVal);
+        double z = randomDouble(testFieldPtr->zGridPtr->minVal, testFieldPtr->zGridPtr->maxVal);
+        cylindricalToCartesian(&x, &y, phi, rho);
+
+        //probe2 is kept "near" its own track so it keeps a different cell
+        getFieldValueProbe(&fv2, 0.5*x, 0.5*y, z, probe2);
+        getFieldValueProbe(&fv1, x, y, z, probe1);
+        getFieldValue(&fv0, x, y, z, testFieldPtr);
+
+        bool result = (fv0.b1 == fv1.b1) && (fv0.b2 == fv1.b2) && (fv0.b3 == fv1.b3);
+        if (!result) {
+            fprintf(stderr, "Probe mismatch at (%-9.3f, %-9.3f, %-9.3f)\n", x, y, z);
+        }
+        mu_assert("The probe value did not match the default probe.", result);
+
+        getFieldValue(&fv0, 0.5*x, 0.5*y, z, testFieldPtr);
+        result = (fv0.b1 == fv2.b1) && (fv0.b2 == fv2.b2) && (fv0.b3 == fv2.b3);
+        mu_assert("The second probe value did not match the default probe.", result);
+    }
+
+    freeProbe(probe1);
+    freeProbe(probe2);
+
+    //recreating the default cell resets it, and leaves it the default probe's
+    Cell3DPtr cell3DPtr = testFieldPtr->cell3DPtr;
+    Cell2DPtr cell2DPtr = testFieldPtr->cell2DPtr;
+    createCell3D(testFieldPtr);
+    createCell2D(testFieldPtr);
+    mu_assert("Creating a cell replaced the default probe's cell.", (testFieldPtr->cell3DPtr == cell3DPtr) &&
+              (testFieldPtr->cell2DPtr == cell2DPtr) && (cell3DPtr == testFieldPtr->probePtr->cell3DPtr) &&
+              (cell2DPtr == testFieldPtr->probePtr->cell2DPtr));
+    getFieldValue(&fv0, 10, 20, 300, testFieldPtr);
+    getFieldValueProbe(&fv1, 10, 20, 300, testFieldPtr->probePtr);
+    mu_assert("The default probe value changed after the cell was recreated.",
+              (fv0.b1 == fv1.b1) && (fv0.b2 == fv1.b2) && (fv0.b3 == fv1.b3));
+
+    fprintf(stdout, "\nPASSED probeUnitTest\n");
+    return NULL;
+}
+
+/**
+ * A unit test for the solenoid rotation, which uses x/rho and y/rho rather
+ * than the angle. The field must be the field at the same rho in the phi = 0
+ * plane, rotated by atan2(y, x), to float rounding. On and near the axis it
+ * must be finite, with the axis rotated by phi = 0.
+ * @return NULL if all tests pass, otherwise an error message.
+ */
+char *solenoidRotationUnitTest() {
+    int count = 100000;
+    double x, y, maxDiff = 0;
+    FieldValue fv, ref;
+
+    for (int i = 0; i < count; i++) {
+        double phi = randomDouble(0, 360);
+        double rho = randomDouble(testFieldPtr->rhoGridPtr->minVal, testFieldPtr->rhoGridPtr->maxVal);
+        double z = randomDouble(testFieldPtr->zGridPtr->minVal, testFieldPtr->zGridPtr->maxVal);
+        cylindricalToCartesian(&x, &y, phi, rho);
+
+        getFieldValue(&fv, x, y, z, testFieldPtr);
+        getFieldValue(&ref, hypot(x, y), 0, z, testFieldPtr);
+        double phiRad = atan2(y, x);
+        double dx = fv.b1 - ref.b1 * cos(phiRad);
+        double dy = fv.b2 - ref.b1 * sin(phiRad);
+        maxDiff = max(maxDiff, hypot(dx, dy) / (fabs(ref.b1) + TINY));
+    }
+    mu_assert("Rotated solenoid field does not match.", maxDiff < 1.0e-6);
+
+    double z = 0.5 * (testFieldPtr->zGridPtr->minVal + testFieldPtr->zGridPtr->maxVal);
+    double tiny[] = {0, 1.0e-300, -1.0e-300};
+    for (int i = 0; i < 3; i++) {
+        getFieldValue(&fv, tiny[i], tiny[(i + 1) % 3], z, testFieldPtr);
+        mu_assert("Solenoid field near the axis is not finite.", isfinite(fv.b1) && isfinite(fv.b2) &&
+                  isfinite(fv.b3));
+    }
+    getFieldValue(&fv, 0, 0, z, testFieldPtr);
+    mu_assert("Solenoid field on the axis is not rotated by phi = 0.", fv.b2 == 0);
+
+    fprintf(stdout, "\nPASSED solenoidRotationUnitTest (max relative difference %-9.3e)\n", maxDiff);
+    return NULL;
+}
+
+/**
+ * A unit test for composite lookups. The combined value must be exactly the
+ * sum of the single field values, with equal shifts (where the transformation
+ * is shared), with different shifts, and for more than two fields.
+ * @return NULL if all tests pass, otherwise an error message.
+ */
+char *compositeUnitTest() {
+    MagneticFieldPtr torus = testFieldPtr;
+    MagneticFieldPtr solenoid = testSolenoidPtr;
+    FieldProbePtr torusProbe = createProbe(torus);
+    FieldProbePtr solenoidProbe = createProbe(solenoid);
+    FieldProbePtr singleProbe = createProbe(torus);
+    FieldValue fv, ft, fs;
+
+    //no shifts, equal nonzero shifts, different shifts
+    double shifts[3][6] = {{0, 0, 0, 0, 0, 0}, {0.3, -0.2, 1.5, 0.3, -0.2, 1.5}, {0, 0, 0, 0.1, -0.25, -2}};
+
+    for (int k = 0; k < 3; k++) {
+        torus->shiftX = shifts[k][0];
+        torus->shiftY = shifts[k][1];
+        torus->shiftZ = shifts[k][2];
+        solenoid->shiftX = shifts[k][3];
+        solenoid->shiftY = shifts[k][4];
+        solenoid->shiftZ = shifts[k][5];
+
+        for (int i = 0; i < 20000; i++) {
+            double x = randomDouble(-400, 400);
+            double y = randomDouble(-400, 400);
+            double z = randomDouble(-200, 500);
+
+            getFieldValueProbe(&ft, x, y, z, singleProbe);
+            getFieldValueProbe(&fs, x, y, z, solenoidProbe);
+
+            getCompositeFieldValueProbe(&fv, x, y, z, torusProbe, solenoidProbe);
+            mu_assert("Composite value is not the sum of the fields.", (fv.b1 == ft.b1 + fs.b1) &&
+                      (fv.b2 == ft.b2 + fs.b2) && (fv.b3 == ft.b3 + fs.b3));
+
+            FieldProbePtr probes[4] = {torusProbe, NULL, solenoidProbe, singleProbe};
+            getCompositeFieldValueProbes(&fv, x, y, z, probes, 4);
+            mu_assert("Composite value of three fields is not their sum.",
+                      (fv.b1 == (ft.b1 + fs.b1) + ft.b1) && (fv.b2 == (ft.b2 + fs.b2) + ft.b2) &&
+                      (fv.b3 == (ft.b3 + fs.b3) + ft.b3));
+        }
+    }
+
+    torus->shiftX = torus->shiftY = torus->shiftZ = 0;
+    solenoid->shiftX = solenoid->shiftY = solenoid->shiftZ = 0;
+
+    freeProbe(torusProbe);
+    freeProbe(solenoidProbe);
+    freeProbe(singleProbe);
+    fprintf(stdout, "\nPASSED compositeUnitTest\n");
+    return NULL;
+}
+
+/**
+ * A unit test for the batched evaluation. The results must match
+ * the single point lookups to float precision.
+ * @return an error message if the test fails, or NULL if it passes.
+ */
+char *batchUnitTest() {
+
+    int n = 100000;
+    FieldValue fv;
+
+    //float tolerance relative to the biggest field in the map
+    double tolerance = 1.0e-5 * testFieldPtr->metricsPtr->maxFieldMagnitude * fabs(testFieldPtr->scale);
+
+    double *x = (double *) malloc(3 * n * sizeof(double));
+    double *y = x + n;
+    double *z = y + n;
+    float *b = (float *) malloc(3 * n * sizeof(float));
+
+    //include some points outside the boundary
+    for (int i = 0; i < n; i++) {
+        double phi = randomDouble(0, 360);
+        double rho = randomDouble(0, 1.1 * testFieldPtr->rhoGridPtr->maxVal);
+        z[i] = randomDouble(testFieldPtr->zGridPtr->minVal - 10, testFieldPtr->zGridPtr->maxVal + 10);
+        cylindricalToCartesian(x + i, y + i, phi, rho);
+    }
+
+    FieldProbePtr probePtr = createProbe(testFieldPtr);
+    getFieldValues(x, y, z, b, b + n, b + 2 * n, n, probePtr);
+
+    for (int i = 0; i < n; i++) {
+        getFieldValue(&fv, x[i], y[i], z[i], testFieldPtr);
+        bool result = (fabs(fv.b1 - b[i]) <= tolerance) &&
+                      (fabs(fv.b2 - b[i + n]) <= tolerance) &&
+                      (fabs(fv.b3 - b[i + 2 * n]) <= tolerance);
+        if (!result) {
+            fprintf(stderr, "Batch mismatch at (%-9.3f, %-9.3f, %-9.3f)\n", x[i], y[i], z[i]);
+        }
+        mu_assert("The batch value did not match the single point value.", result);
+    }
+
+    freeProbe(probePtr);
+    free(b);
+    free(x);
+
+    fprintf(stdout, "\nPASSED batchUnitTest\n");
+    return NULL;
+}
+
+/**
+ * Get the field at a given composite index. A field whose storage precision
+ * is not FLOAT32 has no float values to point to, so this reports an error
+ * and returns NULL; use copyFieldAtIndex, which works for any precision.
  * @param fieldPtr a pointer to the field.
  * @param compositeIndex the composite index.
- * @return a pointer to the field value, or NULL if out of range.
+ * @return a pointer to the field value, or NULL if out of range or the
+ * storage is compact.
  */
 FieldValuePtr getFieldAtIndex(MagneticFieldPtr fieldPtr, int compositeIndex) {
-    if ((compositeIndex < 0) || (compositeIndex > fieldPtr->numValues)) {
+    if (fieldPtr->fieldValues == NULL) {
+        fprintf(stderr, "\ncMag ERROR getFieldAtIndex called for a field with %s storage, use copyFieldAtIndex.\n",
+                precisionLabels[fieldPtr->precision]);
+        return NULL;
+    }
+    if ((compositeIndex < 0) || (compositeIndex >= fieldPtr->numValues)) {
         return NULL;
     }
     return fieldPtr->fieldValues + compositeIndex;
 }
 
+/**
+ * Copy the field at a given composite index. Unlike getFieldAtIndex this
+ * works for any storage precision.
+ * @param fieldPtr a pointer to the field.
+ * @param compositeIndex the composite index, which must be in range.
+ * @param fieldValuePtr upon return holds the field value in kG.
+ */
+void copyFieldAtIndex(MagneticFieldPtr fieldPtr, int compositeIndex, FieldValuePtr fieldValuePtr) {
+    if (fieldPtr->compactValues != NULL) {
+        decodeCompactValue(fieldPtr, compositeIndex, fieldValuePtr);
+    }
+    else {
+        *fieldValuePtr = fieldPtr->fieldValues[compositeIndex];
+    }
+}
+
 
 
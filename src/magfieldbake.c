@@ -0,0 +1,418 @@
+//
+//  magfieldbake.c
+//  cMag
+//  The combined field of two maps (typically the torus and the solenoid) is
+//  resampled, with their current scales and shifts, onto a single grid
+//  covering the region where both maps are defined. A composite lookup in
+//  that region then costs one lookup instead of two. Outside of it at most
+//  one of the maps contributes, and the lookup falls back to the two maps.
+//  The baked grid is an ordinary field map (a full 360 degree "torus" map, or
+//  a solenoid map when the sum has no phi dependence), so it can be written
+//  to and read from a cache directory like any other map.
+//
+
+#include "magfieldbake.h"
+#include "magfieldio.h"
+#include "magfieldutil.h"
+#include "munittest.h"
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+
+//bump this if the baking changes, so old cached grids are not used
+#define BAKEVERSION 2
+
+//largest grid baked by the unit test, in points (~200MB)
+#define BAKETESTMAXPOINTS (1 << 24)
+
+//phi spacing (degrees) used when neither map has a phi grid but the sum
+//still depends on phi because of transverse shifts
+#define BAKEPHIDELTA 2.0
+
+//local prototypes
+static unsigned long long bakeKey(MagneticFieldPtr, MagneticFieldPtr, const int *);
+static int numGridPoints(double, double, double);
+static double finestDelta(GridPtr, GridPtr);
+
+/**
+ * Get the key that identifies a baked grid: the two input maps (path, file
+ * size and modification time, header and creation date), their scales and
+ * shifts, and the size of the grid (which is smaller if it was coarsened).
+ * @param field1 the first field.
+ * @param field2 the second field.
+ * @param numPoints the number of grid points in phi, rho and z.
+ * @return the key.
+ */
+static unsigned long long bakeKey(MagneticFieldPtr field1, MagneticFieldPtr field2, const int *numPoints) {
+    unsigned long long hash = FNVOFFSET;
+    int version = BAKEVERSION;
+    MagneticFieldPtr fields[2] = {field1, field2};
+
+    hash = hashBytes(hash, &version, sizeof(int));
+    hash = hashBytes(hash, numPoints, 3 * sizeof(int));
+    for (int i = 0; i < 2; i++) {
+        MagneticFieldPtr fieldPtr = fields[i];
+        hash = hashFile(hash, fieldPtr->path);
+        //not the reserved words, which differ for a native format copy of the map
+        hash = hashBytes(hash, fieldPtr->headerPtr, offsetof(FieldMapHeader, reserved3));
+        hash = hashBytes(hash, &(fieldPtr->scale), sizeof(double));
+        hash = hashBytes(hash, &(fieldPtr->shiftX), sizeof(double));
+        hash = hashBytes(hash, &(fieldPtr->shiftY), sizeof(double));
+        hash = hashBytes(hash, &(fieldPtr->shiftZ), sizeof(double));
+    }
+    return hash;
+}
+
+/**
+ * Get the number of grid points needed to cover a range with at most a given spacing.
+ * @param minVal the minimum value.
+ * @param maxVal the maximum value.
+ * @param delta the largest acceptable spacing.
+ * @return the number of points, including the ends.
+ */
+static int numGridPoints(double minVal, double maxVal, double delta) {
+    int n = (int) ceil((maxVal - minVal) / delta - 1.0e-6) + 1;
+    return (n < 2) ? 2 : n;
+}
+
+/**
+ * Get the finer of the spacings of two grids. Grids with a single
+ * point (the solenoid phi grid) have infinite spacing.
+ * @param grid1 one grid.
+ * @param grid2 the other grid.
+ * @return the smaller spacing.
+ */
+static double finestDelta(GridPtr grid1, GridPtr grid2) {
+    return min(grid1->delta, grid2->delta);
+}
+
+/**
+ * Resample the sum of two fields, with their current scales and shifts, onto a
+ * single grid over the region where both are defined, with the finer spacing
+ * of the two maps along each axis. If a cache directory is
+ * given, a grid previously baked from the same maps, scales and shifts is read
+ * from it, or the newly baked grid is written to it.
+ * The baked grid is NOT updated if the scales or shifts are changed later;
+ * bake again in that case (which will produce a different cache key).
+ * @param field1 the first field, e.g. the torus.
+ * @param field2 the second field, e.g. the solenoid.
+ * @param cacheDir a directory for baked grids, or NULL for no caching.
+ * @param maxPoints the largest grid, in points (12 bytes each), or 0 for no
+ * limit. A grid that would be bigger has its rho and z spacing coarsened to
+ * fit, which makes the baked field less accurate than the maps.
+ * @return the baked field (in the lab frame, with no shift and a scale of 1),
+ * or NULL if the two fields do not overlap.
+ */
+MagneticFieldPtr bakeCompositeField(MagneticFieldPtr field1, MagneticFieldPtr field2, const char *cacheDir,
+                                    long maxPoints) {
+
+    //the lab region where both maps are defined, regardless of phi. The maps
+    //exclude their upper edges (containsCylindrical), so the region stops one
+    //cell short of them and the last baked nodes still see both maps.
+    double d1 = hypot(field1->shiftX, field1->shiftY);
+    double d2 = hypot(field2->shiftX, field2->shiftY);
+
+    double zMin = max(field1->zGridPtr->minVal + field1->shiftZ, field2->zGridPtr->minVal + field2->shiftZ);
+    double zMax = min(field1->zGridPtr->maxVal - field1->zGridPtr->delta + field1->shiftZ,
+                      field2->zGridPtr->maxVal - field2->zGridPtr->delta + field2->shiftZ);
+    double rhoMin = max(field1->rhoGridPtr->minVal + d1, field2->rhoGridPtr->minVal + d2);
+    double rhoMax = min(field1->rhoGridPtr->maxVal - field1->rhoGridPtr->delta - d1,
+                        field2->rhoGridPtr->maxVal - field2->rhoGridPtr->delta - d2);
+
+    if ((zMax <= zMin) || (rhoMax <= rhoMin)) {
+        fprintf(stderr, "\ncMag WARNING the fields do not overlap, nothing to bake.\n");
+        return NULL;
+    }
+
+    //the sum has phi dependence if either map does, or if there are transverse shifts
+    bool threeD = (field1->type == TORUS) || (field2->type == TORUS) || (d1 > 0) || (d2 > 0);
+
+    double dPhi = finestDelta(field1->phiGridPtr, field2->phiGridPtr);
+    if (!isfinite(dPhi)) {
+        dPhi = BAKEPHIDELTA;
+    }
+
+    double dRho = finestDelta(field1->rhoGridPtr, field2->rhoGridPtr);
+    double dZ = finestDelta(field1->zGridPtr, field2->zGridPtr);
+
+    int nPhi = threeD ? numGridPoints(0, 360, dPhi) : 1;
+    int nRho = numGridPoints(rhoMin, rhoMax, dRho);
+    int nZ = numGridPoints(zMin, zMax, dZ);
+
+    //coarsen rho and z if the caller asked for a smaller grid
+    double total = (double) nPhi * nRho * nZ;
+    if ((maxPoints > 0) && (total > maxPoints)) {
+        double factor = sqrt(total / maxPoints);
+        do { //the ends add a point each, so it can take a little more
+            nRho = numGridPoints(rhoMin, rhoMax, factor * dRho);
+            nZ = numGridPoints(zMin, zMax, factor * dZ);
+            factor *= 1.001;
+        } while (((double) nPhi * nRho * nZ > maxPoints) && ((nRho > 2) || (nZ > 2)));
+        fprintf(stderr, "\ncMag WARNING the baked grid would have %.0f points, more than %ld. Its spacing is "
+                        "coarsened from (%-.3f, %-.3f) to (%-.3f, %-.3f) cm in (rho, z).\n", total, maxPoints,
+                dRho, dZ, (rhoMax - rhoMin) / (nRho - 1), (zMax - zMin) / (nZ - 1));
+    }
+
+    //look for a cached version
+    char *cachePath = NULL;
+    if (cacheDir != NULL) {
+        int numPoints[3] = {nPhi, nRho, nZ};
+        cachePath = (char *) malloc(strlen(cacheDir) + 64);
+        sprintf(cachePath, "%s/cmag_composite_%016llx.dat", cacheDir, bakeKey(field1, field2, numPoints));
+
+        if (access(cachePath, R_OK) == 0) {
+            MagneticFieldPtr bakedPtr = initializeField(cachePath);
+            if (bakedPtr != NULL) {
+                free(cachePath);
+                return bakedPtr;
+            }
+        }
+    }
+
+    FieldMapHeaderPtr headerPtr = (FieldMapHeaderPtr) calloc(1, sizeof(FieldMapHeader));
+    headerPtr->magicWord = MAGICWORD;
+    headerPtr->gridCS = 0; //cylindrical
+    headerPtr->fieldCS = 1; //Cartesian
+    headerPtr->lengthUnits = 0; //cm
+    headerPtr->angleUnits = 0; //degrees
+    headerPtr->fieldUnits = 0; //kG
+    headerPtr->q1min = 0;
+    headerPtr->q1max = threeD ? 360 : 0;
+    headerPtr->nq1 = nPhi;
+    headerPtr->q2min = rhoMin;
+    headerPtr->q2max = rhoMax;
+    headerPtr->nq2 = nRho;
+    headerPtr->q3min = zMin;
+    headerPtr->q3max = zMax;
+    headerPtr->nq3 = nZ;
+
+    //the header stores floats, which must not round below the maps' lower edges
+    if (headerPtr->q2min < rhoMin) {
+        headerPtr->q2min = nextafterf(headerPtr->q2min, INFINITY);
+    }
+    if (headerPtr->q3min < zMin) {
+        headerPtr->q3min = nextafterf(headerPtr->q3min, INFINITY);
+    }
+
+    //creation date as in the Java maps, in ms
+    long long ms = 1000LL * (long long) time(NULL);
+    headerPtr->cdHigh = (int) (ms >> 32);
+    headerPtr->cdLow = (int) (ms & 0xffffffffLL);
+
+    //the header stores floats, use the rounded values for the grid
+    double phiDelta = (nPhi > 1) ? (headerPtr->q1max - headerPtr->q1min) / (nPhi - 1) : 0;
+    double rhoDelta = (headerPtr->q2max - headerPtr->q2min) / (nRho - 1);
+    double zDelta = (headerPtr->q3max - headerPtr->q3min) / (nZ - 1);
+
+    FieldValuePtr fieldValues = (FieldValuePtr) malloc((size_t) nPhi * nRho * nZ * sizeof(FieldValue));
+    if (fieldValues == NULL) {
+        fprintf(stderr, "\ncMag ERROR out of memory when allocating space for baked field map.\n");
+        free(headerPtr);
+        free(cachePath);
+        return NULL;
+    }
+
+    FieldProbePtr probe1 = createProbe(field1);
+    FieldProbePtr probe2 = createProbe(field2);
+
+    //one z row at a time through the batched lookup
+    double *x = (double *) malloc(3 * nZ * sizeof(double));
+    double *y = x + nZ;
+    double *z = y + nZ;
+    float *b = (float *) malloc(3 * nZ * sizeof(float));
+
+    for (int k = 0; k < nZ; k++) {
+        z[k] = headerPtr->q3min + k * zDelta;
+    }
+
+    FieldValuePtr fv = fieldValues;
+    for (int i = 0; i < nPhi; i++) {
+        double phi = headerPtr->q1min + i * phiDelta;
+        for (int j = 0; j < nRho; j++) {
+            double px, py;
+            cylindricalToCartesian(&px, &py, phi, headerPtr->q2min + j * rhoDelta);
+            for (int k = 0; k < nZ; k++) {
+                x[k] = px;
+                y[k] = py;
+            }
+
+            getCompositeFieldValues(x, y, z, b, b + nZ, b + 2 * nZ, nZ, probe1, probe2);
+
+            for (int k = 0; k < nZ; k++, fv++) {
+                if (threeD) {
+                    fv->b1 = b[k];
+                    fv->b2 = b[k + nZ];
+                }
+                else { //solenoid map convention: (Bphi, Brho, Bz) in the phi = 0 plane
+                    fv->b1 = 0;
+                    fv->b2 = b[k];
+                }
+                fv->b3 = b[k + 2 * nZ];
+            }
+        }
+    }
+
+    free(b);
+    free(x);
+    freeProbe(probe1);
+    freeProbe(probe2);
+
+    MagneticFieldPtr bakedPtr = createFieldFromData(headerPtr, fieldValues,
+                                                    (cachePath != NULL) ? cachePath : "baked composite");
+
+    if (cachePath != NULL) {
+        writeField(bakedPtr, cachePath);
+        free(cachePath);
+    }
+
+    return bakedPtr;
+}
+
+/**
+ * Obtain the combined value of two fields, using the baked grid where it
+ * applies. This uses the default probes, so it is not thread safe.
+ * @param fieldValuePtr should be a valid pointer to a FieldValue. Upon
+ * return it will hold the value of the combined field, in kG, in Cartesian
+ * components Bx, By, BZ.
+ * @param x the x coordinate in cm.
+ * @param y the y coordinate in cm.
+ * @param z the z coordinate in cm.
+ * @param bakedPtr the baked field returned by bakeCompositeField (can be NULL).
+ * @param field1 the first field used for the baking.
+ * @param field2 the second field used for the baking.
+ */
+void getBakedFieldValue(FieldValuePtr fieldValuePtr, double x, double y, double z,
+                        MagneticFieldPtr bakedPtr, MagneticFieldPtr field1, MagneticFieldPtr field2) {
+    getBakedFieldValueProbe(fieldValuePtr, x, y, z,
+                            (bakedPtr == NULL) ? NULL : bakedPtr->probePtr,
+                            (field1 == NULL) ? NULL : field1->probePtr,
+                            (field2 == NULL) ? NULL : field2->probePtr);
+}
+
+/**
+ * Obtain the combined value of two fields, using the baked grid where it
+ * applies, with caller owned probes so that it is thread safe.
+ * @param fieldValuePtr should be a valid pointer to a FieldValue. Upon
+ * return it will hold the value of the combined field, in kG, in Cartesian
+ * components Bx, By, BZ.
+ * @param x the x coordinate in cm.
+ * @param y the y coordinate in cm.
+ * @param z the z coordinate in cm.
+ * @param bakedProbe a probe for the baked field (can be NULL).
+ * @param probe1 a probe for the first field used for the baking.
+ * @param probe2 a probe for the second field used for the baking.
+ */
+void getBakedFieldValueProbe(FieldValuePtr fieldValuePtr, double x, double y, double z,
+                             FieldProbePtr bakedProbe, FieldProbePtr probe1, FieldProbePtr probe2) {
+
+    if ((bakedProbe != NULL) && containsCylindrical(bakedProbe->fieldPtr, hypot(x, y), z)) {
+        getFieldValueProbe(fieldValuePtr, x, y, z, bakedProbe);
+    }
+    else {
+        getCompositeFieldValueProbe(fieldValuePtr, x, y, z, probe1, probe2);
+    }
+}
+
+/**
+ * A unit test for the baked composite field. At the baked grid points the
+ * baked field must reproduce the sum of the two fields, elsewhere it must
+ * agree to within the interpolation error. A cached copy must give
+ * identical results.
+ * @return an error message if the test fails, or NULL if it passes.
+ */
+char *bakeUnitTest() {
+
+    FieldValue fv1, fv2;
+    char *cacheDir = getenv("TMPDIR");
+    if (cacheDir == NULL) {
+        cacheDir = "/tmp";
+    }
+
+    MagneticFieldPtr bakedPtr = bakeCompositeField(testFieldPtr, testSolenoidPtr, cacheDir, BAKETESTMAXPOINTS);
+    mu_assert("The test fields did not overlap.", bakedPtr != NULL);
+    mu_assert("The baked grid is bigger than asked for.", bakedPtr->numValues <= BAKETESTMAXPOINTS);
+
+    double maxField = testFieldPtr->metricsPtr->maxFieldMagnitude * fabs(testFieldPtr->scale) +
+                      testSolenoidPtr->metricsPtr->maxFieldMagnitude * fabs(testSolenoidPtr->scale);
+    double tolerance = 1.0e-5 * maxField;
+
+    GridPtr phiGrid = bakedPtr->phiGridPtr;
+    GridPtr rhoGrid = bakedPtr->rhoGridPtr;
+    GridPtr zGrid = bakedPtr->zGridPtr;
+
+    //every grid point, including the last ones in rho and z, both as stored
+    //and through the lookup (which falls back to the maps on the upper edges)
+    double maxNodeDiff = 0;
+    FieldValue stored;
+    for (unsigned int i = 0; i < phiGrid->numPoints; i++) {
+        for (unsigned int j = 0; j < rhoGrid->numPoints; j++) {
+            double x, y;
+            cylindricalToCartesian(&x, &y, phiGrid->values[i], rhoGrid->values[j]);
+            for (unsigned int k = 0; k < zGrid->numPoints; k++) {
+                double z = zGrid->values[k];
+                getCompositeFieldValue(&fv2, x, y, z, testFieldPtr, testSolenoidPtr);
+                getBakedFieldValue(&fv1, x, y, z, bakedPtr, testFieldPtr, testSolenoidPtr);
+                copyFieldAtIndex(bakedPtr, getCompositeIndex(bakedPtr, i, j, k), &stored);
+
+                //a solenoid map stores (Bphi, Brho, Bz) in the phi = 0 plane
+                if (bakedPtr->type == SOLENOID) {
+                    stored.b1 = stored.b2;
+                    stored.b2 = 0;
+                }
+
+                double diff = max(fabs(fv1.b1 - fv2.b1), max(fabs(fv1.b2 - fv2.b2), fabs(fv1.b3 - fv2.b3)));
+                diff = max(diff, max(fabs(stored.b1 - fv2.b1), max(fabs(stored.b2 - fv2.b2), fabs(stored.b3 - fv2.b3))));
+                if (diff > tolerance) {
+                    fprintf(stderr, "Baked mismatch at grid point (%-9.3f, %-9.3f, %-9.3f)\n",
+                            phiGrid->values[i], rhoGrid->values[j], z);
+                }
+                maxNodeDiff = max(maxNodeDiff, diff);
+            }
+        }
+    }
+    mu_assert("The baked field did not match the composite field at a grid point.", maxNodeDiff <= tolerance);
+
+    //random points, in and out of the baked region
+    MagneticFieldPtr cachedPtr = bakeCompositeField(testFieldPtr, testSolenoidPtr, cacheDir, BAKETESTMAXPOINTS);
+    mu_assert("Could not read the cached baked field.", cachedPtr != NULL);
+
+    int numTestPoints = 100000;
+    double maxDiff = 0;
+    double sumDiff = 0;
+    for (int i = 0; i < numTestPoints; i++) {
+        double x, y, fv3diff;
+        FieldValue fv3;
+        double phi = randomDouble(0, 360);
+        double rho = randomDouble(0, 1.1 * rhoGrid->maxVal);
+        double z = randomDouble(zGrid->minVal - 50, zGrid->maxVal + 50);
+        cylindricalToCartesian(&x, &y, phi, rho);
+
+        getBakedFieldValue(&fv1, x, y, z, bakedPtr, testFieldPtr, testSolenoidPtr);
+        getBakedFieldValue(&fv3, x, y, z, cachedPtr, testFieldPtr, testSolenoidPtr);
+        getCompositeFieldValue(&fv2, x, y, z, testFieldPtr, testSolenoidPtr);
+
+        fv3diff = fabs(fv1.b1 - fv3.b1) + fabs(fv1.b2 - fv3.b2) + fabs(fv1.b3 - fv3.b3);
+        mu_assert("The cached baked field did not match the baked field.", fv3diff == 0);
+
+        double diff = max(fabs(fv1.b1 - fv2.b1), max(fabs(fv1.b2 - fv2.b2), fabs(fv1.b3 - fv2.b3)));
+        maxDiff = max(maxDiff, diff);
+        sumDiff += diff;
+    }
+
+    //the resampling error is largest where the field changes fastest, but
+    //even there it should be small compared to the field
+    double avgDiff = sumDiff / numTestPoints;
+    mu_assert("The baked field differed too much from the composite field.",
+              (avgDiff < 1.0e-4 * maxField) && (maxDiff < 1.0e-3 * maxField));
+
+    remove(cachedPtr->path);
+    freeFieldMap(cachedPtr);
+    freeFieldMap(bakedPtr);
+
+    fprintf(stdout, "\nPASSED bakeUnitTest (%u grid points, difference avg: %-9.3e kG  max: %-9.3e kG)\n",
+            phiGrid->numPoints * rhoGrid->numPoints * zGrid->numPoints, avgDiff, maxDiff);
+    return NULL;
+}
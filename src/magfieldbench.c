@@ -0,0 +1,1160 @@
+//
+//  magfieldbench.c
+//  cMag
+//  Simple timing benchmarks for the field lookups. These are not unit tests;
+//  they print timings so that alternative code paths can be compared.
+//
+
+#include "magfieldbench.h"
+#include "magfieldio.h"
+#include "magfieldutil.h"
+#include "magfieldsimd.h"
+#include "magfieldcompact.h"
+#include "magfieldgrad.h"
+#include "magfieldswim.h"
+#include "magfielduniform.h"
+#include "magfieldpool.h"
+#include "magfieldtable.h"
+#include "magfieldintegral.h"
+#include "magfieldset.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+//number of points used by the benchmarks
+#define NUMBENCHPOINTS 1000000
+
+//step size along the straight tracks used by the benchmarks (cm)
+#define TRACKSTEP 0.5
+
+//local prototypes
+static void randomPoints(double *, double *, double *, int, MagneticFieldPtr);
+static void trackPoints(double *, double *, double *, int, MagneticFieldPtr);
+static double timeLookups(const double *, const double *, const double *, int, MagneticFieldPtr);
+static int overshootSwim(SwimmerPtr, int, double, const SwimPoint *, const SwimSurface *, double,
+                         SwimPointPtr, int, bool *);
+
+/**
+ * Get a monotonic time stamp.
+ * @return the time in seconds from an arbitrary origin.
+ */
+double benchmarkTime() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1.0e-9 * ts.tv_nsec;
+}
+
+/**
+ * Fill arrays with random points uniformly distributed (in cylindrical
+ * coordinates) over the boundary of a field.
+ * @param x will hold the x coordinates in cm.
+ * @param y will hold the y coordinates in cm.
+ * @param z will hold the z coordinates in cm.
+ * @param n the number of points.
+ * @param fieldPtr the field whose boundary is used.
+ */
+static void randomPoints(double *x, double *y, double *z, int n, MagneticFieldPtr fieldPtr) {
+    for (int i = 0; i < n; i++) {
+        double phi = randomDouble(0, 360);
+        double rho = randomDouble(fieldPtr->rhoGridPtr->minVal, fieldPtr->rhoGridPtr->maxVal);
+        z[i] = randomDouble(fieldPtr->zGridPtr->minVal, fieldPtr->zGridPtr->maxVal);
+        cylindricalToCartesian(x + i, y + i, phi, rho);
+    }
+}
+
+/**
+ * Fill arrays with points along straight tracks from the origin, keeping only
+ * those inside the boundary of a field. Successive points are close together,
+ * as in a swim, so most lookups reuse the cell or one of its neighbors.
+ * @param x will hold the x coordinates in cm.
+ * @param y will hold the y coordinates in cm.
+ * @param z will hold the z coordinates in cm.
+ * @param n the number of points.
+ * @param fieldPtr the field whose boundary is used.
+ */
+static void trackPoints(double *x, double *y, double *z, int n, MagneticFieldPtr fieldPtr) {
+    double rMax = hypot(fieldPtr->rhoGridPtr->maxVal,
+                        max(fabs(fieldPtr->zGridPtr->minVal), fabs(fieldPtr->zGridPtr->maxVal)));
+    int count = 0;
+
+    while (count < n) {
+        double theta = acos(randomDouble(-1, 1));
+        double phi = randomDouble(0, 2 * M_PI);
+        double dx = sin(theta) * cos(phi);
+        double dy = sin(theta) * sin(phi);
+        double dz = cos(theta);
+
+        for (double s = 0; (s < rMax) && (count < n); s += TRACKSTEP) {
+            if (containsCartesian(fieldPtr, s * dx, s * dy, s * dz)) {
+                x[count] = s * dx;
+                y[count] = s * dy;
+                z[count] = s * dz;
+                count++;
+            }
+        }
+    }
+}
+
+/**
+ * Time single point lookups with a probe.
+ * @param x the x coordinates in cm.
+ * @param y the y coordinates in cm.
+ * @param z the z coordinates in cm.
+ * @param n the number of points.
+ * @param fieldPtr the field.
+ * @return the time per point in ns.
+ */
+static double timeLookups(const double *x, const double *y, const double *z, int n, MagneticFieldPtr fieldPtr) {
+    FieldValue fv;
+    FieldProbePtr probePtr = createProbe(fieldPtr);
+
+    double start = benchmarkTime();
+    for (int i = 0; i < n; i++) {
+        getFieldValueProbe(&fv, x[i], y[i], z[i], probePtr);
+    }
+    double time = benchmarkTime() - start;
+
+    freeProbe(probePtr);
+    return 1.0e9 * time / n;
+}
+
+/**
+ * Print the accuracy of the compact storage precisions and compare the
+ * lookup throughput for random and track-like access with each of them.
+ * @param fieldPtr the field, which must have FLOAT32 storage.
+ * @param stream where to print the results, e.g. stdout.
+ */
+void compactBenchmark(MagneticFieldPtr fieldPtr, FILE *stream) {
+    if (getFieldPrecision(fieldPtr) != FLOAT32) {
+        return;
+    }
+
+    compactAccuracyReport(fieldPtr, stream);
+
+    int n = NUMBENCHPOINTS;
+
+    double *x = (double *) malloc(6 * n * sizeof(double));
+    double *y = x + n;
+    double *z = y + n;
+    double *tx = z + n;
+    double *ty = tx + n;
+    double *tz = ty + n;
+
+    randomPoints(x, y, z, n, fieldPtr);
+    trackPoints(tx, ty, tz, n, fieldPtr);
+
+    Algorithm algorithm = getFieldAlgorithm(fieldPtr);
+    setFieldAlgorithm(fieldPtr, INTERPOLATION);
+
+    fprintf(stream, "\nBENCHMARK storage precision: %d points, %s\n", n,
+            (fieldPtr->type == TORUS) ? "TORUS" : "SOLENOID");
+    fprintf(stream, "  %-12s %14s %14s\n", "precision", "random", "track");
+
+    for (int precision = FLOAT32; precision <= SCALED_INT16; precision++) {
+        if ((precision != FLOAT32) && !addCompactValues(fieldPtr, (StoragePrecision) precision)) {
+            break;
+        }
+        double randomTime = timeLookups(x, y, z, n, fieldPtr);
+        double trackTime = timeLookups(tx, ty, tz, n, fieldPtr);
+        fprintf(stream, "  %-12s %8.2f ns/pt %8.2f ns/pt\n", precisionLabels[precision], randomTime, trackTime);
+        removeCompactValues(fieldPtr);
+    }
+
+    setFieldAlgorithm(fieldPtr, algorithm);
+    free(x);
+}
+
+/**
+ * Compare folding points into a sector of the symmetric torus with atan2,
+ * relativePhi and getSector (as lookups used to) against sectorFold, for
+ * random points and points along tracks. The lookup time is for context.
+ * @param fieldPtr the field, a symmetric torus.
+ * @param stream where to print the results, e.g. stdout.
+ */
+void sectorFoldBenchmark(MagneticFieldPtr fieldPtr, FILE *stream) {
+    int n = NUMBENCHPOINTS;
+
+    double *x = (double *) malloc(6 * n * sizeof(double));
+    double *y = x + n;
+    double *z = y + n;
+    double *tx = z + n;
+    double *ty = tx + n;
+    double *tz = ty + n;
+
+    randomPoints(x, y, z, n, fieldPtr);
+    trackPoints(tx, ty, tz, n, fieldPtr);
+
+    fprintf(stream, "\nBENCHMARK sector folding: %d points\n", n);
+    fprintf(stream, "  %-8s %14s %14s %10s %14s\n", "points", "atan2", "sectorFold", "speedup", "lookup");
+
+    const char *labels[] = {"random", "track"};
+    double *xs[] = {x, tx};
+    double *ys[] = {y, ty};
+    double *zs[] = {z, tz};
+
+    //the sums keep the folds from being optimized away
+    double sum = 0;
+    for (int k = 0; k < 2; k++) {
+        double start = benchmarkTime();
+        for (int i = 0; i < n; i++) {
+            double phi = toDegrees(atan2(ys[k][i], xs[k][i]));
+            sum += relativePhi(phi) + getSector(phi);
+        }
+        double angleTime = 1.0e9 * (benchmarkTime() - start) / n;
+
+        start = benchmarkTime();
+        for (int i = 0; i < n; i++) {
+            double relPhi;
+            int sector;
+            sectorFold(xs[k][i], ys[k][i], &relPhi, &sector);
+            sum -= relPhi + sector;
+        }
+        double foldTime = 1.0e9 * (benchmarkTime() - start) / n;
+
+        double lookupTime = timeLookups(xs[k], ys[k], zs[k], n, fieldPtr);
+        fprintf(stream, "  %-8s %8.2f ns/pt %8.2f ns/pt %10.2f %8.2f ns/pt\n", labels[k], angleTime, foldTime,
+                angleTime / foldTime, lookupTime);
+    }
+    fprintf(stream, "  (sum of differences %-9.3e)\n", sum);
+
+    free(x);
+}
+
+/**
+ * Compare the analytic gradient with a central difference gradient (six
+ * extra lookups) along tracks, where the cell is usually reused.
+ * @param fieldPtr the field.
+ * @param stream where to print the results, e.g. stdout.
+ */
+void gradientBenchmark(MagneticFieldPtr fieldPtr, FILE *stream) {
+    int n = NUMBENCHPOINTS / 4;
+    double h = 0.01;
+
+    double *x = (double *) malloc(3 * n * sizeof(double));
+    double *y = x + n;
+    double *z = y + n;
+    trackPoints(x, y, z, n, fieldPtr);
+
+    FieldProbePtr probePtr = createProbe(fieldPtr);
+    FieldGradient grad;
+    FieldValue fv, plus, minus;
+    double sum = 0;
+
+    double start = benchmarkTime();
+    for (int i = 0; i < n; i++) {
+        getFieldValueProbe(&fv, x[i], y[i], z[i], probePtr);
+        getFieldValueProbe(&plus, x[i] + h, y[i], z[i], probePtr);
+        getFieldValueProbe(&minus, x[i] - h, y[i], z[i], probePtr);
+        sum += plus.b1 - minus.b1;
+        getFieldValueProbe(&plus, x[i], y[i] + h, z[i], probePtr);
+        getFieldValueProbe(&minus, x[i], y[i] - h, z[i], probePtr);
+        sum += plus.b1 - minus.b1;
+        getFieldValueProbe(&plus, x[i], y[i], z[i] + h, probePtr);
+        getFieldValueProbe(&minus, x[i], y[i], z[i] - h, probePtr);
+        sum += plus.b1 - minus.b1;
+    }
+    double differenceTime = benchmarkTime() - start;
+
+    start = benchmarkTime();
+    for (int i = 0; i < n; i++) {
+        getFieldGradientProbe(&grad, x[i], y[i], z[i], probePtr);
+        sum += grad.dB[0][0];
+    }
+    double analyticTime = benchmarkTime() - start;
+
+    fprintf(stream, "\nBENCHMARK gradient: %d track points, %s (checksum %g)\n", n,
+            (fieldPtr->type == TORUS) ? "TORUS" : "SOLENOID", sum);
+    fprintf(stream, "  central differences: %8.2f ns/point\n", 1.0e9 * differenceTime / n);
+    fprintf(stream, "  getFieldGradient:    %8.2f ns/point\n", 1.0e9 * analyticTime / n);
+
+    freeProbe(probePtr);
+    free(x);
+}
+
+/**
+ * Compare the batched field evaluation with calling getCompositeFieldValue in
+ * a loop, for the same random points.
+ * @param torus the torus field (can be NULL).
+ * @param solenoid the solenoid field (can be NULL).
+ * @param stream where to print the results, e.g. stdout.
+ */
+void batchBenchmark(MagneticFieldPtr torus, MagneticFieldPtr solenoid, FILE *stream) {
+    int n = NUMBENCHPOINTS;
+    MagneticFieldPtr boundsPtr = (torus != NULL) ? torus : solenoid;
+
+    double *x = (double *) malloc(3 * n * sizeof(double));
+    double *y = x + n;
+    double *z = y + n;
+    float *b = (float *) malloc(3 * n * sizeof(float));
+    FieldValuePtr loopValues = (FieldValuePtr) malloc(n * sizeof(FieldValue));
+
+    randomPoints(x, y, z, n, boundsPtr);
+
+    FieldProbePtr torusProbe = (torus == NULL) ? NULL : createProbe(torus);
+    FieldProbePtr solenoidProbe = (solenoid == NULL) ? NULL : createProbe(solenoid);
+
+    double start = benchmarkTime();
+    for (int i = 0; i < n; i++) {
+        getCompositeFieldValue(loopValues + i, x[i], y[i], z[i], torus, solenoid);
+    }
+    double loopTime = benchmarkTime() - start;
+
+    start = benchmarkTime();
+    getCompositeFieldValues(x, y, z, b, b + n, b + 2 * n, n, torusProbe, solenoidProbe);
+    double batchTime = benchmarkTime() - start;
+
+    double maxDiff = 0;
+    for (int i = 0; i < n; i++) {
+        maxDiff = max(maxDiff, fabs(loopValues[i].b1 - b[i]));
+        maxDiff = max(maxDiff, fabs(loopValues[i].b2 - b[i + n]));
+        maxDiff = max(maxDiff, fabs(loopValues[i].b3 - b[i + 2 * n]));
+    }
+
+    fprintf(stream, "\nBENCHMARK batch: %d random points\n", n);
+    fprintf(stream, "  getCompositeFieldValue loop: %8.2f ns/point\n", 1.0e9 * loopTime / n);
+    fprintf(stream, "  getCompositeFieldValues:     %8.2f ns/point\n", 1.0e9 * batchTime / n);
+    fprintf(stream, "  speedup: %-6.2f max difference: %-9.3e kG\n", loopTime / batchTime, maxDiff);
+
+    freeProbe(torusProbe);
+    freeProbe(solenoidProbe);
+    free(loopValues);
+    free(b);
+    free(x);
+}
+
+/**
+ * Time the batched interpolation of one field for each available SIMD level.
+ * @param fieldPtr the field.
+ * @param stream where to print the results, e.g. stdout.
+ */
+void simdBenchmark(MagneticFieldPtr fieldPtr, FILE *stream) {
+    int n = NUMBENCHPOINTS;
+
+    double *x = (double *) malloc(3 * n * sizeof(double));
+    double *y = x + n;
+    double *z = y + n;
+    float *b = (float *) malloc(3 * n * sizeof(float));
+
+    randomPoints(x, y, z, n, fieldPtr);
+
+    SimdLevel saved = getSimdLevel();
+    SimdLevel best = getBestSimdLevel();
+
+    fprintf(stream, "\nBENCHMARK simd: %d random points, %s\n", n,
+            (fieldPtr->type == TORUS) ? "TORUS" : "SOLENOID");
+
+    for (int level = SIMD_SCALAR; level <= (int) best; level++) {
+        setSimdLevel((SimdLevel) level);
+        double start = benchmarkTime();
+        simdFieldValues(x, y, z, b, b + n, b + 2 * n, n, fieldPtr, false);
+        double time = benchmarkTime() - start;
+        fprintf(stream, "  %-8s %8.2f ns/point\n", simdLevelLabels[level], 1.0e9 * time / n);
+    }
+
+    setSimdLevel(saved);
+    free(b);
+    free(x);
+}
+
+/**
+ * Compare fixed step RK4 with the adaptive swimmer on tracks from the origin
+ * through the composite field.
+ * @param torus the torus field (can be NULL).
+ * @param solenoid the solenoid field (can be NULL).
+ * @param stream where to print the results, e.g. stdout.
+ */
+void swimBenchmark(MagneticFieldPtr torus, MagneticFieldPtr solenoid, FILE *stream) {
+    int n = 1000;
+    double sMax = 600;
+    double stepSize = 0.5;
+
+    SwimPointPtr starts = (SwimPointPtr) malloc(n * sizeof(SwimPoint));
+    double *momenta = (double *) malloc(n * sizeof(double));
+    SwimPointPtr finals = (SwimPointPtr) malloc(n * sizeof(SwimPoint));
+    for (int i = 0; i < n; i++) {
+        initSwimPoint(starts + i, 0, 0, 0, randomDouble(5, 40), randomDouble(0, 360));
+        momenta[i] = randomDouble(0.5, 5.0);
+    }
+
+    SwimmerPtr swimmer = createSwimmer(torus, solenoid);
+    SwimResult result;
+    long rk4Evaluations = 0;
+    long adaptiveEvaluations = 0;
+    double maxDiff = 0;
+
+    double start = benchmarkTime();
+    for (int i = 0; i < n; i++) {
+        swimRK4(swimmer, -1, momenta[i], starts + i, sMax, stepSize, NULL, 0, &result);
+        rk4Evaluations += result.numFieldEvaluations;
+        finals[i] = result.final;
+    }
+    double rk4Time = benchmarkTime() - start;
+
+    start = benchmarkTime();
+    for (int i = 0; i < n; i++) {
+        swimAdaptive(swimmer, -1, momenta[i], starts + i, sMax, NULL, 0, &result);
+        adaptiveEvaluations += result.numFieldEvaluations;
+        maxDiff = max(maxDiff, hypot(hypot(result.final.x - finals[i].x, result.final.y - finals[i].y),
+                                     result.final.z - finals[i].z));
+    }
+    double adaptiveTime = benchmarkTime() - start;
+
+    fprintf(stream, "\nBENCHMARK swim: %d tracks of %.0f cm (final position max diff %-9.3e cm)\n",
+            n, sMax, maxDiff);
+    fprintf(stream, "  RK4 (%.1f cm steps): %8.2f us/track %8.0f lookups/track\n", stepSize,
+            1.0e6 * rk4Time / n, (double) rk4Evaluations / n);
+    fprintf(stream, "  adaptive (tol %.0e): %8.2f us/track %8.0f lookups/track\n", swimmer->tolerance,
+            1.0e6 * adaptiveTime / n, (double) adaptiveEvaluations / n);
+
+    freeSwimmer(swimmer);
+    free(finals);
+    free(momenta);
+    free(starts);
+}
+
+/**
+ * Time swimTracks on the same tracks for 1, 2, 4, ... threads up to one per core.
+ * @param torus the torus field (can be NULL).
+ * @param solenoid the solenoid field (can be NULL).
+ * @param stream where to print the results, e.g. stdout.
+ */
+void swimScalingBenchmark(MagneticFieldPtr torus, MagneticFieldPtr solenoid, FILE *stream) {
+    int n = 2000;
+    int numCores = getNumCores();
+
+    //lengths vary a lot, as in real events, which is what work stealing is for
+    SwimTrackPtr tracks = (SwimTrackPtr) malloc(n * sizeof(SwimTrack));
+    for (int i = 0; i < n; i++) {
+        tracks[i].charge = (i % 2 == 0) ? -1 : 1;
+        tracks[i].momentum = randomDouble(0.5, 5.0);
+        initSwimPoint(&(tracks[i].start), 0, 0, 0, randomDouble(5, 40), randomDouble(0, 360));
+        tracks[i].sMax = (i % 10 == 0) ? 800 : randomDouble(10, 100);
+        tracks[i].trajectory = NULL;
+        tracks[i].capacity = 0;
+    }
+
+    fprintf(stream, "\nBENCHMARK swim scaling: %d tracks, %d cores\n", n, numCores);
+    fprintf(stream, "  %8s %14s %10s %12s\n", "threads", "tracks/s", "speedup", "efficiency");
+
+    double serialTime = 0;
+    for (int numThreads = 1; ; numThreads = (2 * numThreads > numCores) ? numCores : 2 * numThreads) {
+        double start = benchmarkTime();
+        int used = swimTracks(torus, solenoid, tracks, n, numThreads, NULL);
+        double time = benchmarkTime() - start;
+
+        if (used == 1) {
+            serialTime = time;
+        }
+        double speedup = serialTime / time;
+        fprintf(stream, "  %8d %14.0f %10.2f %11.0f%%\n", used, n / time, speedup, 100 * speedup / used);
+
+        if (numThreads >= numCores) {
+            break;
+        }
+    }
+
+    free(tracks);
+}
+
+/**
+ * Compare swimming tracks one at a time with stepping them SWIMLANES at a
+ * time, on one thread, for each SIMD level.
+ * @param torus the torus field (can be NULL).
+ * @param solenoid the solenoid field (can be NULL).
+ * @param stream where to print the results, e.g. stdout.
+ */
+void swimLanesBenchmark(MagneticFieldPtr torus, MagneticFieldPtr solenoid, FILE *stream) {
+    int n = 2000;
+
+    SwimTrackPtr tracks = (SwimTrackPtr) malloc(n * sizeof(SwimTrack));
+    for (int i = 0; i < n; i++) {
+        tracks[i].charge = (i % 2 == 0) ? -1 : 1;
+        tracks[i].momentum = randomDouble(0.5, 5.0);
+        initSwimPoint(&(tracks[i].start), 0, 0, 0, randomDouble(5, 40), randomDouble(0, 360));
+        tracks[i].sMax = randomDouble(100, 600);
+        tracks[i].trajectory = NULL;
+        tracks[i].capacity = 0;
+    }
+
+    fprintf(stream, "\nBENCHMARK swim lanes: %d tracks, %d lanes, 1 thread\n", n, SWIMLANES);
+
+    double start = benchmarkTime();
+    swimTracks(torus, solenoid, tracks, n, 1, NULL);
+    double singleTime = benchmarkTime() - start;
+    fprintf(stream, "  %-22s %10.0f tracks/s\n", "one track at a time", n / singleTime);
+
+    SimdLevel saved = getSimdLevel();
+    for (int level = SIMD_SCALAR; level <= (int) getBestSimdLevel(); level++) {
+        setSimdLevel((SimdLevel) level);
+        start = benchmarkTime();
+        swimTracksSimd(torus, solenoid, tracks, n, 1, NULL);
+        double time = benchmarkTime() - start;
+        fprintf(stream, "  lanes %-16s %10.0f tracks/s  speedup %5.2f\n", simdLevelLabels[level],
+                n / time, singleTime / time);
+    }
+    setSimdLevel(saved);
+
+    free(tracks);
+}
+
+/**
+ * Compare propagating the Jacobian with the swim to getting the seven
+ * columns from central differences (fourteen extra swims per track).
+ * @param torus the torus field (can be NULL).
+ * @param solenoid the solenoid field (can be NULL).
+ * @param stream where to print the results, e.g. stdout.
+ */
+void jacobianBenchmark(MagneticFieldPtr torus, MagneticFieldPtr solenoid, FILE *stream) {
+    int n = 200;
+    double sMax = 300;
+
+    SwimPointPtr starts = (SwimPointPtr) malloc(n * sizeof(SwimPoint));
+    double *momenta = (double *) malloc(n * sizeof(double));
+    for (int i = 0; i < n; i++) {
+        initSwimPoint(starts + i, 0, 0, 0, randomDouble(5, 40), randomDouble(0, 360));
+        momenta[i] = randomDouble(0.5, 5.0);
+    }
+
+    SwimmerPtr swimmer = createSwimmer(torus, solenoid);
+    SwimResult result;
+    SwimJacobian jacobian;
+    long jacobianEvaluations = 0;
+    long differenceEvaluations = 0;
+
+    double start = benchmarkTime();
+    for (int i = 0; i < n; i++) {
+        swimJacobian(swimmer, -1, momenta[i], starts + i, sMax, NULL, 0, &result, &jacobian);
+        jacobianEvaluations += result.numFieldEvaluations;
+    }
+    double jacobianTime = benchmarkTime() - start;
+
+    start = benchmarkTime();
+    for (int i = 0; i < n; i++) {
+        swimAdaptive(swimmer, -1, momenta[i], starts + i, sMax, NULL, 0, &result);
+        differenceEvaluations += result.numFieldEvaluations;
+        for (int j = 0; j < 7; j++) {
+            for (int sign = -1; sign <= 1; sign += 2) {
+                SwimPoint shifted = starts[i];
+                double p = momenta[i];
+                double *coords = &(shifted.x);
+                if (j < 6) {
+                    coords[j] += sign * 1.0e-3;
+                }
+                else {
+                    p = -1.0 / (-1.0 / p + sign * 1.0e-3);
+                }
+                swimAdaptive(swimmer, -1, p, &shifted, sMax, NULL, 0, &result);
+                differenceEvaluations += result.numFieldEvaluations;
+            }
+        }
+    }
+    double differenceTime = benchmarkTime() - start;
+
+    fprintf(stream, "\nBENCHMARK jacobian: %d tracks of %.0f cm\n", n, sMax);
+    fprintf(stream, "  propagated:          %8.2f us/track %8.0f lookups/track\n",
+            1.0e6 * jacobianTime / n, (double) jacobianEvaluations / n);
+    fprintf(stream, "  central differences: %8.2f us/track %8.0f lookups/track\n",
+            1.0e6 * differenceTime / n, (double) differenceEvaluations / n);
+
+    freeSwimmer(swimmer);
+    free(momenta);
+    free(starts);
+}
+
+/**
+ * Swim to a surface without a stopping condition, the way it is done with
+ * fixed length swims: swim the whole length, find the first trajectory point
+ * past the surface, then swim again from the point before it by the path
+ * length interpolated to the surface, narrowing the bracket (regula falsi)
+ * until a swim ends within the swimmer's surface tolerance.
+ * @param swimmer the swimmer.
+ * @param charge the charge in units of e.
+ * @param momentum the momentum in GeV/c.
+ * @param start the start point.
+ * @param surface the surface, with its sector (if any) resolved.
+ * @param sMax the most path length to swim in cm.
+ * @param buffer a trajectory buffer.
+ * @param capacity the number of points the buffer holds.
+ * @param hit upon return, whether the surface was reached.
+ * @return the field lookups of all the swims.
+ */
+static int overshootSwim(SwimmerPtr swimmer, int charge, double momentum, const SwimPoint *start,
+                         const SwimSurface *surface, double sMax, SwimPointPtr buffer, int capacity, bool *hit) {
+    SwimResult result;
+    *hit = false;
+
+    swimAdaptive(swimmer, charge, momentum, start, sMax, buffer, capacity, &result);
+    int evaluations = result.numFieldEvaluations;
+
+    //the first point past the surface brackets the crossing
+    double g0 = surfaceDistance(surface, start->x, start->y, start->z);
+    int i = 1;
+    while ((i < result.numPoints) &&
+           ((surfaceDistance(surface, buffer[i].x, buffer[i].y, buffer[i].z) > 0) == (g0 > 0))) {
+        i++;
+    }
+    if (i >= result.numPoints) {
+        return evaluations;
+    }
+
+    SwimPoint before = buffer[i - 1];
+    SwimPoint after = buffer[i];
+    double gBefore = surfaceDistance(surface, before.x, before.y, before.z);
+    double gAfter = surfaceDistance(surface, after.x, after.y, after.z);
+
+    for (int pass = 0; pass < 50; pass++) {
+        if (fabs(gAfter) <= swimmer->surfaceTolerance) {
+            *hit = true;
+            break;
+        }
+
+        double ds = (after.s - before.s) * gBefore / (gBefore - gAfter);
+        swimAdaptive(swimmer, charge, momentum, &before, ds, NULL, 0, &result);
+        evaluations += result.numFieldEvaluations;
+
+        double g = surfaceDistance(surface, result.final.x, result.final.y, result.final.z);
+        if (fabs(g) <= swimmer->surfaceTolerance) {
+            *hit = true;
+            break;
+        }
+        if ((g > 0) == (gBefore > 0)) {
+            before = result.final;
+            gBefore = g;
+        }
+        else {
+            after = result.final;
+            gAfter = g;
+        }
+    }
+    return evaluations;
+}
+
+/**
+ * Compare swimming to a sector plane with swimToSurface, which lands on the
+ * plane, against overshooting and swimming again, and against a single swim
+ * of the path length that is already known (the least it can cost).
+ * @param torus the torus field (can be NULL).
+ * @param solenoid the solenoid field (can be NULL).
+ * @param stream where to print the results, e.g. stdout.
+ */
+void surfaceBenchmark(MagneticFieldPtr torus, MagneticFieldPtr solenoid, FILE *stream) {
+    int n = 1000;
+    int capacity = 10000;
+
+    SwimPointPtr starts = (SwimPointPtr) malloc(n * sizeof(SwimPoint));
+    double *momenta = (double *) malloc(n * sizeof(double));
+    double *lengths = (double *) malloc(n * sizeof(double));
+    int *sectors = (int *) malloc(n * sizeof(int));
+    SwimPointPtr buffer = (SwimPointPtr) malloc(capacity * sizeof(SwimPoint));
+    for (int i = 0; i < n; i++) {
+        double phi = randomDouble(0, 360);
+        initSwimPoint(starts + i, 0, 0, 0, randomDouble(5, 40), phi);
+        momenta[i] = randomDouble(0.5, 5.0);
+        sectors[i] = getSector(phi);
+    }
+
+    SwimmerPtr swimmer = createSwimmer(torus, solenoid);
+    SwimSurface surface;
+    initSectorPlaneSurface(&surface, 0, 25, 500);
+    SwimResult result;
+    long surfaceEvaluations = 0;
+    long overshootEvaluations = 0;
+    long fixedEvaluations = 0;
+    int hits = 0;
+    int overshootHits = 0;
+
+    double start = benchmarkTime();
+    for (int i = 0; i < n; i++) {
+        swimToSurface(swimmer, -1, momenta[i], starts + i, &surface, 1000, NULL, 0, &result);
+        surfaceEvaluations += result.numFieldEvaluations;
+        lengths[i] = result.final.s;
+        hits += result.hitSurface ? 1 : 0;
+    }
+    double surfaceTime = benchmarkTime() - start;
+
+    start = benchmarkTime();
+    for (int i = 0; i < n; i++) {
+        SwimSurface sectorSurface;
+        bool hit;
+        initSectorPlaneSurface(&sectorSurface, sectors[i], 25, 500);
+        overshootEvaluations += overshootSwim(swimmer, -1, momenta[i], starts + i, &sectorSurface, 1000,
+                                              buffer, capacity, &hit);
+        overshootHits += hit ? 1 : 0;
+    }
+    double overshootTime = benchmarkTime() - start;
+
+    start = benchmarkTime();
+    for (int i = 0; i < n; i++) {
+        swimAdaptive(swimmer, -1, momenta[i], starts + i, lengths[i], NULL, 0, &result);
+        fixedEvaluations += result.numFieldEvaluations;
+    }
+    double fixedTime = benchmarkTime() - start;
+
+    fprintf(stream, "\nBENCHMARK surface: %d tracks to a sector plane at %.0f cm (%d hit, %d by re-swimming)\n",
+            n, surface.distance, hits, overshootHits);
+    fprintf(stream, "  to the surface:         %8.2f us/track %8.1f lookups/track\n",
+            1.0e6 * surfaceTime / n, (double) surfaceEvaluations / n);
+    fprintf(stream, "  overshoot and re-swim:  %8.2f us/track %8.1f lookups/track\n",
+            1.0e6 * overshootTime / n, (double) overshootEvaluations / n);
+    fprintf(stream, "  known length (bound):   %8.2f us/track %8.1f lookups/track\n",
+            1.0e6 * fixedTime / n, (double) fixedEvaluations / n);
+
+    freeSwimmer(swimmer);
+    free(buffer);
+    free(sectors);
+    free(lengths);
+    free(momenta);
+    free(starts);
+}
+
+/**
+ * Compare adaptive swims with and without helix steps, in the given fields
+ * and in a uniform 50 kG field (an ideal solenoid core).
+ * @param torus the torus field (can be NULL).
+ * @param solenoid the solenoid field (can be NULL).
+ * @param stream where to print the results, e.g. stdout.
+ */
+void helixBenchmark(MagneticFieldPtr torus, MagneticFieldPtr solenoid, FILE *stream) {
+    int n = 1000;
+    double sMax = 1000;
+
+    SwimPointPtr starts = (SwimPointPtr) malloc(n * sizeof(SwimPoint));
+    double *momenta = (double *) malloc(n * sizeof(double));
+    for (int i = 0; i < n; i++) {
+        initSwimPoint(starts + i, 0, 0, 0, randomDouble(5, 40), randomDouble(0, 360));
+        momenta[i] = randomDouble(0.5, 5.0);
+    }
+
+    MagneticFieldPtr uniform = createUniformField(50.0);
+    buildFieldUniformity(uniform);
+    if (torus != NULL) {
+        buildFieldUniformity(torus);
+    }
+    if (solenoid != NULL) {
+        buildFieldUniformity(solenoid);
+    }
+
+    fprintf(stream, "\nBENCHMARK helix: %d tracks of %.0f cm\n", n, sMax);
+
+    for (int f = 0; f < 2; f++) {
+        SwimmerPtr swimmer = (f == 0) ? createSwimmer(torus, solenoid) : createSwimmer(NULL, uniform);
+        SwimResult result;
+
+        for (int mode = 0; mode < 2; mode++) {
+            swimmer->helix = (mode == 1);
+            long evaluations = 0;
+            long steps = 0;
+            long helixSteps = 0;
+
+            double start = benchmarkTime();
+            for (int i = 0; i < n; i++) {
+                swimAdaptive(swimmer, -1, momenta[i], starts + i, sMax, NULL, 0, &result);
+                evaluations += result.numFieldEvaluations;
+                steps += result.numSteps;
+                helixSteps += result.numHelixSteps;
+            }
+            double time = benchmarkTime() - start;
+
+            fprintf(stream, "  %-8s %-12s %8.2f us/track %8.1f lookups/track %5.1f%% helix steps\n",
+                    (f == 0) ? "maps" : "uniform", swimmer->helix ? "helix" : "adaptive",
+                    1.0e6 * time / n, (double) evaluations / n, (steps > 0) ? 100.0 * helixSteps / steps : 0);
+        }
+        freeSwimmer(swimmer);
+    }
+
+    freeFieldMap(uniform);
+    free(momenta);
+    free(starts);
+}
+
+/**
+ * Benchmark swims with predicted step sizes against plain adaptive swims,
+ * after timing the build of the bounds they need, in the caller and on a
+ * background thread.
+ * @param torus the torus field (can be NULL).
+ * @param solenoid the solenoid field (can be NULL).
+ * @param stream where to print the results, e.g. stdout.
+ */
+void predictBenchmark(MagneticFieldPtr torus, MagneticFieldPtr solenoid, FILE *stream) {
+    int n = 1000;
+    double sMax = 1000;
+
+    SwimPointPtr starts = (SwimPointPtr) malloc(n * sizeof(SwimPoint));
+    double *momenta = (double *) malloc(n * sizeof(double));
+    for (int i = 0; i < n; i++) {
+        initSwimPoint(starts + i, 0, 0, 0, randomDouble(5, 40), randomDouble(0, 360));
+        momenta[i] = randomDouble(0.5, 5.0);
+    }
+
+    fprintf(stream, "\nBENCHMARK predicted steps: %d tracks of %.0f cm\n", n, sMax);
+
+    //both maps in the caller, then both at once in the background
+    double start = benchmarkTime();
+    buildFieldUniformity(torus);
+    buildFieldUniformity(solenoid);
+    double inCaller = benchmarkTime() - start;
+
+    start = benchmarkTime();
+    UniformityBuildPtr torusBuild = startFieldUniformityBuild(torus);
+    UniformityBuildPtr solenoidBuild = startFieldUniformityBuild(solenoid);
+    finishFieldUniformityBuild(torusBuild);
+    finishFieldUniformityBuild(solenoidBuild);
+    double inBackground = benchmarkTime() - start;
+
+    fprintf(stream, "  bounds build %8.2f ms in the caller, %8.2f ms on background threads\n",
+            1.0e3 * inCaller, 1.0e3 * inBackground);
+
+    SwimmerPtr swimmer = createSwimmer(torus, solenoid);
+    SwimResult result;
+
+    for (int mode = 0; mode < 2; mode++) {
+        swimmer->predictSteps = (mode == 1);
+        long evaluations = 0;
+        long steps = 0;
+        long rejected = 0;
+
+        start = benchmarkTime();
+        for (int i = 0; i < n; i++) {
+            swimAdaptive(swimmer, -1, momenta[i], starts + i, sMax, NULL, 0, &result);
+            evaluations += result.numFieldEvaluations;
+            steps += result.numSteps;
+            rejected += result.numRejected;
+        }
+        double time = benchmarkTime() - start;
+
+        fprintf(stream, "  %-10s %8.2f us/track %8.1f lookups/track %7.1f steps/track %6.2f rejected/track\n",
+                swimmer->predictSteps ? "predicted" : "adaptive", 1.0e6 * time / n, (double) evaluations / n,
+                (double) steps / n, (double) rejected / n);
+    }
+
+    freeSwimmer(swimmer);
+    free(momenta);
+    free(starts);
+}
+
+/**
+ * Benchmark trajectory table lookups against swims to the same surface,
+ * after timing the build of the table.
+ * @param torus the torus field (can be NULL).
+ * @param solenoid the solenoid field (can be NULL).
+ * @param stream where to print the results, e.g. stdout.
+ */
+void tableBenchmark(MagneticFieldPtr torus, MagneticFieldPtr solenoid, FILE *stream) {
+    int n = 1000;
+
+    TableSpec spec;
+    initTableSpec(&spec);
+    spec.momentum = (TableAxis) {1.0, 5.0, 17};
+    spec.theta = (TableAxis) {10.0, 30.0, 11};
+    spec.vertexZ = (TableAxis) {-5.0, 5.0, 5};
+    SwimSurface surface;
+    initZPlaneSurface(&surface, 500);
+    addTableSurface(&spec, &surface);
+
+    double start = benchmarkTime();
+    TrajectoryTablePtr table = createTrajectoryTable(torus, solenoid, &spec, 0);
+    double buildTime = benchmarkTime() - start;
+    if (table == NULL) {
+        return;
+    }
+
+    fprintf(stream, "\nBENCHMARK trajectory table: %llu crossings built in %8.2f s, %d tracks\n",
+            table->header.numEntries, buildTime, n);
+
+    SwimPointPtr starts = (SwimPointPtr) malloc(n * sizeof(SwimPoint));
+    SwimPointPtr swum = (SwimPointPtr) malloc(n * sizeof(SwimPoint));
+    double *momenta = (double *) malloc(n * sizeof(double));
+    bool *found = (bool *) malloc(n * sizeof(bool));
+    for (int i = 0; i < n; i++) {
+        initSwimPoint(starts + i, 0, 0, randomDouble(-5, 5), randomDouble(10, 30), randomDouble(0, 360));
+        momenta[i] = randomDouble(1.0, 5.0);
+    }
+
+    SwimmerPtr swimmer = createSwimmer(torus, solenoid);
+    SwimResult result;
+    start = benchmarkTime();
+    for (int i = 0; i < n; i++) {
+        swimToSurface(swimmer, -1, momenta[i], starts + i, &surface, spec.sMax, NULL, 0, &result);
+        found[i] = result.hitSurface;
+        swum[i] = result.final;
+    }
+    double swimTime = benchmarkTime() - start;
+
+    SwimPoint crossing;
+    double sumDiff = 0;
+    int numCompared = 0;
+    start = benchmarkTime();
+    for (int i = 0; i < n; i++) {
+        SwimPointPtr sp = starts + i;
+        double theta = toDegrees(acos(sp->tz));
+        double phi = toDegrees(atan2(sp->ty, sp->tx));
+        if (lookupTrajectory(table, -1, momenta[i], theta, phi, sp->z, 0, &crossing, NULL) && found[i]) {
+            sumDiff += sqrt((crossing.x - swum[i].x) * (crossing.x - swum[i].x) +
+                            (crossing.y - swum[i].y) * (crossing.y - swum[i].y));
+            numCompared++;
+        }
+    }
+    double lookupTime = benchmarkTime() - start;
+
+    fprintf(stream, "  swim   %10.3f us/track\n", 1.0e6 * swimTime / n);
+    fprintf(stream, "  lookup %10.3f us/track (mean difference %.3f cm)\n", 1.0e6 * lookupTime / n,
+            sumDiff / max(1, numCompared));
+
+    freeSwimmer(swimmer);
+    freeTrajectoryTable(table);
+    free(found);
+    free(momenta);
+    free(swum);
+    free(starts);
+}
+
+/**
+ * Benchmark field integrals along lines from the target: summing lookups
+ * every centimeter, the cell aligned quadrature with one cell and 2 cm
+ * panels, and lookups in a table of the integrals.
+ * @param torus the torus field (can be NULL).
+ * @param solenoid the solenoid field (can be NULL).
+ * @param stream where to print the results, e.g. stdout.
+ */
+void integralBenchmark(MagneticFieldPtr torus, MagneticFieldPtr solenoid, FILE *stream) {
+    int n = 1000;
+    double length = 800;
+
+    SwimPointPtr starts = (SwimPointPtr) malloc(n * sizeof(SwimPoint));
+    double *exact = (double *) malloc(n * sizeof(double));
+    for (int i = 0; i < n; i++) {
+        initSwimPoint(starts + i, 0, 0, 0, randomDouble(5, 40), randomDouble(0, 360));
+    }
+
+    fprintf(stream, "\nBENCHMARK field integrals: %d lines of %.0f cm\n", n, length);
+
+    FieldProbePtr torusProbe = (torus == NULL) ? NULL : createProbe(torus);
+    FieldProbePtr solenoidProbe = (solenoid == NULL) ? NULL : createProbe(solenoid);
+    FieldIntegral integral;
+    FieldValue fv;
+
+    for (int mode = 0; mode < 4; mode++) {
+        const char *labels[4] = {"one cell", "2 cm panel", "1 cm sum", "table"};
+        long evaluations = 0;
+        double sumDiff = 0;
+
+        double buildTime = 0;
+        IntegralTablePtr table = NULL;
+        if (mode == 3) {
+            TableAxis theta = {5.0, 40.0, 71};
+            TableAxis phi = {0.0, 360.0, 361};
+            double start = benchmarkTime();
+            table = createIntegralTable(torus, solenoid, &theta, &phi, 0, length, 0);
+            buildTime = benchmarkTime() - start;
+        }
+
+        double start = benchmarkTime();
+        for (int i = 0; i < n; i++) {
+            SwimPointPtr sp = starts + i;
+            if (mode < 2) {
+                fieldIntegral(torusProbe, solenoidProbe, sp, length, (mode == 0) ? 0 : 2.0, &integral);
+            }
+            else if (mode == 2) {
+                memset(&integral, 0, sizeof(FieldIntegral));
+                for (double s = 0.5; s < length; s += 1.0) {
+                    getCompositeFieldValueProbe(&fv, s * sp->tx, s * sp->ty, s * sp->tz, torusProbe, solenoidProbe);
+                    integral.bdl[0] += fv.b1;
+                    integral.bdl[1] += fv.b2;
+                    integral.bdl[2] += fv.b3;
+                    integral.numEvaluations++;
+                }
+            }
+            else {
+                lookupFieldIntegral(table, toDegrees(acos(sp->tz)), toDegrees(atan2(sp->ty, sp->tx)), &integral);
+            }
+
+            //the transverse integral of the sum is only needed for the comparison
+            if (mode == 0) {
+                exact[i] = integral.transverse;
+            }
+            else if (mode == 2) {
+                double *bdl = integral.bdl;
+                double kx = sp->ty * bdl[2] - sp->tz * bdl[1];
+                double ky = sp->tz * bdl[0] - sp->tx * bdl[2];
+                double kz = sp->tx * bdl[1] - sp->ty * bdl[0];
+                integral.transverse = sqrt(kx * kx + ky * ky + kz * kz);
+            }
+            evaluations += integral.numEvaluations;
+            sumDiff += fabs(integral.transverse - exact[i]) / max(1, exact[i]);
+        }
+        double time = benchmarkTime() - start;
+
+        fprintf(stream, "  %-11s %10.3f us/line %8.1f lookups/line  mean relative difference %-9.3e",
+                labels[mode], 1.0e6 * time / n, (double) evaluations / n, sumDiff / n);
+        if (mode == 3) {
+            fprintf(stream, "  (built in %.2f s)", buildTime);
+        }
+        fprintf(stream, "\n");
+        freeIntegralTable(table);
+    }
+
+    freeProbe(torusProbe);
+    freeProbe(solenoidProbe);
+    free(exact);
+    free(starts);
+}
+
+/**
+ * Time tracing field lines from seeds spread through the maps, with
+ * preallocated buffers for the points, on one thread and on one per core.
+ * @param torus the torus field (can be NULL).
+ * @param solenoid the solenoid field (can be NULL).
+ * @param stream where to print the results, e.g. stdout.
+ */
+void fieldLineBenchmark(MagneticFieldPtr torus, MagneticFieldPtr solenoid, FILE *stream) {
+    int n = 1000;
+    int capacity = 2000;
+    int numCores = getNumCores();
+
+    SwimTrackPtr lines = (SwimTrackPtr) malloc(n * sizeof(SwimTrack));
+    for (int i = 0; i < n; i++) {
+        lines[i].charge = (i % 2 == 0) ? -1 : 1;
+        lines[i].momentum = 0;
+        initSwimPoint(&(lines[i].start), randomDouble(-300, 300), randomDouble(-300, 300),
+                      randomDouble(100, 500), 0, 0);
+        lines[i].sMax = 500;
+        lines[i].trajectory = (SwimPointPtr) malloc(capacity * sizeof(SwimPoint));
+        lines[i].capacity = capacity;
+    }
+
+    fprintf(stream, "\nBENCHMARK field lines: %d lines of up to %d cm\n", n, 500);
+    fprintf(stream, "  %8s %14s %14s %14s %10s\n", "threads", "lines/s", "points/line", "lookups/line", "speedup");
+
+    double serialTime = 0;
+    int threads[2] = {1, numCores};
+    for (int t = 0; t < ((numCores > 1) ? 2 : 1); t++) {
+        double start = benchmarkTime();
+        int used = traceFieldLines(torus, solenoid, lines, n, threads[t], NULL);
+        double time = benchmarkTime() - start;
+
+        if (t == 0) {
+            serialTime = time;
+        }
+        double points = 0;
+        double lookups = 0;
+        for (int i = 0; i < n; i++) {
+            points += lines[i].result.numPoints;
+            lookups += lines[i].result.numFieldEvaluations;
+        }
+        fprintf(stream, "  %8d %14.0f %14.1f %14.1f %10.2f\n", used, n / time, points / n, lookups / n,
+                serialTime / time);
+    }
+
+    for (int i = 0; i < n; i++) {
+        free(lines[i].trajectory);
+    }
+    free(lines);
+}
+
+/**
+ * Compare getCompositeFieldValueProbes with a field set of the same maps,
+ * for the torus and solenoid, and with the solenoid added again as a small
+ * correction. The points are spread over the whole detector and downstream
+ * of it, where the set skips the maps whose slabs do not reach.
+ * @param torus the torus field (can be NULL).
+ * @param solenoid the solenoid field (can be NULL).
+ * @param stream where to print the results, e.g. stdout.
+ */
+void fieldSetBenchmark(MagneticFieldPtr torus, MagneticFieldPtr solenoid, FILE *stream) {
+    int n = NUMBENCHPOINTS;
+
+    double *x = (double *) malloc(3 * n * sizeof(double));
+    double *y = x + n;
+    double *z = y + n;
+    for (int i = 0; i < n; i++) {
+        double phi = randomDouble(0, 360);
+        double rho = randomDouble(0, 500);
+        z[i] = randomDouble(-300, 900);
+        cylindricalToCartesian(x + i, y + i, phi, rho);
+    }
+
+    MagneticFieldPtr maps[3] = {torus, solenoid, solenoid};
+    FieldProbePtr probes[3];
+    for (int m = 0; m < 3; m++) {
+        probes[m] = (maps[m] == NULL) ? NULL : createProbe(maps[m]);
+    }
+
+    fprintf(stream, "\nBENCHMARK field set: %d points, rho < 500 cm, -300 < z < 900 cm\n", n);
+    fprintf(stream, "  %-6s %14s %14s %10s\n", "maps", "composite", "field set", "speedup");
+
+    FieldValue fv;
+    for (int numMaps = 2; numMaps <= 3; numMaps++) {
+        double start = benchmarkTime();
+        for (int i = 0; i < n; i++) {
+            getCompositeFieldValueProbes(&fv, x[i], y[i], z[i], probes, numMaps);
+        }
+        double compositeTime = 1.0e9 * (benchmarkTime() - start) / n;
+
+        //the same maps, the correction scaled down
+        FieldSetPtr subsetPtr = createFieldSet();
+        for (int m = 0; m < numMaps; m++) {
+            if (maps[m] != NULL) {
+                addFieldToSet(subsetPtr, maps[m]);
+            }
+        }
+        if ((numMaps == 3) && (solenoid != NULL)) {
+            setFieldSetScale(subsetPtr, subsetPtr->numMembers - 1, 0.01);
+        }
+        FieldSetProbePtr setProbe = createFieldSetProbe(subsetPtr);
+
+        start = benchmarkTime();
+        for (int i = 0; i < n; i++) {
+            getFieldSetValue(&fv, x[i], y[i], z[i], setProbe);
+        }
+        double setTime = 1.0e9 * (benchmarkTime() - start) / n;
+
+        fprintf(stream, "  %-6d %8.2f ns/pt %8.2f ns/pt %10.2f\n", numMaps, compositeTime, setTime,
+                compositeTime / setTime);
+        freeFieldSetProbe(setProbe);
+        freeFieldSet(subsetPtr);
+    }
+
+    for (int m = 0; m < 3; m++) {
+        if (probes[m] != NULL) {
+            freeProbe(probes[m]);
+        }
+    }
+    free(x);
+}
+
+/**
+ * Run all the benchmarks.
+ * @param torus the torus field (can be NULL).
+ * @param solenoid the solenoid field (can be NULL).
+ * @param stream where to print the results, e.g. stdout.
+ */
+void runBenchmarks(MagneticFieldPtr torus, MagneticFieldPtr solenoid, FILE *stream) {
+    fprintf(stream, "\n\n***** Benchmarks ****** \n");
+    batchBenchmark(torus, solenoid, stream);
+    fieldSetBenchmark(torus, solenoid, stream);
+    if (torus != NULL) {
+        simdBenchmark(torus, stream);
+        compactBenchmark(torus, stream);
+        gradientBenchmark(torus, stream);
+        if (torus->symmetric) {
+            sectorFoldBenchmark(torus, stream);
+        }
+    }
+    if (solenoid != NULL) {
+        simdBenchmark(solenoid, stream);
+        compactBenchmark(solenoid, stream);
+        gradientBenchmark(solenoid, stream);
+    }
+    swimBenchmark(torus, solenoid, stream);
+    swimScalingBenchmark(torus, solenoid, stream);
+    swimLanesBenchmark(torus, solenoid, stream);
+    jacobianBenchmark(torus, solenoid, stream);
+    surfaceBenchmark(torus, solenoid, stream);
+    helixBenchmark(torus, solenoid, stream);
+    predictBenchmark(torus, solenoid, stream);
+    tableBenchmark(torus, solenoid, stream);
+    integralBenchmark(torus, solenoid, stream);
+    fieldLineBenchmark(torus, solenoid, stream);
+    fprintf(stream, "\n ***** End of benchmarks ******\n");
+}
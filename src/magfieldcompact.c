@@ -0,0 +1,469 @@
+//
+//  magfieldcompact.c
+//  cMag
+//  Compact storage of the field values, 6 rather than 12 bytes per grid point.
+//  The values are either IEEE half floats (about 3 significant digits at any
+//  magnitude) or 16-bit integers times a scale factor chosen per map (a fixed
+//  absolute resolution of 1/32767 of the largest component). Lookups decode the
+//  corners of a cell when the cell is reset, so the interpolation itself is
+//  unchanged.
+//
+
+#include "magfieldcompact.h"
+#include "magfieldio.h"
+#include "magfieldutil.h"
+#include "munittest.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <sys/mman.h>
+
+//number of random points used by the accuracy report
+#define NUMACCURACYPOINTS 200000
+
+//some strings for prints
+const char *precisionLabels[] = {"FLOAT32", "FLOAT16", "SCALED_INT16"};
+
+//the precision given to fields when they are loaded
+static StoragePrecision _defaultPrecision = FLOAT32;
+
+//local prototypes
+static void releaseFloatValues(MagneticFieldPtr);
+static void interpolatedValues(MagneticFieldPtr, const double *, const double *, const double *,
+                               int, FieldValuePtr);
+
+/**
+ * Set the storage precision given to fields when they are loaded.
+ * @param precision the precision.
+ */
+void setDefaultPrecision(StoragePrecision precision) {
+    _defaultPrecision = precision;
+}
+
+/**
+ * Get the storage precision given to fields when they are loaded.
+ * @return the precision.
+ */
+StoragePrecision getDefaultPrecision() {
+    return _defaultPrecision;
+}
+
+/**
+ * Convert a float to an IEEE half float, rounding to nearest even. Values
+ * too big for a half float become infinite.
+ * @param value the float.
+ * @return the bits of the half float.
+ */
+uint16_t floatToHalf(float value) {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(uint32_t));
+
+    uint32_t sign = (bits >> 16) & 0x8000;
+    int exponent = (int) ((bits >> 23) & 0xff);
+    uint32_t mantissa = bits & 0x7fffff;
+
+    //infinity or NaN
+    if (exponent == 0xff) {
+        return (uint16_t) (sign | 0x7c00 | (mantissa ? 0x200 : 0));
+    }
+
+    exponent = exponent - 127 + 15;
+
+    //too big
+    if (exponent >= 31) {
+        return (uint16_t) (sign | 0x7c00);
+    }
+
+    //subnormal (or too small)
+    if (exponent <= 0) {
+        if (exponent < -10) {
+            return (uint16_t) sign;
+        }
+        mantissa |= 0x800000;
+        int shift = 14 - exponent;
+        uint32_t half = mantissa >> shift;
+        uint32_t remainder = mantissa & ((1u << shift) - 1);
+        uint32_t midpoint = 1u << (shift - 1);
+        if ((remainder > midpoint) || ((remainder == midpoint) && (half & 1))) {
+            half++;
+        }
+        return (uint16_t) (sign | half);
+    }
+
+    //normal, a carry out of the mantissa correctly bumps the exponent
+    uint32_t half = sign | ((uint32_t) exponent << 10) | (mantissa >> 13);
+    uint32_t remainder = mantissa & 0x1fff;
+    if ((remainder > 0x1000) || ((remainder == 0x1000) && (half & 1))) {
+        half++;
+    }
+    return (uint16_t) half;
+}
+
+/**
+ * Convert an IEEE half float to a float (exactly).
+ * @param half the bits of the half float.
+ * @return the float.
+ */
+float halfToFloat(uint16_t half) {
+    uint32_t sign = ((uint32_t) (half & 0x8000)) << 16;
+    uint32_t exponent = (half >> 10) & 0x1f;
+    uint32_t mantissa = half & 0x3ff;
+    uint32_t bits;
+
+    if (exponent == 0) {
+        //zero or subnormal, m * 2^-24
+        float value = mantissa * (1.0f / 16777216.0f);
+        return sign ? -value : value;
+    }
+    else if (exponent == 31) {
+        bits = sign | 0x7f800000 | (mantissa << 13);
+    }
+    else {
+        bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+    }
+
+    float value;
+    memcpy(&value, &bits, sizeof(float));
+    return value;
+}
+
+/**
+ * Decode a compact field value.
+ * @param fieldPtr a pointer to the field, which must have compact values.
+ * @param compositeIndex the composite index.
+ * @param fieldValuePtr upon return holds the field value in kG.
+ */
+void decodeCompactValue(MagneticFieldPtr fieldPtr, int compositeIndex, FieldValuePtr fieldValuePtr) {
+    const uint16_t *values = fieldPtr->compactValues + 3 * (size_t) compositeIndex;
+
+    if (fieldPtr->precision == FLOAT16) {
+        fieldValuePtr->b1 = halfToFloat(values[0]);
+        fieldValuePtr->b2 = halfToFloat(values[1]);
+        fieldValuePtr->b3 = halfToFloat(values[2]);
+    }
+    else {
+        float scale = fieldPtr->compactScale;
+        fieldValuePtr->b1 = scale * (int16_t) values[0];
+        fieldValuePtr->b2 = scale * (int16_t) values[1];
+        fieldValuePtr->b3 = scale * (int16_t) values[2];
+    }
+}
+
+/**
+ * Add compact values to a field that still has its float values. Lookups use
+ * the compact values, but the float values are kept, which is what the
+ * accuracy report and the benchmarks need. To save the memory, use setFieldPrecision.
+ * Do not call this while other threads are using the field.
+ * @param fieldPtr a pointer to the field.
+ * @param precision the compact precision (FLOAT16 or SCALED_INT16).
+ * @return true on success.
+ */
+bool addCompactValues(MagneticFieldPtr fieldPtr, StoragePrecision precision) {
+    if ((precision == FLOAT32) || (fieldPtr->fieldValues == NULL)) {
+        fprintf(stderr, "\ncMag ERROR compact values need FLOAT32 values.\n");
+        return false;
+    }
+
+    size_t numFloats = 3 * (size_t) fieldPtr->numValues;
+    //one extra word, since the SIMD kernels gather 32 bits at a time
+    uint16_t *compactValues = (uint16_t *) malloc((numFloats + 1) * sizeof(uint16_t));
+    if (compactValues == NULL) {
+        fprintf(stderr, "\ncMag ERROR out of memory when allocating compact field values.\n");
+        return false;
+    }
+    compactValues[numFloats] = 0;
+
+    const float *values = (const float *) fieldPtr->fieldValues;
+    float scale = 0;
+
+    if (precision == FLOAT16) {
+        for (size_t i = 0; i < numFloats; i++) {
+            compactValues[i] = floatToHalf(values[i]);
+        }
+    }
+    else {
+        //the largest component maps to 32767
+        double maxComponent = 0;
+        for (size_t i = 0; i < numFloats; i++) {
+            maxComponent = max(maxComponent, fabs(values[i]));
+        }
+        scale = (maxComponent > 0) ? (float) (maxComponent / 32767) : 1;
+
+        for (size_t i = 0; i < numFloats; i++) {
+            long quantized = lrint(values[i] / scale);
+            quantized = (quantized > 32767) ? 32767 : ((quantized < -32767) ? -32767 : quantized);
+            compactValues[i] = (uint16_t) (int16_t) quantized;
+        }
+    }
+
+    free(fieldPtr->compactValues);
+    fieldPtr->compactValues = compactValues;
+    fieldPtr->compactScale = scale;
+    fieldPtr->precision = precision;
+    invalidateProbe(fieldPtr->probePtr);
+    return true;
+}
+
+/**
+ * Remove the compact values added by addCompactValues, so that lookups use
+ * the float values again. Does nothing if there are no float values.
+ * @param fieldPtr a pointer to the field.
+ */
+void removeCompactValues(MagneticFieldPtr fieldPtr) {
+    if (fieldPtr->fieldValues == NULL) {
+        return;
+    }
+    free(fieldPtr->compactValues);
+    fieldPtr->compactValues = NULL;
+    fieldPtr->compactScale = 0;
+    fieldPtr->precision = FLOAT32;
+    invalidateProbe(fieldPtr->probePtr);
+}
+
+/**
+ * Free (or unmap) the float values of a field that has compact values.
+ * @param fieldPtr a pointer to the field.
+ */
+static void releaseFloatValues(MagneticFieldPtr fieldPtr) {
+    if (fieldPtr->mapping != NULL) {
+        munmap(fieldPtr->mapping, fieldPtr->mappingLength);
+        fieldPtr->mapping = NULL;
+        fieldPtr->mappingLength = 0;
+    }
+    else {
+        free(fieldPtr->fieldValues);
+    }
+    fieldPtr->fieldValues = NULL;
+}
+
+/**
+ * Set the storage precision of a field. Converting to FLOAT16 or SCALED_INT16
+ * halves the memory used by the values, which are decoded when a cell is reset.
+ * Converting back to FLOAT32 does not recover what the compact values lost.
+ * Do not call this while other threads are using the field; probes other than
+ * the default must have their cells reset after it.
+ * @param fieldPtr a pointer to the field.
+ * @param precision the precision.
+ * @return true on success, false (with the precision unchanged) on failure.
+ */
+bool setFieldPrecision(MagneticFieldPtr fieldPtr, StoragePrecision precision) {
+    if ((precision == fieldPtr->precision) && ((precision != FLOAT32) == (fieldPtr->fieldValues == NULL))) {
+        return true;
+    }
+
+    //only compact values, decode them back to floats first
+    if (fieldPtr->fieldValues == NULL) {
+        FieldValuePtr fieldValues = (FieldValuePtr) malloc(fieldPtr->numValues * sizeof(FieldValue));
+        if (fieldValues == NULL) {
+            fprintf(stderr, "\ncMag ERROR out of memory when decoding compact field values.\n");
+            return false;
+        }
+        for (unsigned int i = 0; i < fieldPtr->numValues; i++) {
+            decodeCompactValue(fieldPtr, i, fieldValues + i);
+        }
+        fieldPtr->fieldValues = fieldValues;
+    }
+
+    if (precision == FLOAT32) {
+        removeCompactValues(fieldPtr);
+        return true;
+    }
+
+    if (!addCompactValues(fieldPtr, precision)) {
+        return false;
+    }
+    releaseFloatValues(fieldPtr);
+    return true;
+}
+
+/**
+ * Get the storage precision of a field.
+ * @param fieldPtr a pointer to the field.
+ * @return the precision.
+ */
+StoragePrecision getFieldPrecision(MagneticFieldPtr fieldPtr) {
+    return fieldPtr->precision;
+}
+
+/**
+ * Evaluate a field (unshifted and unscaled) at a set of points in its grid.
+ * @param fieldPtr a pointer to the field.
+ * @param x the x coordinates in cm.
+ * @param y the y coordinates in cm.
+ * @param z the z coordinates in cm.
+ * @param n the number of points.
+ * @param values upon return the field values.
+ */
+static void interpolatedValues(MagneticFieldPtr fieldPtr, const double *x, const double *y, const double *z,
+                               int n, FieldValuePtr values) {
+    FieldProbePtr probePtr = createProbe(fieldPtr);
+    for (int i = 0; i < n; i++) {
+        fieldPtr->evaluator(values + i, x[i], y[i], hypot(x[i], y[i]), z[i], probePtr);
+    }
+    freeProbe(probePtr);
+}
+
+/**
+ * Print the accuracy of the compact precisions compared with the float map,
+ * at the grid points and at random points. The field must have float values.
+ * @param fieldPtr a pointer to the field.
+ * @param stream where to print the results, e.g. stdout.
+ */
+void compactAccuracyReport(MagneticFieldPtr fieldPtr, FILE *stream) {
+    if ((fieldPtr->fieldValues == NULL) || (fieldPtr->compactValues != NULL)) {
+        fprintf(stderr, "\ncMag ERROR the accuracy report needs a FLOAT32 field.\n");
+        return;
+    }
+
+    int n = NUMACCURACYPOINTS;
+    double *x = (double *) malloc(3 * n * sizeof(double));
+    double *y = x + n;
+    double *z = y + n;
+    FieldValuePtr reference = (FieldValuePtr) malloc(2 * n * sizeof(FieldValue));
+    FieldValuePtr compact = reference + n;
+
+    for (int i = 0; i < n; i++) {
+        double phi = randomDouble(0, 360);
+        double rho = randomDouble(fieldPtr->rhoGridPtr->minVal, fieldPtr->rhoGridPtr->maxVal);
+        z[i] = randomDouble(fieldPtr->zGridPtr->minVal, fieldPtr->zGridPtr->maxVal);
+        cylindricalToCartesian(x + i, y + i, phi, rho);
+    }
+    interpolatedValues(fieldPtr, x, y, z, n, reference);
+
+    double maxField = fieldPtr->metricsPtr->maxFieldMagnitude;
+    size_t floatBytes = fieldPtr->numValues * sizeof(FieldValue);
+
+    fprintf(stream, "\nACCURACY of compact storage, %s (max field %-8.4f kG)\n",
+            (fieldPtr->type == TORUS) ? "TORUS" : "SOLENOID", maxField);
+    fprintf(stream, "  %-12s %9s %12s %12s %12s %12s\n", "precision", "MB",
+            "grid max", "interp max", "interp rms", "max/|Bmax|");
+    fprintf(stream, "  %-12s %9.1f\n", precisionLabels[FLOAT32], floatBytes / 1048576.0);
+
+    for (int precision = FLOAT16; precision <= SCALED_INT16; precision++) {
+        if (!addCompactValues(fieldPtr, (StoragePrecision) precision)) {
+            break;
+        }
+
+        //the stored values
+        double gridMax = 0;
+        for (unsigned int i = 0; i < fieldPtr->numValues; i++) {
+            FieldValue fv;
+            FieldValuePtr exact = fieldPtr->fieldValues + i;
+            decodeCompactValue(fieldPtr, i, &fv);
+            gridMax = max(gridMax, max(fabs(fv.b1 - exact->b1), max(fabs(fv.b2 - exact->b2), fabs(fv.b3 - exact->b3))));
+        }
+
+        //the interpolated values
+        interpolatedValues(fieldPtr, x, y, z, n, compact);
+        double interpMax = 0;
+        double sumSquares = 0;
+        for (int i = 0; i < n; i++) {
+            double d1 = compact[i].b1 - reference[i].b1;
+            double d2 = compact[i].b2 - reference[i].b2;
+            double d3 = compact[i].b3 - reference[i].b3;
+            interpMax = max(interpMax, max(fabs(d1), max(fabs(d2), fabs(d3))));
+            sumSquares += d1 * d1 + d2 * d2 + d3 * d3;
+        }
+
+        fprintf(stream, "  %-12s %9.1f %12.3e %12.3e %12.3e %12.3e\n", precisionLabels[precision],
+                floatBytes / 2097152.0, gridMax, interpMax, sqrt(sumSquares / (3.0 * n)), interpMax / maxField);
+
+        removeCompactValues(fieldPtr);
+    }
+
+    free(reference);
+    free(x);
+}
+
+/**
+ * A unit test for compact storage. Checks the half float conversions, that
+ * lookups stay within the resolution of each precision, and that a field can
+ * be converted and its float values released.
+ * @return an error message if the test fails, or NULL if it passes.
+ */
+char *compactUnitTest() {
+
+    //half floats: exact values, rounding, subnormals, overflow
+    mu_assert("halfToFloat(floatToHalf(1)) != 1", halfToFloat(floatToHalf(1.0f)) == 1.0f);
+    mu_assert("halfToFloat(floatToHalf(-2.5)) != -2.5", halfToFloat(floatToHalf(-2.5f)) == -2.5f);
+    mu_assert("Largest half float is wrong.", halfToFloat(floatToHalf(65504.0f)) == 65504.0f);
+    mu_assert("Smallest half float is wrong.", halfToFloat(floatToHalf(5.9604645e-8f)) == 5.9604645e-8f);
+    mu_assert("Overflow should be infinite.", isinf(halfToFloat(floatToHalf(1.0e6f))));
+    mu_assert("Ties should round to even.", halfToFloat(floatToHalf(1.0f + 1.0f / 2048)) == 1.0f);
+    for (int i = 0; i < 100000; i++) {
+        float value = (float) randomDouble(-100, 100);
+        float error = fabsf(halfToFloat(floatToHalf(value)) - value);
+        //half a unit in the last place, which is fixed (2^-25) for subnormals
+        mu_assert("Half float rounding error too big.", error <= fmaxf(ldexpf(fabsf(value), -11), ldexpf(1.0f, -25)));
+    }
+
+    //lookups, relative to the biggest field in the map
+    int n = 100000;
+    double maxField = testFieldPtr->metricsPtr->maxFieldMagnitude;
+    double tolerances[] = {0, 1.0e-3 * maxField, 1.0e-4 * maxField};
+
+    double *x = (double *) malloc(3 * n * sizeof(double));
+    double *y = x + n;
+    double *z = y + n;
+    FieldValuePtr reference = (FieldValuePtr) malloc(2 * n * sizeof(FieldValue));
+    FieldValuePtr compact = reference + n;
+
+    for (int i = 0; i < n; i++) {
+        double phi = randomDouble(0, 360);
+        double rho = randomDouble(testFieldPtr->rhoGridPtr->minVal, testFieldPtr->rhoGridPtr->maxVal);
+        z[i] = randomDouble(testFieldPtr->zGridPtr->minVal, testFieldPtr->zGridPtr->maxVal);
+        cylindricalToCartesian(x + i, y + i, phi, rho);
+    }
+    interpolatedValues(testFieldPtr, x, y, z, n, reference);
+
+    for (int precision = FLOAT16; precision <= SCALED_INT16; precision++) {
+        mu_assert("Could not add compact values.", addCompactValues(testFieldPtr, (StoragePrecision) precision));
+        interpolatedValues(testFieldPtr, x, y, z, n, compact);
+
+        for (int i = 0; i < n; i++) {
+            bool result = (fabs(compact[i].b1 - reference[i].b1) <= tolerances[precision]) &&
+                          (fabs(compact[i].b2 - reference[i].b2) <= tolerances[precision]) &&
+                          (fabs(compact[i].b3 - reference[i].b3) <= tolerances[precision]);
+            if (!result) {
+                fprintf(stderr, "%s mismatch at (%-9.3f, %-9.3f, %-9.3f)\n",
+                        precisionLabels[precision], x[i], y[i], z[i]);
+            }
+            mu_assert("Compact value differs too much from the float value.", result);
+        }
+        removeCompactValues(testFieldPtr);
+    }
+
+    //a copy of the test field, converted so that the floats are released
+    FieldMapHeaderPtr headerPtr = (FieldMapHeaderPtr) malloc(sizeof(FieldMapHeader));
+    *headerPtr = *(testFieldPtr->headerPtr);
+    FieldValuePtr fieldValues = (FieldValuePtr) malloc(testFieldPtr->numValues * sizeof(FieldValue));
+    memcpy(fieldValues, testFieldPtr->fieldValues, testFieldPtr->numValues * sizeof(FieldValue));
+    MagneticFieldPtr copyPtr = createFieldFromData(headerPtr, fieldValues, testFieldPtr->path);
+
+    mu_assert("Could not convert to SCALED_INT16.", setFieldPrecision(copyPtr, SCALED_INT16));
+    mu_assert("Float values should be released.", copyPtr->fieldValues == NULL);
+    mu_assert("Wrong precision.", getFieldPrecision(copyPtr) == SCALED_INT16);
+    mu_assert("getFieldAtIndex should refuse compact storage.", getFieldAtIndex(copyPtr, 0) == NULL);
+
+    mu_assert("Could not convert to FLOAT16.", setFieldPrecision(copyPtr, FLOAT16));
+    interpolatedValues(copyPtr, x, y, z, n, compact);
+    for (int i = 0; i < n; i++) {
+        //decoded from SCALED_INT16 then encoded as FLOAT16
+        double tolerance = tolerances[SCALED_INT16] + tolerances[FLOAT16];
+        bool result = (fabs(compact[i].b1 - reference[i].b1) <= tolerance) &&
+                      (fabs(compact[i].b2 - reference[i].b2) <= tolerance) &&
+                      (fabs(compact[i].b3 - reference[i].b3) <= tolerance);
+        mu_assert("Converted field differs too much from the float value.", result);
+    }
+
+    mu_assert("Could not convert to FLOAT32.", setFieldPrecision(copyPtr, FLOAT32));
+    mu_assert("Float values should be restored.", copyPtr->fieldValues != NULL);
+    mu_assert("Compact values should be released.", copyPtr->compactValues == NULL);
+
+    freeFieldMap(copyPtr);
+    free(reference);
+    free(x);
+
+    fprintf(stdout, "\nPASSED compactUnitTest\n");
+    return NULL;
+}
@@ -0,0 +1,458 @@
+//
+//  magfieldgrad.c
+//  cMag
+//  The field and its gradient in one pass. The interpolating function is
+//  tri-linear (bi-linear for the solenoid) in the map coordinates (phi, rho, z),
+//  so its partial derivatives come from the same cell corners as the field.
+//  They are then carried through the symmetric torus flip and sector rotation,
+//  or the solenoid phi rotation, and the chain rule to Cartesian coordinates.
+//  The gradient is that of the interpolating function regardless of the
+//  field's algorithm (nearest neighbor has no useful gradient).
+//
+
+#include "magfieldgrad.h"
+#include "magfieldio.h"
+#include "magfieldutil.h"
+#include "munittest.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+//degrees per radian, phi in the maps is in degrees
+#define DEGPERRAD (180.0 / M_PI)
+
+//closer than this (cm) to the axis, derivatives with respect to phi are not used
+#define RHOTINY 1.0e-8
+
+//local prototypes
+static void torusCellGradient(double, double, double, Cell3DPtr, double *, double *, double *, double *);
+static void solenoidCellGradient(double, double, Cell2DPtr, double *, double *, double *);
+static void unfoldVector(double *, bool, int);
+static void torusGradient(FieldGradientPtr, double, double, double, double, FieldProbePtr);
+static void solenoidGradient(FieldGradientPtr, double, double, double, double, FieldProbePtr);
+static void zeroGradient(FieldGradientPtr);
+
+/**
+ * Set the field and gradient to zero.
+ * @param gradientPtr the gradient.
+ */
+static void zeroGradient(FieldGradientPtr gradientPtr) {
+    memset(gradientPtr, 0, sizeof(FieldGradient));
+}
+
+/**
+ * Tri-linear interpolation of the field, and its partial derivatives, in a torus cell.
+ * @param phi the phi coordinate of the map in degrees.
+ * @param rho the rho coordinate in cm.
+ * @param z the z coordinate in cm.
+ * @param cell the cell of the probe.
+ * @param b upon return the field in the (Cartesian) components of the map.
+ * @param dPhi upon return dB/dphi in kG/degree.
+ * @param dRho upon return dB/drho in kG/cm.
+ * @param dZ upon return dB/dz in kG/cm.
+ */
+static void torusCellGradient(double phi, double rho, double z, Cell3DPtr cell,
+                              double *b, double *dPhi, double *dRho, double *dZ) {
+
+    if (!containedInCell3D(cell, phi, rho, z)) {
+        resetCell3D(cell, phi, rho, z);
+    }
+
+    double f0 = (phi - cell->phiMin) * cell->phiNorm;
+    double f1 = (rho - cell->rhoMin) * cell->rhoNorm;
+    double f2 = (z - cell->zMin) * cell->zNorm;
+
+    //weights of the low and high corners, and their derivatives
+    double w0[2] = {1 - f0, f0};
+    double w1[2] = {1 - f1, f1};
+    double w2[2] = {1 - f2, f2};
+    double d0[2] = {-cell->phiNorm, cell->phiNorm};
+    double d1[2] = {-cell->rhoNorm, cell->rhoNorm};
+    double d2[2] = {-cell->zNorm, cell->zNorm};
+
+    for (int n = 0; n < 3; n++) {
+        b[n] = dPhi[n] = dRho[n] = dZ[n] = 0;
+    }
+
+    for (int i = 0; i < 2; i++) {
+        for (int j = 0; j < 2; j++) {
+            for (int k = 0; k < 2; k++) {
+                FieldValuePtr corner = cell->b[i][j][k];
+                double v[3] = {corner->b1, corner->b2, corner->b3};
+                double a = w0[i] * w1[j] * w2[k];
+                double aPhi = d0[i] * w1[j] * w2[k];
+                double aRho = w0[i] * d1[j] * w2[k];
+                double aZ = w0[i] * w1[j] * d2[k];
+
+                for (int n = 0; n < 3; n++) {
+                    b[n] += a * v[n];
+                    dPhi[n] += aPhi * v[n];
+                    dRho[n] += aRho * v[n];
+                    dZ[n] += aZ * v[n];
+                }
+            }
+        }
+    }
+}
+
+/**
+ * Bi-linear interpolation of Brho and Bz, and their partial derivatives, in a solenoid cell.
+ * @param rho the rho coordinate in cm.
+ * @param z the z coordinate in cm.
+ * @param cell the cell of the probe.
+ * @param b upon return (Brho, Bz) in kG.
+ * @param dRho upon return d(Brho, Bz)/drho in kG/cm.
+ * @param dZ upon return d(Brho, Bz)/dz in kG/cm.
+ */
+static void solenoidCellGradient(double rho, double z, Cell2DPtr cell,
+                                 double *b, double *dRho, double *dZ) {
+
+    if (!containedInCell2D(cell, rho, z)) {
+        resetCell2D(cell, rho, z);
+    }
+
+    double f1 = (rho - cell->rhoMin) * cell->rhoNorm;
+    double f2 = (z - cell->zMin) * cell->zNorm;
+
+    double w1[2] = {1 - f1, f1};
+    double w2[2] = {1 - f2, f2};
+    double d1[2] = {-cell->rhoNorm, cell->rhoNorm};
+    double d2[2] = {-cell->zNorm, cell->zNorm};
+
+    for (int n = 0; n < 2; n++) {
+        b[n] = dRho[n] = dZ[n] = 0;
+    }
+
+    for (int j = 0; j < 2; j++) {
+        for (int k = 0; k < 2; k++) {
+            FieldValuePtr corner = cell->b[j][k];
+            double v[2] = {corner->b2, corner->b3};
+            for (int n = 0; n < 2; n++) {
+                b[n] += w1[j] * w2[k] * v[n];
+                dRho[n] += d1[j] * w2[k] * v[n];
+                dZ[n] += w1[j] * d2[k] * v[n];
+            }
+        }
+    }
+}
+
+/**
+ * Take a vector from the symmetric torus map into the actual sector: the
+ * same flip and rotation as for the field itself.
+ * @param v the vector, modified in place.
+ * @param flip if true, flip the x and z components.
+ * @param sector the sector [1..6].
+ */
+static void unfoldVector(double *v, bool flip, int sector) {
+    if (flip) {
+        v[0] = -v[0];
+        v[2] = -v[2];
+    }
+
+    if (sector > 1) {
+        double cos = cosSect[sector];
+        double sin = sinSect[sector];
+        double vx = v[0];
+        double vy = v[1];
+        v[0] = vx * cos - vy * sin;
+        v[1] = vx * sin + vy * cos;
+    }
+}
+
+/**
+ * The field and gradient of a torus (symmetric or full).
+ * @param gradientPtr upon return the (unscaled) field and gradient.
+ * @param x the x coordinate in cm, relative to the field's origin.
+ * @param y the y coordinate in cm, relative to the field's origin.
+ * @param rho the rho coordinate in cm (already checked to be within the map).
+ * @param z the z coordinate in cm, relative to the field's origin.
+ * @param probePtr a pointer to a probe for the torus field map.
+ */
+static void torusGradient(FieldGradientPtr gradientPtr, double x, double y, double rho, double z,
+                          FieldProbePtr probePtr) {
+
+    MagneticFieldPtr fieldPtr = probePtr->fieldPtr;
+    double dPhi[3], dRho[3], dZ[3];
+
+    if (fieldPtr->symmetric) {
+        //the map is at |relative phi|, so d/dphi picks up its sign
+        double relPhi;
+        int sector;
+        sectorFold(x, y, &relPhi, &sector);
+        bool flip = (relPhi < 0.0);
+
+        torusCellGradient(fabs(relPhi), rho, z, probePtr->cell3DPtr, gradientPtr->b, dPhi, dRho, dZ);
+
+        for (int n = 0; n < 3; n++) {
+            dPhi[n] = flip ? -dPhi[n] : dPhi[n];
+        }
+
+        unfoldVector(gradientPtr->b, flip, sector);
+        unfoldVector(dPhi, flip, sector);
+        unfoldVector(dRho, flip, sector);
+        unfoldVector(dZ, flip, sector);
+    }
+    else {
+        double phi = toDegrees(atan2(y, x));
+        if (phi < 0) {
+            phi += 360;
+        }
+        torusCellGradient(phi, rho, z, probePtr->cell3DPtr, gradientPtr->b, dPhi, dRho, dZ);
+    }
+
+    //chain rule, phi (degrees) and rho as functions of x and y
+    double dPhidx = 0, dPhidy = 0, dRhodx = 0, dRhody = 0;
+    if (rho > RHOTINY) {
+        double rho2 = rho * rho;
+        dPhidx = -DEGPERRAD * y / rho2;
+        dPhidy = DEGPERRAD * x / rho2;
+        dRhodx = x / rho;
+        dRhody = y / rho;
+    }
+
+    for (int n = 0; n < 3; n++) {
+        gradientPtr->dB[n][0] = dPhi[n] * dPhidx + dRho[n] * dRhodx;
+        gradientPtr->dB[n][1] = dPhi[n] * dPhidy + dRho[n] * dRhody;
+        gradientPtr->dB[n][2] = dZ[n];
+    }
+}
+
+/**
+ * The field and gradient of a solenoid, whose map holds (0, Brho, Bz) as
+ * functions of rho and z. With c = x/rho and s = y/rho, Bx = Brho c and By = Brho s.
+ * Parameters are as for torusGradient.
+ */
+static void solenoidGradient(FieldGradientPtr gradientPtr, double x, double y, double rho, double z,
+                             FieldProbePtr probePtr) {
+
+    double b[2], dRho[2], dZ[2];
+    solenoidCellGradient(rho, z, probePtr->cell2DPtr, b, dRho, dZ);
+
+    double bRho = b[0];
+    double (*dB)[3] = gradientPtr->dB;
+
+    if (rho < RHOTINY) {
+        //on the axis Brho vanishes linearly, so Bx = k x and By = k y
+        double k = dRho[0];
+        gradientPtr->b[0] = 0;
+        gradientPtr->b[1] = 0;
+        gradientPtr->b[2] = b[1];
+
+        dB[0][0] = k;
+        dB[0][1] = 0;
+        dB[0][2] = 0;
+        dB[1][0] = 0;
+        dB[1][1] = k;
+        dB[1][2] = 0;
+        dB[2][0] = 0;
+        dB[2][1] = 0;
+        dB[2][2] = dZ[1];
+        return;
+    }
+
+    double c = x / rho;
+    double s = y / rho;
+    double bOverRho = bRho / rho;
+
+    gradientPtr->b[0] = bRho * c;
+    gradientPtr->b[1] = bRho * s;
+    gradientPtr->b[2] = b[1];
+
+    //d(x/rho)/dx = s^2/rho, d(x/rho)/dy = d(y/rho)/dx = -cs/rho, d(y/rho)/dy = c^2/rho
+    dB[0][0] = dRho[0] * c * c + bOverRho * s * s;
+    dB[0][1] = dRho[0] * c * s - bOverRho * c * s;
+    dB[0][2] = dZ[0] * c;
+    dB[1][0] = dRho[0] * s * c - bOverRho * c * s;
+    dB[1][1] = dRho[0] * s * s + bOverRho * c * c;
+    dB[1][2] = dZ[0] * s;
+    dB[2][0] = dRho[1] * c;
+    dB[2][1] = dRho[1] * s;
+    dB[2][2] = dZ[1];
+}
+
+/**
+ * Obtain the field and its gradient using the default probe of the field.
+ * This is not thread safe; multithreaded code should use getFieldGradientProbe.
+ * @param gradientPtr upon return holds the field in kG and its gradient in kG/cm,
+ * in Cartesian components. Both are zero outside the map.
+ * @param x the x coordinate in cm.
+ * @param y the y coordinate in cm.
+ * @param z the z coordinate in cm.
+ * @param fieldPtr a pointer to the field map.
+ */
+void getFieldGradient(FieldGradientPtr gradientPtr, double x, double y, double z, MagneticFieldPtr fieldPtr) {
+    getFieldGradientProbe(gradientPtr, x, y, z, fieldPtr->probePtr);
+}
+
+/**
+ * Obtain the field and its gradient, from the same interpolation cell, in one pass.
+ * This replaces the six extra lookups of a finite difference gradient.
+ * @param gradientPtr upon return holds the field in kG and its gradient in kG/cm,
+ * in Cartesian components. Both are zero outside the map.
+ * @param x the x coordinate in cm.
+ * @param y the y coordinate in cm.
+ * @param z the z coordinate in cm.
+ * @param probePtr a pointer to a probe created (by createProbe) for the field map.
+ */
+void getFieldGradientProbe(FieldGradientPtr gradientPtr, double x, double y, double z, FieldProbePtr probePtr) {
+
+    MagneticFieldPtr fieldPtr = probePtr->fieldPtr;
+
+    //shifts move the field, they do not change its derivatives
+    x -= fieldPtr->shiftX;
+    y -= fieldPtr->shiftY;
+    z -= fieldPtr->shiftZ;
+
+    double rho = hypot(x, y);
+
+    if (!containsCylindrical(fieldPtr, rho, z)) {
+        zeroGradient(gradientPtr);
+        return;
+    }
+
+    if (fieldPtr->type == TORUS) {
+        torusGradient(gradientPtr, x, y, rho, z, probePtr);
+    }
+    else {
+        solenoidGradient(gradientPtr, x, y, rho, z, probePtr);
+    }
+
+    //scale the field and gradient
+    double scale = fieldPtr->scale;
+    for (int i = 0; i < 3; i++) {
+        gradientPtr->b[i] *= scale;
+        for (int j = 0; j < 3; j++) {
+            gradientPtr->dB[i][j] *= scale;
+        }
+    }
+}
+
+/**
+ * Obtain the combined field of two maps and its gradient, using their default probes.
+ * @param gradientPtr upon return holds the field in kG and its gradient in kG/cm.
+ * @param x the x coordinate in cm.
+ * @param y the y coordinate in cm.
+ * @param z the z coordinate in cm.
+ * @param field1 the first field (can be NULL).
+ * @param field2 the second field (can be NULL).
+ */
+void getCompositeFieldGradient(FieldGradientPtr gradientPtr, double x, double y, double z,
+                               MagneticFieldPtr field1, MagneticFieldPtr field2) {
+    getCompositeFieldGradientProbe(gradientPtr, x, y, z,
+                                   (field1 == NULL) ? NULL : field1->probePtr,
+                                   (field2 == NULL) ? NULL : field2->probePtr);
+}
+
+/**
+ * Obtain the combined field of two maps and its gradient, with caller owned probes.
+ * @param gradientPtr upon return holds the field in kG and its gradient in kG/cm.
+ * @param x the x coordinate in cm.
+ * @param y the y coordinate in cm.
+ * @param z the z coordinate in cm.
+ * @param probe1 a probe for the first field (can be NULL).
+ * @param probe2 a probe for the second field (can be NULL).
+ */
+void getCompositeFieldGradientProbe(FieldGradientPtr gradientPtr, double x, double y, double z,
+                                    FieldProbePtr probe1, FieldProbePtr probe2) {
+    FieldGradient temp;
+
+    zeroGradient(gradientPtr);
+
+    if (probe1 != NULL) {
+        getFieldGradientProbe(gradientPtr, x, y, z, probe1);
+    }
+    if (probe2 != NULL) {
+        getFieldGradientProbe(&temp, x, y, z, probe2);
+        for (int i = 0; i < 3; i++) {
+            gradientPtr->b[i] += temp.b[i];
+            for (int j = 0; j < 3; j++) {
+                gradientPtr->dB[i][j] += temp.dB[i][j];
+            }
+        }
+    }
+}
+
+/**
+ * A unit test for the gradient. The field must match getFieldValue, and the
+ * gradient must match central differences. The points are kept away from
+ * the cell boundaries (where the interpolating function has kinks) and
+ * from the axis.
+ * @return an error message if the test fails, or NULL if it passes.
+ */
+char *gradientUnitTest() {
+
+    int n = 20000;
+    double h = 1.0e-4; //cm
+    double maxField = testFieldPtr->metricsPtr->maxFieldMagnitude * fabs(testFieldPtr->scale);
+
+    GridPtr phiGrid = testFieldPtr->phiGridPtr;
+    GridPtr rhoGrid = testFieldPtr->rhoGridPtr;
+    GridPtr zGrid = testFieldPtr->zGridPtr;
+
+    FieldProbePtr probePtr = createProbe(testFieldPtr);
+    FieldGradient grad, plus, minus;
+    FieldValue fv;
+
+    Algorithm algorithm = getFieldAlgorithm(testFieldPtr);
+    setFieldAlgorithm(testFieldPtr, INTERPOLATION);
+
+    double maxDiff = 0;
+
+    for (int i = 0; i < n; i++) {
+
+        //map coordinates in the interior of a cell
+        double rho = rhoGrid->values[randomInt(1, rhoGrid->numPoints - 2)] + randomDouble(0.1, 0.9) * rhoGrid->delta;
+        double z = zGrid->values[randomInt(0, zGrid->numPoints - 2)] + randomDouble(0.1, 0.9) * zGrid->delta;
+        double phi;
+
+        if (testFieldPtr->type == SOLENOID) {
+            phi = randomDouble(0, 360);
+        }
+        else {
+            phi = phiGrid->values[randomInt(0, phiGrid->numPoints - 2)] + randomDouble(0.1, 0.9) * phiGrid->delta;
+            if (testFieldPtr->symmetric) {
+                //into a random sector, on either side of its middle
+                phi = 60.0 * randomInt(0, 5) + ((randomInt(0, 1) == 0) ? phi : -phi);
+            }
+        }
+
+        double x, y;
+        cylindricalToCartesian(&x, &y, phi, rho);
+
+        getFieldGradientProbe(&grad, x, y, z, probePtr);
+        getFieldValue(&fv, x, y, z, testFieldPtr);
+
+        double fieldTolerance = 1.0e-5 * maxField;
+        bool result = (fabs(grad.b[0] - fv.b1) <= fieldTolerance) &&
+                      (fabs(grad.b[1] - fv.b2) <= fieldTolerance) &&
+                      (fabs(grad.b[2] - fv.b3) <= fieldTolerance);
+        mu_assert("The gradient's field did not match getFieldValue.", result);
+
+        for (int j = 0; j < 3; j++) {
+            double dx = (j == 0) ? h : 0;
+            double dy = (j == 1) ? h : 0;
+            double dz = (j == 2) ? h : 0;
+            getFieldGradientProbe(&plus, x + dx, y + dy, z + dz, probePtr);
+            getFieldGradientProbe(&minus, x - dx, y - dy, z - dz, probePtr);
+
+            for (int k = 0; k < 3; k++) {
+                double numeric = (plus.b[k] - minus.b[k]) / (2 * h);
+                double diff = fabs(grad.dB[k][j] - numeric);
+                maxDiff = max(maxDiff, diff);
+
+                result = (diff <= 1.0e-6 * maxField + 1.0e-4 * fabs(numeric));
+                if (!result) {
+                    fprintf(stderr, "Gradient mismatch dB%d/dx%d at (%-9.3f, %-9.3f, %-9.3f): %g vs %g\n",
+                            k, j, x, y, z, grad.dB[k][j], numeric);
+                }
+                mu_assert("The gradient did not match the finite difference.", result);
+            }
+        }
+    }
+
+    setFieldAlgorithm(testFieldPtr, algorithm);
+    freeProbe(probePtr);
+
+    fprintf(stdout, "\nPASSED gradientUnitTest (max difference %-9.3e kG/cm)\n", maxDiff);
+    return NULL;
+}
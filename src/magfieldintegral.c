@@ -0,0 +1,593 @@
+//
+//  magfieldintegral.c
+//  cMag
+//  Integrals of the field along straight lines. The line is cut where it
+//  crosses the grid planes and cylinders of each map (and its edges), so
+//  that within a panel each map is a single smooth interpolant and a few
+//  Gauss-Legendre points integrate it, exactly for lines at constant phi.
+//  Panels outside a map skip its lookups. For many lines from the target
+//  at fixed scales and shifts, a (theta, phi) table of the integrals
+//  replaces the quadrature with a bilinear interpolation.
+//
+
+#include "magfieldintegral.h"
+#include "magfieldio.h"
+#include "magfieldutil.h"
+#include "magfieldpool.h"
+#include "munittest.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+//a growing list of path lengths where the line crosses a grid surface
+typedef struct breaklist {
+    double *s;
+    int count;
+    int capacity;
+} BreakList;
+
+//what the workers of createIntegralTable share
+typedef struct integralbuildcontext {
+    FieldProbePtr *torusProbes;    //one per worker, NULL if no torus
+    FieldProbePtr *solenoidProbes; //one per worker, NULL if no solenoid
+    IntegralTablePtr table;
+} IntegralBuildContext;
+
+//Gauss-Legendre abscissas and weights on [-1, 1], for 1 to 4 points
+static const double gaussAbscissas[4][4] = {
+    {0},
+    {-0.5773502691896257645, 0.5773502691896257645},
+    {-0.7745966692414833770, 0, 0.7745966692414833770},
+    {-0.8611363115940525752, -0.3399810435848562648, 0.3399810435848562648, 0.8611363115940525752}
+};
+static const double gaussWeights[4][4] = {
+    {2},
+    {1, 1},
+    {0.5555555555555555556, 0.8888888888888888889, 0.5555555555555555556},
+    {0.3478548451374538574, 0.6521451548625461426, 0.6521451548625461426, 0.3478548451374538574}
+};
+
+//local prototypes
+static void addBreak(BreakList *, double, double);
+static bool useGridLine(int, int, int);
+static int gridStride(GridPtr, double);
+static void addGridBreaks(MagneticFieldPtr, const SwimPoint *, double, double, BreakList *);
+static bool panelInMap(MagneticFieldPtr, const SwimPoint *, double);
+static void integralWork(void *, int, int);
+static void setTransverse(FieldIntegralPtr, double, double, double);
+
+/**
+ * Add a path length to a break list if it is strictly inside the line.
+ * @param list the list.
+ * @param s the path length in cm.
+ * @param length the length of the line in cm.
+ */
+static void addBreak(BreakList *list, double s, double length) {
+    if (!(s > TINY) || !(s < length - TINY)) {
+        return;
+    }
+
+    if (list->count == list->capacity) {
+        list->capacity = 2 * list->capacity + 64;
+        list->s = (double *) realloc(list->s, list->capacity * sizeof(double));
+    }
+    list->s[list->count++] = s;
+}
+
+/**
+ * Whether a grid line is a panel boundary. The edges of the map always are.
+ * @param index the index of the grid line.
+ * @param numPoints the number of grid lines.
+ * @param stride every stride-th line is used.
+ * @return true if it is.
+ */
+static bool useGridLine(int index, int numPoints, int stride) {
+    return (index % stride == 0) || (index == numPoints - 1);
+}
+
+/**
+ * How many cells of a grid a panel may span.
+ * @param gridPtr the grid.
+ * @param panel the longest panel in cm, 0 for one cell.
+ * @return the stride of the grid lines used, at least 1.
+ */
+static int gridStride(GridPtr gridPtr, double panel) {
+    if ((panel <= 0) || (gridPtr->delta <= 0)) {
+        return 1;
+    }
+    return (int) max(1, floor(panel / gridPtr->delta + TINY));
+}
+
+/**
+ * Add where a line crosses the z planes, the rho cylinders and (for a
+ * torus) the phi half planes of a map's grid. In a symmetric torus the phi
+ * planes are folded into each sector, on both sides of its midplane.
+ * @param fieldPtr the map.
+ * @param start the start and direction of the line, in the lab.
+ * @param length the length of the line in cm.
+ * @param panel the longest panel in cm, 0 for one cell.
+ * @param list the list to add to.
+ */
+static void addGridBreaks(MagneticFieldPtr fieldPtr, const SwimPoint *start, double length, double panel,
+                          BreakList *list) {
+    double x0 = start->x - fieldPtr->shiftX;
+    double y0 = start->y - fieldPtr->shiftY;
+    double z0 = start->z - fieldPtr->shiftZ;
+
+    //z planes
+    GridPtr zGrid = fieldPtr->zGridPtr;
+    if ((fabs(start->tz) > TINY) && (zGrid->numPoints > 1)) {
+        int stride = gridStride(zGrid, panel);
+        double zLo = min(z0, z0 + length * start->tz);
+        double zHi = max(z0, z0 + length * start->tz);
+        int first = (int) max(0, ceil((zLo - zGrid->minVal) / zGrid->delta));
+        int last = (int) min(zGrid->numPoints - 1, floor((zHi - zGrid->minVal) / zGrid->delta));
+        for (int k = first; k <= last; k++) {
+            if (useGridLine(k, zGrid->numPoints, stride)) {
+                addBreak(list, (zGrid->values[k] - z0) / start->tz, length);
+            }
+        }
+    }
+
+    //rho cylinders, rho^2 = a s^2 + 2 b s + c
+    GridPtr rhoGrid = fieldPtr->rhoGridPtr;
+    double a = start->tx * start->tx + start->ty * start->ty;
+    double b = x0 * start->tx + y0 * start->ty;
+    double c = x0 * x0 + y0 * y0;
+    if ((a > TINY) && (rhoGrid->numPoints > 1)) {
+        int stride = gridStride(rhoGrid, panel);
+        double sClosest = max(0, min(length, -b / a));
+        double rhoLo = sqrt(max(0, c + sClosest * (2 * b + a * sClosest)));
+        double rhoHi = sqrt(max(c, c + length * (2 * b + a * length)));
+        int first = (int) max(0, ceil((rhoLo - rhoGrid->minVal) / rhoGrid->delta));
+        int last = (int) min(rhoGrid->numPoints - 1, floor((rhoHi - rhoGrid->minVal) / rhoGrid->delta));
+        for (int k = first; k <= last; k++) {
+            if (!useGridLine(k, rhoGrid->numPoints, stride)) {
+                continue;
+            }
+            double r = rhoGrid->values[k];
+            double disc = b * b - a * (c - r * r);
+            if (disc >= 0) {
+                addBreak(list, (-b - sqrt(disc)) / a, length);
+                addBreak(list, (-b + sqrt(disc)) / a, length);
+            }
+        }
+    }
+
+    //phi half planes, only crossed by lines that miss the axis
+    GridPtr phiGrid = fieldPtr->phiGridPtr;
+    if ((fieldPtr->type != TORUS) || (fabs(x0 * start->ty - y0 * start->tx) < TINY * sqrt(max(a, TINY)))) {
+        return;
+    }
+
+    int numFolds = fieldPtr->symmetric ? 12 : 1;
+    for (int fold = 0; fold < numFolds; fold++) {
+        for (int k = 0; k < (int) phiGrid->numPoints; k++) {
+            double phi = phiGrid->values[k];
+            if (fieldPtr->symmetric) {
+                phi = 60.0 * (fold / 2) + ((fold % 2 == 0) ? phi : -phi);
+            }
+            double cosPhi = cos(toRadians(phi));
+            double sinPhi = sin(toRadians(phi));
+
+            double denom = start->tx * sinPhi - start->ty * cosPhi;
+            if (fabs(denom) < TINY) {
+                continue;
+            }
+            double s = (y0 * cosPhi - x0 * sinPhi) / denom;
+            if ((x0 + s * start->tx) * cosPhi + (y0 + s * start->ty) * sinPhi > 0) {
+                addBreak(list, s, length);
+            }
+        }
+    }
+}
+
+/**
+ * Whether a panel is inside a map. Since the edges of the map are panel
+ * boundaries, a panel is either all inside or all outside, so its middle decides.
+ * @param fieldPtr the map.
+ * @param start the start and direction of the line, in the lab.
+ * @param s the path length of the middle of the panel in cm.
+ * @return true if the panel is inside.
+ */
+static bool panelInMap(MagneticFieldPtr fieldPtr, const SwimPoint *start, double s) {
+    double x = start->x + s * start->tx - fieldPtr->shiftX;
+    double y = start->y + s * start->ty - fieldPtr->shiftY;
+    double z = start->z + s * start->tz - fieldPtr->shiftZ;
+    return containsCylindrical(fieldPtr, hypot(x, y), z);
+}
+
+/**
+ * Set the transverse integral from the integral of the field and the direction.
+ * @param integral the integral, with bdl set.
+ * @param tx the x direction cosine.
+ * @param ty the y direction cosine.
+ * @param tz the z direction cosine.
+ */
+static void setTransverse(FieldIntegralPtr integral, double tx, double ty, double tz) {
+    double *bdl = integral->bdl;
+    double kx = ty * bdl[2] - tz * bdl[1];
+    double ky = tz * bdl[0] - tx * bdl[2];
+    double kz = tx * bdl[1] - ty * bdl[0];
+    integral->transverse = sqrt(kx * kx + ky * ky + kz * kz);
+}
+
+/**
+ * Integrate the field along a straight line. The line is cut into panels
+ * at the grid surfaces of the maps (see addGridBreaks), each integrated with
+ * INTEGRALGAUSSPOINTS Gauss-Legendre points, only in the maps it is inside.
+ * With panel = 0 a panel never spans more than one cell, and the integral
+ * of the interpolated field along lines at constant phi (such as lines from
+ * the axis of unshifted maps) is exact. Fine grids, like the solenoid's,
+ * can instead be integrated with panels of a few cells, trading accuracy
+ * for fewer lookups.
+ * @param torusProbe a probe for the torus (can be NULL).
+ * @param solenoidProbe a probe for the solenoid (can be NULL).
+ * @param start the start point and direction of the line.
+ * @param length the length of the line in cm.
+ * @param panel the longest panel in cm, 0 for one cell.
+ * @param integral upon return the integral.
+ */
+void fieldIntegral(FieldProbePtr torusProbe, FieldProbePtr solenoidProbe, const SwimPoint *start, double length,
+                   double panel, FieldIntegralPtr integral) {
+    memset(integral, 0, sizeof(FieldIntegral));
+
+    FieldProbePtr probes[2] = {torusProbe, solenoidProbe};
+    BreakList list = {NULL, 0, 0};
+    for (int i = 0; i < 2; i++) {
+        if (probes[i] != NULL) {
+            addGridBreaks(probes[i]->fieldPtr, start, length, panel, &list);
+        }
+    }
+    if (list.count > 1) {
+        sortArray(list.s, list.count);
+    }
+
+    const double *abscissas = gaussAbscissas[INTEGRALGAUSSPOINTS - 1];
+    const double *weights = gaussWeights[INTEGRALGAUSSPOINTS - 1];
+    FieldValue fv;
+
+    double sLo = 0;
+    for (int i = 0; i <= list.count; i++) {
+        double sHi = (i < list.count) ? list.s[i] : length;
+        double half = 0.5 * (sHi - sLo);
+        double middle = sLo + half;
+        sLo = sHi;
+        if (half < TINY) {
+            continue;
+        }
+
+        for (int m = 0; m < 2; m++) {
+            if ((probes[m] == NULL) || !panelInMap(probes[m]->fieldPtr, start, middle)) {
+                continue;
+            }
+
+            for (int j = 0; j < INTEGRALGAUSSPOINTS; j++) {
+                double s = middle + half * abscissas[j];
+                getFieldValueProbe(&fv, start->x + s * start->tx, start->y + s * start->ty,
+                                   start->z + s * start->tz, probes[m]);
+                integral->numEvaluations++;
+
+                double w = half * weights[j];
+                integral->bdl[0] += w * fv.b1;
+                integral->bdl[1] += w * fv.b2;
+                integral->bdl[2] += w * fv.b3;
+            }
+        }
+    }
+
+    free(list.s);
+    setTransverse(integral, start->tx, start->ty, start->tz);
+}
+
+/**
+ * Work function for createIntegralTable: integrate along the line of one node.
+ * @param context the IntegralBuildContext.
+ * @param worker the worker.
+ * @param index the node.
+ */
+static void integralWork(void *context, int worker, int index) {
+    IntegralBuildContext *bc = (IntegralBuildContext *) context;
+    IntegralTablePtr table = bc->table;
+
+    int iPhi = index % table->phi.numPoints;
+    int iTheta = index / table->phi.numPoints;
+
+    SwimPoint start;
+    initSwimPoint(&start, 0, 0, table->vertexZ, tableAxisValue(&(table->theta), iTheta),
+                  tableAxisValue(&(table->phi), iPhi));
+
+    FieldIntegral integral;
+    fieldIntegral((bc->torusProbes == NULL) ? NULL : bc->torusProbes[worker],
+                  (bc->solenoidProbes == NULL) ? NULL : bc->solenoidProbes[worker],
+                  &start, table->length, 0, &integral);
+
+    for (int i = 0; i < 3; i++) {
+        table->bdl[3 * index + i] = (float) integral.bdl[i];
+    }
+}
+
+/**
+ * Create a table of the field integrals along lines from (0, 0, vertex z),
+ * with the current scales and shifts of the maps. The integrals use one
+ * cell panels, so they are those of the interpolated maps. If the torus is
+ * symmetric (or absent) and neither map is shifted off the z axis, the
+ * table covers sector 1 only, phi from -30 to 30 spaced no more coarsely
+ * than the given phi axis, and lookups are rotated.
+ * @param torus the torus field (can be NULL).
+ * @param solenoid the solenoid field (can be NULL).
+ * @param theta the theta nodes in degrees.
+ * @param phi the phi nodes in degrees.
+ * @param vertexZ the z of the start of the lines in cm.
+ * @param length the length of the lines in cm.
+ * @param numThreads the number of threads, 0 (or less) for one per core.
+ * @return the table, free it with freeIntegralTable, or NULL on error.
+ */
+IntegralTablePtr createIntegralTable(MagneticFieldPtr torus, MagneticFieldPtr solenoid, const TableAxis *theta,
+                                     const TableAxis *phi, double vertexZ, double length, int numThreads) {
+    if ((theta->numPoints < 2) || (phi->numPoints < 2) || !(theta->max > theta->min) ||
+        !(phi->max > phi->min) || !(length > 0)) {
+        fprintf(stderr, "\ncMag ERROR integral tables need two or more nodes per axis and a positive length.\n");
+        return NULL;
+    }
+
+    IntegralTablePtr table = (IntegralTablePtr) calloc(1, sizeof(IntegralTable));
+    table->theta = *theta;
+    table->phi = *phi;
+    table->vertexZ = vertexZ;
+    table->length = length;
+    table->symmetric = ((torus == NULL) || (torus->symmetric && (torus->shiftX == 0) && (torus->shiftY == 0))) &&
+                       ((solenoid == NULL) || ((solenoid->shiftX == 0) && (solenoid->shiftY == 0)));
+    if (table->symmetric) {
+        sectorPhiAxis(phi, &(table->phi));
+    }
+
+    if (torus != NULL) {
+        table->torusScale = torus->scale;
+        table->torusShift[0] = torus->shiftX;
+        table->torusShift[1] = torus->shiftY;
+        table->torusShift[2] = torus->shiftZ;
+    }
+    if (solenoid != NULL) {
+        table->solenoidScale = solenoid->scale;
+        table->solenoidShift[0] = solenoid->shiftX;
+        table->solenoidShift[1] = solenoid->shiftY;
+        table->solenoidShift[2] = solenoid->shiftZ;
+    }
+
+    int n = table->theta.numPoints * table->phi.numPoints;
+    table->bdl = (float *) malloc(3 * n * sizeof(float));
+
+    numThreads = getPoolSize(numThreads, n);
+    IntegralBuildContext context;
+    context.table = table;
+    context.torusProbes = NULL;
+    context.solenoidProbes = NULL;
+    if (torus != NULL) {
+        context.torusProbes = (FieldProbePtr *) malloc(numThreads * sizeof(FieldProbePtr));
+    }
+    if (solenoid != NULL) {
+        context.solenoidProbes = (FieldProbePtr *) malloc(numThreads * sizeof(FieldProbePtr));
+    }
+    for (int i = 0; i < numThreads; i++) {
+        if (torus != NULL) {
+            context.torusProbes[i] = createProbe(torus);
+        }
+        if (solenoid != NULL) {
+            context.solenoidProbes[i] = createProbe(solenoid);
+        }
+    }
+
+    parallelFor(n, numThreads, integralWork, &context);
+
+    for (int i = 0; i < numThreads; i++) {
+        if (torus != NULL) {
+            freeProbe(context.torusProbes[i]);
+        }
+        if (solenoid != NULL) {
+            freeProbe(context.solenoidProbes[i]);
+        }
+    }
+    free(context.torusProbes);
+    free(context.solenoidProbes);
+    return table;
+}
+
+/**
+ * Free an integral table.
+ * @param table the table (can be NULL).
+ */
+void freeIntegralTable(IntegralTablePtr table) {
+    if (table != NULL) {
+        free(table->bdl);
+        free(table);
+    }
+}
+
+/**
+ * Check that the scales and shifts of the maps are still those the table
+ * was made with. If not, the table must be rebuilt.
+ * @param table the table.
+ * @param torus the torus field (can be NULL).
+ * @param solenoid the solenoid field (can be NULL).
+ * @return true if the table is current.
+ */
+bool integralTableIsCurrent(IntegralTablePtr table, MagneticFieldPtr torus, MagneticFieldPtr solenoid) {
+    double torusScale = (torus == NULL) ? 0 : torus->scale;
+    double solenoidScale = (solenoid == NULL) ? 0 : solenoid->scale;
+    if ((torusScale != table->torusScale) || (solenoidScale != table->solenoidScale)) {
+        return false;
+    }
+
+    if ((torus != NULL) && ((torus->shiftX != table->torusShift[0]) || (torus->shiftY != table->torusShift[1]) ||
+                            (torus->shiftZ != table->torusShift[2]))) {
+        return false;
+    }
+    return (solenoid == NULL) || ((solenoid->shiftX == table->solenoidShift[0]) &&
+                                  (solenoid->shiftY == table->solenoidShift[1]) &&
+                                  (solenoid->shiftZ == table->solenoidShift[2]));
+}
+
+/**
+ * Look up the field integral along the line from (0, 0, vertex z) in a
+ * direction, interpolating between the four surrounding nodes.
+ * @param table the table.
+ * @param theta the polar angle of the direction in degrees.
+ * @param phi the azimuthal angle of the direction in degrees.
+ * @param integral upon return the integral, with no lookups.
+ * @return false if the direction is outside the table.
+ */
+bool lookupFieldIntegral(IntegralTablePtr table, double theta, double phi, FieldIntegralPtr integral) {
+    double lineTheta = theta;
+    double linePhi = phi;
+
+    //rotate into sector 1 for one sector tables
+    int sector = toTableSector(table->symmetric, &(table->phi), &phi);
+
+    int iTheta, iPhi;
+    double fTheta, fPhi;
+    if (!tableAxisCell(&(table->theta), theta, &iTheta, &fTheta) ||
+        !tableAxisCell(&(table->phi), phi, &iPhi, &fPhi)) {
+        return false;
+    }
+
+    double sum[3] = {0, 0, 0};
+    for (int corner = 0; corner < 4; corner++) {
+        int dTheta = corner >> 1;
+        int dPhi = corner & 1;
+        double weight = (dTheta ? fTheta : 1 - fTheta) * (dPhi ? fPhi : 1 - fPhi);
+        const float *bdl = table->bdl + 3 * ((iTheta + dTheta) * table->phi.numPoints + iPhi + dPhi);
+        for (int i = 0; i < 3; i++) {
+            sum[i] += weight * bdl[i];
+        }
+    }
+
+    fromTableSector(sector, sum, sum + 1);
+    integral->bdl[0] = sum[0];
+    integral->bdl[1] = sum[1];
+    integral->bdl[2] = sum[2];
+    integral->numEvaluations = 0;
+
+    SwimPoint direction;
+    initSwimPoint(&direction, 0, 0, 0, lineTheta, linePhi);
+    setTransverse(integral, direction.tx, direction.ty, direction.tz);
+    return true;
+}
+
+/**
+ * Unit test for the field integrals. In a uniform field the integral is
+ * the field times the length. In the test fields the quadrature must match
+ * a fine Simpson's rule along lines from the axis and off it, and the table
+ * must reproduce the quadrature at its nodes and approximate it between them.
+ * @return NULL if all tests pass, otherwise an error message.
+ */
+char *integralUnitTest() {
+    FieldIntegral integral;
+    SwimPoint start;
+
+    //uniform field
+    MagneticFieldPtr uniform = createUniformField(10.0);
+    FieldProbePtr uniformProbe = createProbe(uniform);
+    initSwimPoint(&start, 3, -4, 5, 35, 70);
+    fieldIntegral(NULL, uniformProbe, &start, 400, 0, &integral);
+    mu_assert("Wrong integral of a uniform field.", (fabs(integral.bdl[2] - 4000.0) < 1.0e-6) &&
+              (fabs(integral.bdl[0]) < 1.0e-9) && (fabs(integral.transverse - 4000.0 * sin(toRadians(35))) < 1.0e-6));
+    freeProbe(uniformProbe);
+    freeFieldMap(uniform);
+
+    FieldProbePtr torusProbe = createProbe(testFieldPtr);
+    FieldProbePtr solenoidProbe = createProbe(testSolenoidPtr);
+    FieldValue fv;
+    double length = 800;
+    double maxRelDiff = 0;
+    double maxPanelDiff = 0;
+    long exactLookups = 0;
+    long panelLookups = 0;
+
+    for (int i = 0; i < 12; i++) {
+        //half the lines from the axis, half off it
+        double x = (i % 2 == 0) ? 0 : randomDouble(-20, 20);
+        double y = (i % 2 == 0) ? 0 : randomDouble(-20, 20);
+        initSwimPoint(&start, x, y, randomDouble(-5, 5), randomDouble(5, 40), randomDouble(0, 360));
+
+        //Simpson's rule with 0.05 cm steps
+        int n = 16000;
+        double h = length / n;
+        double reference[3] = {0, 0, 0};
+        for (int j = 0; j <= n; j++) {
+            double s = j * h;
+            double w = ((j == 0) || (j == n)) ? 1 : ((j % 2 == 1) ? 4 : 2);
+            getCompositeFieldValueProbe(&fv, start.x + s * start.tx, start.y + s * start.ty, start.z + s * start.tz,
+                                        torusProbe, solenoidProbe);
+            reference[0] += w * h / 3 * fv.b1;
+            reference[1] += w * h / 3 * fv.b2;
+            reference[2] += w * h / 3 * fv.b3;
+        }
+        double refNorm = sqrt(reference[0] * reference[0] + reference[1] * reference[1] +
+                              reference[2] * reference[2]);
+
+        fieldIntegral(torusProbe, solenoidProbe, &start, length, 0, &integral);
+        exactLookups += integral.numEvaluations;
+        double diff = sqrt(pow(integral.bdl[0] - reference[0], 2) + pow(integral.bdl[1] - reference[1], 2) +
+                           pow(integral.bdl[2] - reference[2], 2));
+        maxRelDiff = max(maxRelDiff, diff / refNorm);
+
+        fieldIntegral(torusProbe, solenoidProbe, &start, length, 2.0, &integral);
+        panelLookups += integral.numEvaluations;
+        diff = sqrt(pow(integral.bdl[0] - reference[0], 2) + pow(integral.bdl[1] - reference[1], 2) +
+                    pow(integral.bdl[2] - reference[2], 2));
+        maxPanelDiff = max(maxPanelDiff, diff / refNorm);
+    }
+    mu_assert("Quadrature and Simpson's rule disagree.", maxRelDiff < 1.0e-4);
+    mu_assert("Quadrature with longer panels is too far off.", maxPanelDiff < 1.0e-2);
+    mu_assert("Longer panels should need fewer lookups.", panelLookups < exactLookups);
+
+    //the table, at and between the nodes
+    TableAxis theta = {5.0, 40.0, 36};
+    TableAxis phi = {0.0, 360.0, 121};
+    IntegralTablePtr table = createIntegralTable(testFieldPtr, testSolenoidPtr, &theta, &phi, 0, length, 0);
+    mu_assert("Could not create the integral table.", table != NULL);
+    mu_assert("The integral table should cover one sector.", table->symmetric && (table->phi.numPoints == 21));
+    mu_assert("The integral table should be current.", integralTableIsCurrent(table, testFieldPtr, testSolenoidPtr));
+
+    FieldIntegral looked;
+    double maxNodeDiff = 0;
+    double sumTableDiff = 0;
+    int numTable = 200;
+    for (int i = 0; i < numTable; i++) {
+        bool atNode = (i < 20);
+        double t = atNode ? 5.0 + randomInt(0, 35) : randomDouble(5, 40);
+        double p = atNode ? 3.0 * randomInt(-9, 10) : randomDouble(0, 360);
+
+        initSwimPoint(&start, 0, 0, 0, t, p);
+        fieldIntegral(torusProbe, solenoidProbe, &start, length, 0, &integral);
+        mu_assert("Lookup in the integral table failed.", lookupFieldIntegral(table, t, p, &looked));
+
+        double diff = fabs(looked.transverse - integral.transverse) / max(1, integral.transverse);
+        if (atNode) {
+            maxNodeDiff = max(maxNodeDiff, diff);
+        }
+        else {
+            sumTableDiff += diff;
+        }
+    }
+    sumTableDiff /= (numTable - 20);
+    mu_assert("The integral table should reproduce the nodes.", maxNodeDiff < 1.0e-5);
+    mu_assert("The integral table is too far off between nodes.", sumTableDiff < 2.0e-2);
+    mu_assert("Lookup outside the integral table should fail.", !lookupFieldIntegral(table, 50, 0, &looked));
+
+    double scale = testSolenoidPtr->scale;
+    testSolenoidPtr->scale = 0.5 * scale;
+    bool current = integralTableIsCurrent(table, testFieldPtr, testSolenoidPtr);
+    testSolenoidPtr->scale = scale;
+    mu_assert("The integral table should not be current after a scale change.", !current);
+
+    freeIntegralTable(table);
+    freeProbe(torusProbe);
+    freeProbe(solenoidProbe);
+
+    fprintf(stdout, "\nPASSED integralUnitTest (vs Simpson %-9.3e, 2 cm panels %-9.3e with %.0f vs %.0f lookups, "
+                    "table nodes %-9.3e between %-9.3e)\n", maxRelDiff, maxPanelDiff, panelLookups / 12.0,
+            exactLookups / 12.0, maxNodeDiff, sumTableDiff);
+    return NULL;
+}
@@ -4,9 +4,15 @@
 
 #include "magfieldio.h"
 #include "magfieldutil.h"
+#include "magfieldcompact.h"
+#include "munittest.h"
 #include <stdlib.h>
 #include <time.h>
 #include <math.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <arpa/inet.h>
 
 //do we have to swap bytes?
@@ -14,13 +20,36 @@
 //new format (BigEndian) we probably will have to swap.
 static bool swapBytes = false;
 
+//the metrics stored in the padding of the native format header
+typedef struct nativemetrics {
+    unsigned int tag; //NATIVEMETRICSTAG
+    FieldMetrics metrics;
+} NativeMetrics;
+
+//map files that need no swapping into memory rather than reading them
+static bool _memoryMapping = true;
+
+//directory for native format copies of the maps, NULL if not set
+static char *_cacheDirectory = NULL;
+
 //local prototypes
 static FieldMapHeaderPtr readMapHeader(FILE *);
 static MagneticFieldPtr readField(const char *);
+static FieldValuePtr mapFieldValues(FILE *, long, size_t, void **, size_t *);
+static MagneticFieldPtr readCachedField(const char *);
+static MagneticFieldPtr createField(FieldMapHeaderPtr, FieldValuePtr, const char *, FieldMetricsPtr);
+static bool readNativeMetrics(FILE *, FieldMapHeaderPtr, FieldMetricsPtr);
+static MagneticFieldPtr applyDefaultPrecision(MagneticFieldPtr);
+static char *getCachePath(const char *, const char *);
+static long getDataOffset(FieldMapHeaderPtr);
+static unsigned int getLayoutDescriptor(void);
 static long getFileSize(FILE*);
 static void swap32(char*, int);
 static char* getCreationDate(MagneticFieldPtr);
 static void computeFieldMetrics(MagneticFieldPtr);
+static Cell3DPtr allocCell3D(MagneticFieldPtr);
+static Cell2DPtr allocCell2D(MagneticFieldPtr);
+static void resetDefaultProbe(MagneticFieldPtr);
 
 /**
  * Initialize the torus field.
@@ -42,7 +71,7 @@ MagneticFieldPtr initializeTorus(const char *torusPath) {
         fprintf(stderr, "\ncMag ERROR null torus path even after trying environment variables.\n");
         return NULL;
     }
-    return readField(torusPath);
+    return readCachedField(torusPath);
 }
 
 /**
@@ -65,12 +94,14 @@ MagneticFieldPtr initializeSolenoid(const char *solenoidPath) {
         fprintf(stderr, "\ncMag ERROR null solenoid path even after trying environment variables.\n");
         return NULL;
     }
-    return readField(solenoidPath);
+    return readCachedField(solenoidPath);
 }
 
 
 /**
- * Read a binary field map at the given location.
+ * Read a binary field map at the given location. The field keeps its float
+ * values: the default precision is applied by the callers, after any copy
+ * for the cache directory has been written.
  * @param path the full path to a field map file.
  * @return a valid field pointer on success, NULL on failure.
  */
@@ -91,37 +122,293 @@ static MagneticFieldPtr readField(const char *path) {
         return NULL;
     }
 
-    MagneticFieldPtr fieldPtr = createFieldMap();
-
-    //copy the path and name
-    stringCopy(&(fieldPtr->path), path);
+    int numValues = headerPtr->nq1 * headerPtr->nq2 * headerPtr->nq3;
+    long dataOffset = getDataOffset(headerPtr);
+
+    //native files carry their metrics
+    FieldMetrics metrics;
+    FieldMetricsPtr metricsPtr = readNativeMetrics(file, headerPtr, &metrics) ? &metrics : NULL;
+
+    //native byte order files can be used in place
+    if (_memoryMapping && !swapBytes) {
+        void *mapping;
+        size_t mappingLength;
+        FieldValuePtr fieldValues = mapFieldValues(file, dataOffset, numValues, &mapping, &mappingLength);
+
+        if (fieldValues != NULL) {
+            fclose(file);
+            MagneticFieldPtr fieldPtr = createField(headerPtr, fieldValues, path, metricsPtr);
+            fieldPtr->mapping = mapping;
+            fieldPtr->mappingLength = mappingLength;
+            return fieldPtr;
+        }
 
-    fieldPtr->headerPtr = headerPtr;
-    fieldPtr->numValues = headerPtr->nq1 * headerPtr->nq2 * headerPtr->nq3;
-    fieldPtr->creationDate = getCreationDate(fieldPtr);
+        //fall back on reading
+    }
 
     //malloc the data array
-    fieldPtr->fieldValues = malloc(fieldPtr->numValues * sizeof(FieldValue));
+    FieldValuePtr fieldValues = malloc(numValues * sizeof(FieldValue));
 
     //did we have enough memory?
-    if (fieldPtr->fieldValues == NULL) {
+    if (fieldValues == NULL) {
         fprintf(stderr, "\ncMag ERROR out of memory when allocating space for field map.\n");
         fclose(file);
         return NULL;
     }
 
-    //now we can read the field. Reading the header should have left
-    //the file pointer positioned at the right spot.
-    fread(fieldPtr->fieldValues, sizeof(FieldValue), fieldPtr->numValues, file);
+    //now we can read the field
+    fseek(file, dataOffset, SEEK_SET);
+    fread(fieldValues, sizeof(FieldValue), numValues, file);
     fclose(file);
 
     //swap?
     if (swapBytes) {
-        for (int i = 0; i < fieldPtr->numValues; i++) {
-            swap32((char*) (fieldPtr->fieldValues + i), 3);
+        for (int i = 0; i < numValues; i++) {
+            swap32((char*) (fieldValues + i), 3);
         }
     }
 
+    return createField(headerPtr, fieldValues, path, metricsPtr);
+}
+
+/**
+ * Read the metrics stored in the header padding of a native format file.
+ * @param file the open field map file.
+ * @param headerPtr the header.
+ * @param metricsPtr upon return, the metrics.
+ * @return true if the file has metrics in the byte order of this machine.
+ */
+static bool readNativeMetrics(FILE *file, FieldMapHeaderPtr headerPtr, FieldMetricsPtr metricsPtr) {
+    if ((headerPtr->reserved3 != NATIVEFORMATTAG) || swapBytes ||
+        (headerPtr->reserved4 < sizeof(FieldMapHeader) + sizeof(NativeMetrics))) {
+        return false;
+    }
+
+    NativeMetrics nativeMetrics;
+    fseek(file, sizeof(FieldMapHeader), SEEK_SET);
+    if ((fread(&nativeMetrics, sizeof(NativeMetrics), 1, file) != 1) || (nativeMetrics.tag != NATIVEMETRICSTAG)) {
+        return false;
+    }
+
+    *metricsPtr = nativeMetrics.metrics;
+    return true;
+}
+
+/**
+ * Map the field values of a file into memory. The mapping is read only and
+ * shared, so all the processes on a node that use the same map share one copy
+ * in the page cache, and nothing is read until it is used.
+ * @param file the open field map file.
+ * @param dataOffset the offset of the field values in the file, in bytes.
+ * @param numValues the number of field values, from the header.
+ * @param mapping upon return, the start of the mapping (for munmap).
+ * @param mappingLength upon return, the length of the mapping (for munmap).
+ * @return a pointer to the first field value, or NULL if the file could not be mapped.
+ */
+static FieldValuePtr mapFieldValues(FILE *file, long dataOffset, size_t numValues,
+                                    void **mapping, size_t *mappingLength) {
+    size_t length = dataOffset + numValues * sizeof(FieldValue);
+
+    if (getFileSize(file) < (long) length) {
+        fprintf(stderr, "\ncMag ERROR field map file is too short to map.\n");
+        return NULL;
+    }
+
+    void *start = mmap(NULL, length, PROT_READ, MAP_SHARED, fileno(file), 0);
+    if (start == MAP_FAILED) {
+        fprintf(stderr, "\ncMag WARNING could not map the field map file, reading it instead.\n");
+        return NULL;
+    }
+
+    debugPrint("memory mapped: %zu bytes\n", length);
+    *mapping = start;
+    *mappingLength = length;
+    return (FieldValuePtr) ((char *) start + dataOffset);
+}
+
+/**
+ * Get the offset of the field values in a file. In the original format they
+ * follow the header, in the native format the header gives the offset.
+ * @param headerPtr the header (already swapped if needed).
+ * @return the offset in bytes.
+ */
+static long getDataOffset(FieldMapHeaderPtr headerPtr) {
+    if (headerPtr->reserved3 == NATIVEFORMATTAG) {
+        return headerPtr->reserved4;
+    }
+    return sizeof(FieldMapHeader);
+}
+
+/**
+ * Get the byte order of this machine, as recorded in the native field maps
+ * and the trajectory tables.
+ * @return 1 for little endian, 2 for big endian.
+ */
+unsigned int getByteOrder() {
+    unsigned int one = 1;
+    return (*((unsigned char *) &one) == 1) ? 1 : 2;
+}
+
+/**
+ * Get the layout descriptor written to the native format: the layout in the low
+ * byte and the byte order of this machine (1 little, 2 big endian) in the next.
+ * @return the descriptor.
+ */
+static unsigned int getLayoutDescriptor() {
+    return (getByteOrder() << 8) | NATIVELAYOUT;
+}
+
+/**
+ * Set the directory for native format copies of the field maps. When set,
+ * initializeTorus and initializeSolenoid look there for a copy of the map,
+ * keyed by its path, size and modification time, and use it if found (so
+ * there is no byte swapping, and the copy can be memory mapped). If not
+ * found, the map is read as usual and a copy is written there for next time.
+ * If never set, the COAT_MAGFIELD_CACHEDIR environment variable is used.
+ * @param cacheDirectory the directory (which must exist), or NULL for no caching.
+ */
+void setCacheDirectory(const char *cacheDirectory) {
+    free(_cacheDirectory);
+    _cacheDirectory = NULL;
+    if (cacheDirectory != NULL) {
+        stringCopy(&_cacheDirectory, cacheDirectory);
+    }
+}
+
+/**
+ * Get the directory for native format copies of the field maps.
+ * @return the directory, or NULL if there is none.
+ */
+const char *getCacheDirectory() {
+    if (_cacheDirectory != NULL) {
+        return _cacheDirectory;
+    }
+    return getenv("COAT_MAGFIELD_CACHEDIR");
+}
+
+/**
+ * Get the path of the native format copy of a field map in the cache directory.
+ * The name is the name of the original prefixed by a key made from its path,
+ * size and modification time, so a changed map gets a new copy.
+ * @param path the full path to the original field map file.
+ * @param cacheDirectory the cache directory.
+ * @return the path (free it when done), or NULL if the original can't be found.
+ */
+static char *getCachePath(const char *path, const char *cacheDirectory) {
+    struct stat fileStat;
+    if (stat(path, &fileStat) != 0) {
+        return NULL;
+    }
+
+    unsigned long long key = hashFile(FNVOFFSET, path);
+
+    const char *name = strrchr(path, '/');
+    name = (name == NULL) ? path : name + 1;
+
+    char *cachePath = (char *) malloc(strlen(cacheDirectory) + strlen(name) + 32);
+    sprintf(cachePath, "%s/%016llx_%s", cacheDirectory, key, name);
+    return cachePath;
+}
+
+/**
+ * Read a field map through the cache directory, if there is one.
+ * @param path the full path to the original field map file.
+ * @return a valid field pointer on success, NULL on failure.
+ */
+static MagneticFieldPtr readCachedField(const char *path) {
+    const char *cacheDirectory = getCacheDirectory();
+    char *cachePath = (cacheDirectory == NULL) ? NULL : getCachePath(path, cacheDirectory);
+
+    if (cachePath == NULL) {
+        return applyDefaultPrecision(readField(path));
+    }
+
+    MagneticFieldPtr fieldPtr = NULL;
+    if (access(cachePath, R_OK) == 0) {
+        fieldPtr = readField(cachePath);
+    }
+
+    if (fieldPtr == NULL) {
+        fieldPtr = readField(path);
+        if (fieldPtr != NULL) {
+            writeField(fieldPtr, cachePath);
+        }
+    }
+    else {
+        //the field is known by its original path
+        free(fieldPtr->path);
+        stringCopy(&(fieldPtr->path), path);
+    }
+
+    free(cachePath);
+    return applyDefaultPrecision(fieldPtr);
+}
+
+/**
+ * Convert a newly read field to the default storage precision. This is done
+ * last, since the cache copy can only be written from the float values.
+ * @param fieldPtr the field, or NULL.
+ * @return the field.
+ */
+static MagneticFieldPtr applyDefaultPrecision(MagneticFieldPtr fieldPtr) {
+    if ((fieldPtr != NULL) && (getDefaultPrecision() != FLOAT32)) {
+        setFieldPrecision(fieldPtr, getDefaultPrecision());
+    }
+    return fieldPtr;
+}
+
+/**
+ * Set whether field maps in the native byte order are memory mapped rather
+ * than read. Mapping is the default. It affects only fields loaded afterwards.
+ * @param memoryMapping true to map, false to always read.
+ */
+void setMemoryMapping(bool memoryMapping) {
+    _memoryMapping = memoryMapping;
+}
+
+/**
+ * Check whether field maps in the native byte order are memory mapped.
+ * @return true if they are mapped rather than read.
+ */
+bool getMemoryMapping() {
+    return _memoryMapping;
+}
+
+/**
+ * Create a field map from a header and the field values, as they would be
+ * read from a file. This sets up the grids, the field type, the evaluator and
+ * the default probe, computes the metrics, and converts the values to the
+ * default storage precision.
+ * @param headerPtr the header. The field takes ownership of it.
+ * @param fieldValues the nq1*nq2*nq3 field values. The field takes ownership of them.
+ * @param path the path to the file the field came from, or a descriptive name.
+ * @return a valid field pointer.
+ */
+MagneticFieldPtr createFieldFromData(FieldMapHeaderPtr headerPtr, FieldValuePtr fieldValues, const char *path) {
+    return applyDefaultPrecision(createField(headerPtr, fieldValues, path, NULL));
+}
+
+/**
+ * Create a field map from a header and the field values, keeping the float values.
+ * @param headerPtr the header. The field takes ownership of it.
+ * @param fieldValues the nq1*nq2*nq3 field values. The field takes ownership of them.
+ * @param path the path to the file the field came from, or a descriptive name.
+ * @param metricsPtr the metrics if known (from a native file), or NULL to compute them.
+ * @return a valid field pointer.
+ */
+static MagneticFieldPtr createField(FieldMapHeaderPtr headerPtr, FieldValuePtr fieldValues, const char *path,
+                                    FieldMetricsPtr metricsPtr) {
+
+    MagneticFieldPtr fieldPtr = createFieldMap();
+
+    //copy the path and name
+    stringCopy(&(fieldPtr->path), path);
+
+    fieldPtr->headerPtr = headerPtr;
+    fieldPtr->numValues = headerPtr->nq1 * headerPtr->nq2 * headerPtr->nq3;
+    fieldPtr->creationDate = getCreationDate(fieldPtr);
+    fieldPtr->fieldValues = fieldValues;
+
     //create the coordinate grids
     //CLAS fields always have cylindrical grids
     //with q1 = phi, q2 = rho and q3 = z
@@ -142,34 +429,174 @@ static MagneticFieldPtr readField(const char *path) {
     if (headerPtr->nq1 < 2) {
         fieldPtr->type = SOLENOID;
         fieldPtr->symmetric = true;
-        fieldPtr->cell3DPtr = NULL;
-        createCell2D(fieldPtr);
     }
     else {
         fieldPtr->type = TORUS;
         if ((headerPtr->q1max - headerPtr->q1min) < 31) {
             fieldPtr->symmetric = true;
         }
-        createCell3D(fieldPtr);
-        fieldPtr->cell2DPtr = NULL;
     }
 
+    //resolve the evaluator for the default algorithm
+    setFieldAlgorithm(fieldPtr, getAlgorithm());
+    registerField(fieldPtr);
+
+    //the default probe, whose cells are the ones used by getFieldValue
+    fieldPtr->probePtr = createProbe(fieldPtr);
+    fieldPtr->cell3DPtr = fieldPtr->probePtr->cell3DPtr;
+    fieldPtr->cell2DPtr = fieldPtr->probePtr->cell2DPtr;
 
-    //compute some metrics
-    computeFieldMetrics(fieldPtr);
+
+    //compute some metrics, which would touch every page of a mapped file
+    if (metricsPtr != NULL) {
+        *(fieldPtr->metricsPtr) = *metricsPtr;
+    }
+    else {
+        computeFieldMetrics(fieldPtr);
+    }
 
     printFieldSummary(fieldPtr, stdout);
     return fieldPtr;
 }
 
 /**
- * Create a 3D cell, which is used by the torus.
- * Note that nothing is
- * returned, the field's 2D cell pointer is made to point at the cell,
- * and the cell is given a reference to the field.
- * @param fieldPtr a pointer to the solenoid field.
+ * Write a field map in the native variant of the binary format: native byte
+ * order, with the data aligned at NATIVEDATAOFFSET. The magic word lets readers
+ * on other machines detect that they need to swap. The field metrics are
+ * stored in the header padding.
+ * @param fieldPtr the field to write.
+ * @param path the path of the file. To avoid readers seeing a partially
+ * written file, the data is written to a temporary file that is then renamed.
+ * @return true on success.
+ */
+bool writeField(MagneticFieldPtr fieldPtr, const char *path) {
+
+    if (fieldPtr->fieldValues == NULL) {
+        fprintf(stderr, "\ncMag ERROR only FLOAT32 field maps can be written.\n");
+        return false;
+    }
+
+    //flag the native format and pad the header so the data are aligned
+    FieldMapHeader header = *(fieldPtr->headerPtr);
+    header.magicWord = MAGICWORD;
+    header.reserved3 = NATIVEFORMATTAG;
+    header.reserved4 = NATIVEDATAOFFSET;
+    header.reserved5 = getLayoutDescriptor();
+
+    NativeMetrics nativeMetrics;
+    memset(&nativeMetrics, 0, sizeof(NativeMetrics));
+    nativeMetrics.tag = NATIVEMETRICSTAG;
+    nativeMetrics.metrics = *(fieldPtr->metricsPtr);
+
+    char prefix[NATIVEDATAOFFSET];
+    memset(prefix, 0, sizeof(prefix));
+    memcpy(prefix, &header, sizeof(FieldMapHeader));
+    memcpy(prefix + sizeof(FieldMapHeader), &nativeMetrics, sizeof(NativeMetrics));
+
+    return writeFileAtomically(path, "field map", prefix, sizeof(prefix),
+                               fieldPtr->fieldValues, fieldPtr->numValues * sizeof(FieldValue));
+}
+
+/**
+ * Write a file from a header block and the data that follow it. To avoid
+ * readers seeing a partially written file, the data is written to a
+ * temporary file that is then renamed.
+ * @param path the path of the file.
+ * @param description what the file is, for error messages.
+ * @param prefix the bytes before the data, e.g. a padded header.
+ * @param prefixLength the number of bytes in the prefix.
+ * @param data the data.
+ * @param dataLength the number of bytes of data.
+ * @return true on success.
+ */
+bool writeFileAtomically(const char *path, const char *description, const void *prefix, size_t prefixLength,
+                         const void *data, size_t dataLength) {
+    char *tempPath = (char *) malloc(strlen(path) + 32);
+    sprintf(tempPath, "%s.tmp%ld", path, (long) getpid());
+
+    FILE *file = fopen(tempPath, "wb");
+    if (file == NULL) {
+        fprintf(stderr, "\ncMag ERROR could not write %s file: [%s]\n", description, tempPath);
+        free(tempPath);
+        return false;
+    }
+
+    bool ok = (fwrite(prefix, 1, prefixLength, file) == prefixLength) &&
+              (fwrite(data, 1, dataLength, file) == dataLength);
+    ok = (fclose(file) == 0) && ok;
+
+    if (ok) {
+        ok = (rename(tempPath, path) == 0);
+    }
+    if (!ok) {
+        fprintf(stderr, "\ncMag ERROR failed writing %s file: [%s]\n", description, path);
+        remove(tempPath);
+    }
+
+    free(tempPath);
+    return ok;
+}
+
+/**
+ * Initialize a field (torus or solenoid, as determined by the map) from a path.
+ * Unlike initializeTorus and initializeSolenoid, no environment variables are tried.
+ * @param path the path to a field map file.
+ * @return a valid field pointer on success, NULL on failure.
+ */
+MagneticFieldPtr initializeField(const char *path) {
+    if (path == NULL) {
+        fprintf(stderr, "\ncMag ERROR null field map path.\n");
+        return NULL;
+    }
+    return applyDefaultPrecision(readField(path));
+}
+
+/**
+ * Reset the 3D cell of the field's default probe, which is used by the torus.
+ * The cell is made to "contain nothing", so the next lookup with getFieldValue
+ * refills it. Nothing is allocated: the field's 3D cell pointer stays the
+ * default probe's cell, which the field owns.
+ * @param fieldPtr a pointer to the torus field.
  */
 void createCell3D(MagneticFieldPtr fieldPtr) {
+    resetDefaultProbe(fieldPtr);
+}
+
+/**
+ * Reset the 2D cell of the field's default probe, which is used by the
+ * solenoid, since the lack of phi dependence renders the solenoidal field
+ * effectively 2D. The cell is made to "contain nothing", so the next lookup
+ * with getFieldValue refills it. Nothing is allocated: the field's 2D cell
+ * pointer stays the default probe's cell, which the field owns.
+ * @param fieldPtr a pointer to the solenoid field.
+ */
+void createCell2D(MagneticFieldPtr fieldPtr) {
+    resetDefaultProbe(fieldPtr);
+}
+
+/**
+ * Make the default probe of a field "contain nothing", creating it if the
+ * field has none yet, and point the field's cells at the probe's cells.
+ * @param fieldPtr a pointer to the torus or solenoid field.
+ */
+static void resetDefaultProbe(MagneticFieldPtr fieldPtr) {
+    if (fieldPtr->probePtr == NULL) {
+        fieldPtr->probePtr = createProbe(fieldPtr);
+    }
+    else {
+        invalidateProbe(fieldPtr->probePtr);
+    }
+    fieldPtr->cell3DPtr = fieldPtr->probePtr->cell3DPtr;
+    fieldPtr->cell2DPtr = fieldPtr->probePtr->cell2DPtr;
+}
+
+/**
+ * Allocate a 3D cell that "contains nothing", so that the first
+ * lookup will reset it. The field does not learn about the cell.
+ * @param fieldPtr a pointer to the torus field.
+ * @return a pointer to the new cell.
+ */
+static Cell3DPtr allocCell3D(MagneticFieldPtr fieldPtr) {
     Cell3DPtr cell3DPtr = (Cell3DPtr) malloc(sizeof(Cell3D));
     cell3DPtr->phiMin = INFINITY;
     cell3DPtr->phiMax = -INFINITY;
@@ -178,25 +605,63 @@ void createCell3D(MagneticFieldPtr fieldPtr) {
     cell3DPtr->zMin = INFINITY;
     cell3DPtr->zMax = -INFINITY;
     cell3DPtr->fieldPtr = fieldPtr;
-    fieldPtr->cell3DPtr = cell3DPtr;
+    return cell3DPtr;
 }
 
 /**
- * Create a 2D cell, which is used by the solenoid, since the lack
- * of phi dependence renders the solenoidal field effectively 2D.
- * Note that nothing is
- * returned, the field's 2D cell pointer is made to point at the cell,
- * and the cell is given a reference to the field.
+ * Allocate a 2D cell that "contains nothing", so that the first
+ * lookup will reset it. The field does not learn about the cell.
  * @param fieldPtr a pointer to the solenoid field.
+ * @return a pointer to the new cell.
  */
-void createCell2D(MagneticFieldPtr fieldPtr) {
+static Cell2DPtr allocCell2D(MagneticFieldPtr fieldPtr) {
     Cell2DPtr cell2DPtr = (Cell2DPtr) malloc(sizeof(Cell2D));
     cell2DPtr->rhoMin = INFINITY;
     cell2DPtr->rhoMax = -INFINITY;
     cell2DPtr->zMin = INFINITY;
     cell2DPtr->zMax = -INFINITY;
     cell2DPtr->fieldPtr = fieldPtr;
-    fieldPtr->cell2DPtr = cell2DPtr;
+    return cell2DPtr;
+}
+
+/**
+ * Create a probe for a field. A probe holds the cached cell used
+ * for lookups, so it is the only thing that changes when a field value
+ * is obtained. Give each thread its own probe and they can all share
+ * the same (read only) field map.
+ * @param fieldPtr a pointer to the torus or solenoid field.
+ * @return a pointer to the new probe. Free it with freeProbe.
+ */
+FieldProbePtr createProbe(MagneticFieldPtr fieldPtr) {
+    FieldProbePtr probePtr = (FieldProbePtr) malloc(sizeof(FieldProbe));
+    probePtr->fieldPtr = fieldPtr;
+
+    if (fieldPtr->type == TORUS) {
+        probePtr->cell3DPtr = allocCell3D(fieldPtr);
+        probePtr->cell2DPtr = NULL;
+    }
+    else {
+        probePtr->cell3DPtr = NULL;
+        probePtr->cell2DPtr = allocCell2D(fieldPtr);
+    }
+    return probePtr;
+}
+
+/**
+ * Free the memory associated with a probe. The field map is not freed.
+ * @param probePtr a pointer to the probe.
+ */
+void freeProbe(FieldProbePtr probePtr) {
+    if (probePtr == NULL) {
+        return;
+    }
+    if (probePtr->cell3DPtr != NULL) {
+        freeCell3D(probePtr->cell3DPtr);
+    }
+    if (probePtr->cell2DPtr != NULL) {
+        freeCell2D(probePtr->cell2DPtr);
+    }
+    free(probePtr);
 }
 
 /**
@@ -276,7 +741,14 @@ static FieldMapHeaderPtr readMapHeader(FILE *fd) {
 
     //get the number of field values and the computed file size
     int numFieldValues = headerPtr->nq1 * headerPtr->nq2 * headerPtr->nq3;
-    long computedFileSize = sizeof(FieldMapHeader) + 4 * 3 * numFieldValues;
+    long computedFileSize = getDataOffset(headerPtr) + 4 * 3 * numFieldValues;
+
+    if ((headerPtr->reserved3 == NATIVEFORMATTAG) &&
+        (((headerPtr->reserved5 & 0xff) != NATIVELAYOUT) || (headerPtr->reserved4 < sizeof(FieldMapHeader)))) {
+        fprintf(stderr, "\ncMag ERROR unknown native field map layout.\n");
+        free(headerPtr);
+        return NULL;
+    }
 
     debugPrint("Computed file size: %ld bytes\n", computedFileSize);
     if (actualFileSize != computedFileSize) {
@@ -366,3 +838,126 @@ static void swap32(char *ptr, int num32) {
         }
     }
 }
+
+/**
+ * A unit test for memory mapped loading. The test field is written in the
+ * native byte order, then loaded with and without memory mapping. Both
+ * must reproduce the test field exactly.
+ * @return an error message if the test fails, or NULL if it passes.
+ */
+char *memoryMappingUnitTest() {
+    char *tempDir = getenv("TMPDIR");
+    if (tempDir == NULL) {
+        tempDir = "/tmp";
+    }
+
+    char path[512];
+    snprintf(path, sizeof(path), "%s/cmag_mapping_test_%ld.dat", tempDir, (long) getpid());
+    mu_assert("Could not write the test field.", writeField(testFieldPtr, path));
+
+    bool saved = getMemoryMapping();
+    size_t numBytes = testFieldPtr->numValues * sizeof(FieldValue);
+
+    for (int i = 0; i < 2; i++) {
+        bool mapped = (i == 0);
+        setMemoryMapping(mapped);
+        MagneticFieldPtr fieldPtr = initializeField(path);
+
+        mu_assert("Could not load the test field.", fieldPtr != NULL);
+        mu_assert("Wrong mapping state.", (fieldPtr->mapping != NULL) == mapped);
+        mu_assert("Wrong number of values.", fieldPtr->numValues == testFieldPtr->numValues);
+        mu_assert("The loaded values differ from the original.",
+                  memcmp(fieldPtr->fieldValues, testFieldPtr->fieldValues, numBytes) == 0);
+
+        freeFieldMap(fieldPtr);
+    }
+
+    setMemoryMapping(saved);
+    remove(path);
+
+    fprintf(stdout, "\nPASSED memoryMappingUnitTest\n");
+    return NULL;
+}
+
+/**
+ * A unit test for the cache of native format copies. The first load of the
+ * test field through the cache writes the copy, the second must use it.
+ * @return an error message if the test fails, or NULL if it passes.
+ */
+char *cacheDirectoryUnitTest() {
+    char *tempDir = getenv("TMPDIR");
+    if (tempDir == NULL) {
+        tempDir = "/tmp";
+    }
+
+    char *saved = NULL;
+    if (_cacheDirectory != NULL) {
+        stringCopy(&saved, _cacheDirectory);
+    }
+    setCacheDirectory(tempDir);
+
+    char *cachePath = getCachePath(testFieldPtr->path, tempDir);
+    mu_assert("Could not get the cache path.", cachePath != NULL);
+    remove(cachePath);
+
+    size_t numBytes = testFieldPtr->numValues * sizeof(FieldValue);
+    bool torus = (testFieldPtr->type == TORUS);
+
+    for (int i = 0; i < 2; i++) {
+        MagneticFieldPtr fieldPtr = torus ? initializeTorus(testFieldPtr->path) :
+                                    initializeSolenoid(testFieldPtr->path);
+
+        mu_assert("Could not load the test field through the cache.", fieldPtr != NULL);
+        mu_assert("The copy was not written to the cache.", access(cachePath, R_OK) == 0);
+        mu_assert("The field should keep its original path.", strcmp(fieldPtr->path, testFieldPtr->path) == 0);
+        mu_assert("The loaded values differ from the original.",
+                  memcmp(fieldPtr->fieldValues, testFieldPtr->fieldValues, numBytes) == 0);
+
+        //the second time it comes from the native copy
+        if (i == 1) {
+            mu_assert("The copy is not in the native format.", fieldPtr->headerPtr->reserved3 == NATIVEFORMATTAG);
+            mu_assert("The copy should be memory mapped.", !getMemoryMapping() || (fieldPtr->mapping != NULL));
+            mu_assert("The data are not aligned.", (((size_t) fieldPtr->fieldValues) % 64) == 0);
+            mu_assert("The stored metrics differ from the original.",
+                      (fieldPtr->metricsPtr->maxFieldIndex == testFieldPtr->metricsPtr->maxFieldIndex) &&
+                      (fieldPtr->metricsPtr->maxFieldMagnitude == testFieldPtr->metricsPtr->maxFieldMagnitude) &&
+                      (fieldPtr->metricsPtr->avgFieldMagnitude == testFieldPtr->metricsPtr->avgFieldMagnitude));
+        }
+
+        freeFieldMap(fieldPtr);
+    }
+
+    //with a compact default precision the copy is still written, from the float values
+    remove(cachePath);
+    StoragePrecision savedPrecision = getDefaultPrecision();
+    setDefaultPrecision(FLOAT16);
+
+    for (int i = 0; i < 2; i++) {
+        MagneticFieldPtr fieldPtr = torus ? initializeTorus(testFieldPtr->path) :
+                                    initializeSolenoid(testFieldPtr->path);
+
+        mu_assert("Could not load the compact test field through the cache.", fieldPtr != NULL);
+        mu_assert("The compact field was not written to the cache.", access(cachePath, R_OK) == 0);
+        mu_assert("The field should have the default precision.", getFieldPrecision(fieldPtr) == FLOAT16);
+        if (i == 1) {
+            mu_assert("The compact field did not come from the copy.",
+                      fieldPtr->headerPtr->reserved3 == NATIVEFORMATTAG);
+        }
+        freeFieldMap(fieldPtr);
+    }
+    setDefaultPrecision(savedPrecision);
+
+    //the copy itself is mapped, before it is compacted
+    MagneticFieldPtr copyPtr = readField(cachePath);
+    mu_assert("Could not read the copy.", copyPtr != NULL);
+    mu_assert("The copy should be memory mapped.", !getMemoryMapping() || (copyPtr->mapping != NULL));
+    freeFieldMap(copyPtr);
+
+    remove(cachePath);
+    free(cachePath);
+    setCacheDirectory(saved);
+    free(saved);
+
+    fprintf(stdout, "\nPASSED cacheDirectoryUnitTest\n");
+    return NULL;
+}
@@ -0,0 +1,296 @@
+//
+//  magfieldpool.c
+//  cMag
+//  A work-stealing thread pool. The items [0, n) are split into one
+//  contiguous range per worker. A worker takes items from the front of its
+//  own range, and when it runs dry it steals the back half of the largest
+//  range left, so that uneven jobs (e.g. tracks of very different lengths)
+//  still keep all the workers busy. The calling thread is worker 0.
+//
+
+#include "magfieldpool.h"
+#include "munittest.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+
+//keep the ranges of different workers on different cache lines
+#define CACHELINE 64
+
+typedef struct workrange *WorkRangePtr;
+typedef struct workpool *WorkPoolPtr;
+typedef struct workerarg *WorkerArgPtr;
+
+//the items still to be done by one worker
+typedef struct workrange {
+    pthread_mutex_t lock;
+    int next; //the next item
+    int end;  //one past the last item
+    char pad[CACHELINE];
+} WorkRange;
+
+//shared by all the workers of one parallelFor
+typedef struct workpool {
+    WorkRangePtr ranges;
+    int numThreads;
+    WorkFunction work;
+    void *context;
+} WorkPool;
+
+//what a worker thread is started with
+typedef struct workerarg {
+    WorkPoolPtr pool;
+    int worker;
+} WorkerArg;
+
+//local prototypes
+static void *workerMain(void *);
+static int takeItem(WorkRangePtr);
+static bool stealItems(WorkPoolPtr, int);
+static void poolCheckWork(void *, int, int);
+
+/**
+ * Get the number of cores that are online.
+ * @return the number of cores, at least 1.
+ */
+int getNumCores() {
+    long numCores = sysconf(_SC_NPROCESSORS_ONLN);
+    return (numCores < 1) ? 1 : (int) numCores;
+}
+
+/**
+ * Get the number of workers that parallelFor will use.
+ * @param numThreads the requested number of threads, 0 (or less) for one per core.
+ * @param n the number of items.
+ * @return the number of workers, between 1 and n.
+ */
+int getPoolSize(int numThreads, int n) {
+    if (numThreads < 1) {
+        numThreads = getNumCores();
+    }
+    if (numThreads > n) {
+        numThreads = n;
+    }
+    return (numThreads < 1) ? 1 : numThreads;
+}
+
+/**
+ * Take the item at the front of a range.
+ * @param range the range.
+ * @return the item, or -1 if the range is empty.
+ */
+static int takeItem(WorkRangePtr range) {
+    int item = -1;
+
+    pthread_mutex_lock(&(range->lock));
+    if (range->next < range->end) {
+        item = range->next++;
+    }
+    pthread_mutex_unlock(&(range->lock));
+    return item;
+}
+
+/**
+ * Steal the back half of the largest range of the other workers and make it
+ * the range of the thief.
+ * @param pool the pool.
+ * @param thief the worker that ran out of items.
+ * @return true if something was stolen, false if all the ranges are empty.
+ */
+static bool stealItems(WorkPoolPtr pool, int thief) {
+    while (true) {
+        //pick the victim, the sizes may have changed by the time we steal
+        int victim = -1;
+        int most = 0;
+        for (int i = 0; i < pool->numThreads; i++) {
+            if (i == thief) {
+                continue;
+            }
+            pthread_mutex_lock(&(pool->ranges[i].lock));
+            int remaining = pool->ranges[i].end - pool->ranges[i].next;
+            pthread_mutex_unlock(&(pool->ranges[i].lock));
+            if (remaining > most) {
+                most = remaining;
+                victim = i;
+            }
+        }
+
+        if (victim < 0) {
+            return false;
+        }
+
+        WorkRangePtr range = pool->ranges + victim;
+        int begin = 0;
+        int end = 0;
+
+        pthread_mutex_lock(&(range->lock));
+        int remaining = range->end - range->next;
+        if (remaining > 0) {
+            end = range->end;
+            begin = end - (remaining + 1) / 2;
+            range->end = begin;
+        }
+        pthread_mutex_unlock(&(range->lock));
+
+        if (end > begin) {
+            range = pool->ranges + thief;
+            pthread_mutex_lock(&(range->lock));
+            range->next = begin;
+            range->end = end;
+            pthread_mutex_unlock(&(range->lock));
+            return true;
+        }
+        //the victim finished in the meantime, look again
+    }
+}
+
+/**
+ * The loop run by every worker.
+ * @param arg the WorkerArg of the worker.
+ * @return NULL.
+ */
+static void *workerMain(void *arg) {
+    WorkPoolPtr pool = ((WorkerArgPtr) arg)->pool;
+    int worker = ((WorkerArgPtr) arg)->worker;
+    WorkRangePtr range = pool->ranges + worker;
+
+    while (true) {
+        int item = takeItem(range);
+        if (item < 0) {
+            if (!stealItems(pool, worker)) {
+                break;
+            }
+            continue;
+        }
+        pool->work(pool->context, worker, item);
+    }
+    return NULL;
+}
+
+/**
+ * Do the items [0, n) of some work on a pool of threads. Each item is done
+ * exactly once, by one worker, in no particular order. The work function is
+ * also told which worker it runs on, so that it can use per worker state
+ * (such as field probes) without locking.
+ * @param n the number of items.
+ * @param numThreads the number of threads, 0 (or less) for one per core.
+ * @param work the function that does one item.
+ * @param context passed to the work function.
+ * @return the number of workers that were used.
+ */
+int parallelFor(int n, int numThreads, WorkFunction work, void *context) {
+    if (n < 1) {
+        return 0;
+    }
+
+    numThreads = getPoolSize(numThreads, n);
+
+    WorkPool pool;
+    pool.ranges = (WorkRangePtr) malloc(numThreads * sizeof(WorkRange));
+    pool.numThreads = numThreads;
+    pool.work = work;
+    pool.context = context;
+
+    for (int i = 0; i < numThreads; i++) {
+        pthread_mutex_init(&(pool.ranges[i].lock), NULL);
+        pool.ranges[i].next = (int) (((long) n * i) / numThreads);
+        pool.ranges[i].end = (int) (((long) n * (i + 1)) / numThreads);
+    }
+
+    WorkerArgPtr args = (WorkerArgPtr) malloc(numThreads * sizeof(WorkerArg));
+    pthread_t *threads = (pthread_t *) malloc(numThreads * sizeof(pthread_t));
+
+    for (int i = 0; i < numThreads; i++) {
+        args[i].pool = &pool;
+        args[i].worker = i;
+    }
+
+    //the caller is worker 0. If a thread cannot be started its range is stolen.
+    bool *started = (bool *) calloc(numThreads, sizeof(bool));
+    for (int i = 1; i < numThreads; i++) {
+        started[i] = (pthread_create(threads + i, NULL, workerMain, args + i) == 0);
+        if (!started[i]) {
+            fprintf(stderr, "\ncMag WARNING could not start worker thread %d.\n", i);
+        }
+    }
+
+    workerMain(args);
+
+    for (int i = 1; i < numThreads; i++) {
+        if (started[i]) {
+            pthread_join(threads[i], NULL);
+        }
+    }
+
+    for (int i = 0; i < numThreads; i++) {
+        pthread_mutex_destroy(&(pool.ranges[i].lock));
+    }
+
+    free(started);
+    free(threads);
+    free(args);
+    free(pool.ranges);
+    return numThreads;
+}
+
+//used by the unit test
+typedef struct poolcheck {
+    int *counts;   //times each item was done
+    int *workers;  //the worker that did each item
+    int numThreads;
+} PoolCheck;
+
+/**
+ * Work function for the unit test: very uneven amounts of busy work.
+ * @param context the PoolCheck.
+ * @param worker the worker.
+ * @param index the item.
+ */
+static void poolCheckWork(void *context, int worker, int index) {
+    PoolCheck *check = (PoolCheck *) context;
+    volatile double sum = 0;
+
+    int spins = (index % 97 == 0) ? 200000 : 100;
+    for (int i = 0; i < spins; i++) {
+        sum += i;
+    }
+
+    check->counts[index]++;
+    check->workers[index] = (worker >= 0 && worker < check->numThreads) ? worker : -1;
+}
+
+/**
+ * Unit test for the pool: every item is done exactly once by a valid worker,
+ * for various pool sizes, including more threads than items.
+ * @return NULL if all tests pass, otherwise an error message.
+ */
+char *poolUnitTest() {
+    int n = 5000;
+    PoolCheck check;
+    check.counts = (int *) malloc(n * sizeof(int));
+    check.workers = (int *) malloc(n * sizeof(int));
+
+    int sizes[] = {1, 2, 3, 8, 0};
+    for (int j = 0; j < 5; j++) {
+        for (int m = 1; m <= n; m *= 10) {
+            memset(check.counts, 0, n * sizeof(int));
+            check.numThreads = getPoolSize(sizes[j], m);
+
+            int used = parallelFor(m, sizes[j], poolCheckWork, &check);
+            mu_assert("Wrong number of workers.", used == check.numThreads);
+
+            for (int i = 0; i < m; i++) {
+                mu_assert("Item not done exactly once.", check.counts[i] == 1);
+                mu_assert("Item done by a bad worker.", check.workers[i] >= 0);
+            }
+        }
+    }
+
+    mu_assert("Empty work should use no workers.", parallelFor(0, 4, poolCheckWork, &check) == 0);
+
+    free(check.workers);
+    free(check.counts);
+    fprintf(stdout, "\nPASSED poolUnitTest (%d cores)\n", getNumCores());
+    return NULL;
+}
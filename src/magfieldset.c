@@ -0,0 +1,473 @@
+//
+//  magfieldset.c
+//  cMag
+//  Any number of field maps superimposed, each with its own scale and shift,
+//  e.g. the torus, the solenoid, a correction map and test stand fringe
+//  fields. The z extents of the maps cut z into slabs, and each slab has a
+//  coverage index over rho: for each rho bin, a bitmask of the maps that may
+//  contain points there and of those that contain all of it. A lookup only
+//  touches the maps that may cover the point, and skips the containment test
+//  for those that surely do. Maps in a row with the same shifts share the
+//  shifted point and rho.
+//
+
+#include "magfieldset.h"
+#include "magfieldio.h"
+#include "magfieldutil.h"
+#include "munittest.h"
+#include <stdlib.h>
+#include <math.h>
+
+//the extent of a map is widened by this fraction of the magnitudes involved
+//for the maps that may cover a bin, and narrowed by it for those that surely
+//do, so that rounding of the shifted point can never disagree with the
+//containment test the index stands in for
+#define FIELDSETSLACK 1.0e-9
+
+//the region a map may cover, and the region it surely covers, as placed in
+//a set. Lateral shifts make them annuli about the set's z axis.
+typedef struct memberbounds {
+    double zLo, zHi, rhoLo, rhoHi;         //may cover
+    double zInLo, zInHi, rhoInLo, rhoInHi; //surely covers
+} MemberBounds;
+
+//local prototypes
+static void memberBounds(const FieldSetMember *, MemberBounds *);
+static void buildSlabs(FieldSetPtr);
+static int findSlab(FieldSetPtr, double, int);
+
+/**
+ * Create an empty field set.
+ * @return the field set.
+ */
+FieldSetPtr createFieldSet() {
+    FieldSetPtr setPtr = (FieldSetPtr) malloc(sizeof(FieldSet));
+    setPtr->numMembers = 0;
+    setPtr->numSlabs = 0;
+    return setPtr;
+}
+
+/**
+ * Free a field set. The maps are not freed, they belong to the caller.
+ * @param setPtr the field set.
+ */
+void freeFieldSet(FieldSetPtr setPtr) {
+    free(setPtr);
+}
+
+/**
+ * Add a map to a set. It starts with the map's own scale and shifts, which
+ * can then be changed for the set only with setFieldSetScale and
+ * setFieldSetShift. Do not change a set while probes are using it, and create
+ * probes once the set is complete.
+ * @param setPtr the field set.
+ * @param fieldPtr the map. The same map can be added more than once.
+ * @return the index of the map in the set, or -1 if the map is NULL or the set is full.
+ */
+int addFieldToSet(FieldSetPtr setPtr, MagneticFieldPtr fieldPtr) {
+    if (fieldPtr == NULL) {
+        fprintf(stderr, "\ncMag ERROR null map added to a field set.\n");
+        return -1;
+    }
+    if (setPtr->numMembers >= FIELDSETMAXFIELDS) {
+        fprintf(stderr, "\ncMag ERROR could not add a map to a full field set of %d maps.\n", setPtr->numMembers);
+        return -1;
+    }
+
+    FieldSetMemberPtr member = setPtr->members + setPtr->numMembers;
+    member->fieldPtr = fieldPtr;
+    member->scale = fieldPtr->scale;
+    member->shiftX = fieldPtr->shiftX;
+    member->shiftY = fieldPtr->shiftY;
+    member->shiftZ = fieldPtr->shiftZ;
+
+    setPtr->numMembers++;
+    buildSlabs(setPtr);
+    return setPtr->numMembers - 1;
+}
+
+/**
+ * Set the scale of one map in a set. A map with zero scale is left out of
+ * the slabs, so it costs nothing.
+ * @param setPtr the field set.
+ * @param index the index of the map, from addFieldToSet.
+ * @param scale the scale factor.
+ * @return false if there is no such map.
+ */
+bool setFieldSetScale(FieldSetPtr setPtr, int index, double scale) {
+    if ((index < 0) || (index >= setPtr->numMembers)) {
+        return false;
+    }
+    setPtr->members[index].scale = scale;
+    buildSlabs(setPtr);
+    return true;
+}
+
+/**
+ * Set the shifts of one map in a set.
+ * @param setPtr the field set.
+ * @param index the index of the map, from addFieldToSet.
+ * @param shiftX the shift in x, cm.
+ * @param shiftY the shift in y, cm.
+ * @param shiftZ the shift in z, cm.
+ * @return false if there is no such map.
+ */
+bool setFieldSetShift(FieldSetPtr setPtr, int index, double shiftX, double shiftY, double shiftZ) {
+    if ((index < 0) || (index >= setPtr->numMembers)) {
+        return false;
+    }
+    FieldSetMemberPtr member = setPtr->members + index;
+    member->shiftX = shiftX;
+    member->shiftY = shiftY;
+    member->shiftZ = shiftZ;
+    buildSlabs(setPtr);
+    return true;
+}
+
+/**
+ * The regions a map in a set may cover and surely covers, in z and in the
+ * distance from the set's z axis.
+ * @param member the map in the set.
+ * @param bounds upon return the bounds, cm.
+ */
+static void memberBounds(const FieldSetMember *member, MemberBounds *bounds) {
+    GridPtr rhoGridPtr = member->fieldPtr->rhoGridPtr;
+    GridPtr zGridPtr = member->fieldPtr->zGridPtr;
+    double d = hypot(member->shiftX, member->shiftY);
+
+    double zSlack = FIELDSETSLACK * (1 + fabs(zGridPtr->minVal) + fabs(zGridPtr->maxVal) + fabs(member->shiftZ));
+    double rhoSlack = FIELDSETSLACK * (1 + rhoGridPtr->maxVal + d);
+
+    bounds->zLo = zGridPtr->minVal + member->shiftZ - zSlack;
+    bounds->zHi = zGridPtr->maxVal + member->shiftZ + zSlack;
+    bounds->rhoLo = max(0, rhoGridPtr->minVal - d - rhoSlack);
+    bounds->rhoHi = rhoGridPtr->maxVal + d + rhoSlack;
+
+    bounds->zInLo = zGridPtr->minVal + member->shiftZ + zSlack;
+    bounds->zInHi = zGridPtr->maxVal + member->shiftZ - zSlack;
+    bounds->rhoInLo = (rhoGridPtr->minVal > 0) ? rhoGridPtr->minVal + d + rhoSlack : 0;
+    bounds->rhoInHi = rhoGridPtr->maxVal - d - rhoSlack;
+}
+
+/**
+ * Cut z into slabs at the ends of the maps' z extents, both widened and
+ * narrowed, so a map surely covers the slabs between its narrowed ends. List
+ * for each slab the maps (with nonzero scale) that reach it, in the order
+ * they were added, and build the slab's coverage index over rho.
+ * @param setPtr the field set.
+ */
+static void buildSlabs(FieldSetPtr setPtr) {
+    MemberBounds bounds[FIELDSETMAXFIELDS];
+    double zBounds[4 * FIELDSETMAXFIELDS];
+    int numBounds = 0;
+
+    setPtr->rhoMax = 0;
+    for (int m = 0; m < setPtr->numMembers; m++) {
+        memberBounds(setPtr->members + m, bounds + m);
+        if (setPtr->members[m].scale != 0) {
+            zBounds[numBounds++] = bounds[m].zLo;
+            zBounds[numBounds++] = bounds[m].zHi;
+            if (bounds[m].zInLo < bounds[m].zInHi) {
+                zBounds[numBounds++] = bounds[m].zInLo;
+                zBounds[numBounds++] = bounds[m].zInHi;
+            }
+            setPtr->rhoMax = max(setPtr->rhoMax, bounds[m].rhoHi);
+        }
+    }
+    setPtr->rhoNorm = (setPtr->rhoMax > 0) ? FIELDSETRHOBINS / setPtr->rhoMax : 0;
+
+    if (numBounds > 1) {
+        sortArray(zBounds, numBounds);
+    }
+
+    setPtr->numSlabs = 0;
+    for (int k = 0; k + 1 < numBounds; k++) {
+        if (zBounds[k + 1] <= zBounds[k]) {
+            continue;
+        }
+
+        FieldSetSlabPtr slab = setPtr->slabs + setPtr->numSlabs;
+        slab->zMin = zBounds[k];
+        slab->zMax = zBounds[k + 1];
+        slab->numMembers = 0;
+        for (int b = 0; b < FIELDSETRHOBINS; b++) {
+            slab->reach[b] = 0;
+            slab->inside[b] = 0;
+        }
+
+        for (int m = 0; m < setPtr->numMembers; m++) {
+            MemberBounds *mb = bounds + m;
+            if ((setPtr->members[m].scale == 0) || (mb->zLo > slab->zMin) || (mb->zHi < slab->zMax)) {
+                continue;
+            }
+            slab->members[slab->numMembers++] = m;
+
+            bool zInside = (mb->zInLo <= slab->zMin) && (mb->zInHi >= slab->zMax);
+            for (int b = 0; b < FIELDSETRHOBINS; b++) {
+                double r0 = b / setPtr->rhoNorm;
+                double r1 = (b + 1) / setPtr->rhoNorm;
+                if ((mb->rhoLo <= r1) && (mb->rhoHi >= r0)) {
+                    slab->reach[b] |= (1u << m);
+                }
+                if (zInside && (mb->rhoInLo <= r0) && (mb->rhoInHi >= r1)) {
+                    slab->inside[b] |= (1u << m);
+                }
+            }
+        }
+        setPtr->numSlabs++;
+    }
+}
+
+/**
+ * Find the slab containing z.
+ * @param setPtr the field set.
+ * @param z the z coordinate in cm.
+ * @param guess a slab to try first, e.g. that of the previous lookup.
+ * @return the index of the slab, or -1 if z is outside all the maps.
+ */
+static int findSlab(FieldSetPtr setPtr, double z, int guess) {
+    FieldSetSlabPtr slabs = setPtr->slabs;
+    int numSlabs = setPtr->numSlabs;
+
+    if ((guess >= 0) && (guess < numSlabs) && (z >= slabs[guess].zMin) && (z < slabs[guess].zMax)) {
+        return guess;
+    }
+    if ((numSlabs == 0) || (z < slabs[0].zMin) || (z >= slabs[numSlabs - 1].zMax)) {
+        return -1;
+    }
+
+    int lo = 0;
+    int hi = numSlabs - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (slabs[mid].zMin <= z) {
+            lo = mid;
+        }
+        else {
+            hi = mid - 1;
+        }
+    }
+    return lo;
+}
+
+/**
+ * Create a probe for a field set, with a probe for each of its maps. As for
+ * the maps, each thread needs its own probe while the set is shared.
+ * @param setPtr the complete field set.
+ * @return the probe.
+ */
+FieldSetProbePtr createFieldSetProbe(FieldSetPtr setPtr) {
+    FieldSetProbePtr probePtr = (FieldSetProbePtr) malloc(sizeof(FieldSetProbe));
+    probePtr->setPtr = setPtr;
+    probePtr->slab = -1;
+
+    for (int m = 0; m < FIELDSETMAXFIELDS; m++) {
+        probePtr->probes[m] = (m < setPtr->numMembers) ? createProbe(setPtr->members[m].fieldPtr) : NULL;
+    }
+    return probePtr;
+}
+
+/**
+ * Free a field set probe and the probes of its maps.
+ * @param probePtr the probe.
+ */
+void freeFieldSetProbe(FieldSetProbePtr probePtr) {
+    for (int m = 0; m < FIELDSETMAXFIELDS; m++) {
+        if (probePtr->probes[m] != NULL) {
+            freeProbe(probePtr->probes[m]);
+        }
+    }
+    free(probePtr);
+}
+
+/**
+ * Obtain the combined value of the maps in a set. The coverage index of the
+ * point's slab and rho bin gives the maps that may cover the point; only
+ * those are looked at, and those that surely cover it skip the containment
+ * test. The point is shifted (and rho found) only when a map's shifts differ
+ * from those of the map before it, so unshifted maps use the point as it is.
+ * With the set's scales and shifts equal to the maps' own, the result is the
+ * same as that of getCompositeFieldValueProbes.
+ * @param fieldValuePtr should be a valid pointer to a FieldValue. Upon
+ * return it will hold the value of the combined field, in kG, in Cartesian
+ * components Bx, By, BZ.
+ * @param x the x coordinate in cm.
+ * @param y the y coordinate in cm.
+ * @param z the z coordinate in cm.
+ * @param probePtr a probe for the field set.
+ */
+void getFieldSetValue(FieldValuePtr fieldValuePtr, double x, double y, double z, FieldSetProbePtr probePtr) {
+    fieldValuePtr->b1 = 0;
+    fieldValuePtr->b2 = 0;
+    fieldValuePtr->b3 = 0;
+
+    FieldSetPtr setPtr = probePtr->setPtr;
+    int k = findSlab(setPtr, z, probePtr->slab);
+    if (k < 0) {
+        return;
+    }
+    probePtr->slab = k;
+
+    double r = hypot(x, y);
+    double bin = r * setPtr->rhoNorm;
+    if (bin >= FIELDSETRHOBINS) {
+        return;
+    }
+
+    FieldSetSlabPtr slab = setPtr->slabs + k;
+    unsigned int reach = slab->reach[(int) bin];
+    unsigned int inside = slab->inside[(int) bin];
+
+    //start with the unshifted point
+    double shiftX = 0, shiftY = 0, shiftZ = 0;
+    double xx = x, yy = y, zz = z, rho = r;
+    FieldValue temp;
+
+    for (int m = 0; reach != 0; m++, reach >>= 1, inside >>= 1) {
+        FieldProbePtr memberProbe = probePtr->probes[m];
+        if (((reach & 1) == 0) || (memberProbe == NULL)) {
+            continue;
+        }
+
+        FieldSetMemberPtr member = setPtr->members + m;
+        if ((member->shiftX != shiftX) || (member->shiftY != shiftY) || (member->shiftZ != shiftZ)) {
+            shiftX = member->shiftX;
+            shiftY = member->shiftY;
+            shiftZ = member->shiftZ;
+            xx = x - shiftX;
+            yy = y - shiftY;
+            zz = z - shiftZ;
+            rho = hypot(xx, yy);
+        }
+
+        MagneticFieldPtr fieldPtr = member->fieldPtr;
+        if ((inside & 1) || containsCylindrical(fieldPtr, rho, zz)) {
+            fieldPtr->evaluator(&temp, xx, yy, rho, zz, memberProbe);
+
+            //scaled as by getFieldValueProbe, so the sums agree
+            temp.b1 *= member->scale;
+            temp.b2 *= member->scale;
+            temp.b3 *= member->scale;
+            fieldValuePtr->b1 += temp.b1;
+            fieldValuePtr->b2 += temp.b2;
+            fieldValuePtr->b3 += temp.b3;
+        }
+    }
+}
+
+/**
+ * Unit test for field sets. With the maps' own scales and shifts a set must
+ * give exactly the composite value. A map added twice, once shifted far
+ * downstream and scaled, must give the two placements in their own slabs
+ * and nothing in the gap between them. A map with zero scale must be left
+ * out of the slabs.
+ * @return NULL if all tests pass, otherwise an error message.
+ */
+char *fieldSetUnitTest() {
+    MagneticFieldPtr torus = testFieldPtr;
+    MagneticFieldPtr solenoid = testSolenoidPtr;
+    FieldProbePtr torusProbe = createProbe(torus);
+    FieldProbePtr solenoidProbe = createProbe(solenoid);
+    FieldValue fv, ref;
+
+    //the same as the composite, with and without shifts
+    for (int k = 0; k < 3; k++) {
+        solenoid->shiftX = (k == 0) ? 0 : ((k == 1) ? 0.2 : 40);
+        solenoid->shiftY = (k == 2) ? -30 : 0;
+        solenoid->shiftZ = (k == 0) ? 0 : -1.5;
+
+        FieldSetPtr setPtr = createFieldSet();
+        mu_assert("Could not add the torus to a field set.", addFieldToSet(setPtr, torus) == 0);
+        mu_assert("Could not add the solenoid to a field set.", addFieldToSet(setPtr, solenoid) == 1);
+        mu_assert("A null map should not be added to a field set.", addFieldToSet(setPtr, NULL) == -1);
+        FieldSetProbePtr probePtr = createFieldSetProbe(setPtr);
+
+        for (int i = 0; i < 100000; i++) {
+            double x = randomDouble(-500, 500);
+            double y = randomDouble(-500, 500);
+            double z = randomDouble(-400, 700);
+
+            getFieldSetValue(&fv, x, y, z, probePtr);
+            getCompositeFieldValueProbe(&ref, x, y, z, torusProbe, solenoidProbe);
+            mu_assert("Field set value differs from the composite value.",
+                      (fv.b1 == ref.b1) && (fv.b2 == ref.b2) && (fv.b3 == ref.b3));
+
+            //the index never disagrees with the containment test
+            int slab = findSlab(setPtr, z, 0);
+            double bin = hypot(x, y) * setPtr->rhoNorm;
+            for (int m = 0; m < 2; m++) {
+                FieldSetMemberPtr member = setPtr->members + m;
+                double xx = x - member->shiftX;
+                double yy = y - member->shiftY;
+                bool contained = containsCylindrical(member->fieldPtr, hypot(xx, yy), z - member->shiftZ);
+                bool reach = (slab >= 0) && (bin < FIELDSETRHOBINS) && (setPtr->slabs[slab].reach[(int) bin] & (1u << m));
+                bool inside = reach && (setPtr->slabs[slab].inside[(int) bin] & (1u << m));
+                mu_assert("A map containing a point is not in its coverage index.", reach || !contained);
+                mu_assert("A map surely covering a point does not contain it.", contained || !inside);
+            }
+        }
+
+        //the solenoid reaches no bin beyond its outer radius, and surely
+        //covers some bins near its center
+        int slab = findSlab(setPtr, solenoid->shiftZ, 0);
+        double rhoOut = solenoid->rhoGridPtr->maxVal + hypot(solenoid->shiftX, solenoid->shiftY);
+        int numInside = 0;
+        for (int b = 0; b < FIELDSETRHOBINS; b++) {
+            if (b / setPtr->rhoNorm > rhoOut + 1) {
+                mu_assert("The solenoid is indexed beyond its outer radius.", !(setPtr->slabs[slab].reach[b] & 2u));
+            }
+            numInside += (setPtr->slabs[slab].inside[b] & 2u) ? 1 : 0;
+        }
+        mu_assert("The solenoid surely covers no bin.", numInside > 0);
+
+        freeFieldSetProbe(probePtr);
+        freeFieldSet(setPtr);
+    }
+    solenoid->shiftX = 0;
+    solenoid->shiftY = 0;
+    solenoid->shiftZ = 0;
+
+    //the solenoid twice, the second time downstream and scaled
+    FieldSetPtr setPtr = createFieldSet();
+    addFieldToSet(setPtr, solenoid);
+    int fringe = addFieldToSet(setPtr, solenoid);
+    double shiftZ = solenoid->zGridPtr->maxVal - solenoid->zGridPtr->minVal + 100;
+    setFieldSetShift(setPtr, fringe, 0, 0, shiftZ);
+    setFieldSetScale(setPtr, fringe, 0.5);
+    mu_assert("Bad slabs for separated maps.", (setPtr->numSlabs == 7) && (setPtr->slabs[1].numMembers == 1) &&
+              (setPtr->slabs[3].numMembers == 0) && (setPtr->slabs[5].numMembers == 1) &&
+              (setPtr->slabs[5].members[0] == fringe));
+
+    FieldSetProbePtr probePtr = createFieldSetProbe(setPtr);
+    for (int i = 0; i < 100000; i++) {
+        double x = randomDouble(-300, 300);
+        double y = randomDouble(-300, 300);
+        double z = randomDouble(solenoid->zGridPtr->minVal - 50, solenoid->zGridPtr->maxVal + shiftZ + 50);
+
+        getFieldSetValue(&fv, x, y, z, probePtr);
+        if (z < solenoid->zGridPtr->maxVal) {
+            getFieldValueProbe(&ref, x, y, z, solenoidProbe);
+        }
+        else {
+            getFieldValueProbe(&ref, x, y, z - shiftZ, solenoidProbe);
+            ref.b1 *= 0.5;
+            ref.b2 *= 0.5;
+            ref.b3 *= 0.5;
+        }
+        mu_assert("Field set value of a shifted and scaled map is wrong.",
+                  (fv.b1 == ref.b1) && (fv.b2 == ref.b2) && (fv.b3 == ref.b3));
+    }
+    freeFieldSetProbe(probePtr);
+
+    setFieldSetScale(setPtr, fringe, 0);
+    mu_assert("A map with zero scale is in the slabs.", (setPtr->numSlabs == 3) &&
+              (setPtr->slabs[1].numMembers == 1) && (setPtr->slabs[1].members[0] == 0));
+    mu_assert("A set with a bad index was changed.", !setFieldSetScale(setPtr, 2, 1) &&
+              !setFieldSetShift(setPtr, -1, 0, 0, 0));
+    freeFieldSet(setPtr);
+
+    freeProbe(torusProbe);
+    freeProbe(solenoidProbe);
+    fprintf(stdout, "\nPASSED fieldSetUnitTest\n");
+    return NULL;
+}
@@ -0,0 +1,694 @@
+//
+//  magfieldsimd.c
+//  cMag
+//  Vectorized tri-linear (torus) and bi-linear (solenoid) interpolation for
+//  batched lookups. Each point is first reduced by scalar code to a corner
+//  index, the fractional position in its cell and a 2x2 (+1) transform that
+//  combines the symmetric torus flip, the sector or phi rotation and the
+//  scale factor. The kernels then do the corner loads and multiply-adds for
+//  several points per instruction. There are kernels for AVX-512, AVX2/FMA
+//  and SSE2, chosen at run time, and a plain C kernel that is used for the
+//  leftover points and on other architectures. Compact (16 bit) values are
+//  decoded as they are gathered.
+//
+
+#include "magfieldsimd.h"
+#include "magfieldcompact.h"
+#include "magfieldutil.h"
+#include "munittest.h"
+#include <stdlib.h>
+#include <math.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CMAG_X86_SIMD 1
+#include <immintrin.h>
+#else
+#define CMAG_X86_SIMD 0
+#endif
+
+//number of points reduced and interpolated together
+#define SIMDCHUNK 256
+
+//some strings for prints
+const char *simdLevelLabels[] = { "scalar", "SSE2", "AVX2", "AVX-512" };
+
+//the level selected with setSimdLevel, or -1 for the best available
+static int _simdLevel = -1;
+
+//the per point results of the scalar reduction
+typedef struct simdchunk {
+    int index[SIMDCHUNK]; //offset (in floats) of the 000 corner
+    double f0[SIMDCHUNK]; //fractional phi position in the cell (0 for solenoid)
+    double f1[SIMDCHUNK]; //fractional rho position in the cell
+    double f2[SIMDCHUNK]; //fractional z position in the cell
+
+    //the transform from map components to scaled Cartesian components,
+    //all zero for points outside the map
+    double r11[SIMDCHUNK];
+    double r12[SIMDCHUNK];
+    double r21[SIMDCHUNK];
+    double r22[SIMDCHUNK];
+    double r33[SIMDCHUNK];
+} SimdChunk;
+
+//the values of a map as the kernels see them
+typedef struct simdvalues {
+    const float *floats; //the FLOAT32 values, or NULL if compact
+    const uint16_t *compact; //the compact values, or NULL
+    StoragePrecision precision;
+    float scale; //the compact scale for SCALED_INT16
+} SimdValues;
+
+//local prototypes
+static float loadValue(const SimdValues *, int);
+static void reduceChunk(SimdChunk *, const double *, const double *, const double *,
+                        int, MagneticFieldPtr);
+static void kernelScalar(const SimdValues *, const SimdChunk *, int, int, const int *, int, int,
+                         float *, float *, float *, bool);
+#if CMAG_X86_SIMD
+static void kernelSSE2(const SimdValues *, const SimdChunk *, int, const int *, int, int,
+                       float *, float *, float *, bool);
+static void kernelAVX2(const SimdValues *, const SimdChunk *, int, const int *, int, int,
+                       float *, float *, float *, bool);
+static void kernelAVX512(const SimdValues *, const SimdChunk *, int, const int *, int, int,
+                         float *, float *, float *, bool);
+#endif
+
+/**
+ * Get the best instruction set for which there is a kernel
+ * and which is supported by this processor.
+ * @return the best available SIMD level.
+ */
+SimdLevel getBestSimdLevel() {
+#if CMAG_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        return SIMD_AVX512;
+    }
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") && __builtin_cpu_supports("f16c")) {
+        return SIMD_AVX2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return SIMD_SSE2;
+    }
+#endif
+    return SIMD_SCALAR;
+}
+
+/**
+ * Get the SIMD level that the batched lookups will use.
+ * @return the SIMD level in use.
+ */
+SimdLevel getSimdLevel() {
+    SimdLevel best = getBestSimdLevel();
+    if ((_simdLevel < 0) || (_simdLevel > (int) best)) {
+        return best;
+    }
+    return (SimdLevel) _simdLevel;
+}
+
+/**
+ * Select the SIMD level for the batched lookups, mostly for testing and
+ * benchmarking. Levels not supported by the processor fall back to the best one
+ * that is. This is a global setting.
+ * @param level the desired SIMD level.
+ */
+void setSimdLevel(SimdLevel level) {
+    _simdLevel = level;
+}
+
+/**
+ * Load one map component for the plain C kernels, decoding compact values.
+ * @param values the map values.
+ * @param offset the offset in components (floats or 16 bit words).
+ * @return the component in kG.
+ */
+static inline float loadValue(const SimdValues *values, int offset) {
+    if (values->floats != NULL) {
+        return values->floats[offset];
+    }
+    if (values->precision == FLOAT16) {
+        return halfToFloat(values->compact[offset]);
+    }
+    return values->scale * (int16_t) values->compact[offset];
+}
+
+/**
+ * Reduce a chunk of points to corner indices, cell fractions and transforms.
+ * This is where all the branching (bounds, symmetric flip, sector) happens,
+ * so that the kernels are branch free.
+ * @param chunk will hold the results.
+ * @param x the x coordinates in cm.
+ * @param y the y coordinates in cm.
+ * @param z the z coordinates in cm.
+ * @param n the number of points, at most SIMDCHUNK.
+ * @param fieldPtr the field.
+ */
+static void reduceChunk(SimdChunk *chunk, const double *x, const double *y, const double *z,
+                        int n, MagneticFieldPtr fieldPtr) {
+
+    GridPtr phiGrid = fieldPtr->phiGridPtr;
+    GridPtr rhoGrid = fieldPtr->rhoGridPtr;
+    GridPtr zGrid = fieldPtr->zGridPtr;
+
+    double phiNorm = 1. / phiGrid->delta;
+    double rhoNorm = 1. / rhoGrid->delta;
+    double zNorm = 1. / zGrid->delta;
+
+    double scale = fieldPtr->scale;
+    bool torus = (fieldPtr->type == TORUS);
+    int N23 = fieldPtr->N23;
+    int NZ = zGrid->numPoints;
+
+    for (int i = 0; i < n; i++) {
+        double xx = x[i] - fieldPtr->shiftX;
+        double yy = y[i] - fieldPtr->shiftY;
+        double zz = z[i] - fieldPtr->shiftZ;
+        double rho = hypot(xx, yy);
+
+        int nPhi = 0, nRho = -1, nZ = -1;
+        double phi = 0;
+
+        if (containsCylindrical(fieldPtr, rho, zz)) {
+            if (torus && !fieldPtr->symmetric) {
+                phi = toDegrees(atan2(yy, xx));
+            }
+            nRho = getIndex(rhoGrid, rho);
+            nZ = getIndex(zGrid, zz);
+        }
+
+        double c = 1, s = 0, flip = 1;
+
+        if (torus && (nZ >= 0)) {
+            if (fieldPtr->symmetric) {
+                double relPhi;
+                int sector;
+                sectorFold(xx, yy, &relPhi, &sector);
+                flip = (relPhi < 0.0) ? -1 : 1;
+                c = cosSect[sector];
+                s = sinSect[sector];
+                phi = fabs(relPhi);
+            }
+            else if (phi < 0) {
+                phi += 360;
+            }
+            nPhi = getIndex(phiGrid, phi);
+        }
+
+        if ((nPhi < 0) || (nRho < 0) || (nZ < 0)) {
+            chunk->index[i] = 0;
+            chunk->f0[i] = 0;
+            chunk->f1[i] = 0;
+            chunk->f2[i] = 0;
+            chunk->r11[i] = 0;
+            chunk->r12[i] = 0;
+            chunk->r21[i] = 0;
+            chunk->r22[i] = 0;
+            chunk->r33[i] = 0;
+            continue;
+        }
+
+        chunk->index[i] = 3 * (nPhi * N23 + nRho * NZ + nZ);
+        chunk->f1[i] = (rho - rhoGrid->values[nRho]) * rhoNorm;
+        chunk->f2[i] = (zz - zGrid->values[nZ]) * zNorm;
+
+        if (torus) {
+            chunk->f0[i] = (phi - phiGrid->values[nPhi]) * phiNorm;
+            chunk->r11[i] = scale * c * flip;
+            chunk->r12[i] = -scale * s;
+            chunk->r21[i] = scale * s * flip;
+            chunk->r22[i] = scale * c;
+            chunk->r33[i] = scale * flip;
+        }
+        else { //solenoid: b1 (Bphi) is 0 and b2 (Brho) is rotated by phi
+            chunk->f0[i] = 0;
+            chunk->r11[i] = 0;
+            chunk->r12[i] = (rho > 0) ? scale * (xx / rho) : scale;
+            chunk->r21[i] = 0;
+            chunk->r22[i] = (rho > 0) ? scale * (yy / rho) : 0;
+            chunk->r33[i] = scale;
+        }
+    }
+}
+
+/**
+ * The plain C kernel.
+ * @param values the field values of the map.
+ * @param chunk the reduced points.
+ * @param from the first point to process.
+ * @param to one past the last point to process.
+ * @param off the offsets (in floats) of the corners relative to the 000 corner.
+ * @param nCorner 8 for the torus, 4 for the solenoid.
+ * @param comp0 the first map component used (1 for the solenoid, which has no Bphi).
+ * @param bx the x components of the field in kG.
+ * @param by the y components of the field in kG.
+ * @param bz the z components of the field in kG.
+ * @param accumulate if true, add to the output rather than overwrite it.
+ */
+static void kernelScalar(const SimdValues *values, const SimdChunk *chunk, int from, int to,
+                         const int *off, int nCorner, int comp0,
+                         float *bx, float *by, float *bz, bool accumulate) {
+
+    for (int i = from; i < to; i++) {
+        double f0 = chunk->f0[i], f1 = chunk->f1[i], f2 = chunk->f2[i];
+        double g0 = 1 - f0, g1 = 1 - f1, g2 = 1 - f2;
+        double a[8];
+
+        a[0] = g0 * g1 * g2;
+        a[1] = g0 * g1 * f2;
+        a[2] = g0 * f1 * g2;
+        a[3] = g0 * f1 * f2;
+        a[4] = f0 * g1 * g2;
+        a[5] = f0 * g1 * f2;
+        a[6] = f0 * f1 * g2;
+        a[7] = f0 * f1 * f2;
+
+        double b[3] = {0, 0, 0};
+        int base = chunk->index[i];
+        for (int k = 0; k < nCorner; k++) {
+            for (int j = comp0; j < 3; j++) {
+                b[j] += loadValue(values, base + off[k] + j) * a[k];
+            }
+        }
+
+        float vx = (float) (chunk->r11[i] * b[0] + chunk->r12[i] * b[1]);
+        float vy = (float) (chunk->r21[i] * b[0] + chunk->r22[i] * b[1]);
+        float vz = (float) (chunk->r33[i] * b[2]);
+
+        if (accumulate) {
+            bx[i] += vx;
+            by[i] += vy;
+            bz[i] += vz;
+        }
+        else {
+            bx[i] = vx;
+            by[i] = vy;
+            bz[i] = vz;
+        }
+    }
+}
+
+#if CMAG_X86_SIMD
+
+/**
+ * The SSE2 kernel, two points at a time. SSE2 has no gather, so the corner
+ * loads are scalar but the arithmetic is vectorized. Parameters are as for
+ * kernelScalar, with from = 0 and to = n. A leftover point is not processed;
+ * that is left for the scalar kernel.
+ */
+__attribute__((target("sse2")))
+static void kernelSSE2(const SimdValues *values, const SimdChunk *chunk, int n,
+                       const int *off, int nCorner, int comp0,
+                       float *bx, float *by, float *bz, bool accumulate) {
+
+    __m128d one = _mm_set1_pd(1.0);
+
+    for (int i = 0; i + 2 <= n; i += 2) {
+        __m128d f0 = _mm_loadu_pd(chunk->f0 + i);
+        __m128d f1 = _mm_loadu_pd(chunk->f1 + i);
+        __m128d f2 = _mm_loadu_pd(chunk->f2 + i);
+        __m128d g0 = _mm_sub_pd(one, f0);
+        __m128d g1 = _mm_sub_pd(one, f1);
+        __m128d g2 = _mm_sub_pd(one, f2);
+
+        __m128d gg = _mm_mul_pd(g0, g1);
+        __m128d gf = _mm_mul_pd(g0, f1);
+        __m128d fg = _mm_mul_pd(f0, g1);
+        __m128d ff = _mm_mul_pd(f0, f1);
+
+        __m128d a[8];
+        a[0] = _mm_mul_pd(gg, g2);
+        a[1] = _mm_mul_pd(gg, f2);
+        a[2] = _mm_mul_pd(gf, g2);
+        a[3] = _mm_mul_pd(gf, f2);
+        a[4] = _mm_mul_pd(fg, g2);
+        a[5] = _mm_mul_pd(fg, f2);
+        a[6] = _mm_mul_pd(ff, g2);
+        a[7] = _mm_mul_pd(ff, f2);
+
+        int p0 = chunk->index[i];
+        int p1 = chunk->index[i + 1];
+
+        __m128d b[3];
+        b[0] = b[1] = b[2] = _mm_setzero_pd();
+        for (int k = 0; k < nCorner; k++) {
+            for (int j = comp0; j < 3; j++) {
+                __m128d v = _mm_set_pd(loadValue(values, p1 + off[k] + j),
+                                       loadValue(values, p0 + off[k] + j));
+                b[j] = _mm_add_pd(b[j], _mm_mul_pd(v, a[k]));
+            }
+        }
+
+        __m128d vx = _mm_add_pd(_mm_mul_pd(_mm_loadu_pd(chunk->r11 + i), b[0]),
+                                _mm_mul_pd(_mm_loadu_pd(chunk->r12 + i), b[1]));
+        __m128d vy = _mm_add_pd(_mm_mul_pd(_mm_loadu_pd(chunk->r21 + i), b[0]),
+                                _mm_mul_pd(_mm_loadu_pd(chunk->r22 + i), b[1]));
+        __m128d vz = _mm_mul_pd(_mm_loadu_pd(chunk->r33 + i), b[2]);
+
+        float ox[4], oy[4], oz[4];
+        _mm_storeu_ps(ox, _mm_cvtpd_ps(vx));
+        _mm_storeu_ps(oy, _mm_cvtpd_ps(vy));
+        _mm_storeu_ps(oz, _mm_cvtpd_ps(vz));
+
+        for (int l = 0; l < 2; l++) {
+            if (accumulate) {
+                bx[i + l] += ox[l];
+                by[i + l] += oy[l];
+                bz[i + l] += oz[l];
+            }
+            else {
+                bx[i + l] = ox[l];
+                by[i + l] = oy[l];
+                bz[i + l] = oz[l];
+            }
+        }
+    }
+}
+
+/**
+ * Gather one component of four corners for the AVX2 kernel. Compact values
+ * are gathered as 32 bit words (the allocation is padded for the last one)
+ * and the low halves decoded.
+ * @param values the map values.
+ * @param j the component.
+ * @param corner the offsets of the corners in components.
+ * @return the components in kG.
+ */
+__attribute__((target("avx2,fma,f16c")))
+static inline __m256d gatherAVX2(const SimdValues *values, int j, __m128i corner) {
+    if (values->floats != NULL) {
+        return _mm256_cvtps_pd(_mm_i32gather_ps(values->floats + j, corner, 4));
+    }
+
+    __m128i words = _mm_i32gather_epi32((const int *) (values->compact + j), corner, 2);
+    if (values->precision == FLOAT16) {
+        __m128i halves = _mm_shuffle_epi8(words, _mm_setr_epi8(0, 1, 4, 5, 8, 9, 12, 13,
+                                                               -1, -1, -1, -1, -1, -1, -1, -1));
+        return _mm256_cvtps_pd(_mm_cvtph_ps(halves));
+    }
+
+    __m128i ints = _mm_srai_epi32(_mm_slli_epi32(words, 16), 16);
+    return _mm256_cvtps_pd(_mm_mul_ps(_mm_cvtepi32_ps(ints), _mm_set1_ps(values->scale)));
+}
+
+/**
+ * The AVX2 kernel, four points at a time, using gathers for the corner loads
+ * and fused multiply-adds. Parameters are as for kernelSSE2.
+ */
+__attribute__((target("avx2,fma,f16c")))
+static void kernelAVX2(const SimdValues *values, const SimdChunk *chunk, int n,
+                       const int *off, int nCorner, int comp0,
+                       float *bx, float *by, float *bz, bool accumulate) {
+
+    __m256d one = _mm256_set1_pd(1.0);
+
+    for (int i = 0; i + 4 <= n; i += 4) {
+        __m256d f0 = _mm256_loadu_pd(chunk->f0 + i);
+        __m256d f1 = _mm256_loadu_pd(chunk->f1 + i);
+        __m256d f2 = _mm256_loadu_pd(chunk->f2 + i);
+        __m256d g0 = _mm256_sub_pd(one, f0);
+        __m256d g1 = _mm256_sub_pd(one, f1);
+        __m256d g2 = _mm256_sub_pd(one, f2);
+
+        __m256d gg = _mm256_mul_pd(g0, g1);
+        __m256d gf = _mm256_mul_pd(g0, f1);
+        __m256d fg = _mm256_mul_pd(f0, g1);
+        __m256d ff = _mm256_mul_pd(f0, f1);
+
+        __m256d a[8];
+        a[0] = _mm256_mul_pd(gg, g2);
+        a[1] = _mm256_mul_pd(gg, f2);
+        a[2] = _mm256_mul_pd(gf, g2);
+        a[3] = _mm256_mul_pd(gf, f2);
+        a[4] = _mm256_mul_pd(fg, g2);
+        a[5] = _mm256_mul_pd(fg, f2);
+        a[6] = _mm256_mul_pd(ff, g2);
+        a[7] = _mm256_mul_pd(ff, f2);
+
+        __m128i index = _mm_loadu_si128((const __m128i *) (chunk->index + i));
+
+        __m256d b[3];
+        b[0] = b[1] = b[2] = _mm256_setzero_pd();
+        for (int k = 0; k < nCorner; k++) {
+            __m128i corner = _mm_add_epi32(index, _mm_set1_epi32(off[k]));
+            for (int j = comp0; j < 3; j++) {
+                __m256d v = gatherAVX2(values, j, corner);
+                b[j] = _mm256_fmadd_pd(v, a[k], b[j]);
+            }
+        }
+
+        __m256d vx = _mm256_fmadd_pd(_mm256_loadu_pd(chunk->r11 + i), b[0],
+                                     _mm256_mul_pd(_mm256_loadu_pd(chunk->r12 + i), b[1]));
+        __m256d vy = _mm256_fmadd_pd(_mm256_loadu_pd(chunk->r21 + i), b[0],
+                                     _mm256_mul_pd(_mm256_loadu_pd(chunk->r22 + i), b[1]));
+        __m256d vz = _mm256_mul_pd(_mm256_loadu_pd(chunk->r33 + i), b[2]);
+
+        __m128 ox = _mm256_cvtpd_ps(vx);
+        __m128 oy = _mm256_cvtpd_ps(vy);
+        __m128 oz = _mm256_cvtpd_ps(vz);
+
+        if (accumulate) {
+            ox = _mm_add_ps(ox, _mm_loadu_ps(bx + i));
+            oy = _mm_add_ps(oy, _mm_loadu_ps(by + i));
+            oz = _mm_add_ps(oz, _mm_loadu_ps(bz + i));
+        }
+        _mm_storeu_ps(bx + i, ox);
+        _mm_storeu_ps(by + i, oy);
+        _mm_storeu_ps(bz + i, oz);
+    }
+}
+
+/**
+ * Gather one component of eight corners for the AVX-512 kernel, as for gatherAVX2.
+ * @param values the map values.
+ * @param j the component.
+ * @param corner the offsets of the corners in components.
+ * @return the components in kG.
+ */
+__attribute__((target("avx512f")))
+static inline __m512d gatherAVX512(const SimdValues *values, int j, __m256i corner) {
+    if (values->floats != NULL) {
+        return _mm512_cvtps_pd(_mm256_i32gather_ps(values->floats + j, corner, 4));
+    }
+
+    __m256i words = _mm256_i32gather_epi32((const int *) (values->compact + j), corner, 2);
+    if (values->precision == FLOAT16) {
+        __m256i halves = _mm512_cvtepi32_epi16(_mm512_castsi256_si512(words));
+        return _mm512_cvtps_pd(_mm512_castps512_ps256(_mm512_cvtph_ps(halves)));
+    }
+
+    __m256i ints = _mm256_srai_epi32(_mm256_slli_epi32(words, 16), 16);
+    return _mm512_cvtps_pd(_mm256_mul_ps(_mm256_cvtepi32_ps(ints), _mm256_set1_ps(values->scale)));
+}
+
+/**
+ * The AVX-512 kernel, eight points at a time. Parameters are as for kernelSSE2.
+ */
+__attribute__((target("avx512f")))
+static void kernelAVX512(const SimdValues *values, const SimdChunk *chunk, int n,
+                         const int *off, int nCorner, int comp0,
+                         float *bx, float *by, float *bz, bool accumulate) {
+
+    __m512d one = _mm512_set1_pd(1.0);
+
+    for (int i = 0; i + 8 <= n; i += 8) {
+        __m512d f0 = _mm512_loadu_pd(chunk->f0 + i);
+        __m512d f1 = _mm512_loadu_pd(chunk->f1 + i);
+        __m512d f2 = _mm512_loadu_pd(chunk->f2 + i);
+        __m512d g0 = _mm512_sub_pd(one, f0);
+        __m512d g1 = _mm512_sub_pd(one, f1);
+        __m512d g2 = _mm512_sub_pd(one, f2);
+
+        __m512d gg = _mm512_mul_pd(g0, g1);
+        __m512d gf = _mm512_mul_pd(g0, f1);
+        __m512d fg = _mm512_mul_pd(f0, g1);
+        __m512d ff = _mm512_mul_pd(f0, f1);
+
+        __m512d a[8];
+        a[0] = _mm512_mul_pd(gg, g2);
+        a[1] = _mm512_mul_pd(gg, f2);
+        a[2] = _mm512_mul_pd(gf, g2);
+        a[3] = _mm512_mul_pd(gf, f2);
+        a[4] = _mm512_mul_pd(fg, g2);
+        a[5] = _mm512_mul_pd(fg, f2);
+        a[6] = _mm512_mul_pd(ff, g2);
+        a[7] = _mm512_mul_pd(ff, f2);
+
+        __m256i index = _mm256_loadu_si256((const __m256i *) (chunk->index + i));
+
+        __m512d b[3];
+        b[0] = b[1] = b[2] = _mm512_setzero_pd();
+        for (int k = 0; k < nCorner; k++) {
+            __m256i corner = _mm256_add_epi32(index, _mm256_set1_epi32(off[k]));
+            for (int j = comp0; j < 3; j++) {
+                __m512d v = gatherAVX512(values, j, corner);
+                b[j] = _mm512_fmadd_pd(v, a[k], b[j]);
+            }
+        }
+
+        __m512d vx = _mm512_fmadd_pd(_mm512_loadu_pd(chunk->r11 + i), b[0],
+                                     _mm512_mul_pd(_mm512_loadu_pd(chunk->r12 + i), b[1]));
+        __m512d vy = _mm512_fmadd_pd(_mm512_loadu_pd(chunk->r21 + i), b[0],
+                                     _mm512_mul_pd(_mm512_loadu_pd(chunk->r22 + i), b[1]));
+        __m512d vz = _mm512_mul_pd(_mm512_loadu_pd(chunk->r33 + i), b[2]);
+
+        __m256 ox = _mm512_cvtpd_ps(vx);
+        __m256 oy = _mm512_cvtpd_ps(vy);
+        __m256 oz = _mm512_cvtpd_ps(vz);
+
+        if (accumulate) {
+            ox = _mm256_add_ps(ox, _mm256_loadu_ps(bx + i));
+            oy = _mm256_add_ps(oy, _mm256_loadu_ps(by + i));
+            oz = _mm256_add_ps(oz, _mm256_loadu_ps(bz + i));
+        }
+        _mm256_storeu_ps(bx + i, ox);
+        _mm256_storeu_ps(by + i, oy);
+        _mm256_storeu_ps(bz + i, oz);
+    }
+}
+
+#endif
+
+/**
+ * Obtain the interpolated value of a field at many points using the
+ * vectorized kernels. This does not use a probe (or cell), so it is
+ * thread safe. It always interpolates, regardless of the algorithm setting.
+ * @param x the x coordinates in cm.
+ * @param y the y coordinates in cm.
+ * @param z the z coordinates in cm.
+ * @param bx upon return the x components of the field in kG.
+ * @param by upon return the y components of the field in kG.
+ * @param bz upon return the z components of the field in kG.
+ * @param n the number of points.
+ * @param fieldPtr the field.
+ * @param accumulate if true, the field is added to what is already in bx, by, bz.
+ */
+void simdFieldValues(const double *x, const double *y, const double *z,
+                     float *bx, float *by, float *bz, int n,
+                     MagneticFieldPtr fieldPtr, bool accumulate) {
+
+    SimdChunk chunk;
+    SimdLevel level = getSimdLevel();
+
+    //the compact values are used if there are any, as in the cells
+    SimdValues values;
+    values.floats = (fieldPtr->compactValues == NULL) ? (const float *) fieldPtr->fieldValues : NULL;
+    values.compact = fieldPtr->compactValues;
+    values.precision = fieldPtr->precision;
+    values.scale = fieldPtr->compactScale;
+
+    //corner offsets in floats, in the order of the interpolation weights
+    int NZ3 = 3 * fieldPtr->zGridPtr->numPoints;
+    int N233 = 3 * fieldPtr->N23;
+    int off[8] = {0, 3, NZ3, NZ3 + 3, N233, N233 + 3, N233 + NZ3, N233 + NZ3 + 3};
+
+    bool torus = (fieldPtr->type == TORUS);
+    int nCorner = torus ? 8 : 4;
+    int comp0 = torus ? 0 : 1;
+
+    for (int start = 0; start < n; start += SIMDCHUNK) {
+        int m = n - start;
+        if (m > SIMDCHUNK) {
+            m = SIMDCHUNK;
+        }
+
+        reduceChunk(&chunk, x + start, y + start, z + start, m, fieldPtr);
+
+        int done = 0;
+#if CMAG_X86_SIMD
+        switch (level) {
+            case SIMD_AVX512:
+                kernelAVX512(&values, &chunk, m, off, nCorner, comp0,
+                             bx + start, by + start, bz + start, accumulate);
+                done = m - (m % 8);
+                break;
+
+            case SIMD_AVX2:
+                kernelAVX2(&values, &chunk, m, off, nCorner, comp0,
+                           bx + start, by + start, bz + start, accumulate);
+                done = m - (m % 4);
+                break;
+
+            case SIMD_SSE2:
+                kernelSSE2(&values, &chunk, m, off, nCorner, comp0,
+                           bx + start, by + start, bz + start, accumulate);
+                done = m - (m % 2);
+                break;
+
+            default:
+                break;
+        }
+#endif
+        kernelScalar(&values, &chunk, done, m, off, nCorner, comp0,
+                     bx + start, by + start, bz + start, accumulate);
+    }
+}
+
+/**
+ * A unit test for the vectorized kernels. Every available SIMD level is
+ * compared with the scalar (single point) lookup.
+ * @return an error message if the test fails, or NULL if it passes.
+ */
+char *simdUnitTest() {
+
+    int n = 100003; //not a multiple of the vector width
+    FieldValue fv;
+    int savedLevel = _simdLevel;
+    Algorithm algorithm = getFieldAlgorithm(testFieldPtr);
+    setFieldAlgorithm(testFieldPtr, INTERPOLATION);
+
+    //float tolerance relative to the biggest field in the map
+    double tolerance = 1.0e-5 * testFieldPtr->metricsPtr->maxFieldMagnitude * fabs(testFieldPtr->scale);
+
+    double *x = (double *) malloc(3 * n * sizeof(double));
+    double *y = x + n;
+    double *z = y + n;
+    float *b = (float *) malloc(3 * n * sizeof(float));
+
+    for (int i = 0; i < n; i++) {
+        double phi = randomDouble(0, 360);
+        double rho = randomDouble(0, 1.1 * testFieldPtr->rhoGridPtr->maxVal);
+        z[i] = randomDouble(testFieldPtr->zGridPtr->minVal - 10, testFieldPtr->zGridPtr->maxVal + 10);
+        cylindricalToCartesian(x + i, y + i, phi, rho);
+    }
+
+    //include the sector boundaries and the symmetric torus wedge edges
+    for (int i = 0; i < 24; i++) {
+        cylindricalToCartesian(x + i, y + i, 15.0 * i, 0.5 * testFieldPtr->rhoGridPtr->maxVal);
+    }
+
+    SimdLevel best = getBestSimdLevel();
+
+    //float values, then each compact precision (decoded in the cells by getFieldValue)
+    for (int precision = FLOAT32; precision <= SCALED_INT16; precision++) {
+        if (precision != FLOAT32) {
+            mu_assert("Could not add compact values.", addCompactValues(testFieldPtr, (StoragePrecision) precision));
+        }
+
+        for (int level = SIMD_SCALAR; level <= (int) best; level++) {
+            setSimdLevel((SimdLevel) level);
+            simdFieldValues(x, y, z, b, b + n, b + 2 * n, n, testFieldPtr, false);
+
+            for (int i = 0; i < n; i++) {
+                getFieldValue(&fv, x[i], y[i], z[i], testFieldPtr);
+                bool result = (fabs(fv.b1 - b[i]) <= tolerance) &&
+                              (fabs(fv.b2 - b[i + n]) <= tolerance) &&
+                              (fabs(fv.b3 - b[i + 2 * n]) <= tolerance);
+                if (!result) {
+                    fprintf(stderr, "%s %s mismatch at (%-9.3f, %-9.3f, %-9.3f)\n", precisionLabels[precision],
+                            simdLevelLabels[level], x[i], y[i], z[i]);
+                }
+                mu_assert("The SIMD value did not match the scalar value.", result);
+            }
+        }
+        removeCompactValues(testFieldPtr);
+    }
+
+    _simdLevel = savedLevel;
+    setFieldAlgorithm(testFieldPtr, algorithm);
+    free(b);
+    free(x);
+
+    fprintf(stdout, "\nPASSED simdUnitTest (best level: %s)\n", simdLevelLabels[best]);
+    return NULL;
+}
@@ -0,0 +1,2490 @@
+//
+//  magfieldswim.c
+//  cMag
+//  Runge-Kutta swimming of charged particles through the composite field.
+//  The state is the position and the direction cosines, the independent
+//  variable is the path length s. With k = q * SWIMCONSTANT / p the equations
+//  of motion are dr/ds = t and dt/ds = k t x B. Field lines are traced by
+//  the same stepper, with dr/ds = +-B/|B|.
+//
+
+#include "magfieldswim.h"
+#include "magfieldio.h"
+#include "magfieldutil.h"
+#include "magfieldpool.h"
+#include "magfieldgrad.h"
+#include "magfielduniform.h"
+#include "munittest.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+//number of state variables (x, y, z, tx, ty, tz)
+#define NSTATE 6
+
+//the state followed by the 6x7 Jacobian, row major
+#define MAXSTATE (NSTATE + NSTATE * 7)
+
+//the first adaptive step, cm
+#define SWIMFIRSTSTEP 1.0
+
+//the most trial steps when landing on a stopping surface
+#define SWIMSURFACEITERATIONS 10
+
+//the most smallest steps a field line takes over jumps in the field without
+//a step of FIELDLINEJUMPS smallest steps in between, before it is considered
+//caught on a jump that the field points into from both sides
+#define FIELDLINEJUMPS 100
+
+//step prediction: the error constants for smooth fields (see stepFromBound)
+//and for crossing the edge of a map, and how far short of an edge a step
+//stops (see predictedStep)
+#define PREDICTSMOOTH 1.0e-3
+#define PREDICTJUMP 0.1
+#define PREDICTMARGIN 0.1
+
+//step size controller, the usual safety factor and limits on the change
+#define SAFETY 0.9
+#define MINSCALE 0.2
+#define MAXSCALE 5.0
+
+//some strings for prints
+const char *swimStatusLabels[] = {"SWIM_OK", "SWIM_MAX_STEPS", "SWIM_STEP_TOO_SMALL", "SWIM_NO_FIELD"};
+
+//Dormand-Prince 5(4) coefficients. The field is static, so the stage times are not needed.
+//Row j gives the weights of the earlier stages for stage j, the last row is the solution.
+static const double dpA[7][6] = {
+    {0},
+    {1.0 / 5.0},
+    {3.0 / 40.0, 9.0 / 40.0},
+    {44.0 / 45.0, -56.0 / 15.0, 32.0 / 9.0},
+    {19372.0 / 6561.0, -25360.0 / 2187.0, 64448.0 / 6561.0, -212.0 / 729.0},
+    {9017.0 / 3168.0, -355.0 / 33.0, 46732.0 / 5247.0, 49.0 / 176.0, -5103.0 / 18656.0},
+    {35.0 / 384.0, 0, 500.0 / 1113.0, 125.0 / 192.0, -2187.0 / 6784.0, 11.0 / 84.0}
+};
+
+//difference between the 5th and 4th order solutions
+static const double dpE[7] = {71.0 / 57600.0, 0, -71.0 / 16695.0, 71.0 / 1920.0,
+                              -17253.0 / 339200.0, 22.0 / 525.0, -1.0 / 40.0};
+
+//tracks per work item of swimTracksSimd
+#define SWIMLANEBLOCK 256
+
+typedef struct swimlanes *SwimLanesPtr;
+
+//a bundle of tracks stepped together, one per lane, in structure of arrays
+//form so that the per lane arithmetic is a dense loop over the lanes
+typedef struct swimlanes {
+    SwimmerPtr swimmer;     //the probes and settings
+    SwimTrackPtr tracks;    //all the tracks
+    int nextTrack;          //the next track to load into an idle lane
+    int endTrack;           //one past the last track of this block
+
+    int track[SWIMLANES];       //the track in each lane, -1 if idle
+    int evaluations[SWIMLANES]; //field evaluations of each lane's track
+    bool last[SWIMLANES];       //the step ends the track
+    double k[SWIMLANES];        //charge * SWIMCONSTANT / momentum, 0 if idle
+    double s[SWIMLANES];        //path length swum
+    double h[SWIMLANES];        //step size, 0 if idle
+    double error[SWIMLANES];    //error estimate of the step, relative to the tolerance
+
+    double y[NSTATE][SWIMLANES];     //the state
+    double yNew[NSTATE][SWIMLANES];  //the state at the end of the step
+    double ks[7][NSTATE][SWIMLANES]; //the stages, ks[0] is the derivative at the start
+
+    //the packed positions and fields of the lanes being evaluated
+    double px[SWIMLANES], py[SWIMLANES], pz[SWIMLANES];
+    float bx[SWIMLANES], by[SWIMLANES], bz[SWIMLANES];
+} SwimLanes;
+
+//the right hand side of the equations of motion, possibly extended
+typedef void (*SwimDerivative)(SwimmerPtr, double, const double *, double *);
+
+//local prototypes
+static void derivative(SwimmerPtr, double, const double *, double *);
+static void rk4Step(SwimmerPtr, double, double, double *);
+static double dormandPrinceStep(SwimmerPtr, SwimDerivative, int, double, double, const double *,
+                                const double *, double *, double *);
+static void adaptiveSteps(SwimmerPtr, SwimDerivative, int, double, double *, double *, double, double,
+                          const SwimSurface *, SwimPointPtr, int, SwimResultPtr);
+static double helixLength(SwimmerPtr, double, const double *, const double *, double, double);
+static void helixStep(double, double, const double *, const double *, double *);
+static double stepFromBound(double, double, const DerivativeBound *);
+static double firstRoot(double, double, double, double);
+static double edgeCrossing(MagneticFieldPtr, const double *, const double *, double);
+static double predictedStep(SwimmerPtr, double, const double *, const double *, double);
+static double edgeLimitedStep(SwimmerPtr, double, const double *, const double *, double, double,
+                              const DerivativeBound *);
+static void setSectorNormal(SwimSurfacePtr, int);
+static double hermiteRoot(SwimmerPtr, const SwimSurface *, double, double, double,
+                          const double *, const double *, const double *, const double *);
+static void landOnSurface(SwimmerPtr, SwimDerivative, int, double, const SwimSurface *, double, double, double,
+                          double *, double *, double *, double *, double, double *, SwimPointPtr, int, SwimResultPtr);
+static void jacobianDerivative(SwimmerPtr, double, const double *, double *);
+static void fieldLineDerivative(SwimmerPtr, double, const double *, double *);
+static void fieldLineWork(void *, int, int);
+static void swimPlanes(SwimmerPtr, double, const double *, double, double, double *);
+static void planeTransport(const SwimPoint *, const double *, const double *, double (*)[7], double (*)[5]);
+static void startSwim(SwimmerPtr, const SwimPoint *, double *, SwimPointPtr, int, SwimResultPtr);
+static void storePoint(const double *, double, SwimPointPtr, int, SwimResultPtr);
+static double shrinkStep(SwimmerPtr, double, double);
+static double growStep(SwimmerPtr, double, double);
+static void swimTrackWork(void *, int, int);
+static int runSwimTracks(MagneticFieldPtr, MagneticFieldPtr, SwimTrackPtr, int, int, const Swimmer *,
+                         WorkFunction, int);
+static bool loadLane(SwimLanesPtr, int);
+static void finishLane(SwimLanesPtr, int);
+static void laneDerivative(SwimLanesPtr, double (*)[SWIMLANES], double (*)[SWIMLANES], const bool *);
+static void laneDormandPrince(SwimLanesPtr, const bool *);
+static void swimLaneBlock(SwimLanesPtr);
+static void swimLaneWork(void *, int, int);
+
+//what the workers of swimTracks share
+typedef struct swimtrackscontext {
+    SwimmerPtr *swimmers; //one per worker
+    SwimTrackPtr tracks;
+    int numTracks;
+} SwimTracksContext;
+
+/**
+ * Create a swimmer for a torus and solenoid pair. The swimmer has its own
+ * probes, so it must not be shared between threads, but the fields can be.
+ * @param torus the torus field (can be NULL).
+ * @param solenoid the solenoid field (can be NULL).
+ * @return the swimmer, free it with freeSwimmer.
+ */
+SwimmerPtr createSwimmer(MagneticFieldPtr torus, MagneticFieldPtr solenoid) {
+    SwimmerPtr swimmer = (SwimmerPtr) malloc(sizeof(Swimmer));
+
+    swimmer->torusProbe = (torus == NULL) ? NULL : createProbe(torus);
+    swimmer->solenoidProbe = (solenoid == NULL) ? NULL : createProbe(solenoid);
+
+    swimmer->tolerance = SWIMTOLERANCE;
+    swimmer->minStep = SWIMMINSTEP;
+    swimmer->maxStep = SWIMMAXSTEP;
+    swimmer->maxSteps = SWIMMAXSTEPS;
+    swimmer->surfaceTolerance = SWIMSURFACETOLERANCE;
+    swimmer->helix = false;
+    swimmer->predictSteps = false;
+    swimmer->numFieldEvaluations = 0;
+    memset(swimmer->field, 0, sizeof(swimmer->field));
+    return swimmer;
+}
+
+/**
+ * Free a swimmer and its probes (but not the fields).
+ * @param swimmer the swimmer.
+ */
+void freeSwimmer(SwimmerPtr swimmer) {
+    if (swimmer == NULL) {
+        return;
+    }
+    freeProbe(swimmer->torusProbe);
+    freeProbe(swimmer->solenoidProbe);
+    free(swimmer);
+}
+
+/**
+ * Initialize a start point from a position and the polar angles of the direction.
+ * @param point the point.
+ * @param x the x coordinate in cm.
+ * @param y the y coordinate in cm.
+ * @param z the z coordinate in cm.
+ * @param theta the polar angle of the direction in degrees.
+ * @param phi the azimuthal angle of the direction in degrees.
+ */
+void initSwimPoint(SwimPointPtr point, double x, double y, double z, double theta, double phi) {
+    double sinTheta = sin(toRadians(theta));
+
+    point->x = x;
+    point->y = y;
+    point->z = z;
+    point->tx = sinTheta * cos(toRadians(phi));
+    point->ty = sinTheta * sin(toRadians(phi));
+    point->tz = cos(toRadians(theta));
+    point->s = 0;
+}
+
+/**
+ * Get the composite field with the swimmer's probes, so that successive
+ * lookups along the track mostly reuse the cached cells. The field is also
+ * kept in the swimmer, for helix steps.
+ * @param swimmer the swimmer.
+ * @param x the x coordinate in cm.
+ * @param y the y coordinate in cm.
+ * @param z the z coordinate in cm.
+ * @param b upon return the field (Bx, By, Bz) in kG.
+ */
+void swimField(SwimmerPtr swimmer, double x, double y, double z, double *b) {
+    FieldValue fv;
+    getCompositeFieldValueProbe(&fv, x, y, z, swimmer->torusProbe, swimmer->solenoidProbe);
+    swimmer->numFieldEvaluations++;
+
+    b[0] = fv.b1;
+    b[1] = fv.b2;
+    b[2] = fv.b3;
+    memcpy(swimmer->field, b, sizeof(swimmer->field));
+}
+
+/**
+ * The right hand side of the equations of motion.
+ * @param swimmer the swimmer.
+ * @param k the charge times SWIMCONSTANT over the momentum, 1/(kG cm).
+ * @param y the state (x, y, z, tx, ty, tz).
+ * @param dyds upon return the derivative of the state with respect to s.
+ */
+static void derivative(SwimmerPtr swimmer, double k, const double *y, double *dyds) {
+    double b[3];
+    swimField(swimmer, y[0], y[1], y[2], b);
+
+    dyds[0] = y[3];
+    dyds[1] = y[4];
+    dyds[2] = y[5];
+    dyds[3] = k * (y[4] * b[2] - y[5] * b[1]);
+    dyds[4] = k * (y[5] * b[0] - y[3] * b[2]);
+    dyds[5] = k * (y[3] * b[1] - y[4] * b[0]);
+}
+
+/**
+ * Take one classical fourth order Runge-Kutta step, and restore the norm of
+ * the direction, which the method does not conserve.
+ * @param swimmer the swimmer.
+ * @param k the charge times SWIMCONSTANT over the momentum.
+ * @param h the step in cm.
+ * @param y the state, advanced upon return.
+ */
+static void rk4Step(SwimmerPtr swimmer, double k, double h, double *y) {
+    double k1[NSTATE], k2[NSTATE], k3[NSTATE], k4[NSTATE], yt[NSTATE];
+
+    derivative(swimmer, k, y, k1);
+    for (int i = 0; i < NSTATE; i++) {
+        yt[i] = y[i] + 0.5 * h * k1[i];
+    }
+    derivative(swimmer, k, yt, k2);
+    for (int i = 0; i < NSTATE; i++) {
+        yt[i] = y[i] + 0.5 * h * k2[i];
+    }
+    derivative(swimmer, k, yt, k3);
+    for (int i = 0; i < NSTATE; i++) {
+        yt[i] = y[i] + h * k3[i];
+    }
+    derivative(swimmer, k, yt, k4);
+
+    for (int i = 0; i < NSTATE; i++) {
+        y[i] += h * (k1[i] + 2 * k2[i] + 2 * k3[i] + k4[i]) / 6.0;
+    }
+
+    double norm = sqrt(y[3] * y[3] + y[4] * y[4] + y[5] * y[5]);
+    y[3] /= norm;
+    y[4] /= norm;
+    y[5] /= norm;
+}
+
+/**
+ * Take one Dormand-Prince 5(4) step. The derivative at the end of the step is
+ * the first stage of the next one (first same as last), so an accepted step
+ * costs six field evaluations. Only the track state (the first NSTATE
+ * variables) enters the error estimate, anything carried along with it (such
+ * as the Jacobian) just takes the same steps.
+ * @param swimmer the swimmer.
+ * @param f the right hand side of the equations.
+ * @param n the number of variables, at most MAXSTATE.
+ * @param k the charge times SWIMCONSTANT over the momentum.
+ * @param h the step in cm.
+ * @param y the state at the start of the step.
+ * @param k1 the derivative at the start of the step.
+ * @param yNew upon return the (fifth order) state at the end of the step.
+ * @param k7 upon return the derivative at the end of the step.
+ * @return the error estimate relative to the tolerance, accept if <= 1.
+ */
+static double dormandPrinceStep(SwimmerPtr swimmer, SwimDerivative f, int n, double k, double h,
+                                const double *y, const double *k1, double *yNew, double *k7) {
+    double ks[7][MAXSTATE];
+
+    memcpy(ks[0], k1, n * sizeof(double));
+    for (int j = 1; j < 7; j++) {
+        for (int i = 0; i < n; i++) {
+            double sum = 0;
+            for (int m = 0; m < j; m++) {
+                sum += dpA[j][m] * ks[m][i];
+            }
+            yNew[i] = y[i] + h * sum;
+        }
+        f(swimmer, k, yNew, ks[j]);
+    }
+    memcpy(k7, ks[6], n * sizeof(double));
+
+    double error = 0;
+    for (int i = 0; i < NSTATE; i++) {
+        double sum = 0;
+        for (int m = 0; m < 7; m++) {
+            sum += dpE[m] * ks[m][i];
+        }
+        error = max(error, fabs(h * sum));
+    }
+    return error / swimmer->tolerance;
+}
+
+/**
+ * The step to retry with after a rejected step.
+ * @param swimmer the swimmer.
+ * @param h the rejected step in cm.
+ * @param error the error estimate relative to the tolerance, > 1.
+ * @return the smaller step in cm.
+ */
+static double shrinkStep(SwimmerPtr swimmer, double h, double error) {
+    return max(swimmer->minStep, h * max(MINSCALE, SAFETY * pow(error, -0.25)));
+}
+
+/**
+ * The step to try after an accepted step.
+ * @param swimmer the swimmer.
+ * @param h the accepted step in cm.
+ * @param error the error estimate relative to the tolerance, <= 1.
+ * @return the next step in cm.
+ */
+static double growStep(SwimmerPtr swimmer, double h, double error) {
+    double scale = (error > 0) ? SAFETY * pow(error, -0.2) : MAXSCALE;
+    return min(swimmer->maxStep, h * min(MAXSCALE, max(MINSCALE, scale)));
+}
+
+/**
+ * Common start of a swim: clear the result and store the start point.
+ * @param swimmer the swimmer.
+ * @param start the start point.
+ * @param y upon return the state at the start.
+ * @param trajectory the caller's trajectory buffer (can be NULL).
+ * @param capacity the number of points the buffer holds.
+ * @param result the result to initialize.
+ */
+static void startSwim(SwimmerPtr swimmer, const SwimPoint *start, double *y,
+                      SwimPointPtr trajectory, int capacity, SwimResultPtr result) {
+    memset(result, 0, sizeof(SwimResult));
+    result->status = SWIM_OK;
+    swimmer->numFieldEvaluations = 0;
+
+    y[0] = start->x;
+    y[1] = start->y;
+    y[2] = start->z;
+    y[3] = start->tx;
+    y[4] = start->ty;
+    y[5] = start->tz;
+    storePoint(y, start->s, trajectory, capacity, result);
+}
+
+/**
+ * Record a point: always as the final point, and in the trajectory buffer if
+ * there is room.
+ * @param y the state.
+ * @param s the path length in cm.
+ * @param trajectory the caller's trajectory buffer (can be NULL).
+ * @param capacity the number of points the buffer holds.
+ * @param result the result being filled.
+ */
+static void storePoint(const double *y, double s, SwimPointPtr trajectory, int capacity,
+                       SwimResultPtr result) {
+    SwimPointPtr point = &(result->final);
+    point->x = y[0];
+    point->y = y[1];
+    point->z = y[2];
+    point->tx = y[3];
+    point->ty = y[4];
+    point->tz = y[5];
+    point->s = s;
+
+    if (trajectory != NULL) {
+        if (result->numPoints < capacity) {
+            trajectory[result->numPoints++] = *point;
+        }
+        else {
+            result->truncated = true;
+        }
+    }
+}
+
+/**
+ * Swim a track with fixed size fourth order Runge-Kutta steps. The last step
+ * is shortened to end at the requested path length.
+ * @param swimmer the swimmer.
+ * @param charge the charge in units of e, e.g. -1 for an electron.
+ * @param momentum the momentum in GeV/c.
+ * @param start the start point. Its path length is the path length at the start.
+ * @param sMax the path length to swim in cm.
+ * @param stepSize the step size in cm.
+ * @param trajectory a buffer for the trajectory points, starting with the start
+ * point, one per step. Can be NULL if only the final point is wanted.
+ * @param capacity the number of points the buffer holds.
+ * @param result upon return the outcome of the swim.
+ */
+void swimRK4(SwimmerPtr swimmer, int charge, double momentum, const SwimPoint *start,
+             double sMax, double stepSize, SwimPointPtr trajectory, int capacity, SwimResultPtr result) {
+    double y[NSTATE];
+
+    startSwim(swimmer, start, y, trajectory, capacity, result);
+    if ((momentum <= 0) || (stepSize <= 0)) {
+        fprintf(stderr, "\ncMag ERROR swimming needs a positive momentum and step size.\n");
+        return;
+    }
+
+    double k = charge * SWIMCONSTANT / momentum;
+    double s = 0;
+
+    while (s < sMax) {
+        if (result->numSteps >= swimmer->maxSteps) {
+            result->status = SWIM_MAX_STEPS;
+            break;
+        }
+
+        double h = min(stepSize, sMax - s);
+        rk4Step(swimmer, k, h, y);
+        s += h;
+        result->numSteps++;
+        storePoint(y, start->s + s, trajectory, capacity, result);
+    }
+
+    result->numFieldEvaluations = swimmer->numFieldEvaluations;
+}
+
+/**
+ * Swim a track with adaptive Dormand-Prince 5(4) steps. The step size is
+ * chosen so that the estimated error of each step, in cm for the position
+ * and in direction cosines, is within the swimmer's tolerance.
+ * @param swimmer the swimmer.
+ * @param charge the charge in units of e, e.g. -1 for an electron.
+ * @param momentum the momentum in GeV/c.
+ * @param start the start point. Its path length is the path length at the start.
+ * @param sMax the path length to swim in cm.
+ * @param trajectory a buffer for the trajectory points, starting with the start
+ * point, one per accepted step. Can be NULL if only the final point is wanted.
+ * @param capacity the number of points the buffer holds.
+ * @param result upon return the outcome of the swim.
+ */
+void swimAdaptive(SwimmerPtr swimmer, int charge, double momentum, const SwimPoint *start,
+                  double sMax, SwimPointPtr trajectory, int capacity, SwimResultPtr result) {
+    double y[NSTATE], k1[NSTATE];
+
+    startSwim(swimmer, start, y, trajectory, capacity, result);
+    if (momentum <= 0) {
+        fprintf(stderr, "\ncMag ERROR swimming needs a positive momentum.\n");
+        return;
+    }
+
+    double k = charge * SWIMCONSTANT / momentum;
+    derivative(swimmer, k, y, k1);
+    adaptiveSteps(swimmer, derivative, NSTATE, k, y, k1, start->s, sMax, NULL, trajectory, capacity, result);
+    result->numFieldEvaluations = swimmer->numFieldEvaluations;
+}
+
+/**
+ * Initialize a stopping surface that is a plane of constant z.
+ * @param surface the surface.
+ * @param z the z of the plane in cm.
+ */
+void initZPlaneSurface(SwimSurfacePtr surface, double z) {
+    memset(surface, 0, sizeof(SwimSurface));
+    surface->type = SWIM_ZPLANE;
+    surface->distance = z;
+    surface->nz = 1;
+}
+
+/**
+ * Initialize a stopping surface that is a cylinder about the z axis.
+ * @param surface the surface.
+ * @param rho the radius of the cylinder in cm.
+ */
+void initCylinderSurface(SwimSurfacePtr surface, double rho) {
+    memset(surface, 0, sizeof(SwimSurface));
+    surface->type = SWIM_CYLINDER;
+    surface->distance = rho;
+}
+
+/**
+ * Initialize a stopping surface that is a plane of a sector, such as a drift
+ * chamber layer. In the sector's own frame, where the midplane of the sector
+ * is the xz plane (rotated by cosSect and sinSect), the normal of the plane
+ * is tilted from the z axis towards x.
+ * @param surface the surface.
+ * @param sector the sector [1..6], or 0 for the sector that the swim starts in.
+ * @param tilt the tilt of the normal from the z axis in degrees, e.g. 25 for the drift chambers.
+ * @param distance the distance of the plane from the origin in cm.
+ */
+void initSectorPlaneSurface(SwimSurfacePtr surface, int sector, double tilt, double distance) {
+    memset(surface, 0, sizeof(SwimSurface));
+    surface->type = SWIM_SECTORPLANE;
+    surface->tilt = tilt;
+    surface->distance = distance;
+    setSectorNormal(surface, ((sector >= 1) && (sector <= 6)) ? sector : 0);
+}
+
+/**
+ * Set the sector and the normal of a sector plane.
+ * @param surface the surface.
+ * @param sector the sector [1..6], or 0 to leave the normal until the start is known.
+ */
+static void setSectorNormal(SwimSurfacePtr surface, int sector) {
+    surface->sector = sector;
+    if (sector == 0) {
+        surface->nx = 0;
+        surface->ny = 0;
+        surface->nz = 0;
+        return;
+    }
+
+    double sinTilt = sin(toRadians(surface->tilt));
+    surface->nx = sinTilt * cosSect[sector];
+    surface->ny = sinTilt * sinSect[sector];
+    surface->nz = cos(toRadians(surface->tilt));
+}
+
+/**
+ * The signed distance of a point from a stopping surface: positive beyond a
+ * plane (along its normal) or outside a cylinder. For planes and cylinders
+ * about the axis this is the true distance.
+ * @param surface the surface.
+ * @param x the x coordinate in cm.
+ * @param y the y coordinate in cm.
+ * @param z the z coordinate in cm.
+ * @return the signed distance in cm.
+ */
+double surfaceDistance(const SwimSurface *surface, double x, double y, double z) {
+    if (surface->type == SWIM_CYLINDER) {
+        return sqrt(x * x + y * y) - surface->distance;
+    }
+    return surface->nx * x + surface->ny * y + surface->nz * z - surface->distance;
+}
+
+/**
+ * Swim a track with adaptive steps until it reaches a surface, or the path
+ * length runs out. The crossing is bracketed by the step that would pass the
+ * surface, and the final step lands on the surface (within the swimmer's
+ * surfaceTolerance), so there is no need to overshoot and swim again.
+ * @param swimmer the swimmer.
+ * @param charge the charge in units of e, e.g. -1 for an electron.
+ * @param momentum the momentum in GeV/c.
+ * @param start the start point. Its path length is the path length at the start.
+ * @param surface the surface to stop on. A start on the surface does not count.
+ * @param sMax the most path length to swim in cm.
+ * @param trajectory a buffer for the trajectory points, starting with the start
+ * point, one per accepted step. Can be NULL if only the final point is wanted.
+ * @param capacity the number of points the buffer holds.
+ * @param result upon return the outcome of the swim, hitSurface tells if the
+ * surface was reached.
+ */
+void swimToSurface(SwimmerPtr swimmer, int charge, double momentum, const SwimPoint *start,
+                   const SwimSurface *surface, double sMax, SwimPointPtr trajectory, int capacity,
+                   SwimResultPtr result) {
+    double y[NSTATE], k1[NSTATE];
+
+    startSwim(swimmer, start, y, trajectory, capacity, result);
+    if (momentum <= 0) {
+        fprintf(stderr, "\ncMag ERROR swimming needs a positive momentum.\n");
+        return;
+    }
+
+    //a sector plane without a sector is in the sector of the start, or of the direction if on the axis
+    SwimSurface resolved = *surface;
+    if ((resolved.type == SWIM_SECTORPLANE) && (resolved.sector == 0)) {
+        bool onAxis = (fabs(start->x) < TINY) && (fabs(start->y) < TINY);
+        double phi = onAxis ? atan2(start->ty, start->tx) : atan2(start->y, start->x);
+        setSectorNormal(&resolved, getSector(toDegrees(phi)));
+    }
+
+    double k = charge * SWIMCONSTANT / momentum;
+    derivative(swimmer, k, y, k1);
+    adaptiveSteps(swimmer, derivative, NSTATE, k, y, k1, start->s, sMax, &resolved, trajectory, capacity, result);
+    result->numFieldEvaluations = swimmer->numFieldEvaluations;
+}
+
+/**
+ * The adaptive step loop shared by the adaptive swims.
+ * @param swimmer the swimmer.
+ * @param f the right hand side of the equations.
+ * @param n the number of variables, at most MAXSTATE.
+ * @param k the charge times SWIMCONSTANT over the momentum.
+ * @param y the state at the start, upon return the state at the end.
+ * @param k1 the derivative at the start, upon return the derivative at the end.
+ * @param s0 the path length at the start in cm.
+ * @param sMax the path length to swim in cm.
+ * @param surface stop on this surface if it is reached first (can be NULL).
+ * @param trajectory the caller's trajectory buffer (can be NULL).
+ * @param capacity the number of points the buffer holds.
+ * @param result the result being filled.
+ */
+static void adaptiveSteps(SwimmerPtr swimmer, SwimDerivative f, int n, double k, double *y, double *k1,
+                          double s0, double sMax, const SwimSurface *surface,
+                          SwimPointPtr trajectory, int capacity, SwimResultPtr result) {
+    double yNew[MAXSTATE], k7[MAXSTATE];
+    double s = 0;
+    int numJumps = 0;
+    double g0 = (surface == NULL) ? 0 : surfaceDistance(surface, y[0], y[1], y[2]);
+
+    //helix steps need bounds for the maps, and the field at the start of the
+    //step. The caller's derivative at the start was the last lookup.
+    MagneticFieldPtr torus = (swimmer->torusProbe == NULL) ? NULL : swimmer->torusProbe->fieldPtr;
+    MagneticFieldPtr solenoid = (swimmer->solenoidProbe == NULL) ? NULL : swimmer->solenoidProbe->fieldPtr;
+    bool useHelix = swimmer->helix && (f == derivative) &&
+                    (compositeVariationBound(torus, solenoid, y[0], y[1], y[2], 0) >= 0);
+    bool haveField = useHelix;
+    double change = 0;
+    double hLast = 0;
+    double b[3];
+    memcpy(b, swimmer->field, sizeof(b));
+
+    //predicted steps need bounds for the maps too, start with the predicted step,
+    //and then only stop short of the edges of the maps
+    bool predict = swimmer->predictSteps && (f != fieldLineDerivative) &&
+                   (compositeVariationBound(torus, solenoid, y[0], y[1], y[2], 0) >= 0);
+    double h = predict ? predictedStep(swimmer, k, y, k1, swimmer->maxStep) : min(SWIMFIRSTSTEP, swimmer->maxStep);
+
+    while (s < sMax) {
+        if (result->numSteps >= swimmer->maxSteps) {
+            result->status = SWIM_MAX_STEPS;
+            break;
+        }
+
+        //where the field is uniform enough, an exact helix step with one lookup,
+        //if it is at least as long as the adaptive step. Not after a rejected
+        //step, which means that the field is far from uniform here. A bound
+        //costs about as much as a lookup, so not either where the change of
+        //the field over the last step, which no bound over a ball reaching
+        //back to its start can be below (scaled down for a shorter step),
+        //already rules a helix step out.
+        bool helix = false;
+        double hAdaptive = h;
+        double hTry = min(h, sMax - s);
+        double seen = (hLast > 0) ? change * min(1.0, hTry / hLast) : 0;
+        if (useHelix && haveField &&
+            (fabs(k) * seen * hTry * max(1.0, 0.5 * hTry) <= swimmer->tolerance)) {
+            double hHelix = helixLength(swimmer, k, y, b, min(swimmer->maxStep, sMax - s), hTry);
+            if (hHelix > 0) {
+                helix = true;
+                h = hHelix;
+            }
+        }
+
+        //land exactly on sMax
+        bool last = (h >= sMax - s);
+        if (last) {
+            h = sMax - s;
+        }
+
+        double error = 0;
+        if (helix) {
+            helixStep(k, h, y, b, yNew);
+            derivative(swimmer, k, yNew, k7);
+        }
+        else {
+            error = dormandPrinceStep(swimmer, f, n, k, h, y, k1, yNew, k7);
+        }
+
+        //the direction of a field line jumps where a map ends, which no step
+        //resolves, so field lines step over the jump with the smallest step
+        bool jump = (f == fieldLineDerivative) && (error > 1) && (h <= swimmer->minStep) &&
+                    (numJumps < FIELDLINEJUMPS);
+        if (jump) {
+            numJumps++;
+        }
+        else if (h > FIELDLINEJUMPS * swimmer->minStep) {
+            numJumps = 0;
+        }
+
+        if ((error > 1) && !jump) {
+            result->numRejected++;
+            haveField = false;
+            if (h <= swimmer->minStep) {
+                result->status = SWIM_STEP_TOO_SMALL;
+                break;
+            }
+            h = shrinkStep(swimmer, h, error);
+            continue;
+        }
+
+        //a step that crosses the surface is not taken, unless it happens to end on it.
+        //A start on the surface does not count as a crossing.
+        double g1 = 0;
+        bool crossed = false;
+        if (surface != NULL) {
+            g1 = surfaceDistance(surface, yNew[0], yNew[1], yNew[2]);
+            crossed = ((g0 < 0) && (g1 >= 0)) || ((g0 > 0) && (g1 <= 0));
+            if (crossed && (fabs(g1) > swimmer->surfaceTolerance)) {
+                result->numRejected++;
+                landOnSurface(swimmer, f, n, k, surface, h, g0, g1, y, k1, yNew, k7, s0, &s,
+                              trajectory, capacity, result);
+                break;
+            }
+        }
+
+        s = last ? sMax : s + h;
+        memcpy(y, yNew, n * sizeof(double));
+        memcpy(k1, k7, n * sizeof(double));
+        result->numSteps++;
+
+        //the direction of a field line is that of the field at its new end
+        if (f == fieldLineDerivative) {
+            memcpy(y + 3, k1, 3 * sizeof(double));
+        }
+        storePoint(y, s0 + s, trajectory, capacity, result);
+
+        //and the line ends where the field does
+        if ((f == fieldLineDerivative) && (swimmer->field[0] == 0) && (swimmer->field[1] == 0) &&
+            (swimmer->field[2] == 0)) {
+            result->status = SWIM_NO_FIELD;
+            break;
+        }
+
+        //the last lookup, at the end of either kind of step, was at the new start
+        result->numHelixSteps += helix ? 1 : 0;
+        //the change of the field over the step, for the next helix step
+        change = sqrt((swimmer->field[0] - b[0]) * (swimmer->field[0] - b[0]) +
+                      (swimmer->field[1] - b[1]) * (swimmer->field[1] - b[1]) +
+                      (swimmer->field[2] - b[2]) * (swimmer->field[2] - b[2]));
+        hLast = h;
+        memcpy(b, swimmer->field, sizeof(b));
+        haveField = useHelix;
+
+        if (crossed) {
+            result->hitSurface = true;
+            break;
+        }
+        g0 = g1;
+        h = helix ? hAdaptive : growStep(swimmer, h, error);
+        if (predict) {
+            h = edgeLimitedStep(swimmer, k, y, k1, h, h, NULL);
+        }
+    }
+}
+
+/**
+ * The step that keeps a Dormand-Prince step within the tolerance where the
+ * field is smooth, according to bounds on the field and its derivatives
+ * where the step can go. The error of a fifth order step is about
+ * C (r h)^5, with r the turning rate |k| |B| plus the rates at which the
+ * gradient and the second derivative of the field bend the track.
+ * PREDICTSMOOTH is C from swims through the maps.
+ * @param tolerance the absolute error per step.
+ * @param k the charge times SWIMCONSTANT over the momentum.
+ * @param bound the bounds over the ball the step can reach.
+ * @return the step in cm, INFINITY if nothing limits it.
+ */
+static double stepFromBound(double tolerance, double k, const DerivativeBound *bound) {
+    double rate = fabs(k) * bound->magnitude + sqrt(fabs(k) * bound->gradient) + cbrt(fabs(k) * bound->curvature);
+    return (rate > 0) ? pow(tolerance / PREDICTSMOOTH, 0.2) / rate : INFINITY;
+}
+
+/**
+ * The smallest root of a s^2 + b s + c in (0, sMax].
+ * @param a the quadratic coefficient.
+ * @param b the linear coefficient.
+ * @param c the constant.
+ * @param sMax the end of the range.
+ * @return the root, INFINITY if there is none in the range.
+ */
+static double firstRoot(double a, double b, double c, double sMax) {
+    double roots[2] = {INFINITY, INFINITY};
+
+    if (fabs(a) * sMax <= 1.0e-12 * fabs(b)) {
+        if (b != 0) {
+            roots[0] = -c / b;
+        }
+    }
+    else {
+        double discriminant = b * b - 4 * a * c;
+        if (discriminant >= 0) {
+            double q = -0.5 * (b + copysign(sqrt(discriminant), b));
+            roots[0] = q / a;
+            roots[1] = (q != 0) ? c / q : INFINITY;
+        }
+    }
+
+    double root = INFINITY;
+    for (int i = 0; i < 2; i++) {
+        if ((roots[i] > 0) && (roots[i] <= sMax)) {
+            root = min(root, roots[i]);
+        }
+    }
+    return root;
+}
+
+/**
+ * Where a track first crosses an edge of a map, along the parabola
+ * r + t s + a s^2 / 2 with a = dt/ds. The edges are the planes at the ends
+ * of the z grid and the cylinders at the ends of the rho grid, where they
+ * bound the map.
+ * @param fieldPtr the field map.
+ * @param y the state.
+ * @param dyds the derivative of the state.
+ * @param sMax how far to look in cm.
+ * @return the path length to the crossing in cm, INFINITY if there is none within sMax.
+ */
+static double edgeCrossing(MagneticFieldPtr fieldPtr, const double *y, const double *dyds, double sMax) {
+    double p[3] = {y[0] - fieldPtr->shiftX, y[1] - fieldPtr->shiftY, y[2] - fieldPtr->shiftZ};
+    const double *t = dyds;
+    const double *a = dyds + 3;
+    GridPtr rhoGrid = fieldPtr->rhoGridPtr;
+    GridPtr zGrid = fieldPtr->zGridPtr;
+    double crossing = INFINITY;
+
+    double zEdges[2] = {zGrid->minVal, zGrid->maxVal};
+    for (int i = 0; i < 2; i++) {
+        double s = firstRoot(0.5 * a[2], t[2], p[2] - zEdges[i], sMax);
+        if (s < crossing) {
+            double rho = hypot(p[0] + (t[0] + 0.5 * a[0] * s) * s, p[1] + (t[1] + 0.5 * a[1] * s) * s);
+            if ((rho >= rhoGrid->minVal) && (rho <= rhoGrid->maxVal)) {
+                crossing = s;
+            }
+        }
+    }
+
+    //rho^2 along the parabola, to second order in s
+    double rhoEdges[2] = {rhoGrid->minVal, rhoGrid->maxVal};
+    for (int i = (rhoGrid->minVal > 0) ? 0 : 1; i < 2; i++) {
+        double qa = t[0] * t[0] + t[1] * t[1] + p[0] * a[0] + p[1] * a[1];
+        double qb = 2 * (p[0] * t[0] + p[1] * t[1]);
+        double qc = p[0] * p[0] + p[1] * p[1] - rhoEdges[i] * rhoEdges[i];
+        double s = firstRoot(qa, qb, qc, sMax);
+        if (s < crossing) {
+            double z = p[2] + (t[2] + 0.5 * a[2] * s) * s;
+            if ((z >= zGrid->minVal) && (z <= zGrid->maxVal)) {
+                crossing = s;
+            }
+        }
+    }
+    return crossing;
+}
+
+/**
+ * The predicted step for a track at a point, up to hMax. First the smooth
+ * error model, with the bounds over the ball of radius hMax. (Taking them
+ * again over the smaller ball of a shortened step would allow a slightly
+ * longer step, which is not worth the extra bounds.) Then the edges of the
+ * maps, see edgeLimitedStep.
+ * @param swimmer the swimmer.
+ * @param k the charge times SWIMCONSTANT over the momentum.
+ * @param y the state.
+ * @param dyds the derivative of the state.
+ * @param hMax the longest step in cm.
+ * @return the step in cm, hMax if the maps have no bounds.
+ */
+static double predictedStep(SwimmerPtr swimmer, double k, const double *y, const double *dyds, double hMax) {
+    MagneticFieldPtr fields[2] = {(swimmer->torusProbe == NULL) ? NULL : swimmer->torusProbe->fieldPtr,
+                                  (swimmer->solenoidProbe == NULL) ? NULL : swimmer->solenoidProbe->fieldPtr};
+    DerivativeBound bounds[2], sum;
+    memset(bounds, 0, sizeof(bounds));
+    memset(&sum, 0, sizeof(sum));
+
+    //the bounds of the maps are kept separately for their edges
+    for (int i = 0; i < 2; i++) {
+        if (fields[i] != NULL) {
+            if (!fieldDerivativeBound(fields[i], y[0], y[1], y[2], hMax, bounds + i)) {
+                return hMax;
+            }
+            sum.magnitude += bounds[i].magnitude;
+            sum.gradient += bounds[i].gradient;
+            sum.curvature += bounds[i].curvature;
+        }
+    }
+    return edgeLimitedStep(swimmer, k, y, dyds, min(hMax, stepFromBound(swimmer->tolerance, k, &sum)), hMax, bounds);
+}
+
+/**
+ * Limit a step at the edges of the maps, where the field jumps and the error
+ * controller would reject the step that crosses. Only a step shorter than
+ * tolerance / (PREDICTJUMP |k| B) can cross one, so a longer step stops short
+ * of the edge by PREDICTMARGIN of the distance, and the next one crosses.
+ * The bounds of a map are only needed, and only taken, when the step can
+ * reach its edge.
+ * @param swimmer the swimmer.
+ * @param k the charge times SWIMCONSTANT over the momentum.
+ * @param y the state.
+ * @param dyds the derivative of the state.
+ * @param h the step in cm.
+ * @param hMax the radius of the ball for the bounds in cm, >= h.
+ * @param bounds the bounds of the maps over that ball, or NULL to take them as needed.
+ * @return the step in cm, h if the maps have no bounds.
+ */
+static double edgeLimitedStep(SwimmerPtr swimmer, double k, const double *y, const double *dyds,
+                              double h, double hMax, const DerivativeBound *bounds) {
+    MagneticFieldPtr fields[2] = {(swimmer->torusProbe == NULL) ? NULL : swimmer->torusProbe->fieldPtr,
+                                  (swimmer->solenoidProbe == NULL) ? NULL : swimmer->solenoidProbe->fieldPtr};
+    double hLimit = h;
+
+    for (int i = 0; i < 2; i++) {
+        if ((fields[i] == NULL) || (k == 0)) {
+            continue;
+        }
+
+        double crossing = edgeCrossing(fields[i], y, dyds, hLimit);
+        if (crossing > hLimit) {
+            continue;
+        }
+
+        DerivativeBound bound;
+        if (bounds != NULL) {
+            bound = bounds[i];
+        }
+        else if (!fieldDerivativeBound(fields[i], y[0], y[1], y[2], hMax, &bound)) {
+            return h;
+        }
+        if (bound.edgeField == 0) {
+            continue;
+        }
+
+        double hJump = swimmer->tolerance / (PREDICTJUMP * fabs(k) * bound.edgeField);
+        hLimit = (crossing <= hJump) ? min(hLimit, hJump) : (1 - PREDICTMARGIN) * crossing;
+    }
+    return max(swimmer->minStep, hLimit);
+}
+
+/**
+ * The step size for an adaptive swim from a point, predicted from the bounds
+ * on the field and its derivatives so that the step is within the swimmer's
+ * tolerance. Adaptive swims with predictSteps set start with it, and then
+ * let the error controller choose the steps, except that a step that would
+ * cross an edge of a map stops short of it. That avoids most rejected steps.
+ * Costs one field lookup.
+ * @param swimmer the swimmer, with buildFieldUniformity called on its maps.
+ * @param charge the charge in units of e.
+ * @param momentum the momentum in GeV/c.
+ * @param point the point.
+ * @return the step in cm, between the swimmer's minStep and maxStep, or 0 if a map has no bounds.
+ */
+double predictStepSize(SwimmerPtr swimmer, int charge, double momentum, const SwimPoint *point) {
+    MagneticFieldPtr torus = (swimmer->torusProbe == NULL) ? NULL : swimmer->torusProbe->fieldPtr;
+    MagneticFieldPtr solenoid = (swimmer->solenoidProbe == NULL) ? NULL : swimmer->solenoidProbe->fieldPtr;
+    if (compositeVariationBound(torus, solenoid, point->x, point->y, point->z, 0) < 0) {
+        return 0;
+    }
+
+    double k = charge * SWIMCONSTANT / momentum;
+    double y[NSTATE] = {point->x, point->y, point->z, point->tx, point->ty, point->tz};
+    double dyds[NSTATE];
+    derivative(swimmer, k, y, dyds);
+    return predictedStep(swimmer, k, y, dyds, swimmer->maxStep);
+}
+
+/**
+ * The longest helix step, from hMax halving down to hMin, that is within the
+ * tolerance. The field bound d over the ball that the step cannot leave
+ * limits the error, for the direction to |k| d h and for the position to
+ * |k| d h^2 / 2, either growing by at most exp(|k| |B| h). The bound over the
+ * ball of the longest step holds for all the shorter ones, so this costs a
+ * single bound, and a second over the smaller ball of hMin if that fails.
+ * @param swimmer the swimmer.
+ * @param k the charge times SWIMCONSTANT over the momentum.
+ * @param y the state at the start of the step.
+ * @param b the field at the start of the step.
+ * @param hMax the longest step to try in cm.
+ * @param hMin the shortest step worth taking in cm, <= hMax.
+ * @return the step in cm, or 0 if no helix step is worth taking.
+ */
+static double helixLength(SwimmerPtr swimmer, double k, const double *y, const double *b,
+                          double hMax, double hMin) {
+    MagneticFieldPtr torus = (swimmer->torusProbe == NULL) ? NULL : swimmer->torusProbe->fieldPtr;
+    MagneticFieldPtr solenoid = (swimmer->solenoidProbe == NULL) ? NULL : swimmer->solenoidProbe->fieldPtr;
+    double kb = fabs(k) * sqrt(b[0] * b[0] + b[1] * b[1] + b[2] * b[2]);
+
+    double radius = hMax;
+    double variation = compositeVariationBound(torus, solenoid, y[0], y[1], y[2], radius);
+    for (double h = hMax; (variation >= 0) && (h >= hMin); h = (h > hMin) ? max(0.5 * h, hMin) : 0) {
+        //a tighter bound over the smaller ball before giving up
+        if ((h == hMin) && (radius > hMin)) {
+            radius = hMin;
+            variation = compositeVariationBound(torus, solenoid, y[0], y[1], y[2], radius);
+            if (variation < 0) {
+                break;
+            }
+        }
+        double error = fabs(k) * variation * h * max(1.0, 0.5 * h) * exp(kb * h);
+        if (error <= swimmer->tolerance) {
+            return h;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Take a step along the helix of a uniform field. The direction turns about
+ * the field at the rate -k |B| per unit path length.
+ * @param k the charge times SWIMCONSTANT over the momentum.
+ * @param h the step in cm.
+ * @param y the state at the start of the step.
+ * @param b the (uniform) field in kG.
+ * @param yNew upon return the state at the end of the step.
+ */
+static void helixStep(double k, double h, const double *y, const double *b, double *yNew) {
+    double bMag = sqrt(b[0] * b[0] + b[1] * b[1] + b[2] * b[2]);
+    double omega = -k * bMag;
+
+    //no turning, a straight line
+    if (omega == 0) {
+        for (int i = 0; i < 3; i++) {
+            yNew[i] = y[i] + h * y[i + 3];
+            yNew[i + 3] = y[i + 3];
+        }
+        return;
+    }
+
+    //the direction along the field, across it, and the unit field crossed into it
+    double u[3] = {b[0] / bMag, b[1] / bMag, b[2] / bMag};
+    double along = u[0] * y[3] + u[1] * y[4] + u[2] * y[5];
+    double across[3], turn[3];
+    for (int i = 0; i < 3; i++) {
+        across[i] = y[i + 3] - along * u[i];
+    }
+    turn[0] = u[1] * across[2] - u[2] * across[1];
+    turn[1] = u[2] * across[0] - u[0] * across[2];
+    turn[2] = u[0] * across[1] - u[1] * across[0];
+
+    double angle = omega * h;
+    double sinA = sin(angle);
+    double cosA = cos(angle);
+    double halfSin = sin(0.5 * angle);
+    double oneMinusCos = 2 * halfSin * halfSin;
+
+    for (int i = 0; i < 3; i++) {
+        yNew[i] = y[i] + along * u[i] * h + (across[i] * sinA + turn[i] * oneMinusCos) / omega;
+        yNew[i + 3] = along * u[i] + across[i] * cosA + turn[i] * sinA;
+    }
+}
+
+/**
+ * Finish a swim on a surface that the step from y to yNew crosses. The
+ * crossing is estimated on the cubic Hermite interpolant of the step, which
+ * needs no field lookups, and a real step is taken to it. The estimate is
+ * usually good enough the first time, if not the step just taken narrows the
+ * bracket and the next estimate is much better.
+ * @param swimmer the swimmer.
+ * @param f the right hand side of the equations.
+ * @param n the number of variables, at most MAXSTATE.
+ * @param k the charge times SWIMCONSTANT over the momentum.
+ * @param surface the surface.
+ * @param h the step in cm.
+ * @param g0 the distance from the surface at the start of the step.
+ * @param g1 the distance from the surface at the end of the step, of the other sign.
+ * @param y the state at the start of the step, upon return the state on the surface.
+ * @param k1 the derivative at the start, upon return the derivative on the surface.
+ * @param yNew the state at the end of the step (overwritten).
+ * @param k7 the derivative at the end of the step (overwritten).
+ * @param s0 the path length at the start of the swim in cm.
+ * @param s the path length swum, upon return the path length to the surface.
+ * @param trajectory the caller's trajectory buffer (can be NULL).
+ * @param capacity the number of points the buffer holds.
+ * @param result the result being filled.
+ */
+static void landOnSurface(SwimmerPtr swimmer, SwimDerivative f, int n, double k, const SwimSurface *surface,
+                          double h, double g0, double g1, double *y, double *k1, double *yNew, double *k7,
+                          double s0, double *s, SwimPointPtr trajectory, int capacity, SwimResultPtr result) {
+    double yRoot[MAXSTATE], kRoot[MAXSTATE];
+
+    for (int iteration = 1; iteration <= SWIMSURFACEITERATIONS; iteration++) {
+        double hRoot = h * hermiteRoot(swimmer, surface, h, g0, g1, y, k1, yNew, k7);
+
+        //shorter than a step that passed, so no need to check the error
+        dormandPrinceStep(swimmer, f, n, k, hRoot, y, k1, yRoot, kRoot);
+        double g = surfaceDistance(surface, yRoot[0], yRoot[1], yRoot[2]);
+        bool done = (fabs(g) <= swimmer->surfaceTolerance) || (iteration == SWIMSURFACEITERATIONS);
+
+        if (done || ((g < 0) == (g0 < 0))) {
+            //short of the surface (or on it), keep the step
+            *s += hRoot;
+            memcpy(y, yRoot, n * sizeof(double));
+            memcpy(k1, kRoot, n * sizeof(double));
+            result->numSteps++;
+            storePoint(y, s0 + *s, trajectory, capacity, result);
+
+            if (done) {
+                result->hitSurface = true;
+                return;
+            }
+            h -= hRoot;
+            g0 = g;
+        }
+        else {
+            //past the surface, this is the new end of the bracket
+            result->numRejected++;
+            h = hRoot;
+            g1 = g;
+            memcpy(yNew, yRoot, n * sizeof(double));
+            memcpy(k7, kRoot, n * sizeof(double));
+        }
+    }
+}
+
+/**
+ * Find where the cubic Hermite interpolant of the positions over a step
+ * crosses a surface, by the Illinois variant of regula falsi.
+ * @param swimmer the swimmer, for the surface tolerance.
+ * @param surface the surface.
+ * @param h the step in cm.
+ * @param g0 the distance from the surface at the start of the step.
+ * @param g1 the distance from the surface at the end of the step, of the other sign.
+ * @param y0 the state at the start of the step.
+ * @param dy0 the derivative at the start of the step.
+ * @param y1 the state at the end of the step.
+ * @param dy1 the derivative at the end of the step.
+ * @return the crossing as a fraction of the step.
+ */
+static double hermiteRoot(SwimmerPtr swimmer, const SwimSurface *surface, double h, double g0, double g1,
+                          const double *y0, const double *dy0, const double *y1, const double *dy1) {
+    double a = 0;
+    double b = 1;
+    double theta = 0.5;
+    int side = 0;
+
+    for (int i = 0; i < 50; i++) {
+        theta = (a * g1 - b * g0) / (g1 - g0);
+
+        double t2 = theta * theta;
+        double t3 = t2 * theta;
+        double h00 = 2 * t3 - 3 * t2 + 1;
+        double h10 = h * (t3 - 2 * t2 + theta);
+        double h01 = 3 * t2 - 2 * t3;
+        double h11 = h * (t3 - t2);
+
+        double r[3];
+        for (int j = 0; j < 3; j++) {
+            r[j] = h00 * y0[j] + h10 * dy0[j] + h01 * y1[j] + h11 * dy1[j];
+        }
+
+        double g = surfaceDistance(surface, r[0], r[1], r[2]);
+        if (fabs(g) < 0.01 * swimmer->surfaceTolerance) {
+            break;
+        }
+
+        //halve the value at the end that stays put twice in a row
+        if ((g < 0) == (g0 < 0)) {
+            a = theta;
+            g0 = g;
+            if (side == -1) {
+                g1 /= 2;
+            }
+            side = -1;
+        }
+        else {
+            b = theta;
+            g1 = g;
+            if (side == 1) {
+                g0 /= 2;
+            }
+            side = 1;
+        }
+    }
+    return theta;
+}
+
+/**
+ * The equations of motion extended by the variational equations of the 6x7
+ * Jacobian J = d(state)/d(start state, q/p). With A the derivative of the right
+ * hand side with respect to the state, dJ/ds = A J, plus SWIMCONSTANT t x B in
+ * the q/p column. A needs the field gradient, which comes with the field
+ * from a single lookup.
+ * @param swimmer the swimmer.
+ * @param k the charge times SWIMCONSTANT over the momentum.
+ * @param y the state followed by the Jacobian, row major.
+ * @param dyds upon return the derivative with respect to s.
+ */
+static void jacobianDerivative(SwimmerPtr swimmer, double k, const double *y, double *dyds) {
+    FieldGradient grad;
+    getCompositeFieldGradientProbe(&grad, y[0], y[1], y[2], swimmer->torusProbe, swimmer->solenoidProbe);
+    swimmer->numFieldEvaluations++;
+
+    const double *t = y + 3;
+    const double *b = grad.b;
+    double txb[3] = {t[1] * b[2] - t[2] * b[1], t[2] * b[0] - t[0] * b[2], t[0] * b[1] - t[1] * b[0]};
+
+    dyds[0] = t[0];
+    dyds[1] = t[1];
+    dyds[2] = t[2];
+    dyds[3] = k * txb[0];
+    dyds[4] = k * txb[1];
+    dyds[5] = k * txb[2];
+
+    const double *J = y + NSTATE;
+    double *dJ = dyds + NSTATE;
+
+    for (int j = 0; j < 7; j++) {
+        double dr[3] = {J[j], J[7 + j], J[14 + j]};
+        double dt[3] = {J[21 + j], J[28 + j], J[35 + j]};
+
+        //the change of the field along dr
+        double db[3];
+        for (int i = 0; i < 3; i++) {
+            db[i] = grad.dB[i][0] * dr[0] + grad.dB[i][1] * dr[1] + grad.dB[i][2] * dr[2];
+        }
+
+        //d(dt)/ds = k (dt x B + t x dB), plus the q/p term
+        double q = (j == 6) ? SWIMCONSTANT : 0;
+        dJ[j] = dt[0];
+        dJ[7 + j] = dt[1];
+        dJ[14 + j] = dt[2];
+        dJ[21 + j] = k * (dt[1] * b[2] - dt[2] * b[1] + t[1] * db[2] - t[2] * db[1]) + q * txb[0];
+        dJ[28 + j] = k * (dt[2] * b[0] - dt[0] * b[2] + t[2] * db[0] - t[0] * db[2]) + q * txb[1];
+        dJ[35 + j] = k * (dt[0] * b[1] - dt[1] * b[0] + t[0] * db[1] - t[1] * db[0]) + q * txb[2];
+    }
+}
+
+/**
+ * Convert the fixed path length Jacobian to the transport matrix between the
+ * planes of constant z through the start and the end. A variation of the end
+ * point is moved along the track back onto the end plane, which is where the
+ * derivative of the state at the end comes in.
+ * @param start the start point.
+ * @param y the state at the end.
+ * @param dyds the derivative of the state at the end.
+ * @param global the 6x7 fixed path length Jacobian.
+ * @param transport upon return the 5x5 transport matrix.
+ */
+static void planeTransport(const SwimPoint *start, const double *y, const double *dyds,
+                           double (*global)[7], double (*transport)[5]) {
+    memset(transport, 0, 25 * sizeof(double));
+
+    if ((fabs(start->tz) < TINY) || (fabs(y[5]) < TINY)) {
+        fprintf(stderr, "\ncMag WARNING no transport matrix for a track parallel to the z planes.\n");
+        return;
+    }
+
+    //d(global start)/d(local start): t = sign(tz) (tx, ty, 1) / sqrt(1 + tx^2 + ty^2)
+    double tx = start->tx / start->tz;
+    double ty = start->ty / start->tz;
+    double norm = sqrt(1 + tx * tx + ty * ty);
+    double sigma = (start->tz < 0) ? -1 : 1;
+    double v[3] = {tx, ty, 1};
+
+    double D[7][5];
+    memset(D, 0, sizeof(D));
+    D[0][0] = 1;
+    D[1][1] = 1;
+    for (int i = 0; i < 3; i++) {
+        D[3 + i][2] = sigma * (((i == 0) ? 1 : 0) - v[i] * tx / (norm * norm)) / norm;
+        D[3 + i][3] = sigma * (((i == 1) ? 1 : 0) - v[i] * ty / (norm * norm)) / norm;
+    }
+    D[6][4] = 1;
+
+    //the variations at the end, for a fixed path length
+    double M[6][5];
+    for (int i = 0; i < 6; i++) {
+        for (int c = 0; c < 5; c++) {
+            M[i][c] = 0;
+            for (int m = 0; m < 7; m++) {
+                M[i][c] += global[i][m] * D[m][c];
+            }
+        }
+    }
+
+    //back onto the end plane: ds = -dz / tz
+    for (int c = 0; c < 5; c++) {
+        double ds = -M[2][c] / y[5];
+        for (int i = 0; i < 6; i++) {
+            M[i][c] += dyds[i] * ds;
+        }
+    }
+
+    //to the local parameters at the end
+    double txEnd = y[3] / y[5];
+    double tyEnd = y[4] / y[5];
+    for (int c = 0; c < 5; c++) {
+        transport[0][c] = M[0][c];
+        transport[1][c] = M[1][c];
+        transport[2][c] = (M[3][c] - txEnd * M[5][c]) / y[5];
+        transport[3][c] = (M[4][c] - tyEnd * M[5][c]) / y[5];
+    }
+    transport[4][4] = 1;
+}
+
+/**
+ * Swim a track with adaptive steps and propagate its Jacobian in the same
+ * pass. Each Runge-Kutta stage does one lookup of the field and its gradient
+ * from the interpolation cell, rather than the six or more extra swims of
+ * numerical differentiation. The steps are controlled by the track state only.
+ * @param swimmer the swimmer.
+ * @param charge the charge in units of e, e.g. -1 for an electron.
+ * @param momentum the momentum in GeV/c.
+ * @param start the start point. Its path length is the path length at the start.
+ * @param sMax the path length to swim in cm.
+ * @param trajectory a buffer for the trajectory points, starting with the start
+ * point, one per accepted step. Can be NULL if only the final point is wanted.
+ * @param capacity the number of points the buffer holds.
+ * @param result upon return the outcome of the swim.
+ * @param jacobian upon return the Jacobians of the swim.
+ */
+void swimJacobian(SwimmerPtr swimmer, int charge, double momentum, const SwimPoint *start, double sMax,
+                  SwimPointPtr trajectory, int capacity, SwimResultPtr result, SwimJacobianPtr jacobian) {
+    double y[MAXSTATE], k1[MAXSTATE];
+
+    memset(jacobian, 0, sizeof(SwimJacobian));
+    startSwim(swimmer, start, y, trajectory, capacity, result);
+    if (momentum <= 0) {
+        fprintf(stderr, "\ncMag ERROR swimming needs a positive momentum.\n");
+        return;
+    }
+
+    //start with the identity, and no dependence on q/p
+    memset(y + NSTATE, 0, NSTATE * 7 * sizeof(double));
+    for (int i = 0; i < NSTATE; i++) {
+        y[NSTATE + 7 * i + i] = 1;
+    }
+
+    double k = charge * SWIMCONSTANT / momentum;
+    jacobianDerivative(swimmer, k, y, k1);
+    adaptiveSteps(swimmer, jacobianDerivative, MAXSTATE, k, y, k1, start->s, sMax, NULL,
+                  trajectory, capacity, result);
+    result->numFieldEvaluations = swimmer->numFieldEvaluations;
+
+    memcpy(jacobian->global, y + NSTATE, sizeof(jacobian->global));
+    planeTransport(start, y, k1, jacobian->global, jacobian->transport);
+}
+
+/**
+ * The right hand side for field lines: the unit vector along the field,
+ * or against it. Where there is no field the line goes straight on, so
+ * that a step leaving the maps is smooth, and the line stops after it.
+ * @param swimmer the swimmer.
+ * @param k 1 to follow the field, -1 to go against it.
+ * @param y the position and, in y[3..5], the direction of the line at the start of the step.
+ * @param dyds upon return the derivative, zero for the direction.
+ */
+static void fieldLineDerivative(SwimmerPtr swimmer, double k, const double *y, double *dyds) {
+    double b[3];
+    swimField(swimmer, y[0], y[1], y[2], b);
+
+    double magnitude = sqrt(b[0] * b[0] + b[1] * b[1] + b[2] * b[2]);
+    for (int i = 0; i < 3; i++) {
+        dyds[i] = (magnitude > 0) ? k * b[i] / magnitude : y[3 + i];
+        dyds[3 + i] = 0;
+    }
+}
+
+/**
+ * Trace a field line with the adaptive stepper, so the error of each step in
+ * the position is within the swimmer's tolerance. The swimmer's probes keep
+ * their cells from step to step. The points of the line hold the position,
+ * the direction of the line (the unit field, or minus it) and the length
+ * along the line. The trace stops after sMax, or with SWIM_NO_FIELD at the
+ * first point outside the maps. Where the field jumps, at the edge of a map,
+ * the line steps over the jump with the smallest steps. A line caught on a
+ * jump that the field points into from both sides ends with SWIM_STEP_TOO_SMALL.
+ * @param swimmer the swimmer.
+ * @param direction 1 to follow the field, -1 to go against it.
+ * @param x the x coordinate of the seed in cm.
+ * @param y the y coordinate of the seed in cm.
+ * @param z the z coordinate of the seed in cm.
+ * @param sMax the longest line in cm.
+ * @param trajectory a buffer for the points of the line, starting with the
+ * seed, one per step. Can be NULL if only the final point is wanted.
+ * @param capacity the number of points the buffer holds.
+ * @param result upon return the outcome of the trace.
+ */
+void traceFieldLine(SwimmerPtr swimmer, int direction, double x, double y, double z, double sMax,
+                    SwimPointPtr trajectory, int capacity, SwimResultPtr result) {
+    double state[NSTATE], k1[NSTATE];
+    double sign = (direction < 0) ? -1 : 1;
+
+    SwimPoint start = {x, y, z, 0, 0, 0, 0};
+    double b[3];
+    swimField(swimmer, x, y, z, b);
+    double magnitude = sqrt(b[0] * b[0] + b[1] * b[1] + b[2] * b[2]);
+    if (magnitude > 0) {
+        start.tx = sign * b[0] / magnitude;
+        start.ty = sign * b[1] / magnitude;
+        start.tz = sign * b[2] / magnitude;
+    }
+
+    startSwim(swimmer, &start, state, trajectory, capacity, result);
+    swimmer->numFieldEvaluations = 1;
+    if (magnitude > 0) {
+        memcpy(k1, state + 3, 3 * sizeof(double));
+        memset(k1 + 3, 0, 3 * sizeof(double));
+        adaptiveSteps(swimmer, fieldLineDerivative, NSTATE, sign, state, k1, 0, sMax, NULL,
+                      trajectory, capacity, result);
+    }
+    else {
+        result->status = SWIM_NO_FIELD;
+    }
+    result->numFieldEvaluations = swimmer->numFieldEvaluations;
+}
+
+/**
+ * Work function for swimTracks: swim one track with the worker's swimmer.
+ * @param context the SwimTracksContext.
+ * @param worker the worker.
+ * @param index the track.
+ */
+static void swimTrackWork(void *context, int worker, int index) {
+    SwimTracksContext *tc = (SwimTracksContext *) context;
+    SwimTrackPtr track = tc->tracks + index;
+
+    swimAdaptive(tc->swimmers[worker], track->charge, track->momentum, &(track->start), track->sMax,
+                 track->trajectory, track->capacity, &(track->result));
+}
+
+/**
+ * Swim many tracks with the adaptive swimmer on a pool of threads. Track
+ * lengths vary a lot, so the tracks are shared out by work stealing. Each
+ * worker has its own swimmer, and so its own probes, while the field maps
+ * are shared read only. The results are the same as swimming the tracks one
+ * at a time.
+ * @param torus the torus field (can be NULL).
+ * @param solenoid the solenoid field (can be NULL).
+ * @param tracks the tracks. Each result is filled in.
+ * @param n the number of tracks.
+ * @param numThreads the number of threads, 0 (or less) for one per core.
+ * @param settings a swimmer whose tolerance and step limits are used, or NULL
+ * for the defaults.
+ * @return the number of threads that were used.
+ */
+int swimTracks(MagneticFieldPtr torus, MagneticFieldPtr solenoid, SwimTrackPtr tracks, int n,
+               int numThreads, const Swimmer *settings) {
+    return runSwimTracks(torus, solenoid, tracks, n, numThreads, settings, swimTrackWork, n);
+}
+
+/**
+ * Work function for traceFieldLines: trace one line with the worker's swimmer.
+ * @param context the SwimTracksContext.
+ * @param worker the worker.
+ * @param index the line.
+ */
+static void fieldLineWork(void *context, int worker, int index) {
+    SwimTracksContext *tc = (SwimTracksContext *) context;
+    SwimTrackPtr track = tc->tracks + index;
+
+    traceFieldLine(tc->swimmers[worker], track->charge, track->start.x, track->start.y, track->start.z,
+                   track->sMax, track->trajectory, track->capacity, &(track->result));
+}
+
+/**
+ * Trace many field lines on a pool of threads, like swimTracks. For each
+ * track the start position is the seed and the charge the direction (1 to
+ * follow the field, -1 to go against it), the momentum and start direction
+ * are not used. The points go into the tracks' preallocated buffers.
+ * @param torus the torus field (can be NULL).
+ * @param solenoid the solenoid field (can be NULL).
+ * @param lines the lines. Each result is filled in.
+ * @param n the number of lines.
+ * @param numThreads the number of threads, 0 (or less) for one per core.
+ * @param settings a swimmer whose tolerance and step limits are used, or NULL
+ * for the defaults.
+ * @return the number of threads that were used.
+ */
+int traceFieldLines(MagneticFieldPtr torus, MagneticFieldPtr solenoid, SwimTrackPtr lines, int n,
+                    int numThreads, const Swimmer *settings) {
+    return runSwimTracks(torus, solenoid, lines, n, numThreads, settings, fieldLineWork, n);
+}
+
+/**
+ * Run swim work on a thread pool with one swimmer per worker.
+ * @param torus the torus field (can be NULL).
+ * @param solenoid the solenoid field (can be NULL).
+ * @param tracks the tracks.
+ * @param n the number of tracks.
+ * @param numThreads the number of threads, 0 (or less) for one per core.
+ * @param settings a swimmer whose tolerance and step limits are used, or NULL.
+ * @param work the work function.
+ * @param numItems the number of work items.
+ * @return the number of threads that were used.
+ */
+static int runSwimTracks(MagneticFieldPtr torus, MagneticFieldPtr solenoid, SwimTrackPtr tracks, int n,
+                         int numThreads, const Swimmer *settings, WorkFunction work, int numItems) {
+    if (n < 1) {
+        return 0;
+    }
+
+    numThreads = getPoolSize(numThreads, numItems);
+
+    SwimTracksContext context;
+    context.tracks = tracks;
+    context.numTracks = n;
+    context.swimmers = (SwimmerPtr *) malloc(numThreads * sizeof(SwimmerPtr));
+
+    for (int i = 0; i < numThreads; i++) {
+        SwimmerPtr swimmer = createSwimmer(torus, solenoid);
+        if (settings != NULL) {
+            swimmer->tolerance = settings->tolerance;
+            swimmer->minStep = settings->minStep;
+            swimmer->maxStep = settings->maxStep;
+            swimmer->maxSteps = settings->maxSteps;
+            swimmer->surfaceTolerance = settings->surfaceTolerance;
+            swimmer->helix = settings->helix;
+            swimmer->predictSteps = settings->predictSteps;
+        }
+        context.swimmers[i] = swimmer;
+    }
+
+    parallelFor(numItems, numThreads, work, &context);
+
+    for (int i = 0; i < numThreads; i++) {
+        freeSwimmer(context.swimmers[i]);
+    }
+    free(context.swimmers);
+    return numThreads;
+}
+
+/**
+ * Load the next track of the block into a lane and store its start point.
+ * Tracks that cannot be swum are skipped, as swimAdaptive would.
+ * @param lanes the lanes.
+ * @param l the lane.
+ * @return true if a track was loaded, false if there are none left.
+ */
+static bool loadLane(SwimLanesPtr lanes, int l) {
+    while (lanes->nextTrack < lanes->endTrack) {
+        int t = lanes->nextTrack++;
+        SwimTrackPtr track = lanes->tracks + t;
+        double y[NSTATE];
+
+        startSwim(lanes->swimmer, &(track->start), y, track->trajectory, track->capacity, &(track->result));
+        if (track->momentum <= 0) {
+            fprintf(stderr, "\ncMag ERROR swimming needs a positive momentum.\n");
+            continue;
+        }
+
+        for (int i = 0; i < NSTATE; i++) {
+            lanes->y[i][l] = y[i];
+        }
+        lanes->track[l] = t;
+        lanes->evaluations[l] = 0;
+        lanes->k[l] = track->charge * SWIMCONSTANT / track->momentum;
+        lanes->s[l] = 0;
+        lanes->h[l] = min(SWIMFIRSTSTEP, lanes->swimmer->maxStep);
+        return true;
+    }
+    return false;
+}
+
+/**
+ * Finish the track in a lane and make the lane idle.
+ * @param lanes the lanes.
+ * @param l the lane.
+ */
+static void finishLane(SwimLanesPtr lanes, int l) {
+    lanes->tracks[lanes->track[l]].result.numFieldEvaluations = lanes->evaluations[l];
+    lanes->track[l] = -1;
+    lanes->k[l] = 0;
+    lanes->h[l] = 0;
+}
+
+/**
+ * The right hand side of the equations of motion for the selected lanes.
+ * Their positions are packed so that the field is a single batched (gathered)
+ * lookup, the other lanes are not evaluated.
+ * @param lanes the lanes.
+ * @param y the states.
+ * @param dyds upon return the derivatives of the selected lanes.
+ * @param mask the lanes to evaluate.
+ */
+static void laneDerivative(SwimLanesPtr lanes, double (*y)[SWIMLANES], double (*dyds)[SWIMLANES],
+                           const bool *mask) {
+    int packed[SWIMLANES];
+    int m = 0;
+
+    for (int l = 0; l < SWIMLANES; l++) {
+        if (mask[l]) {
+            packed[m] = l;
+            lanes->px[m] = y[0][l];
+            lanes->py[m] = y[1][l];
+            lanes->pz[m] = y[2][l];
+            m++;
+        }
+    }
+
+    if (m == 0) {
+        return;
+    }
+
+    getCompositeFieldValues(lanes->px, lanes->py, lanes->pz, lanes->bx, lanes->by, lanes->bz, m,
+                            lanes->swimmer->torusProbe, lanes->swimmer->solenoidProbe);
+
+    for (int a = 0; a < m; a++) {
+        int l = packed[a];
+        double k = lanes->k[l];
+        double b0 = lanes->bx[a], b1 = lanes->by[a], b2 = lanes->bz[a];
+
+        lanes->evaluations[l]++;
+        dyds[0][l] = y[3][l];
+        dyds[1][l] = y[4][l];
+        dyds[2][l] = y[5][l];
+        dyds[3][l] = k * (y[4][l] * b2 - y[5][l] * b1);
+        dyds[4][l] = k * (y[5][l] * b0 - y[3][l] * b2);
+        dyds[5][l] = k * (y[3][l] * b1 - y[4][l] * b0);
+    }
+}
+
+/**
+ * Take a Dormand-Prince step in the selected lanes, each with its own step
+ * size. The arithmetic runs over all the lanes (idle lanes have h = 0), only
+ * the field lookups are restricted to the selected lanes.
+ * @param lanes the lanes. Upon return yNew, ks[6] and error hold the step.
+ * @param mask the lanes that step.
+ */
+static void laneDormandPrince(SwimLanesPtr lanes, const bool *mask) {
+    for (int j = 1; j < 7; j++) {
+        for (int i = 0; i < NSTATE; i++) {
+            for (int l = 0; l < SWIMLANES; l++) {
+                double sum = 0;
+                for (int m = 0; m < j; m++) {
+                    sum += dpA[j][m] * lanes->ks[m][i][l];
+                }
+                lanes->yNew[i][l] = lanes->y[i][l] + lanes->h[l] * sum;
+            }
+        }
+        laneDerivative(lanes, lanes->yNew, lanes->ks[j], mask);
+    }
+
+    for (int l = 0; l < SWIMLANES; l++) {
+        lanes->error[l] = 0;
+    }
+    for (int i = 0; i < NSTATE; i++) {
+        for (int l = 0; l < SWIMLANES; l++) {
+            double sum = 0;
+            for (int m = 0; m < 7; m++) {
+                sum += dpE[m] * lanes->ks[m][i][l];
+            }
+            lanes->error[l] = max(lanes->error[l], fabs(lanes->h[l] * sum));
+        }
+    }
+    for (int l = 0; l < SWIMLANES; l++) {
+        lanes->error[l] /= lanes->swimmer->tolerance;
+    }
+}
+
+/**
+ * Swim a block of tracks through the lanes. When a track ends, the next one
+ * of the block is loaded into its lane, so the lanes stay busy until the
+ * block runs out. The step logic is that of swimAdaptive, lane by lane.
+ * @param lanes the lanes, with all lanes idle and the block set.
+ */
+static void swimLaneBlock(SwimLanesPtr lanes) {
+    SwimmerPtr swimmer = lanes->swimmer;
+    bool mask[SWIMLANES];
+
+    while (true) {
+        //load tracks into the idle lanes, and get their first derivative
+        bool loaded = false;
+        for (int l = 0; l < SWIMLANES; l++) {
+            mask[l] = (lanes->track[l] < 0) && loadLane(lanes, l);
+            loaded = loaded || mask[l];
+        }
+        if (loaded) {
+            laneDerivative(lanes, lanes->y, lanes->ks[0], mask);
+        }
+
+        //finish the tracks that are done, the others take a step
+        bool stepping = false;
+        bool finished = false;
+        for (int l = 0; l < SWIMLANES; l++) {
+            mask[l] = false;
+            if (lanes->track[l] < 0) {
+                continue;
+            }
+
+            SwimResultPtr result = &(lanes->tracks[lanes->track[l]].result);
+            double sMax = lanes->tracks[lanes->track[l]].sMax;
+
+            if ((lanes->s[l] < sMax) && (result->numSteps >= swimmer->maxSteps)) {
+                result->status = SWIM_MAX_STEPS;
+            }
+            if ((lanes->s[l] >= sMax) || (result->status != SWIM_OK)) {
+                finishLane(lanes, l);
+                finished = true;
+                continue;
+            }
+
+            //land exactly on sMax
+            lanes->last[l] = (lanes->h[l] >= sMax - lanes->s[l]);
+            if (lanes->last[l]) {
+                lanes->h[l] = sMax - lanes->s[l];
+            }
+            mask[l] = true;
+            stepping = true;
+        }
+
+        if (finished && (lanes->nextTrack < lanes->endTrack)) {
+            continue;
+        }
+        if (!stepping) {
+            break;
+        }
+
+        laneDormandPrince(lanes, mask);
+
+        for (int l = 0; l < SWIMLANES; l++) {
+            if (!mask[l]) {
+                continue;
+            }
+
+            SwimTrackPtr track = lanes->tracks + lanes->track[l];
+            SwimResultPtr result = &(track->result);
+            double error = lanes->error[l];
+
+            if (error > 1) {
+                result->numRejected++;
+                if (lanes->h[l] <= swimmer->minStep) {
+                    result->status = SWIM_STEP_TOO_SMALL;
+                }
+                else {
+                    lanes->h[l] = shrinkStep(swimmer, lanes->h[l], error);
+                }
+                continue;
+            }
+
+            double y[NSTATE];
+            for (int i = 0; i < NSTATE; i++) {
+                y[i] = lanes->y[i][l] = lanes->yNew[i][l];
+                lanes->ks[0][i][l] = lanes->ks[6][i][l];
+            }
+
+            lanes->s[l] = lanes->last[l] ? track->sMax : lanes->s[l] + lanes->h[l];
+            result->numSteps++;
+            storePoint(y, track->start.s + lanes->s[l], track->trajectory, track->capacity, result);
+            lanes->h[l] = growStep(swimmer, lanes->h[l], error);
+        }
+    }
+}
+
+/**
+ * Work function for swimTracksSimd: swim one block of tracks through the
+ * lanes, with the worker's swimmer.
+ * @param context the SwimTracksContext.
+ * @param worker the worker.
+ * @param index the block.
+ */
+static void swimLaneWork(void *context, int worker, int index) {
+    SwimTracksContext *tc = (SwimTracksContext *) context;
+    SwimLanesPtr lanes = (SwimLanesPtr) calloc(1, sizeof(SwimLanes));
+
+    lanes->swimmer = tc->swimmers[worker];
+    lanes->tracks = tc->tracks;
+    lanes->nextTrack = index * SWIMLANEBLOCK;
+    lanes->endTrack = (int) min(tc->numTracks, lanes->nextTrack + SWIMLANEBLOCK);
+    for (int l = 0; l < SWIMLANES; l++) {
+        lanes->track[l] = -1;
+    }
+
+    swimLaneBlock(lanes);
+    free(lanes);
+}
+
+/**
+ * Swim many tracks with the adaptive swimmer, SWIMLANES tracks at a time.
+ * Rather than vectorizing one lookup, each stage of the Runge-Kutta step
+ * evaluates the field for all the lanes in one batched lookup, which uses
+ * the vectorized (gathered) interpolation kernels, and lanes are masked off
+ * as their tracks end and refilled with the next track. Each lane has its own
+ * step size, so the results agree with swimTracks up to the float rounding
+ * of the batched lookups. Blocks of tracks are shared out to a thread pool.
+ * @param torus the torus field (can be NULL).
+ * @param solenoid the solenoid field (can be NULL).
+ * @param tracks the tracks. Each result is filled in.
+ * @param n the number of tracks.
+ * @param numThreads the number of threads, 0 (or less) for one per core.
+ * @param settings a swimmer whose tolerance and step limits are used, or NULL
+ * for the defaults.
+ * @return the number of threads that were used.
+ */
+int swimTracksSimd(MagneticFieldPtr torus, MagneticFieldPtr solenoid, SwimTrackPtr tracks, int n,
+                   int numThreads, const Swimmer *settings) {
+    return runSwimTracks(torus, solenoid, tracks, n, numThreads, settings, swimLaneWork,
+                         (n + SWIMLANEBLOCK - 1) / SWIMLANEBLOCK);
+}
+
+/**
+ * Create a solenoid style map with a uniform field along z. It covers
+ * rho < 1000 cm and |z| < 1000 cm, and is used for testing since
+ * tracks in it are exact helices.
+ * @param bz the field in kG.
+ * @return the field.
+ */
+MagneticFieldPtr createUniformField(double bz) {
+    FieldMapHeaderPtr headerPtr = (FieldMapHeaderPtr) calloc(1, sizeof(FieldMapHeader));
+    headerPtr->magicWord = MAGICWORD;
+    headerPtr->gridCS = 0; //cylindrical
+    headerPtr->fieldCS = 1; //Cartesian
+    headerPtr->q1min = 0;
+    headerPtr->q1max = 0;
+    headerPtr->nq1 = 1;
+    headerPtr->q2min = 0;
+    headerPtr->q2max = 1000;
+    headerPtr->nq2 = 3;
+    headerPtr->q3min = -1000;
+    headerPtr->q3max = 1000;
+    headerPtr->nq3 = 3;
+
+    int numValues = headerPtr->nq2 * headerPtr->nq3;
+    FieldValuePtr fieldValues = (FieldValuePtr) malloc(numValues * sizeof(FieldValue));
+    for (int i = 0; i < numValues; i++) {
+        fieldValues[i].b1 = 0;
+        fieldValues[i].b2 = 0;
+        fieldValues[i].b3 = (float) bz;
+    }
+
+    return createFieldFromData(headerPtr, fieldValues, "uniform field");
+}
+
+/**
+ * Unit test for the swimmer. In a uniform field the tracks are helices that
+ * both integrators must follow, and in the test fields the two integrators
+ * must agree.
+ * @return NULL if all tests pass, otherwise an error message.
+ */
+char *swimUnitTest() {
+    int capacity = 2000;
+    SwimPointPtr trajectory = (SwimPointPtr) malloc(capacity * sizeof(SwimPoint));
+    SwimResult result, rk4Result;
+    SwimPoint start;
+
+    //uniform field, compare with the helix
+    double b0 = 10.0;
+    MagneticFieldPtr uniform = createUniformField(b0);
+    SwimmerPtr swimmer = createSwimmer(NULL, uniform);
+
+    double maxDiff = 0;
+    for (int i = 0; i < 20; i++) {
+        int charge = (i % 2 == 0) ? -1 : 1;
+        double p = randomDouble(0.5, 5.0);
+        double sMax = randomDouble(100, 500);
+        initSwimPoint(&start, randomDouble(-10, 10), randomDouble(-10, 10), randomDouble(-10, 10),
+                      randomDouble(10, 170), randomDouble(0, 360));
+
+        swimAdaptive(swimmer, charge, p, &start, sMax, trajectory, capacity, &result);
+        mu_assert("Adaptive swim in uniform field failed.", result.status == SWIM_OK);
+        mu_assert("Bad number of trajectory points.", result.numPoints == result.numSteps + 1);
+        mu_assert("Bad number of field evaluations.",
+                  result.numFieldEvaluations == 6 * (result.numSteps + result.numRejected) + 1);
+
+        swimRK4(swimmer, charge, p, &start, sMax, 1.0, NULL, 0, &rk4Result);
+        mu_assert("Bad number of RK4 field evaluations.",
+                  rk4Result.numFieldEvaluations == 4 * rk4Result.numSteps);
+
+        //the helix, with omega the turning rate per unit path length
+        double omega = charge * SWIMCONSTANT * b0 / p;
+        for (int j = 0; j < result.numPoints + 1; j++) {
+            SwimPointPtr point = (j < result.numPoints) ? trajectory + j : &(rk4Result.final);
+            double ws = omega * point->s;
+            double x = start.x + (start.tx * sin(ws) - start.ty * cos(ws) + start.ty) / omega;
+            double y = start.y + (start.ty * sin(ws) + start.tx * cos(ws) - start.tx) / omega;
+            double z = start.z + start.tz * point->s;
+            double diff = sqrt((point->x - x) * (point->x - x) + (point->y - y) * (point->y - y) +
+                               (point->z - z) * (point->z - z));
+            maxDiff = max(maxDiff, diff);
+        }
+        mu_assert("Final path length is wrong.", fabs(result.final.s - sMax) < 1.0e-9);
+    }
+    mu_assert("Swim does not follow the helix.", maxDiff < 1.0e-3);
+
+    //a small buffer only truncates the stored trajectory
+    swimAdaptive(swimmer, -1, 1.0, &start, 300, trajectory, 3, &rk4Result);
+    swimAdaptive(swimmer, -1, 1.0, &start, 300, NULL, 0, &result);
+    mu_assert("Trajectory should be truncated.", rk4Result.truncated && (rk4Result.numPoints == 3));
+    mu_assert("Truncation changed the swim.", memcmp(&(result.final), &(rk4Result.final), sizeof(SwimPoint)) == 0);
+
+    //neutral tracks are straight lines
+    swimAdaptive(swimmer, 0, 1.0, &start, 300, NULL, 0, &result);
+    mu_assert("Neutral track is not straight.",
+              fabs(result.final.x - (start.x + 300 * start.tx)) < 1.0e-9 &&
+              fabs(result.final.y - (start.y + 300 * start.ty)) < 1.0e-9 &&
+              fabs(result.final.z - (start.z + 300 * start.tz)) < 1.0e-9);
+
+    freeSwimmer(swimmer);
+    freeFieldMap(uniform);
+
+    //the test fields, the two integrators should agree. The interpolated field
+    //has kinks at the cell boundaries, so the tolerance must be tight.
+    swimmer = createSwimmer(testFieldPtr, testSolenoidPtr);
+    swimmer->tolerance = 1.0e-8;
+    double maxAgree = 0;
+    for (int i = 0; i < 10; i++) {
+        int charge = (i % 2 == 0) ? -1 : 1;
+        double p = randomDouble(0.5, 5.0);
+        initSwimPoint(&start, 0, 0, 0, randomDouble(5, 40), randomDouble(0, 360));
+
+        swimAdaptive(swimmer, charge, p, &start, 600, NULL, 0, &result);
+        swimRK4(swimmer, charge, p, &start, 600, 0.05, NULL, 0, &rk4Result);
+        mu_assert("Adaptive swim in test fields failed.", result.status == SWIM_OK);
+
+        double diff = sqrt((result.final.x - rk4Result.final.x) * (result.final.x - rk4Result.final.x) +
+                           (result.final.y - rk4Result.final.y) * (result.final.y - rk4Result.final.y) +
+                           (result.final.z - rk4Result.final.z) * (result.final.z - rk4Result.final.z));
+        maxAgree = max(maxAgree, diff);
+    }
+    mu_assert("Adaptive and RK4 swims disagree.", maxAgree < 1.0e-2);
+
+    //many tracks on several threads give the same results as one at a time
+    int numTracks = 100;
+    int pointsPerTrack = capacity / numTracks;
+    SwimTrackPtr tracks = (SwimTrackPtr) malloc(numTracks * sizeof(SwimTrack));
+    for (int i = 0; i < numTracks; i++) {
+        tracks[i].charge = (i % 2 == 0) ? -1 : 1;
+        tracks[i].momentum = randomDouble(0.5, 5.0);
+        initSwimPoint(&(tracks[i].start), 0, 0, 0, randomDouble(5, 40), randomDouble(0, 360));
+        tracks[i].sMax = randomDouble(50, 600);
+        tracks[i].trajectory = trajectory + i * pointsPerTrack;
+        tracks[i].capacity = pointsPerTrack;
+    }
+
+    int used = swimTracks(testFieldPtr, testSolenoidPtr, tracks, numTracks, 4, swimmer);
+    mu_assert("Wrong number of threads.", used == 4);
+
+    for (int i = 0; i < numTracks; i++) {
+        SwimTrackPtr track = tracks + i;
+        swimAdaptive(swimmer, track->charge, track->momentum, &(track->start), track->sMax, NULL, 0, &result);
+        mu_assert("Parallel swim differs.", (memcmp(&(result.final), &(track->result.final), sizeof(SwimPoint)) == 0) &&
+                  (result.numSteps == track->result.numSteps));
+        mu_assert("Bad parallel trajectory start.", (track->trajectory->x == track->start.x) &&
+                  (track->trajectory->tz == track->start.tz));
+        mu_assert("Bad parallel trajectory.", track->result.truncated ? (track->result.numPoints == pointsPerTrack) :
+                  (memcmp(&(track->result.final), track->trajectory + track->result.numPoints - 1, sizeof(SwimPoint)) == 0));
+    }
+
+    //the lanes follow the same steps, up to the rounding of the batched lookups
+    tracks[7].sMax = 0;
+    swimTracksSimd(testFieldPtr, testSolenoidPtr, tracks, numTracks, 2, swimmer);
+
+    double maxLanes = 0;
+    for (int i = 0; i < numTracks; i++) {
+        SwimTrackPtr track = tracks + i;
+        swimAdaptive(swimmer, track->charge, track->momentum, &(track->start), track->sMax, NULL, 0, &result);
+        mu_assert("Lane swim failed.", track->result.status == SWIM_OK);
+        mu_assert("Bad number of lane field evaluations.", track->result.numFieldEvaluations ==
+                  6 * (track->result.numSteps + track->result.numRejected) + 1);
+        mu_assert("Lane swim has the wrong length.", track->result.final.s == track->start.s + track->sMax);
+        mu_assert("Bad lane trajectory.", track->result.truncated ? (track->result.numPoints == pointsPerTrack) :
+                  (memcmp(&(track->result.final), track->trajectory + track->result.numPoints - 1, sizeof(SwimPoint)) == 0));
+
+        double diff = sqrt((result.final.x - track->result.final.x) * (result.final.x - track->result.final.x) +
+                           (result.final.y - track->result.final.y) * (result.final.y - track->result.final.y) +
+                           (result.final.z - track->result.final.z) * (result.final.z - track->result.final.z));
+        maxLanes = max(maxLanes, diff);
+    }
+    mu_assert("Lane and single track swims disagree.", maxLanes < 1.0e-2);
+    free(tracks);
+
+    freeSwimmer(swimmer);
+    free(trajectory);
+
+    fprintf(stdout, "\nPASSED swimUnitTest (helix max diff: %-9.3e cm  RK4 vs adaptive: %-9.3e cm  lanes: %-9.3e cm)\n",
+            maxDiff, maxAgree, maxLanes);
+    return NULL;
+}
+
+/**
+ * Swim from a start given by plane parameters and return the plane parameters
+ * where the track crosses a plane of constant z, for the finite differences
+ * in jacobianUnitTest. The crossing is found by a straight step from the end
+ * of the swim, which is exact to second order in the (small) distance.
+ * @param swimmer the swimmer.
+ * @param z0 the z of the start plane in cm.
+ * @param p the start (x, y, dx/dz, dy/dz, q/p) with the charge of sign(q/p).
+ * @param sMax the path length to swim in cm.
+ * @param zEnd the z of the end plane in cm.
+ * @param q upon return the end (x, y, dx/dz, dy/dz, q/p).
+ */
+static void swimPlanes(SwimmerPtr swimmer, double z0, const double *p, double sMax, double zEnd, double *q) {
+    SwimPoint start;
+    SwimResult result;
+    double norm = sqrt(1 + p[2] * p[2] + p[3] * p[3]);
+    int charge = (p[4] < 0) ? -1 : 1;
+
+    start.x = p[0];
+    start.y = p[1];
+    start.z = z0;
+    start.tx = p[2] / norm;
+    start.ty = p[3] / norm;
+    start.tz = 1 / norm;
+    start.s = 0;
+
+    swimAdaptive(swimmer, charge, charge / p[4], &start, sMax, NULL, 0, &result);
+
+    double y[NSTATE] = {result.final.x, result.final.y, result.final.z,
+                        result.final.tx, result.final.ty, result.final.tz};
+    double dyds[NSTATE];
+    derivative(swimmer, charge * SWIMCONSTANT * fabs(p[4]), y, dyds);
+
+    double ds = (zEnd - y[2]) / y[5];
+    for (int i = 0; i < NSTATE; i++) {
+        y[i] += dyds[i] * ds;
+    }
+
+    q[0] = y[0];
+    q[1] = y[1];
+    q[2] = y[3] / y[5];
+    q[3] = y[4] / y[5];
+    q[4] = p[4];
+}
+
+/**
+ * Unit test for the Jacobian propagation. Both the fixed path length
+ * Jacobian and the plane to plane transport matrix are compared with
+ * central differences of swims with perturbed starts.
+ * @return NULL if all tests pass, otherwise an error message.
+ */
+char *jacobianUnitTest() {
+    SwimPoint start, pStart;
+    SwimResult result, plus, minus;
+    SwimJacobian jacobian;
+
+    SwimmerPtr swimmer = createSwimmer(testFieldPtr, testSolenoidPtr);
+    swimmer->tolerance = 1.0e-9;
+
+    double maxGlobal = 0;
+    double maxTransport = 0;
+
+    //the maps end abruptly, and the jumps in the field at their edges are
+    //not in the Jacobian, so the tracks stay inside the solenoid (from the
+    //origin) or the torus (from beyond the solenoid)
+    for (int n = 0; n < 6; n++) {
+        int charge = (n % 2 == 0) ? -1 : 1;
+        double p = randomDouble(1.0, 4.0);
+        double sMax;
+
+        if (n < 3) {
+            sMax = 150;
+            initSwimPoint(&start, randomDouble(-1, 1), randomDouble(-1, 1), randomDouble(-1, 1),
+                          randomDouble(50, 70), randomDouble(0, 360));
+        }
+        else {
+            sMax = 250;
+            initSwimPoint(&start, randomDouble(-1, 1), randomDouble(-1, 1), 310,
+                          randomDouble(10, 30), randomDouble(0, 360));
+        }
+
+        swimJacobian(swimmer, charge, p, &start, sMax, NULL, 0, &result, &jacobian);
+        mu_assert("Jacobian swim failed.", result.status == SWIM_OK);
+        mu_assert("Bad number of Jacobian field evaluations.",
+                  result.numFieldEvaluations == 6 * (result.numSteps + result.numRejected) + 1);
+
+        //the fixed path length Jacobian
+        double lambda = charge / p;
+        for (int j = 0; j < 7; j++) {
+            double delta = (j < 3) ? 1.0e-2 : 1.0e-3;
+            double *startPtr = &(pStart.x);
+
+            pStart = start;
+            if (j < 6) {
+                startPtr[j] += delta;
+            }
+            swimAdaptive(swimmer, charge, (j < 6) ? p : charge / (lambda + delta), &pStart, sMax, NULL, 0, &plus);
+
+            pStart = start;
+            if (j < 6) {
+                startPtr[j] -= delta;
+            }
+            swimAdaptive(swimmer, charge, (j < 6) ? p : charge / (lambda - delta), &pStart, sMax, NULL, 0, &minus);
+
+            double *plusPtr = &(plus.final.x);
+            double *minusPtr = &(minus.final.x);
+            for (int i = 0; i < 6; i++) {
+                double difference = (plusPtr[i] - minusPtr[i]) / (2 * delta);
+                maxGlobal = max(maxGlobal, fabs(difference - jacobian.global[i][j]) / (1 + fabs(difference)));
+            }
+        }
+
+        //the transport matrix
+        double local[5] = {start.x, start.y, start.tx / start.tz, start.ty / start.tz, lambda};
+        double localPlus[5], localMinus[5], endPlus[5], endMinus[5];
+        for (int j = 0; j < 5; j++) {
+            double delta = (j < 2) ? 1.0e-2 : 1.0e-3;
+            memcpy(localPlus, local, sizeof(local));
+            memcpy(localMinus, local, sizeof(local));
+            localPlus[j] += delta;
+            localMinus[j] -= delta;
+
+            swimPlanes(swimmer, start.z, localPlus, sMax, result.final.z, endPlus);
+            swimPlanes(swimmer, start.z, localMinus, sMax, result.final.z, endMinus);
+
+            for (int i = 0; i < 5; i++) {
+                double difference = (endPlus[i] - endMinus[i]) / (2 * delta);
+                maxTransport = max(maxTransport, fabs(difference - jacobian.transport[i][j]) / (1 + fabs(difference)));
+            }
+        }
+    }
+
+    //the interpolated field is only piecewise smooth, so the differences
+    //(of swims with float fields) agree to about a percent
+    mu_assert("Fixed path length Jacobian does not match differences.", maxGlobal < 2.0e-2);
+    mu_assert("Transport matrix does not match differences.", maxTransport < 2.0e-2);
+    freeSwimmer(swimmer);
+
+    fprintf(stdout, "\nPASSED jacobianUnitTest (max relative difference: fixed length %-9.3e  transport %-9.3e)\n",
+            maxGlobal, maxTransport);
+    return NULL;
+}
+
+/**
+ * Unit test for swimming to surfaces. In a uniform field the crossings of
+ * planes of constant z are known, and in all fields the swim must end on the
+ * surface, at the same point as a swim of the same fixed length.
+ * @return NULL if all tests pass, otherwise an error message.
+ */
+char *surfaceUnitTest() {
+    SwimResult result, fixedResult;
+    SwimSurface surface;
+    SwimPoint start;
+
+    double b0 = 10.0;
+    MagneticFieldPtr uniform = createUniformField(b0);
+    SwimmerPtr swimmer = createSwimmer(NULL, uniform);
+
+    //planes of constant z: the track gets there after (zPlane - z) / tz
+    double maxPathDiff = 0;
+    for (int i = 0; i < 20; i++) {
+        int charge = (i % 2 == 0) ? -1 : 1;
+        double p = randomDouble(0.5, 5.0);
+        initSwimPoint(&start, randomDouble(-10, 10), randomDouble(-10, 10), randomDouble(-10, 10),
+                      randomDouble(10, 80), randomDouble(0, 360));
+        double length = randomDouble(50, 300);
+        initZPlaneSurface(&surface, start.z + length);
+
+        swimToSurface(swimmer, charge, p, &start, &surface, 2000, NULL, 0, &result);
+        mu_assert("Swim to plane failed.", (result.status == SWIM_OK) && result.hitSurface);
+        mu_assert("Swim did not end on the plane.",
+                  fabs(result.final.z - surface.distance) <= swimmer->surfaceTolerance);
+        maxPathDiff = max(maxPathDiff, fabs(result.final.s - length / start.tz));
+        mu_assert("Bad number of field evaluations.",
+                  result.numFieldEvaluations == 6 * (result.numSteps + result.numRejected) + 1);
+    }
+    mu_assert("Wrong path length to the plane.", maxPathDiff < 1.0e-3);
+
+    //a plane behind the track is never reached
+    initZPlaneSurface(&surface, start.z - 10);
+    swimToSurface(swimmer, -1, 1.0, &start, &surface, 300, NULL, 0, &result);
+    mu_assert("Plane behind the track was hit.", !result.hitSurface && (result.final.s == 300));
+
+    //a start on the surface does not count
+    initZPlaneSurface(&surface, start.z);
+    swimToSurface(swimmer, -1, 1.0, &start, &surface, 300, NULL, 0, &result);
+    mu_assert("Start on the plane was a hit.", !result.hitSurface && (result.final.s == 300));
+
+    //cylinders, from the axis the transverse radius of the helix is at least 100 cm
+    for (int i = 0; i < 20; i++) {
+        int charge = (i % 2 == 0) ? -1 : 1;
+        double p = randomDouble(1.0, 5.0);
+        initSwimPoint(&start, 0, 0, 0, randomDouble(30, 150), randomDouble(0, 360));
+        initCylinderSurface(&surface, randomDouble(20, 150));
+
+        swimToSurface(swimmer, charge, p, &start, &surface, 2000, NULL, 0, &result);
+        mu_assert("Swim to cylinder failed.", (result.status == SWIM_OK) && result.hitSurface);
+        mu_assert("Swim did not end on the cylinder.",
+                  fabs(surfaceDistance(&surface, result.final.x, result.final.y, result.final.z)) <=
+                  swimmer->surfaceTolerance);
+    }
+
+    freeSwimmer(swimmer);
+    freeFieldMap(uniform);
+
+    //drift chamber like sector planes in the test fields, in the sector of each track.
+    //Softer tracks can be turned back by the torus before they get there. As
+    //in swimUnitTest the kinks of the interpolated field need a tight tolerance.
+    swimmer = createSwimmer(testFieldPtr, testSolenoidPtr);
+    swimmer->tolerance = 1.0e-8;
+    double maxDiff = 0;
+    long surfaceEvaluations = 0;
+    long fixedEvaluations = 0;
+    for (int i = 0; i < 20; i++) {
+        int charge = (i % 2 == 0) ? -1 : 1;
+        double p = randomDouble(2.0, 5.0);
+        initSwimPoint(&start, 0, 0, 0, randomDouble(10, 30), randomDouble(0, 360));
+        initSectorPlaneSurface(&surface, 0, 25, randomDouble(220, 500));
+
+        swimToSurface(swimmer, charge, p, &start, &surface, 2000, NULL, 0, &result);
+        mu_assert("Swim to sector plane failed.", (result.status == SWIM_OK) && result.hitSurface);
+
+        int sector = getSector(toDegrees(atan2(start.ty, start.tx)));
+        SwimSurface sectorSurface;
+        initSectorPlaneSurface(&sectorSurface, sector, 25, surface.distance);
+        mu_assert("Swim did not end on the sector plane.",
+                  fabs(surfaceDistance(&sectorSurface, result.final.x, result.final.y, result.final.z)) <=
+                  swimmer->surfaceTolerance);
+
+        swimAdaptive(swimmer, charge, p, &start, result.final.s, NULL, 0, &fixedResult);
+        double diff = sqrt((result.final.x - fixedResult.final.x) * (result.final.x - fixedResult.final.x) +
+                           (result.final.y - fixedResult.final.y) * (result.final.y - fixedResult.final.y) +
+                           (result.final.z - fixedResult.final.z) * (result.final.z - fixedResult.final.z));
+        maxDiff = max(maxDiff, diff);
+        surfaceEvaluations += result.numFieldEvaluations;
+        fixedEvaluations += fixedResult.numFieldEvaluations;
+    }
+    mu_assert("Swim to sector plane and fixed length swim disagree.", maxDiff < 1.0e-3);
+
+    freeSwimmer(swimmer);
+
+    fprintf(stdout, "\nPASSED surfaceUnitTest (path length diff: %-9.3e cm  vs fixed length: %-9.3e cm"
+            "  lookups %.1f vs %.1f per track)\n", maxPathDiff, maxDiff,
+            surfaceEvaluations / 20.0, fixedEvaluations / 20.0);
+    return NULL;
+}
+
+/**
+ * Unit test for helix steps. In a uniform field every step is a helix step
+ * with one lookup, and exact. In the test fields helix steps may only be
+ * taken where the field bounds allow, so the swim must agree with the plain
+ * adaptive swim, and take no more lookups.
+ * @return NULL if all tests pass, otherwise an error message.
+ */
+char *helixUnitTest() {
+    SwimResult result, plainResult;
+    SwimPoint start;
+    SwimSurface surface;
+
+    double b0 = 10.0;
+    MagneticFieldPtr uniform = createUniformField(b0);
+    mu_assert("Could not build the uniform field bounds.", buildFieldUniformity(uniform));
+    SwimmerPtr swimmer = createSwimmer(NULL, uniform);
+    swimmer->helix = true;
+
+    double maxDiff = 0;
+    for (int i = 0; i < 20; i++) {
+        int charge = (i % 2 == 0) ? -1 : 1;
+        double p = randomDouble(0.5, 5.0);
+        double sMax = randomDouble(100, 500);
+        initSwimPoint(&start, randomDouble(-10, 10), randomDouble(-10, 10), randomDouble(-10, 10),
+                      randomDouble(10, 170), randomDouble(0, 360));
+
+        swimAdaptive(swimmer, charge, p, &start, sMax, NULL, 0, &result);
+        mu_assert("Helix swim failed.", result.status == SWIM_OK);
+        mu_assert("Not all steps were helix steps.", result.numHelixSteps == result.numSteps);
+        mu_assert("Helix steps should be as long as allowed.",
+                  result.numSteps == (int) ceil(sMax / swimmer->maxStep));
+        mu_assert("Helix steps should take one lookup.", result.numFieldEvaluations == result.numSteps + 1);
+
+        double omega = charge * SWIMCONSTANT * b0 / p;
+        double ws = omega * sMax;
+        double x = start.x + (start.tx * sin(ws) - start.ty * cos(ws) + start.ty) / omega;
+        double y = start.y + (start.ty * sin(ws) + start.tx * cos(ws) - start.tx) / omega;
+        double z = start.z + start.tz * sMax;
+        maxDiff = max(maxDiff, sqrt((result.final.x - x) * (result.final.x - x) +
+                                    (result.final.y - y) * (result.final.y - y) +
+                                    (result.final.z - z) * (result.final.z - z)));
+    }
+    mu_assert("Helix steps do not follow the helix.", maxDiff < 1.0e-6);
+
+    //helix steps still land on surfaces
+    initZPlaneSurface(&surface, start.z + 100 * start.tz);
+    swimToSurface(swimmer, -1, 1.0, &start, &surface, 1000, NULL, 0, &result);
+    mu_assert("Helix swim missed the plane.", result.hitSurface &&
+              (fabs(result.final.z - surface.distance) <= swimmer->surfaceTolerance));
+
+    freeSwimmer(swimmer);
+    freeFieldMap(uniform);
+
+    //the test fields, past the ends of the maps
+    mu_assert("Could not build the test field bounds.",
+              buildFieldUniformity(testFieldPtr) && buildFieldUniformity(testSolenoidPtr));
+    swimmer = createSwimmer(testFieldPtr, testSolenoidPtr);
+
+    double maxAgree = 0;
+    long helixEvaluations = 0;
+    long plainEvaluations = 0;
+    for (int i = 0; i < 20; i++) {
+        int charge = (i % 2 == 0) ? -1 : 1;
+        double p = randomDouble(0.5, 5.0);
+        initSwimPoint(&start, 0, 0, 0, randomDouble(5, 40), randomDouble(0, 360));
+
+        swimmer->helix = false;
+        swimAdaptive(swimmer, charge, p, &start, 1000, NULL, 0, &plainResult);
+        swimmer->helix = true;
+        swimAdaptive(swimmer, charge, p, &start, 1000, NULL, 0, &result);
+        mu_assert("Helix swim in test fields failed.", result.status == SWIM_OK);
+
+        double diff = sqrt((result.final.x - plainResult.final.x) * (result.final.x - plainResult.final.x) +
+                           (result.final.y - plainResult.final.y) * (result.final.y - plainResult.final.y) +
+                           (result.final.z - plainResult.final.z) * (result.final.z - plainResult.final.z));
+        maxAgree = max(maxAgree, diff);
+        helixEvaluations += result.numFieldEvaluations;
+        plainEvaluations += plainResult.numFieldEvaluations;
+    }
+    mu_assert("Helix and plain swims disagree.", maxAgree < 1.0e-2);
+    mu_assert("Helix swims should not take more lookups.", helixEvaluations <= plainEvaluations);
+    freeSwimmer(swimmer);
+
+    fprintf(stdout, "\nPASSED helixUnitTest (helix max diff: %-9.3e cm  vs plain: %-9.3e cm"
+            "  lookups %.1f vs %.1f per track)\n", maxDiff, maxAgree,
+            helixEvaluations / 20.0, plainEvaluations / 20.0);
+    return NULL;
+}
+
+/**
+ * Unit test for predicted steps. Without bounds there is no prediction. In
+ * the test fields, swims with predicted steps must reject far fewer steps
+ * and need fewer lookups than plain adaptive swims, and be no less accurate,
+ * compared with swims at a much tighter tolerance.
+ * @return NULL if all tests pass, otherwise an error message.
+ */
+char *predictUnitTest() {
+    SwimResult result, plainResult, tightResult;
+    SwimPoint start;
+    initSwimPoint(&start, 0, 0, 0, 20, 30);
+
+    MagneticFieldPtr uniform = createUniformField(10.0);
+    SwimmerPtr swimmer = createSwimmer(NULL, uniform);
+    mu_assert("Prediction without bounds should be zero.", predictStepSize(swimmer, -1, 1.0, &start) == 0);
+    buildFieldUniformity(uniform);
+    double h = predictStepSize(swimmer, -1, 1.0, &start);
+    mu_assert("Bad predicted step in the uniform field.", (h >= swimmer->minStep) && (h <= swimmer->maxStep));
+    freeSwimmer(swimmer);
+    freeFieldMap(uniform);
+
+    mu_assert("Could not build the test field bounds.",
+              buildFieldUniformity(testFieldPtr) && buildFieldUniformity(testSolenoidPtr));
+    swimmer = createSwimmer(testFieldPtr, testSolenoidPtr);
+    SwimmerPtr tight = createSwimmer(testFieldPtr, testSolenoidPtr);
+    tight->tolerance = 1.0e-9;
+    tight->minStep = 1.0e-8;
+    tight->maxSteps = 10 * SWIMMAXSTEPS;
+
+    double maxError = 0;
+    double maxPlainError = 0;
+    long rejected = 0;
+    long plainRejected = 0;
+    long evaluations = 0;
+    long plainEvaluations = 0;
+    for (int i = 0; i < 20; i++) {
+        int charge = (i % 2 == 0) ? -1 : 1;
+        double p = randomDouble(0.5, 5.0);
+        initSwimPoint(&start, 0, 0, 0, randomDouble(5, 40), randomDouble(0, 360));
+
+        h = predictStepSize(swimmer, charge, p, &start);
+        mu_assert("Bad predicted step in the test fields.", (h >= swimmer->minStep) && (h <= swimmer->maxStep));
+
+        swimmer->predictSteps = false;
+        swimAdaptive(swimmer, charge, p, &start, 1000, NULL, 0, &plainResult);
+        swimmer->predictSteps = true;
+        swimAdaptive(swimmer, charge, p, &start, 1000, NULL, 0, &result);
+        swimAdaptive(tight, charge, p, &start, 1000, NULL, 0, &tightResult);
+        mu_assert("Swim with predicted steps failed.", (result.status == SWIM_OK) && (tightResult.status == SWIM_OK));
+
+        SwimPointPtr ends[2] = {&(result.final), &(plainResult.final)};
+        double errors[2];
+        for (int j = 0; j < 2; j++) {
+            errors[j] = sqrt((ends[j]->x - tightResult.final.x) * (ends[j]->x - tightResult.final.x) +
+                             (ends[j]->y - tightResult.final.y) * (ends[j]->y - tightResult.final.y) +
+                             (ends[j]->z - tightResult.final.z) * (ends[j]->z - tightResult.final.z));
+        }
+        maxError = max(maxError, errors[0]);
+        maxPlainError = max(maxPlainError, errors[1]);
+        rejected += result.numRejected;
+        plainRejected += plainResult.numRejected;
+        evaluations += result.numFieldEvaluations;
+        plainEvaluations += plainResult.numFieldEvaluations;
+    }
+    mu_assert("Predicted steps should avoid most rejected steps.", 2 * rejected <= plainRejected);
+    mu_assert("Predicted steps should need fewer lookups.", evaluations < plainEvaluations);
+    mu_assert("Predicted steps are less accurate.", maxError <= 2 * maxPlainError + 1.0e-3);
+    freeSwimmer(tight);
+    freeSwimmer(swimmer);
+
+    fprintf(stdout, "\nPASSED predictUnitTest (rejected %.2f vs %.2f, lookups %.1f vs %.1f per track,"
+            " max error %-9.3e vs %-9.3e cm)\n", rejected / 20.0, plainRejected / 20.0,
+            evaluations / 20.0, plainEvaluations / 20.0, maxError, maxPlainError);
+    return NULL;
+}
+
+/**
+ * Unit test for field lines. In a uniform field they are straight. In the
+ * solenoid, whose field has no phi component, they stay in their phi plane
+ * and leave the map with SWIM_NO_FIELD. In the test fields every point's
+ * direction must be along the field, a line traced back must return to its
+ * seed (unless it crosses a jump in the field), and traceFieldLines must give
+ * the same lines as tracing them one at a time.
+ * @return NULL if all tests pass, otherwise an error message.
+ */
+char *fieldLineUnitTest() {
+    int capacity = 4000;
+    SwimPointPtr line = (SwimPointPtr) malloc(capacity * sizeof(SwimPoint));
+    SwimResult result, back;
+
+    //uniform field
+    MagneticFieldPtr uniform = createUniformField(10.0);
+    SwimmerPtr swimmer = createSwimmer(NULL, uniform);
+    traceFieldLine(swimmer, 1, 1, 2, 3, 100, NULL, 0, &result);
+    mu_assert("Field line in a uniform field failed.", (result.status == SWIM_OK) &&
+              (fabs(result.final.z - 103) < 1.0e-9) && (fabs(result.final.x - 1) < 1.0e-9) &&
+              (fabs(result.final.tz - 1) < 1.0e-12));
+    traceFieldLine(swimmer, -1, 1, 2, 3, 100, NULL, 0, &result);
+    mu_assert("Field line against a uniform field failed.", (fabs(result.final.z + 97) < 1.0e-9) &&
+              (fabs(result.final.tz + 1) < 1.0e-12));
+    freeSwimmer(swimmer);
+    freeFieldMap(uniform);
+
+    //the solenoid alone
+    swimmer = createSwimmer(NULL, testSolenoidPtr);
+    traceFieldLine(swimmer, 1, 30, 40, 0, 5000, line, capacity, &result);
+    mu_assert("Solenoid field line should leave the map.", result.status == SWIM_NO_FIELD);
+    mu_assert("Solenoid field line left the map too late.",
+              !containsCartesian(testSolenoidPtr, result.final.x, result.final.y, result.final.z) &&
+              containsCartesian(testSolenoidPtr, line[result.numPoints - 2].x, line[result.numPoints - 2].y,
+                                line[result.numPoints - 2].z));
+    double maxPhiDrift = 0;
+    for (int i = 0; i < result.numPoints; i++) {
+        maxPhiDrift = max(maxPhiDrift, fabs(40 * line[i].x - 30 * line[i].y) / 50);
+    }
+    mu_assert("Solenoid field line left its phi plane.", maxPhiDrift < 1.0e-5);
+    freeSwimmer(swimmer);
+
+    //the test fields
+    swimmer = createSwimmer(testFieldPtr, testSolenoidPtr);
+    double maxAngle = 0;
+    double maxReturn = 0;
+    int n = 20;
+    SwimTrackPtr lines = (SwimTrackPtr) calloc(n, sizeof(SwimTrack));
+    for (int i = 0; i < n; i++) {
+        SwimTrackPtr track = lines + i;
+        initSwimPoint(&(track->start), randomDouble(-200, 200), randomDouble(-200, 200), randomDouble(150, 450), 0, 0);
+        track->charge = (i % 2 == 0) ? 1 : -1;
+        track->sMax = 300;
+        track->capacity = capacity;
+        track->trajectory = (SwimPointPtr) malloc(capacity * sizeof(SwimPoint));
+
+        traceFieldLine(swimmer, track->charge, track->start.x, track->start.y, track->start.z, track->sMax,
+                       line, capacity, &result);
+        //a line can get caught where the field jumps at the edge of the solenoid map
+        double rho = sqrt(result.final.x * result.final.x + result.final.y * result.final.y);
+        bool atEdge = (fabs(rho - testSolenoidPtr->rhoGridPtr->maxVal) < 1) ||
+                      (fabs(fabs(result.final.z) - testSolenoidPtr->zGridPtr->maxVal) < 1);
+        mu_assert("Field line in the test fields failed.", (result.status == SWIM_OK) ||
+                  (result.status == SWIM_NO_FIELD) || ((result.status == SWIM_STEP_TOO_SMALL) && atEdge));
+
+        double b[3];
+        for (int j = 0; j < result.numPoints; j++) {
+            swimField(swimmer, line[j].x, line[j].y, line[j].z, b);
+            double magnitude = sqrt(b[0] * b[0] + b[1] * b[1] + b[2] * b[2]);
+            if (magnitude > 0) {
+                double dot = track->charge * (line[j].tx * b[0] + line[j].ty * b[1] + line[j].tz * b[2]) / magnitude;
+                maxAngle = max(maxAngle, acos(min(1, dot)));
+            }
+        }
+
+        //back along the line to the seed, unless it crosses the edge of the
+        //solenoid map, where the field jumps and the line cannot be retraced
+        bool inside = containsCartesian(testSolenoidPtr, track->start.x, track->start.y, track->start.z);
+        bool crosses = false;
+        for (int j = 0; j < result.numPoints; j++) {
+            crosses = crosses || (containsCartesian(testSolenoidPtr, line[j].x, line[j].y, line[j].z) != inside);
+        }
+        if ((result.status == SWIM_OK) && !crosses) {
+            traceFieldLine(swimmer, -track->charge, result.final.x, result.final.y, result.final.z,
+                           result.final.s, NULL, 0, &back);
+            maxReturn = max(maxReturn, sqrt(pow(back.final.x - track->start.x, 2) +
+                                            pow(back.final.y - track->start.y, 2) +
+                                            pow(back.final.z - track->start.z, 2)));
+        }
+    }
+    mu_assert("Field line directions are not along the field.", maxAngle < 1.0e-6);
+    mu_assert("Field lines traced back miss their seeds.", maxReturn < 5.0e-2);
+
+    //in parallel
+    traceFieldLines(testFieldPtr, testSolenoidPtr, lines, n, 0, NULL);
+    for (int i = 0; i < n; i++) {
+        SwimTrackPtr track = lines + i;
+        traceFieldLine(swimmer, track->charge, track->start.x, track->start.y, track->start.z, track->sMax,
+                       line, capacity, &result);
+        mu_assert("Parallel field line differs.", (track->result.numPoints == result.numPoints) &&
+                  (memcmp(track->trajectory, line, result.numPoints * sizeof(SwimPoint)) == 0));
+        free(track->trajectory);
+    }
+
+    free(lines);
+    freeSwimmer(swimmer);
+    free(line);
+    fprintf(stdout, "\nPASSED fieldLineUnitTest (phi drift %-9.3e cm  angle to field %-9.3e  return %-9.3e cm)\n",
+            maxPhiDrift, maxAngle, maxReturn);
+    return NULL;
+}
@@ -0,0 +1,865 @@
+//
+//  magfieldtable.c
+//  cMag
+//  Trajectory lookup tables. Tracks from the target are swum once, to each
+//  of a set of reference surfaces, for a grid of charge, momentum, theta,
+//  phi and vertex z, and the crossings are stored. A lookup interpolates
+//  between the 16 surrounding nodes of the track's charge, linearly in 1/p
+//  (to which the bending is close to proportional), theta, phi and vertex z,
+//  so it evaluates no field at all. With a symmetric torus (or none) and no
+//  transverse shifts the field has the six fold symmetry of the sectors, so
+//  the table covers sector 1 only, phi in [-30, 30], and lookups in the
+//  other sectors are rotated.
+//
+
+#include "magfieldtable.h"
+#include "magfieldio.h"
+#include "magfieldutil.h"
+#include "magfieldpool.h"
+#include "munittest.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+//what the workers of createTrajectoryTable share
+typedef struct tablebuildcontext {
+    SwimmerPtr *swimmers; //one per worker
+    TrajectoryTablePtr table;
+} TableBuildContext;
+
+//local prototypes
+static bool validSpec(const TableSpec *);
+static bool isSectorSymmetric(MagneticFieldPtr, MagneticFieldPtr, const TableSpec *);
+static void setMapInfo(MagneticFieldPtr, char *, double *, double *, long long *);
+static void inverseMomentumAxis(const TableAxis *, TableAxisPtr);
+static size_t numNodes(const TableSpec *);
+static TableEntryPtr nodeEntry(TrajectoryTablePtr, int, const int *, int);
+static double interpolationError(TrajectoryTablePtr, int, const int *, const double *, int);
+static bool nearAcceptanceEdge(TrajectoryTablePtr, int, double, double, double, double, int);
+static void tableWork(void *, int, int);
+static size_t getDataOffset(void);
+
+/**
+ * Fill a table spec with the defaults and no surfaces: 0.5 to 10 GeV/c,
+ * theta from 5 to 40 degrees, phi every 5 degrees, and vertex z from -10
+ * to 10 cm, with swims of up to 1000 cm.
+ * @param spec the spec to fill.
+ */
+void initTableSpec(TableSpecPtr spec) {
+    memset(spec, 0, sizeof(TableSpec));
+    spec->momentum = (TableAxis) {0.5, 10.0, 24};
+    spec->theta = (TableAxis) {5.0, 40.0, 36};
+    spec->phi = (TableAxis) {0.0, 360.0, 73};
+    spec->vertexZ = (TableAxis) {-10.0, 10.0, 5};
+    spec->sMax = 1000.0;
+    spec->numSurfaces = 0;
+}
+
+/**
+ * Add a reference surface to a table spec.
+ * @param spec the spec.
+ * @param surface the surface, which is copied.
+ * @return false if the spec already has TABLEMAXSURFACES surfaces.
+ */
+bool addTableSurface(TableSpecPtr spec, const SwimSurface *surface) {
+    if (spec->numSurfaces >= TABLEMAXSURFACES) {
+        fprintf(stderr, "\ncMag ERROR a trajectory table has at most %d surfaces.\n", TABLEMAXSURFACES);
+        return false;
+    }
+    spec->surfaces[spec->numSurfaces++] = *surface;
+    return true;
+}
+
+/**
+ * Check that a table spec makes sense.
+ * @param spec the spec.
+ * @return true if it does.
+ */
+static bool validSpec(const TableSpec *spec) {
+    const TableAxis *axes[4] = {&(spec->momentum), &(spec->theta), &(spec->phi), &(spec->vertexZ)};
+    for (int i = 0; i < 4; i++) {
+        if ((axes[i]->numPoints < 2) || !(axes[i]->max > axes[i]->min)) {
+            fprintf(stderr, "\ncMag ERROR table axes need at least two points and max > min.\n");
+            return false;
+        }
+    }
+    if ((spec->momentum.min <= 0) || (spec->sMax <= 0)) {
+        fprintf(stderr, "\ncMag ERROR table momenta and path lengths must be positive.\n");
+        return false;
+    }
+    if ((spec->numSurfaces < 1) || (spec->numSurfaces > TABLEMAXSURFACES)) {
+        fprintf(stderr, "\ncMag ERROR a trajectory table needs 1 to %d surfaces.\n", TABLEMAXSURFACES);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Whether the fields and surfaces look the same from every sector: the torus
+ * (if any) is symmetric, neither map is shifted off the z axis, and the
+ * sector planes are in the track's sector.
+ * @param torus the torus field (can be NULL).
+ * @param solenoid the solenoid field (can be NULL).
+ * @param spec the spec.
+ * @return true if one sector is enough.
+ */
+static bool isSectorSymmetric(MagneticFieldPtr torus, MagneticFieldPtr solenoid, const TableSpec *spec) {
+    if ((torus != NULL) && (!torus->symmetric || (torus->shiftX != 0) || (torus->shiftY != 0))) {
+        return false;
+    }
+    if ((solenoid != NULL) && ((solenoid->shiftX != 0) || (solenoid->shiftY != 0))) {
+        return false;
+    }
+    for (int i = 0; i < spec->numSurfaces; i++) {
+        if ((spec->surfaces[i].type == SWIM_SECTORPLANE) && (spec->surfaces[i].sector != 0)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Record which map a table was made with: its file name, size and
+ * modification time, scale and shift. The name is without the directory, so
+ * tables still apply when the maps are moved, but a map file that is
+ * rewritten under the same name gets a new size or time.
+ * @param fieldPtr the field (can be NULL).
+ * @param name upon return the file name, empty if there is no field.
+ * @param scale upon return the scale factor.
+ * @param shift upon return the shift in cm.
+ * @param file upon return the size in bytes and modification time of the file,
+ * zero if there is none.
+ */
+static void setMapInfo(MagneticFieldPtr fieldPtr, char *name, double *scale, double *shift, long long *file) {
+    memset(name, 0, TABLENAMELENGTH);
+    *scale = 0;
+    shift[0] = shift[1] = shift[2] = 0;
+    file[0] = file[1] = 0;
+
+    if (fieldPtr == NULL) {
+        return;
+    }
+
+    if (fieldPtr->path != NULL) {
+        const char *base = strrchr(fieldPtr->path, '/');
+        base = (base == NULL) ? fieldPtr->path : base + 1;
+        strncpy(name, base, TABLENAMELENGTH - 1);
+
+        struct stat fileStat;
+        if (stat(fieldPtr->path, &fileStat) == 0) {
+            file[0] = (long long) fileStat.st_size;
+            file[1] = (long long) fileStat.st_mtime;
+        }
+    }
+    *scale = fieldPtr->scale;
+    shift[0] = fieldPtr->shiftX;
+    shift[1] = fieldPtr->shiftY;
+    shift[2] = fieldPtr->shiftZ;
+}
+
+/**
+ * The value at a node of an axis.
+ * @param axis the axis.
+ * @param i the node.
+ * @return the value.
+ */
+double tableAxisValue(const TableAxis *axis, int i) {
+    return axis->min + i * (axis->max - axis->min) / (axis->numPoints - 1);
+}
+
+/**
+ * Find the cell of an axis that holds a value.
+ * @param axis the axis.
+ * @param value the value.
+ * @param i upon return the node at the low end of the cell.
+ * @param fraction upon return how far along the cell the value is, [0, 1].
+ * @return false if the value is outside the axis.
+ */
+bool tableAxisCell(const TableAxis *axis, double value, int *i, double *fraction) {
+    double t = (value - axis->min) / (axis->max - axis->min) * (axis->numPoints - 1);
+    if (!(t >= -TINY) || !(t <= axis->numPoints - 1 + TINY)) {
+        return false;
+    }
+
+    //values within TINY of a node are on it, so its neighbors don't matter
+    double node = floor(t + 0.5);
+    if (fabs(t - node) < TINY) {
+        t = node;
+    }
+
+    *i = (int) max(0, min(axis->numPoints - 2, floor(t)));
+    *fraction = max(0, min(1, t - *i));
+    return true;
+}
+
+/**
+ * The phi axis of a table that covers sector 1 only: from -30 to 30 degrees,
+ * spaced no more coarsely than a given axis.
+ * @param phi the given phi axis in degrees.
+ * @param sector upon return the axis over sector 1.
+ */
+void sectorPhiAxis(const TableAxis *phi, TableAxisPtr sector) {
+    double spacing = (phi->max - phi->min) / (phi->numPoints - 1);
+    sector->min = -30.0;
+    sector->max = 30.0;
+    sector->numPoints = (int) max(2, ceil(60.0 / spacing - TINY)) + 1;
+}
+
+/**
+ * Bring an azimuth into the phi range of a table. For a table that covers
+ * sector 1 only it is first rotated from its sector into sector 1.
+ * @param symmetric true if the table covers sector 1 only.
+ * @param axis the phi axis of the table.
+ * @param phi the azimuth in degrees, upon return in the range of the axis if it can be.
+ * @return the sector to rotate the looked up vectors back to with fromTableSector,
+ * 1 if the table is not symmetric.
+ */
+int toTableSector(bool symmetric, const TableAxis *axis, double *phi) {
+    int sector = symmetric ? getSector(*phi) : 1;
+    double value = fmod(*phi - 60.0 * (sector - 1), 360.0);
+    if (value < axis->min) {
+        value += 360.0;
+    }
+    if (value > axis->max) {
+        value -= 360.0;
+    }
+    *phi = value;
+    return sector;
+}
+
+/**
+ * Rotate the transverse part of a vector looked up in sector 1 back to the
+ * sector of the lookup.
+ * @param sector the sector from toTableSector.
+ * @param x the x component, upon return rotated.
+ * @param y the y component, upon return rotated.
+ */
+void fromTableSector(int sector, double *x, double *y) {
+    double c = cosSect[sector];
+    double s = sinSect[sector];
+    double vx = *x;
+    *x = c * vx - s * *y;
+    *y = s * vx + c * *y;
+}
+
+/**
+ * The axis of 1/p that the momentum nodes are evenly spaced on. The first
+ * node is the largest momentum.
+ * @param momentum the momentum axis.
+ * @param inverse upon return the axis in 1/p.
+ */
+static void inverseMomentumAxis(const TableAxis *momentum, TableAxisPtr inverse) {
+    inverse->min = 1.0 / momentum->max;
+    inverse->max = 1.0 / momentum->min;
+    inverse->numPoints = momentum->numPoints;
+}
+
+/**
+ * The number of nodes (tracks) of a table, both charges.
+ * @param spec the spec.
+ * @return the number of nodes.
+ */
+static size_t numNodes(const TableSpec *spec) {
+    return 2 * (size_t) spec->momentum.numPoints * spec->theta.numPoints * spec->phi.numPoints *
+           spec->vertexZ.numPoints;
+}
+
+/**
+ * Work function for createTrajectoryTable: swim the track of one node to
+ * each surface with the worker's swimmer.
+ * @param context the TableBuildContext.
+ * @param worker the worker.
+ * @param index the node.
+ */
+static void tableWork(void *context, int worker, int index) {
+    TableBuildContext *bc = (TableBuildContext *) context;
+    TableHeaderPtr header = &(bc->table->header);
+    const TableSpec *spec = &(header->spec);
+    SwimmerPtr swimmer = bc->swimmers[worker];
+
+    //charge slowest, vertex z fastest
+    int node = index;
+    int iz = node % spec->vertexZ.numPoints;
+    node /= spec->vertexZ.numPoints;
+    int iPhi = node % spec->phi.numPoints;
+    node /= spec->phi.numPoints;
+    int iTheta = node % spec->theta.numPoints;
+    node /= spec->theta.numPoints;
+    int iP = node % spec->momentum.numPoints;
+    int charge = (node / spec->momentum.numPoints == 0) ? -1 : 1;
+
+    TableAxis inverse;
+    inverseMomentumAxis(&(spec->momentum), &inverse);
+    double p = 1.0 / tableAxisValue(&inverse, iP);
+
+    SwimPoint start;
+    initSwimPoint(&start, 0, 0, tableAxisValue(&(spec->vertexZ), iz),
+                  tableAxisValue(&(spec->theta), iTheta), tableAxisValue(&(spec->phi), iPhi));
+
+    SwimResult result;
+    TableEntryPtr entry = bc->table->entries + (size_t) index * spec->numSurfaces;
+
+    for (int i = 0; i < spec->numSurfaces; i++, entry++) {
+        //one sector tables are all in sector 1, including its edges
+        SwimSurface surface = spec->surfaces[i];
+        if (header->symmetric && (surface.type == SWIM_SECTORPLANE)) {
+            initSectorPlaneSurface(&surface, 1, surface.tilt, surface.distance);
+        }
+
+        swimToSurface(swimmer, charge, p, &start, &surface, spec->sMax, NULL, 0, &result);
+        if (!result.hitSurface) {
+            memset(entry, 0, sizeof(TableEntry));
+            entry->s = -1;
+            continue;
+        }
+
+        SwimPointPtr point = &(result.final);
+        entry->x = (float) point->x;
+        entry->y = (float) point->y;
+        entry->z = (float) point->z;
+        entry->tx = (float) point->tx;
+        entry->ty = (float) point->ty;
+        entry->tz = (float) point->tz;
+        entry->s = (float) point->s;
+    }
+}
+
+/**
+ * Create a trajectory table by swimming the track of every node to every
+ * surface, on a pool of threads. If the fields are sector symmetric (see
+ * isSectorSymmetric) the phi axis of the spec is replaced by one over
+ * sector 1, phi from -30 to 30, spaced no more coarsely. Otherwise the
+ * sector planes must have a sector, since the track's sector would change
+ * across the table.
+ * @param torus the torus field (can be NULL).
+ * @param solenoid the solenoid field (can be NULL).
+ * @param spec what the table covers.
+ * @param numThreads the number of threads, 0 (or less) for one per core.
+ * @return the table, free it with freeTrajectoryTable, or NULL on error.
+ */
+TrajectoryTablePtr createTrajectoryTable(MagneticFieldPtr torus, MagneticFieldPtr solenoid,
+                                         const TableSpec *spec, int numThreads) {
+    if (!validSpec(spec)) {
+        return NULL;
+    }
+
+    bool symmetric = isSectorSymmetric(torus, solenoid, spec);
+    for (int i = 0; i < spec->numSurfaces; i++) {
+        if (!symmetric && (spec->surfaces[i].type == SWIM_SECTORPLANE) && (spec->surfaces[i].sector == 0)) {
+            fprintf(stderr, "\ncMag ERROR table sector planes need a sector unless the fields are sector symmetric.\n");
+            return NULL;
+        }
+    }
+
+    TrajectoryTablePtr table = (TrajectoryTablePtr) calloc(1, sizeof(TrajectoryTable));
+    TableHeaderPtr header = &(table->header);
+    header->magicWord = TABLEMAGICWORD;
+    header->version = TABLEVERSION;
+    header->byteOrder = getByteOrder();
+    header->symmetric = symmetric ? 1 : 0;
+    header->spec = *spec;
+    if (symmetric) {
+        sectorPhiAxis(&(spec->phi), &(header->spec.phi));
+    }
+    setMapInfo(torus, header->torusName, &(header->torusScale), header->torusShift, header->torusFile);
+    setMapInfo(solenoid, header->solenoidName, &(header->solenoidScale), header->solenoidShift,
+               header->solenoidFile);
+
+    size_t n = numNodes(&(header->spec));
+    header->numEntries = n * spec->numSurfaces;
+    header->dataOffset = getDataOffset();
+    table->entries = (TableEntryPtr) malloc(header->numEntries * sizeof(TableEntry));
+
+    numThreads = getPoolSize(numThreads, (int) n);
+    TableBuildContext context;
+    context.table = table;
+    context.swimmers = (SwimmerPtr *) malloc(numThreads * sizeof(SwimmerPtr));
+    for (int i = 0; i < numThreads; i++) {
+        context.swimmers[i] = createSwimmer(torus, solenoid);
+    }
+
+    parallelFor((int) n, numThreads, tableWork, &context);
+
+    for (int i = 0; i < numThreads; i++) {
+        freeSwimmer(context.swimmers[i]);
+    }
+    free(context.swimmers);
+    return table;
+}
+
+/**
+ * The offset of the entries in a table file: the header, padded so the
+ * entries are aligned to a cache line.
+ * @return the offset in bytes.
+ */
+static size_t getDataOffset() {
+    return ((sizeof(TableHeader) + 63) / 64) * 64;
+}
+
+/**
+ * Write a trajectory table to a file, in the byte order of this machine.
+ * @param table the table.
+ * @param path the path of the file. To avoid readers seeing a partially
+ * written file, the data is written to a temporary file that is then renamed.
+ * @return true on success.
+ */
+bool writeTrajectoryTable(TrajectoryTablePtr table, const char *path) {
+    TableHeader header = table->header;
+    header.dataOffset = getDataOffset();
+
+    //the header, padded so the entries are aligned
+    char *prefix = (char *) calloc(header.dataOffset, 1);
+    memcpy(prefix, &header, sizeof(TableHeader));
+
+    bool ok = writeFileAtomically(path, "trajectory table", prefix, header.dataOffset,
+                                  table->entries, header.numEntries * sizeof(TableEntry));
+    free(prefix);
+    return ok;
+}
+
+/**
+ * Read a trajectory table file written by writeTrajectoryTable. Like the
+ * field maps (see setMemoryMapping) the entries are memory mapped, shared
+ * and read only, unless mapping is off or fails, in which case they are read.
+ * @param path the path of the file.
+ * @return the table, free it with freeTrajectoryTable, or NULL on error.
+ */
+TrajectoryTablePtr readTrajectoryTable(const char *path) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        fprintf(stderr, "\ncMag ERROR could not open trajectory table file: [%s]\n", path);
+        return NULL;
+    }
+
+    TrajectoryTablePtr table = (TrajectoryTablePtr) calloc(1, sizeof(TrajectoryTable));
+    TableHeaderPtr header = &(table->header);
+    struct stat fileStat;
+
+    bool ok = (fread(header, sizeof(TableHeader), 1, file) == 1) && (header->magicWord == TABLEMAGICWORD) &&
+              (header->version == TABLEVERSION) && validSpec(&(header->spec));
+    if (ok && (header->byteOrder != getByteOrder())) {
+        fprintf(stderr, "\ncMag ERROR trajectory table was written with a different byte order: [%s]\n", path);
+        ok = false;
+    }
+
+    size_t numBytes = header->numEntries * sizeof(TableEntry);
+    size_t length = header->dataOffset + numBytes;
+    ok = ok && (header->numEntries == numNodes(&(header->spec)) * header->spec.numSurfaces) &&
+         (fstat(fileno(file), &fileStat) == 0) && ((size_t) fileStat.st_size >= length);
+
+    if (ok && getMemoryMapping()) {
+        void *start = mmap(NULL, length, PROT_READ, MAP_SHARED, fileno(file), 0);
+        if (start != MAP_FAILED) {
+            table->mapping = start;
+            table->mappingLength = length;
+            table->entries = (TableEntryPtr) ((char *) start + header->dataOffset);
+        }
+    }
+
+    if (ok && (table->entries == NULL)) {
+        table->entries = (TableEntryPtr) malloc(numBytes);
+        ok = (fseek(file, (long) header->dataOffset, SEEK_SET) == 0) &&
+             (fread(table->entries, sizeof(TableEntry), header->numEntries, file) == header->numEntries);
+    }
+    fclose(file);
+
+    if (!ok) {
+        fprintf(stderr, "\ncMag ERROR not a valid trajectory table file: [%s]\n", path);
+        freeTrajectoryTable(table);
+        return NULL;
+    }
+    return table;
+}
+
+/**
+ * Free a trajectory table.
+ * @param table the table (can be NULL).
+ */
+void freeTrajectoryTable(TrajectoryTablePtr table) {
+    if (table == NULL) {
+        return;
+    }
+
+    //mapped entries belong to the mapping
+    if (table->mapping != NULL) {
+        munmap(table->mapping, table->mappingLength);
+    }
+    else {
+        free(table->entries);
+    }
+    free(table);
+}
+
+/**
+ * Check that a table was made for these fields: the same map files (by name,
+ * size and modification time), scale factors and shifts.
+ * @param table the table.
+ * @param torus the torus field (can be NULL).
+ * @param solenoid the solenoid field (can be NULL).
+ * @return true if the table applies to the fields.
+ */
+bool tableMatchesFields(TrajectoryTablePtr table, MagneticFieldPtr torus, MagneticFieldPtr solenoid) {
+    char name[TABLENAMELENGTH];
+    double scale, shift[3];
+    long long file[2];
+    TableHeaderPtr header = &(table->header);
+
+    setMapInfo(torus, name, &scale, shift, file);
+    if ((strcmp(name, header->torusName) != 0) || (scale != header->torusScale) ||
+        (memcmp(shift, header->torusShift, sizeof(shift)) != 0) ||
+        (memcmp(file, header->torusFile, sizeof(file)) != 0)) {
+        return false;
+    }
+
+    setMapInfo(solenoid, name, &scale, shift, file);
+    return (strcmp(name, header->solenoidName) == 0) && (scale == header->solenoidScale) &&
+           (memcmp(shift, header->solenoidShift, sizeof(shift)) == 0) &&
+           (memcmp(file, header->solenoidFile, sizeof(file)) == 0);
+}
+
+/**
+ * Look up where a track from (0, 0, vertex z) crosses a reference surface.
+ * The entries of the 16 nodes around the track are interpolated, the
+ * direction is normalized again. How close the crossing is to the swum one
+ * depends on the spacing of the nodes and grows fast at low momentum, so
+ * callers that need a bound should ask for the error estimate, which is
+ * within a factor of two of the actual error in the test fields. Near the
+ * edge of the acceptance, where there is no estimate, the lookup fails and
+ * the track should be swum. Since only q/p matters, tracks with
+ * |charge| > 1 use the node of p / |charge|.
+ * @param table the table.
+ * @param charge the charge in units of e.
+ * @param momentum the momentum in GeV/c.
+ * @param theta the polar angle of the direction in degrees.
+ * @param phi the azimuthal angle of the direction in degrees.
+ * @param vertexZ the z of the vertex in cm.
+ * @param surface the index of the surface in the table's spec.
+ * @param crossing upon return the crossing, s is the path length from the vertex.
+ * @param error upon return an estimate of how far off the crossing is in cm, see
+ * interpolationError (can be NULL).
+ * @return false if the track is outside the table, or it (or a neighboring node) misses the
+ * surface, or the crossing has no error estimate.
+ */
+bool lookupTrajectory(TrajectoryTablePtr table, int charge, double momentum, double theta, double phi,
+                      double vertexZ, int surface, SwimPointPtr crossing, double *error) {
+    TableHeaderPtr header = &(table->header);
+    const TableSpec *spec = &(header->spec);
+    if ((charge == 0) || (momentum <= 0) || (surface < 0) || (surface >= spec->numSurfaces)) {
+        return false;
+    }
+
+    //rotate into sector 1 for one sector tables
+    int sector = toTableSector(header->symmetric != 0, &(spec->phi), &phi);
+
+    TableAxis inverse;
+    inverseMomentumAxis(&(spec->momentum), &inverse);
+
+    int node[4];
+    double fraction[4];
+    if (!tableAxisCell(&inverse, abs(charge) / momentum, node, fraction) ||
+        !tableAxisCell(&(spec->theta), theta, node + 1, fraction + 1) ||
+        !tableAxisCell(&(spec->phi), phi, node + 2, fraction + 2) ||
+        !tableAxisCell(&(spec->vertexZ), vertexZ, node + 3, fraction + 3)) {
+        return false;
+    }
+
+    int chargeIndex = (charge < 0) ? 0 : 1;
+    double sum[7] = {0};
+
+    for (int corner = 0; corner < 16; corner++) {
+        double weight = 1;
+        int cornerNode[4];
+        for (int d = 0; d < 4; d++) {
+            int upper = (corner >> d) & 1;
+            weight *= upper ? fraction[d] : 1 - fraction[d];
+            cornerNode[d] = node[d] + upper;
+        }
+        if (weight == 0) {
+            continue;
+        }
+
+        TableEntryPtr entry = nodeEntry(table, chargeIndex, cornerNode, surface);
+        if (entry->s < 0) {
+            return false;
+        }
+        float values[7] = {entry->x, entry->y, entry->z, entry->tx, entry->ty, entry->tz, entry->s};
+        for (int i = 0; i < 7; i++) {
+            sum[i] += weight * values[i];
+        }
+    }
+
+    double norm = sqrt(sum[3] * sum[3] + sum[4] * sum[4] + sum[5] * sum[5]);
+    fromTableSector(sector, sum, sum + 1);
+    fromTableSector(sector, sum + 3, sum + 4);
+
+    crossing->x = sum[0];
+    crossing->y = sum[1];
+    crossing->z = sum[2];
+    crossing->tx = sum[3] / norm;
+    crossing->ty = sum[4] / norm;
+    crossing->tz = sum[5] / norm;
+    crossing->s = sum[6];
+
+    //at the edge of the acceptance the crossings need not be smooth
+    double estimate = interpolationError(table, chargeIndex, node, fraction, surface);
+    if (!isfinite(estimate)) {
+        return false;
+    }
+    if (error != NULL) {
+        *error = estimate;
+    }
+    return true;
+}
+
+/**
+ * The entry of a node of a table.
+ * @param table the table.
+ * @param chargeIndex 0 for negative, 1 for positive tracks.
+ * @param node the node along the 1/p, theta, phi and vertex z axes.
+ * @param surface the index of the surface.
+ * @return the entry.
+ */
+static TableEntryPtr nodeEntry(TrajectoryTablePtr table, int chargeIndex, const int *node, int surface) {
+    const TableSpec *spec = &(table->header.spec);
+    int numPoints[4] = {spec->momentum.numPoints, spec->theta.numPoints, spec->phi.numPoints,
+                        spec->vertexZ.numPoints};
+
+    size_t index = chargeIndex;
+    for (int d = 0; d < 4; d++) {
+        index = index * numPoints[d] + node[d];
+    }
+    return table->entries + index * spec->numSurfaces + surface;
+}
+
+/**
+ * An estimate of the error of an interpolated crossing. Along each axis the
+ * linear interpolation is off by about f (1 - f) / 2 times the second
+ * difference of the crossings at three nodes, f being how far along the
+ * cell the track is. The larger of the second differences centered on
+ * either end of the cell is taken, along the other axes at the nodes
+ * nearest the track. Where one of the nodes misses the surface, i.e. near
+ * the edge of the acceptance, the crossings need not be smooth and there
+ * is no estimate.
+ * @param table the table.
+ * @param chargeIndex 0 for negative, 1 for positive tracks.
+ * @param node the low corner of the cell along each axis.
+ * @param fraction how far along the cell the track is, along each axis.
+ * @param surface the index of the surface.
+ * @return the estimate in cm, INFINITY if there is none.
+ */
+static double interpolationError(TrajectoryTablePtr table, int chargeIndex, const int *node,
+                                 const double *fraction, int surface) {
+    const TableSpec *spec = &(table->header.spec);
+    int numPoints[4] = {spec->momentum.numPoints, spec->theta.numPoints, spec->phi.numPoints,
+                        spec->vertexZ.numPoints};
+
+    int nearest[4];
+    for (int d = 0; d < 4; d++) {
+        nearest[d] = node[d] + ((fraction[d] >= 0.5) ? 1 : 0);
+    }
+
+    double error = 0;
+    for (int d = 0; d < 4; d++) {
+        if ((numPoints[d] < 3) || (fraction[d] == 0)) {
+            continue;
+        }
+
+        //three nodes along the axis, centered on either end of the cell
+        double second = 0;
+        for (int end = 0; end < 2; end++) {
+            int at[4];
+            memcpy(at, nearest, sizeof(at));
+            TableEntryPtr entries[3];
+            for (int i = 0; i < 3; i++) {
+                at[d] = (int) max(1, min(numPoints[d] - 2, node[d] + end)) + i - 1;
+                entries[i] = nodeEntry(table, chargeIndex, at, surface);
+                if (entries[i]->s < 0) {
+                    return INFINITY;
+                }
+            }
+
+            double dx = entries[0]->x - 2.0 * entries[1]->x + entries[2]->x;
+            double dy = entries[0]->y - 2.0 * entries[1]->y + entries[2]->y;
+            double dz = entries[0]->z - 2.0 * entries[1]->z + entries[2]->z;
+            second = max(second, sqrt(dx * dx + dy * dy + dz * dz));
+        }
+        error += 0.5 * fraction[d] * (1 - fraction[d]) * second;
+    }
+    return error;
+}
+
+/**
+ * Check whether a track is near the edge of a table's acceptance, i.e. whether
+ * a node within one node of its cell (the nodes the lookup and the error
+ * estimate use) misses the surface. Used by the unit test.
+ * @param table the table.
+ * @param charge the charge in units of e.
+ * @param momentum the momentum in GeV/c.
+ * @param theta the polar angle of the direction in degrees.
+ * @param phi the azimuthal angle of the direction in degrees.
+ * @param vertexZ the z of the vertex in cm.
+ * @param surface the index of the surface.
+ * @return true if a node near the track misses the surface.
+ */
+static bool nearAcceptanceEdge(TrajectoryTablePtr table, int charge, double momentum, double theta, double phi,
+                               double vertexZ, int surface) {
+    const TableSpec *spec = &(table->header.spec);
+    toTableSector(table->header.symmetric != 0, &(spec->phi), &phi);
+
+    TableAxis inverse;
+    inverseMomentumAxis(&(spec->momentum), &inverse);
+
+    int node[4];
+    double fraction[4];
+    if (!tableAxisCell(&inverse, abs(charge) / momentum, node, fraction) ||
+        !tableAxisCell(&(spec->theta), theta, node + 1, fraction + 1) ||
+        !tableAxisCell(&(spec->phi), phi, node + 2, fraction + 2) ||
+        !tableAxisCell(&(spec->vertexZ), vertexZ, node + 3, fraction + 3)) {
+        return false;
+    }
+
+    int numPoints[4] = {spec->momentum.numPoints, spec->theta.numPoints, spec->phi.numPoints,
+                        spec->vertexZ.numPoints};
+    int chargeIndex = (charge < 0) ? 0 : 1;
+
+    //nodes from one below to two above the low corner of the cell
+    for (int corner = 0; corner < 256; corner++) {
+        int at[4];
+        bool inside = true;
+        for (int d = 0; d < 4; d++) {
+            at[d] = node[d] + ((corner >> (2 * d)) & 3) - 1;
+            inside = inside && (at[d] >= 0) && (at[d] < numPoints[d]);
+        }
+        if (inside && (nodeEntry(table, chargeIndex, at, surface)->s < 0)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Unit test for trajectory tables, with a small table in the test fields.
+ * At the nodes of sector 1 a lookup must reproduce the swim. Elsewhere it
+ * must have a finite error estimate and be within twice it (plus 1 mm) of
+ * the swim. With this coarse table that is up to 20 to 30 cm for the slowest
+ * inbending tracks. Tracks that hit the surface but whose lookup fails must
+ * be at the edge of the acceptance, and few.
+ * A written and reread (memory mapped) table must give the same lookups,
+ * and know which fields and map files it was made for.
+ * @return NULL if all tests pass, otherwise an error message.
+ */
+char *tableUnitTest() {
+    TableSpec spec;
+    initTableSpec(&spec);
+    spec.momentum = (TableAxis) {1.0, 5.0, 9};
+    spec.theta = (TableAxis) {10.0, 30.0, 11};
+    spec.vertexZ = (TableAxis) {-5.0, 5.0, 3};
+
+    SwimSurface surface;
+    initZPlaneSurface(&surface, 500);
+    addTableSurface(&spec, &surface);
+    initSectorPlaneSurface(&surface, 0, 25, 600);
+    addTableSurface(&spec, &surface);
+
+    TrajectoryTablePtr table = createTrajectoryTable(testFieldPtr, testSolenoidPtr, &spec, 0);
+    mu_assert("Could not create the table.", table != NULL);
+    mu_assert("The test fields should be sector symmetric.", table->header.symmetric == 1);
+    mu_assert("The table should match its fields.", tableMatchesFields(table, testFieldPtr, testSolenoidPtr));
+    mu_assert("The table should not match other fields.", !tableMatchesFields(table, testFieldPtr, NULL));
+
+    SwimmerPtr swimmer = createSwimmer(testFieldPtr, testSolenoidPtr);
+    SwimPoint start, crossing;
+    SwimResult result;
+
+    double maxNodeDiff = 0;
+    double sumDiff = 0;
+    double maxDiff = 0;
+    double maxRatio = 0;
+    int numCompared = 0;
+    int numEdge = 0;
+
+    for (int i = 0; i < 400; i++) {
+        int charge = (i % 2 == 0) ? -1 : 1;
+        bool atNode = (i < 40);
+        double p = atNode ? 1.0 / (0.2 + 0.1 * randomInt(0, 8)) : randomDouble(1.2, 5.0);
+        double theta = atNode ? 10.0 + 2 * randomInt(0, 10) : randomDouble(12, 28);
+        double phi = atNode ? 5.0 * randomInt(-5, 6) : randomDouble(0, 360);
+        double z = atNode ? -5.0 : randomDouble(-5, 5);
+        int s = i % 2;
+
+        initSwimPoint(&start, 0, 0, z, theta, phi);
+        swimToSurface(swimmer, charge, p, &start, spec.surfaces + s, spec.sMax, NULL, 0, &result);
+        double estimate;
+        bool found = lookupTrajectory(table, charge, p, theta, phi, z, s, &crossing, &estimate);
+        mu_assert("Lookup and swim disagree on hitting the surface.", atNode ? (found == result.hitSurface) : true);
+
+        //a track that hits but can't be looked up must be next to a node that misses
+        if (!found && result.hitSurface && !atNode) {
+            mu_assert("A lookup failed away from the edge of the acceptance.",
+                      nearAcceptanceEdge(table, charge, p, theta, phi, z, s));
+            numEdge++;
+        }
+        if (!found || !result.hitSurface) {
+            continue;
+        }
+
+        double diff = sqrt((crossing.x - result.final.x) * (crossing.x - result.final.x) +
+                           (crossing.y - result.final.y) * (crossing.y - result.final.y) +
+                           (crossing.z - result.final.z) * (crossing.z - result.final.z));
+        if (atNode) {
+            maxNodeDiff = max(maxNodeDiff, diff);
+        }
+        else {
+            mu_assert("A successful lookup has no error estimate.", isfinite(estimate));
+            mu_assert("Interpolated crossing is off by more than the estimate allows.",
+                      diff <= 2 * estimate + 0.1);
+            sumDiff += diff;
+            numCompared++;
+            maxDiff = max(maxDiff, diff);
+            maxRatio = max(maxRatio, diff / max(estimate, 0.01));
+        }
+    }
+    mu_assert("Lookup at a node should reproduce the swim.", maxNodeDiff < 1.0e-3);
+    mu_assert("Too few lookups compared.", numCompared > 100);
+    mu_assert("Too many lookups fail at the edge of the acceptance.", numEdge < numCompared / 5);
+    mu_assert("Interpolated crossings are too far off.", sumDiff / numCompared < 2.0);
+
+    //outside the table
+    mu_assert("Lookup outside the table should fail.", !lookupTrajectory(table, -1, 0.5, 20, 0, 0, 0, &crossing, NULL));
+    mu_assert("Lookup of a bad surface should fail.", !lookupTrajectory(table, -1, 2, 20, 0, 0, 2, &crossing, NULL));
+
+    //write, read back and compare
+    char *tempDir = getenv("TMPDIR");
+    if (tempDir == NULL) {
+        tempDir = "/tmp";
+    }
+    char path[512];
+    snprintf(path, sizeof(path), "%s/cmag_table_test_%ld.tab", tempDir, (long) getpid());
+    mu_assert("Could not write the table.", writeTrajectoryTable(table, path));
+
+    TrajectoryTablePtr reread = readTrajectoryTable(path);
+    mu_assert("Could not read the table.", reread != NULL);
+    mu_assert("The table should be memory mapped.", (reread->mapping != NULL) == getMemoryMapping());
+    mu_assert("The reread entries differ.", memcmp(reread->entries, table->entries,
+                                                   table->header.numEntries * sizeof(TableEntry)) == 0);
+    mu_assert("The reread table should match its fields.",
+              tableMatchesFields(reread, testFieldPtr, testSolenoidPtr));
+    freeTrajectoryTable(reread);
+    remove(path);
+
+    //a map file rewritten under the same name
+    table->header.torusFile[1]++;
+    mu_assert("The table should not match a rewritten map.", !tableMatchesFields(table, testFieldPtr, testSolenoidPtr));
+    table->header.torusFile[1]--;
+
+    freeSwimmer(swimmer);
+    freeTrajectoryTable(table);
+
+    fprintf(stdout, "\nPASSED tableUnitTest (at nodes %-9.3e cm, between nodes mean %-9.3e cm max %-9.3e cm"
+            " or %.2f times the estimate, %d more at the acceptance edge)\n",
+            maxNodeDiff, sumDiff / numCompared, maxDiff, maxRatio, numEdge);
+    return NULL;
+}
@@ -0,0 +1,685 @@
+//
+//  magfielduniform.c
+//  cMag
+//  Bounds on the variation of the field over a ball, for stepping methods
+//  that need to know where the field is nearly uniform. The grid is split
+//  into blocks of cells, and each block keeps the range of the grid values
+//  in it. Interpolation (and nearest neighbor) never leaves that range. The
+//  blocks are merged pairwise into a pyramid, so that a ball of any size is
+//  covered by at most two blocks along each axis of some level. The blocks
+//  also keep the largest first and second differences of the grid values,
+//  which bound how fast the field changes, for choosing step sizes.
+//
+
+#include "magfielduniform.h"
+#include "magfieldio.h"
+#include "magfieldutil.h"
+#include "munittest.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+
+//a build of the bounds on a background thread
+typedef struct uniformitybuild {
+    MagneticFieldPtr fieldPtr;
+    FieldUniformityPtr uniformityPtr; //the result
+    pthread_t thread;
+    bool started; //false if the build ran in the caller
+} UniformityBuild;
+
+//local prototypes
+static void resetBlock(BlockBoundPtr);
+static void addValue(BlockBoundPtr, const FieldValue *);
+static void addBlock(BlockBoundPtr, const BlockBound *);
+static void addZero(BlockBoundPtr);
+static void addDerivatives(MagneticFieldPtr, BlockBoundPtr, const int *, const int *, const int *);
+static void buildBaseLevel(MagneticFieldPtr, FieldUniformityPtr, const int *);
+static void buildLevel(FieldUniformityPtr, int);
+static FieldUniformityPtr createUniformity(MagneticFieldPtr);
+static void *buildMain(void *);
+static void cellRange(GridPtr, double, double, int *, int *);
+static double coverBall(MagneticFieldPtr, double, double, double, double, BlockBoundPtr, bool *, double *, bool *);
+
+/**
+ * Set a block bound to the empty range.
+ * @param block the block.
+ */
+static void resetBlock(BlockBoundPtr block) {
+    for (int c = 0; c < 3; c++) {
+        block->lo[c] = INFINITY;
+        block->hi[c] = -INFINITY;
+    }
+    block->maxMagnitude = 0;
+    block->maxGradient = 0;
+    block->maxCurvature = 0;
+}
+
+/**
+ * Widen a block bound to include a field value.
+ * @param block the block.
+ * @param fv the field value.
+ */
+static void addValue(BlockBoundPtr block, const FieldValue *fv) {
+    float b[3] = {fv->b1, fv->b2, fv->b3};
+    for (int c = 0; c < 3; c++) {
+        block->lo[c] = fminf(block->lo[c], b[c]);
+        block->hi[c] = fmaxf(block->hi[c], b[c]);
+    }
+    block->maxMagnitude = fmaxf(block->maxMagnitude, sqrtf(b[0] * b[0] + b[1] * b[1] + b[2] * b[2]));
+}
+
+/**
+ * Widen a block bound to include another one.
+ * @param block the block.
+ * @param other the block to include.
+ */
+static void addBlock(BlockBoundPtr block, const BlockBound *other) {
+    for (int c = 0; c < 3; c++) {
+        block->lo[c] = fminf(block->lo[c], other->lo[c]);
+        block->hi[c] = fmaxf(block->hi[c], other->hi[c]);
+    }
+    block->maxMagnitude = fmaxf(block->maxMagnitude, other->maxMagnitude);
+    block->maxGradient = fmaxf(block->maxGradient, other->maxGradient);
+    block->maxCurvature = fmaxf(block->maxCurvature, other->maxCurvature);
+}
+
+/**
+ * Widen a block bound to include a zero field (outside the map).
+ * @param block the block.
+ */
+static void addZero(BlockBoundPtr block) {
+    for (int c = 0; c < 3; c++) {
+        block->lo[c] = fminf(block->lo[c], 0);
+        block->hi[c] = fmaxf(block->hi[c], 0);
+    }
+}
+
+/**
+ * Widen a block bound to include the differences at a grid point: the first
+ * differences to the next point along each axis, if it is in the block, and
+ * the second differences, if the point has neighbors on both sides. Phi
+ * differences are along the arc at the point's rho, and are skipped on the
+ * axis. The components of the solenoid turn with phi, which adds |Brho| / rho
+ * to the gradient.
+ * @param fieldPtr the field map.
+ * @param block the block.
+ * @param numPoints the grid points along (phi, rho, z).
+ * @param n the grid indices (phi, rho, z) of the point.
+ * @param last the last grid indices of the block.
+ */
+static void addDerivatives(MagneticFieldPtr fieldPtr, BlockBoundPtr block, const int *numPoints,
+                           const int *n, const int *last) {
+    GridPtr grids[3] = {fieldPtr->phiGridPtr, fieldPtr->rhoGridPtr, fieldPtr->zGridPtr};
+    double rho = grids[1]->minVal + n[1] * grids[1]->delta;
+    double spacing[3] = {rho * toRadians(grids[0]->delta), grids[1]->delta, grids[2]->delta};
+
+    FieldValue center, next, previous;
+    copyFieldAtIndex(fieldPtr, getCompositeIndex(fieldPtr, n[0], n[1], n[2]), &center);
+
+    if ((fieldPtr->type == SOLENOID) && (rho > 0)) {
+        block->maxGradient = fmaxf(block->maxGradient, (float) (fabsf(center.b2) / rho));
+    }
+
+    for (int d = 0; d < 3; d++) {
+        if ((n[d] + 1 >= numPoints[d]) || !(spacing[d] > 0)) {
+            continue;
+        }
+
+        int m[3] = {n[0], n[1], n[2]};
+        m[d] = n[d] + 1;
+        copyFieldAtIndex(fieldPtr, getCompositeIndex(fieldPtr, m[0], m[1], m[2]), &next);
+        float d1[3] = {next.b1 - center.b1, next.b2 - center.b2, next.b3 - center.b3};
+
+        if (n[d] + 1 <= last[d]) {
+            double diff = sqrt(d1[0] * d1[0] + d1[1] * d1[1] + d1[2] * d1[2]);
+            block->maxGradient = fmaxf(block->maxGradient, (float) (diff / spacing[d]));
+        }
+
+        if (n[d] > 0) {
+            m[d] = n[d] - 1;
+            copyFieldAtIndex(fieldPtr, getCompositeIndex(fieldPtr, m[0], m[1], m[2]), &previous);
+            float d2[3] = {d1[0] - center.b1 + previous.b1, d1[1] - center.b2 + previous.b2,
+                           d1[2] - center.b3 + previous.b3};
+            double diff = sqrt(d2[0] * d2[0] + d2[1] * d2[1] + d2[2] * d2[2]);
+            block->maxCurvature = fmaxf(block->maxCurvature, (float) (diff / (spacing[d] * spacing[d])));
+        }
+    }
+}
+
+/**
+ * Build the smallest blocks from the grid values. A block of cells includes
+ * the grid points on all its faces, so neighboring blocks share points.
+ * @param fieldPtr the field map.
+ * @param uniformityPtr the pyramid being built.
+ * @param numPoints the grid points along (phi, rho, z).
+ */
+static void buildBaseLevel(MagneticFieldPtr fieldPtr, FieldUniformityPtr uniformityPtr, const int *numPoints) {
+    int *nb = uniformityPtr->numBlocks[0];
+    BlockBoundPtr blocks = uniformityPtr->blocks[0];
+    FieldValue fv;
+
+    for (int i = 0; i < nb[0]; i++) {
+        for (int j = 0; j < nb[1]; j++) {
+            for (int l = 0; l < nb[2]; l++) {
+                BlockBoundPtr block = blocks + (i * nb[1] + j) * nb[2] + l;
+                resetBlock(block);
+
+                int last[3] = {(int) min((i + 1) * UNIFORMBASEBLOCK, numPoints[0] - 1),
+                               (int) min((j + 1) * UNIFORMBASEBLOCK, numPoints[1] - 1),
+                               (int) min((l + 1) * UNIFORMBASEBLOCK, numPoints[2] - 1)};
+
+                for (int nPhi = i * UNIFORMBASEBLOCK; nPhi <= last[0]; nPhi++) {
+                    for (int nRho = j * UNIFORMBASEBLOCK; nRho <= last[1]; nRho++) {
+                        for (int nZ = l * UNIFORMBASEBLOCK; nZ <= last[2]; nZ++) {
+                            int n[3] = {nPhi, nRho, nZ};
+                            copyFieldAtIndex(fieldPtr, getCompositeIndex(fieldPtr, nPhi, nRho, nZ), &fv);
+                            addValue(block, &fv);
+                            addDerivatives(fieldPtr, block, numPoints, n, last);
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+/**
+ * Build a level of the pyramid by merging up to eight blocks of the level below.
+ * @param uniformityPtr the pyramid being built.
+ * @param level the level to build, > 0.
+ */
+static void buildLevel(FieldUniformityPtr uniformityPtr, int level) {
+    int *nb = uniformityPtr->numBlocks[level];
+    int *below = uniformityPtr->numBlocks[level - 1];
+    BlockBoundPtr blocks = uniformityPtr->blocks[level];
+    BlockBoundPtr children = uniformityPtr->blocks[level - 1];
+
+    for (int i = 0; i < nb[0]; i++) {
+        for (int j = 0; j < nb[1]; j++) {
+            for (int l = 0; l < nb[2]; l++) {
+                BlockBoundPtr block = blocks + (i * nb[1] + j) * nb[2] + l;
+                resetBlock(block);
+
+                for (int ci = 2 * i; ci < min(2 * i + 2, below[0]); ci++) {
+                    for (int cj = 2 * j; cj < min(2 * j + 2, below[1]); cj++) {
+                        for (int cl = 2 * l; cl < min(2 * l + 2, below[2]); cl++) {
+                            addBlock(block, children + (ci * below[1] + cj) * below[2] + cl);
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+/**
+ * Build the pyramid of bounds of a field map, without attaching it.
+ * @param fieldPtr the field map.
+ * @return the bounds.
+ */
+static FieldUniformityPtr createUniformity(MagneticFieldPtr fieldPtr) {
+    int numPoints[3] = {fieldPtr->phiGridPtr->numPoints, fieldPtr->rhoGridPtr->numPoints,
+                        fieldPtr->zGridPtr->numPoints};
+    int numCells[3];
+    for (int d = 0; d < 3; d++) {
+        numCells[d] = (numPoints[d] > 1) ? numPoints[d] - 1 : 1;
+    }
+
+    FieldUniformityPtr uniformityPtr = (FieldUniformityPtr) calloc(1, sizeof(FieldUniformity));
+    int size = UNIFORMBASEBLOCK;
+
+    for (int level = 0; level < UNIFORMMAXLEVELS; level++) {
+        int *nb = uniformityPtr->numBlocks[level];
+        for (int d = 0; d < 3; d++) {
+            nb[d] = (numCells[d] + size - 1) / size;
+        }
+        uniformityPtr->blocks[level] = (BlockBoundPtr) malloc(nb[0] * nb[1] * nb[2] * sizeof(BlockBound));
+        uniformityPtr->numLevels = level + 1;
+
+        if (level == 0) {
+            buildBaseLevel(fieldPtr, uniformityPtr, numPoints);
+        }
+        else {
+            buildLevel(uniformityPtr, level);
+        }
+
+        if ((nb[0] == 1) && (nb[1] == 1) && (nb[2] == 1)) {
+            break;
+        }
+        size *= 2;
+    }
+    return uniformityPtr;
+}
+
+/**
+ * Build (or rebuild) the variation bounds of a field map. They are derived
+ * from the stored values, so rebuild them after changing the precision. This
+ * changes the map, so do it before sharing the map between threads.
+ * @param fieldPtr the field map.
+ * @return true if the bounds were built.
+ */
+bool buildFieldUniformity(MagneticFieldPtr fieldPtr) {
+    if (fieldPtr == NULL) {
+        return false;
+    }
+
+    FieldUniformityPtr uniformityPtr = createUniformity(fieldPtr);
+    freeFieldUniformity(fieldPtr->uniformityPtr);
+    fieldPtr->uniformityPtr = uniformityPtr;
+    return true;
+}
+
+/**
+ * The body of the background build thread.
+ * @param arg the build.
+ * @return NULL.
+ */
+static void *buildMain(void *arg) {
+    UniformityBuildPtr build = (UniformityBuildPtr) arg;
+    build->uniformityPtr = createUniformity(build->fieldPtr);
+    return NULL;
+}
+
+/**
+ * Start building the variation bounds of a field map on a background thread,
+ * for example while the other maps load. The build only reads the map, which
+ * is unchanged (and has no bounds from this build) until
+ * finishFieldUniformityBuild. Until then do not change the map's values,
+ * layout or precision. If no thread can be started the bounds are built
+ * before returning.
+ * @param fieldPtr the field map.
+ * @return the build, pass it to finishFieldUniformityBuild, or NULL if fieldPtr is NULL.
+ */
+UniformityBuildPtr startFieldUniformityBuild(MagneticFieldPtr fieldPtr) {
+    if (fieldPtr == NULL) {
+        return NULL;
+    }
+
+    UniformityBuildPtr build = (UniformityBuildPtr) malloc(sizeof(UniformityBuild));
+    build->fieldPtr = fieldPtr;
+    build->uniformityPtr = NULL;
+    build->started = (pthread_create(&(build->thread), NULL, buildMain, build) == 0);
+    if (!build->started) {
+        buildMain(build);
+    }
+    return build;
+}
+
+/**
+ * Wait for a background build to finish and attach the bounds to the map,
+ * replacing any older ones. Frees the build.
+ * @param build the build from startFieldUniformityBuild (can be NULL).
+ * @return true if the bounds were attached.
+ */
+bool finishFieldUniformityBuild(UniformityBuildPtr build) {
+    if (build == NULL) {
+        return false;
+    }
+    if (build->started) {
+        pthread_join(build->thread, NULL);
+    }
+
+    freeFieldUniformity(build->fieldPtr->uniformityPtr);
+    build->fieldPtr->uniformityPtr = build->uniformityPtr;
+    free(build);
+    return true;
+}
+
+/**
+ * Free the variation bounds of a field map.
+ * @param uniformityPtr the bounds (can be NULL).
+ */
+void freeFieldUniformity(FieldUniformityPtr uniformityPtr) {
+    if (uniformityPtr == NULL) {
+        return;
+    }
+    for (int level = 0; level < uniformityPtr->numLevels; level++) {
+        free(uniformityPtr->blocks[level]);
+    }
+    free(uniformityPtr);
+}
+
+/**
+ * The range of cells along one axis that covers a range of the coordinate.
+ * @param gridPtr the grid of the coordinate.
+ * @param lo the low end of the range, within the grid.
+ * @param hi the high end of the range, within the grid.
+ * @param first upon return the first cell.
+ * @param last upon return the last cell.
+ */
+static void cellRange(GridPtr gridPtr, double lo, double hi, int *first, int *last) {
+    if (gridPtr->numPoints < 2) {
+        *first = 0;
+        *last = 0;
+        return;
+    }
+
+    int lastCell = (int) gridPtr->numPoints - 2;
+    *first = (int) max(0, min(lastCell, floor((lo - gridPtr->minVal) / gridPtr->delta)));
+    *last = (int) max(0, min(lastCell, floor((hi - gridPtr->minVal) / gridPtr->delta)));
+}
+
+/**
+ * The bounds of the blocks that cover a ball, at the level where the ball
+ * spans at most two blocks along each axis. Where the ball is partly outside
+ * the map the range includes zero.
+ * @param fieldPtr the field map, with bounds built.
+ * @param x the x coordinate of the center in cm.
+ * @param y the y coordinate of the center in cm.
+ * @param z the z coordinate of the center in cm.
+ * @param h the radius of the ball in cm.
+ * @param bound upon return the combined bound of the blocks.
+ * @param fixedFrame upon return, true if the ball stays where the map components
+ * are a fixed rotation of the Cartesian ones, i.e. it is in one sector half of a
+ * symmetric torus (always true for the other maps).
+ * @param spacing upon return the longest cell edge in the ball in cm.
+ * @param partlyOutside upon return, true if the ball reaches an edge of the map.
+ * @return the distance of the center from the map axis in cm, or -1 if the ball is
+ * all outside the map.
+ */
+static double coverBall(MagneticFieldPtr fieldPtr, double x, double y, double z, double h,
+                        BlockBoundPtr bound, bool *fixedFrame, double *spacing, bool *partlyOutside) {
+    FieldUniformityPtr uniformityPtr = fieldPtr->uniformityPtr;
+
+    x -= fieldPtr->shiftX;
+    y -= fieldPtr->shiftY;
+    z -= fieldPtr->shiftZ;
+    double rho = hypot(x, y);
+
+    GridPtr phiGrid = fieldPtr->phiGridPtr;
+    GridPtr rhoGrid = fieldPtr->rhoGridPtr;
+    GridPtr zGrid = fieldPtr->zGridPtr;
+
+    //all outside the map, where the field is zero
+    if ((rho + h < rhoGrid->minVal) || (rho - h >= rhoGrid->maxVal) ||
+        (z + h < zGrid->minVal) || (z - h >= zGrid->maxVal)) {
+        return -1;
+    }
+
+    *partlyOutside = (rho + h >= rhoGrid->maxVal) || (z - h < zGrid->minVal) || (z + h >= zGrid->maxVal) ||
+                     ((rhoGrid->minVal > 0) && (rho - h < rhoGrid->minVal));
+
+    //the ranges of the map coordinates in the ball
+    double lo[3], hi[3];
+    lo[1] = max(rho - h, rhoGrid->minVal);
+    hi[1] = min(rho + h, rhoGrid->maxVal);
+    lo[2] = max(z - h, zGrid->minVal);
+    hi[2] = min(z + h, zGrid->maxVal);
+
+    *fixedFrame = true;
+    *spacing = max(rhoGrid->delta, zGrid->delta);
+
+    if (fieldPtr->type == SOLENOID) {
+        lo[0] = phiGrid->minVal;
+        hi[0] = phiGrid->minVal;
+    }
+    else {
+        double phi = toDegrees(atan2(y, x));
+        if (fieldPtr->symmetric) {
+            phi = fabs(relativePhi(phi));
+        }
+        else if (phi < 0) {
+            phi += 360;
+        }
+
+        double dPhi = (h < rho) ? toDegrees(asin(h / rho)) : 360;
+        lo[0] = phi - dPhi;
+        hi[0] = phi + dPhi;
+
+        //across the middle or edge of a sector (symmetric), or across phi = 0 (full)
+        if ((lo[0] < phiGrid->minVal) || (hi[0] > phiGrid->maxVal)) {
+            *fixedFrame = !fieldPtr->symmetric;
+            lo[0] = *fixedFrame ? phiGrid->minVal : max(lo[0], phiGrid->minVal);
+            hi[0] = *fixedFrame ? phiGrid->maxVal : min(hi[0], phiGrid->maxVal);
+        }
+        *spacing = max(*spacing, hi[1] * toRadians(phiGrid->delta));
+    }
+
+    //the cells in the ball, and the level where they span at most two blocks per axis
+    int first[3], last[3];
+    int span = 1;
+    GridPtr grids[3] = {phiGrid, rhoGrid, zGrid};
+    for (int d = 0; d < 3; d++) {
+        cellRange(grids[d], lo[d], hi[d], first + d, last + d);
+        span = (int) max(span, last[d] - first[d] + 1);
+    }
+
+    int level = 0;
+    int size = UNIFORMBASEBLOCK;
+    while ((size < span) && (level < uniformityPtr->numLevels - 1)) {
+        level++;
+        size *= 2;
+    }
+
+    int *nb = uniformityPtr->numBlocks[level];
+    BlockBoundPtr blocks = uniformityPtr->blocks[level];
+    resetBlock(bound);
+
+    for (int i = first[0] / size; i <= min(last[0] / size, nb[0] - 1); i++) {
+        for (int j = first[1] / size; j <= min(last[1] / size, nb[1] - 1); j++) {
+            for (int l = first[2] / size; l <= min(last[2] / size, nb[2] - 1); l++) {
+                addBlock(bound, blocks + (i * nb[1] + j) * nb[2] + l);
+            }
+        }
+    }
+
+    if (*partlyOutside) {
+        addZero(bound);
+    }
+    return rho;
+}
+
+/**
+ * A bound on how much the field of one map can differ, anywhere within a
+ * distance h of a point, from the field at the point: |B(r) - B(r0)| for
+ * |r - r0| <= h. Where the ball is in one sector half of a symmetric torus
+ * (or anywhere, for the other maps) this is the size of the range of the
+ * components, plus for the solenoid the turning of Brho with phi. Otherwise
+ * it is twice the largest field in the ball.
+ * @param fieldPtr the field map.
+ * @param x the x coordinate of the point in cm.
+ * @param y the y coordinate of the point in cm.
+ * @param z the z coordinate of the point in cm.
+ * @param h the radius of the ball in cm.
+ * @return the bound in kG, or -1 if buildFieldUniformity has not been called.
+ */
+double fieldVariationBound(MagneticFieldPtr fieldPtr, double x, double y, double z, double h) {
+    if (fieldPtr->uniformityPtr == NULL) {
+        return -1;
+    }
+
+    BlockBound bound;
+    bool fixedFrame, partlyOutside;
+    double spacing;
+    double rho = coverBall(fieldPtr, x, y, z, h, &bound, &fixedFrame, &spacing, &partlyOutside);
+    if (rho < 0) {
+        return 0;
+    }
+
+    double variation = 2.0 * bound.maxMagnitude;
+
+    if (fixedFrame) {
+        double spread = 0;
+        for (int c = 0; c < 3; c++) {
+            spread += (bound.hi[c] - bound.lo[c]) * (bound.hi[c] - bound.lo[c]);
+        }
+        spread = sqrt(spread);
+
+        //Brho (b2 of the solenoid) turns by less than 2h/rho radians
+        if (fieldPtr->type == SOLENOID) {
+            double bRho = max(fabs(bound.lo[1]), fabs(bound.hi[1]));
+            spread += bRho * ((h < rho) ? 2 * h / rho : 2);
+        }
+        variation = min(variation, spread);
+    }
+
+    return variation * fabs(fieldPtr->scale);
+}
+
+/**
+ * A bound on how much the combined field of two maps can differ, within a
+ * distance h of a point, from the field at the point.
+ * @param field1 the first field (can be NULL).
+ * @param field2 the second field (can be NULL).
+ * @param x the x coordinate of the point in cm.
+ * @param y the y coordinate of the point in cm.
+ * @param z the z coordinate of the point in cm.
+ * @param h the radius of the ball in cm.
+ * @return the bound in kG, or -1 if a map has no bounds built.
+ */
+double compositeVariationBound(MagneticFieldPtr field1, MagneticFieldPtr field2,
+                               double x, double y, double z, double h) {
+    double variation = 0;
+    MagneticFieldPtr fields[2] = {field1, field2};
+
+    for (int i = 0; i < 2; i++) {
+        if (fields[i] != NULL) {
+            double bound = fieldVariationBound(fields[i], x, y, z, h);
+            if (bound < 0) {
+                return -1;
+            }
+            variation += bound;
+        }
+    }
+    return variation;
+}
+
+/**
+ * Bounds on the field of one map and on its first and second derivatives
+ * within a distance h of a point. The derivatives are those of the grid
+ * values; where the field jumps to zero at the edge of the map, or where
+ * the components of a symmetric torus are folded, they say nothing.
+ * @param fieldPtr the field map.
+ * @param x the x coordinate of the point in cm.
+ * @param y the y coordinate of the point in cm.
+ * @param z the z coordinate of the point in cm.
+ * @param h the radius of the ball in cm.
+ * @param bound upon return the bounds, all zero if the ball is outside the map.
+ * @return false if buildFieldUniformity has not been called.
+ */
+bool fieldDerivativeBound(MagneticFieldPtr fieldPtr, double x, double y, double z, double h,
+                          DerivativeBoundPtr bound) {
+    memset(bound, 0, sizeof(DerivativeBound));
+    if (fieldPtr->uniformityPtr == NULL) {
+        return false;
+    }
+
+    BlockBound blocks;
+    bool fixedFrame, partlyOutside;
+    double spacing;
+    if (coverBall(fieldPtr, x, y, z, h, &blocks, &fixedFrame, &spacing, &partlyOutside) < 0) {
+        return true;
+    }
+
+    double scale = fabs(fieldPtr->scale);
+    bound->magnitude = blocks.maxMagnitude * scale;
+    bound->gradient = blocks.maxGradient * scale;
+    bound->curvature = blocks.maxCurvature * scale;
+    bound->spacing = spacing;
+    bound->edgeField = partlyOutside ? bound->magnitude : 0;
+    return true;
+}
+
+/**
+ * Unit test for the variation bounds: the field at random points in balls of
+ * random sizes, in and around the map, never differs from the field at the
+ * center by more than the bound. Inside the map, the field also changes no
+ * faster than the gradient bound allows. The bounds are built in the
+ * background.
+ * @return NULL if all tests pass, otherwise an error message.
+ */
+char *uniformityUnitTest() {
+    MagneticFieldPtr fieldPtr = testFieldPtr;
+    mu_assert("Bounds without a table should be negative.",
+              (fieldPtr->uniformityPtr != NULL) || (fieldVariationBound(fieldPtr, 0, 0, 0, 1) < 0));
+    mu_assert("Could not build the bounds.", finishFieldUniformityBuild(startFieldUniformityBuild(fieldPtr)));
+
+    FieldProbePtr probePtr = createProbe(fieldPtr);
+    FieldValue center, fv;
+    double slack = 1.0e-5 * fieldPtr->metricsPtr->maxFieldMagnitude * fabs(fieldPtr->scale);
+
+    GridPtr rhoGrid = fieldPtr->rhoGridPtr;
+    GridPtr zGrid = fieldPtr->zGridPtr;
+
+    double sumRatio = 0;
+    int numRatios = 0;
+
+    for (int i = 0; i < 2000; i++) {
+        double rho = randomDouble(max(0, rhoGrid->minVal - 20), rhoGrid->maxVal + 20);
+        double phi = randomDouble(0, 360);
+        double z = randomDouble(zGrid->minVal - 20, zGrid->maxVal + 20);
+        double h = (i % 2 == 0) ? randomDouble(0.1, 5) : randomDouble(5, 100);
+
+        double x0, y0;
+        cylindricalToCartesian(&x0, &y0, phi, rho);
+        double bound = fieldVariationBound(fieldPtr, x0, y0, z, h);
+        mu_assert("Negative bound.", bound >= 0);
+
+        getFieldValueProbe(&center, x0, y0, z, probePtr);
+        double largest = 0;
+
+        for (int j = 0; j < 20; j++) {
+            //a random point in the ball
+            double u = randomDouble(-1, 1);
+            double a = randomDouble(0, 2 * M_PI);
+            double r = h * cbrt(randomDouble(0, 1));
+            double s = sqrt(1 - u * u);
+
+            getFieldValueProbe(&fv, x0 + r * s * cos(a), y0 + r * s * sin(a), z + r * u, probePtr);
+            double diff = sqrt((fv.b1 - center.b1) * (fv.b1 - center.b1) + (fv.b2 - center.b2) * (fv.b2 - center.b2) +
+                               (fv.b3 - center.b3) * (fv.b3 - center.b3));
+            mu_assert("Field varies more than the bound.", diff <= bound + slack);
+            largest = max(largest, diff);
+        }
+
+        if (largest > slack) {
+            sumRatio += largest / bound;
+            numRatios++;
+        }
+    }
+
+    double variationRatio = (numRatios > 0) ? sumRatio / numRatios : 0;
+
+    //a ball that is entirely outside the map
+    mu_assert("Bound outside the map should be zero.",
+              fieldVariationBound(fieldPtr, 0, 0, zGrid->maxVal + 50, 10) == 0);
+
+    //the derivative along any direction is at most sqrt(3) times the largest
+    //along the grid lines. Pairs of points in balls away from the map edges.
+    DerivativeBound derivatives;
+    sumRatio = 0;
+    numRatios = 0;
+    for (int i = 0; i < 1000; i++) {
+        double h = randomDouble(0.5, 5);
+        double rho = randomDouble(max(20, rhoGrid->minVal) + h, rhoGrid->maxVal - h);
+        double phi = randomDouble(0, 360);
+        double z = randomDouble(zGrid->minVal + h, zGrid->maxVal - h);
+
+        double x0, y0;
+        cylindricalToCartesian(&x0, &y0, phi, rho);
+        mu_assert("Could not bound the derivatives.", fieldDerivativeBound(fieldPtr, x0, y0, z, h, &derivatives));
+        mu_assert("Negative derivative bound.", (derivatives.gradient >= 0) && (derivatives.curvature >= 0));
+
+        double dx = randomDouble(-h, h) / 2;
+        double dy = randomDouble(-h, h) / 2;
+        double dz = randomDouble(-h, h) / 2;
+        getFieldValueProbe(&center, x0 + dx, y0 + dy, z + dz, probePtr);
+        getFieldValueProbe(&fv, x0 - dx, y0 - dy, z - dz, probePtr);
+
+        double diff = sqrt((fv.b1 - center.b1) * (fv.b1 - center.b1) + (fv.b2 - center.b2) * (fv.b2 - center.b2) +
+                           (fv.b3 - center.b3) * (fv.b3 - center.b3));
+        double allowed = sqrt(3.0) * derivatives.gradient * 2 * sqrt(dx * dx + dy * dy + dz * dz);
+        mu_assert("Field changes faster than the gradient bound.", diff <= 1.01 * allowed + slack);
+
+        if (diff > slack) {
+            sumRatio += diff / allowed;
+            numRatios++;
+        }
+    }
+
+    freeProbe(probePtr);
+    fprintf(stdout, "\nPASSED uniformityUnitTest (%d levels, sampled/bound %-6.3f, gradient sampled/bound %-6.3f)\n",
+            fieldPtr->uniformityPtr->numLevels, variationRatio, (numRatios > 0) ? sumRatio / numRatios : 0);
+    return NULL;
+}
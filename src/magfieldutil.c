@@ -8,11 +8,14 @@
 #include "magfield.h"
 #include "magfieldio.h"
 #include "magfieldutil.h"
+#include "magfielduniform.h"
 #include "munittest.h"
 #include <stdlib.h>
 #include <math.h>
 #include <string.h>
 #include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #define _USE_MATH_DEFINES
 #ifndef M_PI
@@ -28,6 +31,20 @@ int mtests_run = 0;
 //used for degrees <--> radians;
 const double PIOVER180 = M_PI/180.;
 
+//tangents of the centers of the two halves of a sector's 0 to 30 degree
+//wedge, and of the line between them, used by sectorFold
+#define TAN7P5 0.13165249758739585347
+#define TAN15 0.26794919243112270647
+#define TAN22P5 0.41421356237309504880
+
+//points within this fraction of |x| + |y| of a sector boundary or of the
+//middle of a sector are folded with atan2, so that the side they fall on
+//is exactly the same as with relativePhi and getSector
+#define SECTORFOLDBAND 1.0e-12
+
+//the sector from the signs of the three boundary lines, see sectorFold
+static const int foldSectors[] = { 1, 6, 0, 5, 2, 0, 3, 4 };
+
 //some strings for prints
 const char *csLabels[] = { "cylindrical", "Cartesian" };
 const char *lengthUnitLabels[] = { "cm", "m" };
@@ -36,6 +53,7 @@ const char *fieldUnitLabels[] = { "kG", "G", "T" };
 
 //local prototypes
 static void freeGrid(GridPtr gridPtr);
+static double wedgeAngle(double, double);
 
 /**
  * Convert an angle from radians to degrees.
@@ -185,6 +203,75 @@ int getSector(double phi) {
     return 1;
 }
 
+/**
+ * The angle, in degrees, of (u, w) for 0 <= w <= u tan(30 degrees).
+ * Relative to the center of the nearer half of the wedge the tangent is at
+ * most tan(7.5 degrees), where nine terms of the arctangent series are
+ * exact to double precision.
+ * @param u the component along the middle of the sector, positive.
+ * @param w the (absolute) component across it.
+ * @return the angle in degrees, [0, 30].
+ */
+static double wedgeAngle(double u, double w) {
+    bool lower = (w <= TAN15 * u);
+    double center = lower ? 7.5 : 22.5;
+    double tc = lower ? TAN7P5 : TAN22P5;
+
+    //the tangent relative to the center
+    double d = (w - tc * u) / (u + tc * w);
+    double d2 = d * d;
+    double series = 1.0 / 17;
+    series = 1.0 / 15 - d2 * series;
+    series = 1.0 / 13 - d2 * series;
+    series = 1.0 / 11 - d2 * series;
+    series = 1.0 / 9 - d2 * series;
+    series = 1.0 / 7 - d2 * series;
+    series = 1.0 / 5 - d2 * series;
+    series = 1.0 / 3 - d2 * series;
+    series = 1 - d2 * series;
+    return center + toDegrees(d * series);
+}
+
+/**
+ * Fold a point into a sector of the symmetric torus without atan2: the
+ * same as relativePhi and getSector of the point's phi. The sector follows
+ * from which side of the lines at 30, 90 and 150 degrees the point is on,
+ * the sector's rotation (cosSect, sinSect) takes the point to sector 1,
+ * and the angle there comes from the ratio of its components. Points on
+ * (or within rounding of) a sector boundary or the middle of a sector use
+ * atan2, so that they go to exactly the same sector and side as before.
+ * @param x the x coordinate.
+ * @param y the y coordinate.
+ * @param relPhi upon return, phi relative to the middle of the sector in degrees, (-30, 30].
+ * @param sector upon return, the sector [1..6].
+ */
+void sectorFold(double x, double y, double *relPhi, int *sector) {
+    double band = SECTORFOLDBAND * (fabs(x) + fabs(y));
+
+    //positive from 30 to 210 and from 150 to 330 degrees
+    double s30 = ROOT3OVER2 * y - 0.5 * x;
+    double s150 = -ROOT3OVER2 * y - 0.5 * x;
+
+    if ((fabs(s30) > band) && (fabs(x) > band) && (fabs(s150) > band)) {
+        int sect = foldSectors[((s30 > 0) << 2) | ((x < 0) << 1) | (s150 > 0)];
+        double cos = cosSect[sect];
+        double sin = sinSect[sect];
+        double u = x * cos + y * sin;
+        double v = y * cos - x * sin;
+
+        if (fabs(v) > band) {
+            double angle = wedgeAngle(u, fabs(v));
+            *relPhi = (v < 0) ? -angle : angle;
+            *sector = sect;
+            return;
+        }
+    }
+
+    double phi = toDegrees(atan2(y, x));
+    *relPhi = relativePhi(phi);
+    *sector = getSector(phi);
+}
+
 /**
  * Print a summary of the map for diagnostics and debugging.
  * @param fieldPtr the pointer to the map.
@@ -221,9 +308,10 @@ void printFieldSummary(MagneticFieldPtr fieldPtr, FILE *stream) {
     fprintf(stream, "max field magnitude: %-10.6f %s\n",
             fieldPtr->metricsPtr->maxFieldMagnitude, fieldUnits(fieldPtr));
 
-    FieldValuePtr fieldValPtr= getFieldAtIndex(fieldPtr, fieldPtr->metricsPtr->maxFieldIndex);
+    FieldValue maxFieldValue;
+    copyFieldAtIndex(fieldPtr, fieldPtr->metricsPtr->maxFieldIndex, &maxFieldValue);
     fprintf(stdout, "max field vector");
-    printFieldValue(fieldValPtr, stdout);
+    printFieldValue(&maxFieldValue, stdout);
 
     //get the location of the max field
     int phiIndex, rhoIndex, zIndex;
@@ -303,6 +391,17 @@ void printFieldValueFull(FieldValuePtr fvPtr, char *units, FILE *stream) {
 MagneticFieldPtr createFieldMap() {
      MagneticFieldPtr fieldPtr = (MagneticFieldPtr) malloc(sizeof(MagneticField));
      fieldPtr->metricsPtr = (FieldMetricsPtr) malloc(sizeof(FieldMetrics));
+     fieldPtr->algorithm = getAlgorithm();
+     fieldPtr->evaluator = NULL;
+     fieldPtr->probePtr = NULL;
+     fieldPtr->cell3DPtr = NULL;
+     fieldPtr->cell2DPtr = NULL;
+     fieldPtr->mapping = NULL;
+     fieldPtr->mappingLength = 0;
+     fieldPtr->precision = FLOAT32;
+     fieldPtr->compactValues = NULL;
+     fieldPtr->compactScale = 0;
+     fieldPtr->uniformityPtr = NULL;
      fieldPtr->scale = 1;
      fieldPtr->shiftX = 0;
      fieldPtr->shiftY = 0;
@@ -317,16 +416,23 @@ MagneticFieldPtr createFieldMap() {
  * @param fieldPtr a pointer to the field
  */
 void freeFieldMap(MagneticFieldPtr fieldPtr) {
+    unregisterField(fieldPtr);
     free(fieldPtr->metricsPtr);
     freeGrid(fieldPtr->phiGridPtr);
     freeGrid(fieldPtr->rhoGridPtr);
     freeGrid(fieldPtr->zGridPtr);
 
-    if (fieldPtr->type == TORUS) {
-        freeCell3D(fieldPtr->cell3DPtr);
+    //the default probe owns the cells
+    freeProbe(fieldPtr->probePtr);
+    free(fieldPtr->compactValues);
+    freeFieldUniformity(fieldPtr->uniformityPtr);
+
+    //mapped values belong to the mapping
+    if (fieldPtr->mapping != NULL) {
+        munmap(fieldPtr->mapping, fieldPtr->mappingLength);
     }
     else {
-        freeCell2D(fieldPtr->cell2DPtr);
+        free(fieldPtr->fieldValues);
     }
     free(fieldPtr);
 }
@@ -341,6 +447,43 @@ static void freeGrid(GridPtr gridPtr) {
     free(gridPtr);
 }
 
+/**
+ * Update an FNV-1a hash with a block of bytes. Used to key cached files.
+ * @param hash the hash so far, or FNVOFFSET to start.
+ * @param data the bytes.
+ * @param length the number of bytes.
+ * @return the updated hash.
+ */
+unsigned long long hashBytes(unsigned long long hash, const void *data, size_t length) {
+    const unsigned char *bytes = (const unsigned char *) data;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+/**
+ * Update an FNV-1a hash with a file's path and, if the file exists, its size
+ * and modification time, so that a file replaced at the same path gets a
+ * different key. Used to key files cached from other files.
+ * @param hash the hash so far, or FNVOFFSET to start.
+ * @param path the path to the file.
+ * @return the updated hash.
+ */
+unsigned long long hashFile(unsigned long long hash, const char *path) {
+    hash = hashBytes(hash, path, strlen(path));
+
+    struct stat fileStat;
+    if (stat(path, &fileStat) == 0) {
+        long long size = (long long) fileStat.st_size;
+        long long modified = (long long) fileStat.st_mtime;
+        hash = hashBytes(hash, &size, sizeof(long long));
+        hash = hashBytes(hash, &modified, sizeof(long long));
+    }
+    return hash;
+}
+
 /**
  * Copy a string and create the pointer
  * @param dest on input a pointer to an unallocated string.
@@ -351,6 +494,7 @@ void stringCopy(char **dest, const char *src) {
     unsigned long len = strlen(src);
     *dest = (char*) malloc(len + 1);
     strncpy(*dest, src, len);
+    (*dest)[len] = '\0';
 }
 
 /**
@@ -417,6 +561,57 @@ char *conversionUnitTest() {
     return NULL;
 }
 
+/**
+ * A unit test for sectorFold. At random points it must give the sector and
+ * side of relativePhi and getSector, with the same angle to rounding. On
+ * sector boundaries and sector middles, and just off them, it must give
+ * exactly the same results.
+ * @return an error message if the test fails, or NULL if it passes.
+ */
+char *sectorFoldUnitTest() {
+    double relPhi, refRelPhi, maxDiff = 0;
+    int sector;
+
+    for (int i = 0; i < 1000000; i++) {
+        double x = randomDouble(-500, 500);
+        double y = randomDouble(-500, 500);
+        double phi = toDegrees(atan2(y, x));
+        refRelPhi = relativePhi(phi);
+
+        sectorFold(x, y, &relPhi, &sector);
+        mu_assert("Folded to the wrong sector.", sector == getSector(phi));
+        mu_assert("Folded to the wrong side of the sector.", (relPhi < 0) == (refRelPhi < 0));
+        maxDiff = max(maxDiff, fabs(relPhi - refRelPhi));
+    }
+    mu_assert("Folded angle differs.", maxDiff < 1.0e-10);
+
+    //every 30 degrees is a boundary or a middle
+    double offsets[] = {0, 1.0e-13, -1.0e-13, 1.0e-9, -1.0e-9};
+    for (int k = -12; k <= 12; k++) {
+        for (int j = 0; j < 5; j++) {
+            double rho = randomDouble(1, 500);
+            double angle = toRadians(30.0 * k) + offsets[j];
+            double x = rho * cos(angle);
+            double y = rho * sin(angle);
+            double phi = toDegrees(atan2(y, x));
+            refRelPhi = relativePhi(phi);
+
+            sectorFold(x, y, &relPhi, &sector);
+            mu_assert("Folded a boundary point to the wrong sector.", sector == getSector(phi));
+            mu_assert("Folded a boundary point to the wrong side.", (relPhi < 0) == (refRelPhi < 0));
+            if (j < 3) {
+                mu_assert("Folded a boundary point to a different angle.", relPhi == refRelPhi);
+            }
+        }
+    }
+
+    sectorFold(0, 0, &relPhi, &sector);
+    mu_assert("Folded the origin differently.", (relPhi == relativePhi(0)) && (sector == getSector(0)));
+
+    fprintf(stdout, "\nPASSED sectorFoldUnitTest (max angle difference %-9.3e degrees)\n", maxDiff);
+    return NULL;
+}
+
 /**
  * A unit test for the random number generator
  * @return an error message if the test fails, or NULL if it passes.
@@ -15,6 +15,17 @@
 #include "munittest.h"
 #include "magfieldutil.h"
 #include "magfielddraw.h"
+#include "magfieldbench.h"
+#include "magfieldsimd.h"
+#include "magfieldbake.h"
+#include "magfieldcompact.h"
+#include "magfieldgrad.h"
+#include "magfieldswim.h"
+#include "magfieldpool.h"
+#include "magfielduniform.h"
+#include "magfieldtable.h"
+#include "magfieldintegral.h"
+#include "magfieldset.h"
 
 //the three fields we'll try to initialize
 static MagneticFieldPtr symmetricTorus;
@@ -33,26 +44,64 @@ static char *allTests() {
     mu_run_test(gridUnitTest);
     mu_run_test(randomUnitTest);
     mu_run_test(conversionUnitTest);
+    mu_run_test(sectorFoldUnitTest);
     mu_run_test(binarySearchUnitTest);
+    mu_run_test(poolUnitTest);
 
     fprintf(stdout, "\n  [SYMMETRIC TORUS]");
     testFieldPtr = symmetricTorus;
     mu_run_test(compositeIndexUnitTest);
     mu_run_test(containsUnitTest);
+    mu_run_test(probeUnitTest);
+    mu_run_test(batchUnitTest);
+    mu_run_test(compactUnitTest);
+    mu_run_test(gradientUnitTest);
+    mu_run_test(uniformityUnitTest);
+    mu_run_test(simdUnitTest);
     mu_run_test(nearestNeighborUnitTest);
 
     fprintf(stdout, "\n  [FULL  TORUS]");
     testFieldPtr = fullTorus;
     mu_run_test(compositeIndexUnitTest);
     mu_run_test(containsUnitTest);
+    mu_run_test(probeUnitTest);
+    mu_run_test(batchUnitTest);
+    mu_run_test(compactUnitTest);
+    mu_run_test(gradientUnitTest);
+    mu_run_test(uniformityUnitTest);
+    mu_run_test(simdUnitTest);
     mu_run_test(nearestNeighborUnitTest);
 
     testFieldPtr = solenoid;
     fprintf(stdout, "\n  [SOLENOID]");
     mu_run_test(compositeIndexUnitTest);
     mu_run_test(containsUnitTest);
+    mu_run_test(probeUnitTest);
+    mu_run_test(solenoidRotationUnitTest);
+    mu_run_test(batchUnitTest);
+    mu_run_test(compactUnitTest);
+    mu_run_test(gradientUnitTest);
+    mu_run_test(uniformityUnitTest);
+    mu_run_test(simdUnitTest);
+    mu_run_test(memoryMappingUnitTest);
+    mu_run_test(cacheDirectoryUnitTest);
     mu_run_test(nearestNeighborUnitTest);
 
+    testFieldPtr = symmetricTorus;
+    testSolenoidPtr = solenoid;
+    fprintf(stdout, "\n  [COMPOSITE]");
+    mu_run_test(compositeUnitTest);
+    mu_run_test(fieldSetUnitTest);
+    mu_run_test(bakeUnitTest);
+    mu_run_test(swimUnitTest);
+    mu_run_test(jacobianUnitTest);
+    mu_run_test(surfaceUnitTest);
+    mu_run_test(helixUnitTest);
+    mu_run_test(predictUnitTest);
+    mu_run_test(fieldLineUnitTest);
+    mu_run_test(tableUnitTest);
+    mu_run_test(integralUnitTest);
+
     fprintf(stdout, "\n ***** End of unit tests ******\n");
     return NULL;
 }
@@ -153,12 +202,9 @@ static void useAlgorithm(char c) {
  */
 static void environment() {
     printf("\nEnvironment: ");
-    if (getAlgorithm() == NEAREST_NEIGHBOR) {
-        printf("\tNearest Neighbor");
-    }
-    else {
-        printf("\tInterpolation");
-    }
+    printf("\n\tsymmetric torus: %s", (getFieldAlgorithm(symmetricTorus) == NEAREST_NEIGHBOR) ? "Nearest Neighbor" : "Interpolation");
+    printf("\n\tfull torus:      %s", (getFieldAlgorithm(fullTorus) == NEAREST_NEIGHBOR) ? "Nearest Neighbor" : "Interpolation");
+    printf("\n\tsolenoid:        %s", (getFieldAlgorithm(solenoid) == NEAREST_NEIGHBOR) ? "Nearest Neighbor" : "Interpolation");
 }
 
 /**
@@ -177,6 +223,7 @@ static void userCommands() {
 
     while (!done) {
         printf("\nOptions:");
+        printf("\n\tb\trun benchmarks");
         printf("\n\tc\tcurrent environment");
         printf("\n\ti\tuse interpolation");
         printf("\n\tn\tuse nearest neighbor");
@@ -193,6 +240,10 @@ static void userCommands() {
         if ((choice != NULL) && (strlen(choice) > 0)) {
             switch (choice[0]) {
 
+                case 'b':
+                    runBenchmarks(symmetricTorus, solenoid, stdout);
+                    break;
+
                 case 'c':
                     environment();
                     break;